@@ -0,0 +1,201 @@
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+#include "bench.hpp"
+#include "endpoints.hpp"
+#include "http/arena.hpp"
+#include "idallocator.hpp"
+#include "storage.hpp"
+#include "utils.hpp"
+
+// Text that looks like a paste of code, with the characters that need escaping here and there
+static std::string code_text(size_t size)
+{
+	static const char *line = "\tif (a < b && c > d) { printf(\"%s\\n\", \"x & y\"); }\n";
+	std::string out;
+	while (out.size() < size)
+		out += line;
+	out.resize(size);
+	return out;
+}
+
+// What --data-urlencode sends for code_text
+static std::string urlencoded(size_t size)
+{
+	std::string text = code_text(size), out;
+	static const char hex[] = "0123456789ABCDEF";
+	for (unsigned char c : text) {
+		if (isalnum(c) || c == '-' || c == '_' || c == '.' || c == '~') {
+			out += c;
+		} else if (c == ' ') {
+			out += '+';
+		} else {
+			out += '%';
+			out += hex[c >> 4];
+			out += hex[c & 15];
+		}
+	}
+	return out;
+}
+
+BENCHMARK(url_decode_4k, "url_decode/4k")
+{
+	b.pause();
+	const std::string encoded = urlencoded(4 << 10);
+	std::string s;
+	s.reserve(encoded.size());
+	b.setBytes(encoded.size());
+	b.resume();
+	for (size_t i = 0; i < b.n; i++) {
+		s.assign(encoded);
+		keep(url_decode(s));
+	}
+}
+
+static void parse_form(Bench &b, size_t size)
+{
+	b.pause();
+	const std::string form = "expiration=1h&content=" + urlencoded(size);
+	std::string body;
+	body.reserve(form.size());
+	b.setBytes(form.size());
+	b.resume();
+	for (size_t i = 0; i < b.n; i++) {
+		body.assign(form);
+		keep(parse_form_data(body));
+	}
+}
+
+BENCHMARK(parse_form_4k, "parse_form_data/4k")
+{
+	parse_form(b, 4 << 10);
+}
+
+BENCHMARK(parse_form_1m, "parse_form_data/1m")
+{
+	parse_form(b, 1 << 20);
+}
+
+BENCHMARK(html_escape_64k, "html_escape/64k")
+{
+	b.pause();
+	const std::string text = code_text(64 << 10);
+	std::string out;
+	out.reserve(text.size() * 2);
+	b.setBytes(text.size());
+	b.resume();
+	for (size_t i = 0; i < b.n; i++) {
+		out.clear();
+		html_escape(out, text);
+		keep(out);
+	}
+}
+
+BENCHMARK(generate_id_6, "generate_id/6")
+{
+	for (size_t i = 0; i < b.n; i++)
+		keep(generate_id());
+}
+
+BENCHMARK(id_allocate, "IdAllocator/allocate")
+{
+	for (size_t i = 0; i < b.n; i++)
+		keep(IdAllocator::instance().allocate());
+}
+
+// Storage paths are relative to the working directory, so the storage benchmarks run from a
+// scratch directory on tmpfs to measure the code rather than the disk
+class ScratchDir {
+   private:
+	std::filesystem::path previous, path;
+
+   public:
+	ScratchDir()
+	{
+		previous = std::filesystem::current_path();
+		const char *base = access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+		std::string tmpl = std::string(base) + "/posthaste-bench-XXXXXX";
+		if (!mkdtemp(tmpl.data()))
+			abort();
+		path = tmpl;
+		std::filesystem::current_path(path);
+	}
+	~ScratchDir()
+	{
+		std::filesystem::current_path(previous);
+		std::filesystem::remove_all(path);
+	}
+};
+
+static void save(Bench &b, size_t size)
+{
+	b.pause();
+	ScratchDir dir;
+	const std::string content = code_text(size);
+	std::vector<std::string> ids;
+	for (size_t i = 0; i < b.n; i++)
+		ids.push_back(generate_id(10));
+	b.setBytes(size);
+	b.resume();
+
+	for (size_t i = 0; i < b.n; i++)
+		keep(save_paste_to_disk(ids[i], content, "1d"));
+	b.pause();	// Cleaning up the directory is not part of it
+}
+
+BENCHMARK(save_1k, "save_paste_to_disk/1k")
+{
+	save(b, 1 << 10);
+}
+
+BENCHMARK(save_64k, "save_paste_to_disk/64k_gzip")
+{
+	save(b, 64 << 10);
+}
+
+static void show(Bench &b, size_t size, bool curl)
+{
+	b.pause();
+	ScratchDir dir;
+	const std::string content = code_text(size);
+	std::vector<HttpRequest> requests(64);
+	for (HttpRequest &req : requests) {
+		std::string id = generate_id(10);
+		save_paste_to_disk(id, content, "1d");
+		req.setMethod("GET");
+		req.setPath("/p/" + id);
+		req.addHeader("User-Agent", curl ? "curl/8.5.0" : "Mozilla/5.0");
+		req.addHeader("Accept-Encoding", "gzip");
+	}
+	b.setBytes(size);
+	Arena arena;
+	b.resume();
+
+	// Like the server, the request and everything the handler allocates live in an arena
+	for (size_t i = 0; i < b.n; i++) {
+		Arena::Scope request_memory(arena);
+		HttpRequest req(requests[i % requests.size()], arena.get());
+		keep(show_paste(req));
+	}
+	b.pause();
+}
+
+// curl gets the file as stored, through sendfile, so this is mostly the open and the .meta read
+BENCHMARK(show_curl_1k, "show_paste/curl_1k")
+{
+	show(b, 1 << 10, true);
+}
+
+BENCHMARK(show_html_1k, "show_paste/html_1k")
+{
+	show(b, 1 << 10, false);
+}
+
+BENCHMARK(show_html_64k, "show_paste/html_64k_gzip")
+{
+	show(b, 64 << 10, false);
+}
@@ -0,0 +1,184 @@
+#include "bench.hpp"
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Every allocation in the process goes through here. Relaxed counters, so workers of the
+// ThreadPool benchmarks are counted too
+static std::atomic<uint64_t> n_allocs = 0, n_alloc_bytes = 0;
+
+void *operator new(size_t size)
+{
+	n_allocs.fetch_add(1, std::memory_order_relaxed);
+	n_alloc_bytes.fetch_add(size, std::memory_order_relaxed);
+	if (void *p = malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+	free(p);
+}
+
+void Bench::pause()
+{
+	if (!running)
+		return;
+	elapsed += Clock::now() - started;
+	allocs += n_allocs.load(std::memory_order_relaxed) - allocs_start;
+	alloc_bytes += n_alloc_bytes.load(std::memory_order_relaxed) - alloc_bytes_start;
+	running = false;
+}
+
+void Bench::resume()
+{
+	if (running)
+		return;
+	allocs_start = n_allocs.load(std::memory_order_relaxed);
+	alloc_bytes_start = n_alloc_bytes.load(std::memory_order_relaxed);
+	running = true;
+	started = Clock::now();
+}
+
+struct Case {
+	const char *name;
+	void (*fn)(Bench &);
+};
+
+static std::vector<Case> &cases()
+{
+	static std::vector<Case> c;
+	return c;
+}
+
+Registrar::Registrar(const char *name, void (*fn)(Bench &))
+{
+	cases().push_back({ name, fn });
+}
+
+struct Result {
+	size_t n;
+	double ns_per_op, bytes_per_op, allocs_per_op;
+	size_t processed_per_op;  // From setBytes
+};
+
+struct Runner {
+	static Bench run(void (*fn)(Bench &), size_t n)
+	{
+		Bench b;
+		b.n = n;
+		b.resume();
+		fn(b);
+		b.pause();
+		return b;
+	}
+
+	// Same growth rule as Go: aim 20% past the target, at most 100x per round
+	static Result measure(void (*fn)(Bench &), double min_ns)
+	{
+		size_t n = 1;
+		for (;;) {
+			Bench b = run(fn, n);
+			double ns = std::chrono::duration<double, std::nano>(b.elapsed).count();
+			if (ns >= min_ns || n >= 1'000'000'000)
+				return { n, ns / n, double(b.alloc_bytes) / n, double(b.allocs) / n,
+						 b.bytes_per_op };
+			size_t predicted = ns > 0 ? size_t(min_ns * 1.2 * n / ns) : n * 100;
+			n = std::max(n + 1, std::min(predicted, n * 100));
+		}
+	}
+};
+
+// Reads back our own output format, nothing else
+static std::map<std::string, Result> load_baseline(const char *path)
+{
+	std::map<std::string, Result> baseline;
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		perror(path);
+		exit(1);
+	}
+	char line[512], name[256];
+	Result r {};
+	while (fgets(line, sizeof(line), file)) {
+		if (sscanf(line,
+				   "{\"benchmark\":\"%255[^\"]\",\"iterations\":%*u,\"ns_per_op\":%lf,"
+				   "\"bytes_per_op\":%lf,\"allocs_per_op\":%lf",
+				   name, &r.ns_per_op, &r.bytes_per_op, &r.allocs_per_op)
+			== 4)
+			baseline[name] = r;
+	}
+	fclose(file);
+	return baseline;
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+			"Usage: %s [-f <substring>] [-t <min ms per benchmark>] [-b <baseline.jsonl>]\n"
+			"Prints one JSON object per benchmark on stdout. With -b, also prints the change\n"
+			"against a previous run on stderr\n",
+			argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	std::string_view filter;
+	double min_ms = 300;
+	const char *baseline_path = nullptr;
+
+	for (int i = 1; i < argc; i++) {
+		std::string_view arg(argv[i]);
+		if (i + 1 == argc)
+			usage(argv[0]);
+		if (arg == "-f") {
+			filter = argv[++i];
+		} else if (arg == "-t") {
+			min_ms = atof(argv[++i]);
+		} else if (arg == "-b") {
+			baseline_path = argv[++i];
+		} else {
+			usage(argv[0]);
+		}
+	}
+
+	std::map<std::string, Result> baseline;
+	if (baseline_path)
+		baseline = load_baseline(baseline_path);
+
+	for (const Case &c : cases()) {
+		if (std::string_view(c.name).find(filter) == std::string_view::npos)
+			continue;
+
+		Result r = Runner::measure(c.fn, min_ms * 1e6);
+		printf("{\"benchmark\":\"%s\",\"iterations\":%zu,\"ns_per_op\":%.2f,"
+			   "\"bytes_per_op\":%.1f,\"allocs_per_op\":%.2f",
+			   c.name, r.n, r.ns_per_op, r.bytes_per_op, r.allocs_per_op);
+		if (r.processed_per_op)
+			printf(",\"mb_per_s\":%.1f", r.processed_per_op * 1e3 / r.ns_per_op);
+		printf("}\n");
+		fflush(stdout);
+
+		auto old = baseline.find(c.name);
+		if (old != baseline.end()) {
+			fprintf(stderr, "%-36s %12.1f -> %12.1f ns/op (%+6.1f%%)  %8.2f -> %8.2f allocs/op\n",
+					c.name, old->second.ns_per_op, r.ns_per_op,
+					(r.ns_per_op / old->second.ns_per_op - 1) * 100, old->second.allocs_per_op,
+					r.allocs_per_op);
+		}
+	}
+	return 0;
+}
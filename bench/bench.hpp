@@ -0,0 +1,52 @@
+#ifndef BENCH_HPP
+#define BENCH_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Minimal benchmark harness, in the spirit of Go's testing.B. A benchmark runs b.n operations
+// and the runner grows n until a run takes long enough to trust. Allocations are counted by
+// replacing the global operator new, so allocs/op and bytes/op are exact for the timed part
+class Bench {
+   public:
+	size_t n = 1;
+
+	// Excludes setup from the time and the allocation counts
+	void pause();
+	void resume();
+	// Bytes processed per operation, reported as throughput
+	void setBytes(size_t bytes)
+	{
+		bytes_per_op = bytes;
+	}
+
+   private:
+	friend struct Runner;
+	using Clock = std::chrono::steady_clock;
+
+	Clock::time_point started;
+	Clock::duration elapsed {};
+	uint64_t allocs_start = 0, alloc_bytes_start = 0;
+	uint64_t allocs = 0, alloc_bytes = 0;
+	size_t bytes_per_op = 0;
+	bool running = false;
+};
+
+struct Registrar {
+	Registrar(const char *name, void (*fn)(Bench &));
+};
+
+#define BENCHMARK(id, name)                        \
+	static void id(Bench &);                       \
+	static Registrar id##_registrar { name, id }; \
+	static void id(Bench &b)
+
+// Keeps the compiler from optimizing away a result nobody reads
+template <typename T>
+inline void keep(const T &value)
+{
+	asm volatile("" : : "r,m"(value) : "memory");
+}
+
+#endif	// !BENCH_HPP
@@ -0,0 +1,216 @@
+#include <atomic>
+#include <fcntl.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "bench.hpp"
+#include "http/httpresponse.hpp"
+#include "http/httpserver.hpp"
+#include "http/threadpool.hpp"
+
+// The parser reads from the socket itself, so canned streams are fed through a socketpair
+struct ParserBench {
+	static void run(Bench &b, const std::string &request)
+	{
+		b.pause();
+		int fds[2];
+		socketpair(AF_UNIX, SOCK_STREAM, 0, fds);
+		fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+		// As many pipelined copies as fit comfortably in the socket buffer
+		size_t per_batch = std::max<size_t>(1, (64 << 10) / request.size());
+		std::string batch;
+		for (size_t i = 0; i < per_batch; i++)
+			batch += request;
+
+		sockaddr_storage peer {};
+		HttpServer::ConnectionContext ctx(fds[1], peer, 0);
+		b.setBytes(request.size());
+
+		for (size_t done = 0; done < b.n;) {
+			b.pause();
+			size_t count = std::min(per_batch, b.n - done);
+			for (size_t written = 0; written < count * request.size();) {
+				ssize_t w = write(fds[0], batch.data() + written, count * request.size() - written);
+				if (w <= 0)
+					abort();
+				written += w;
+			}
+			b.resume();
+
+			for (size_t i = 0; i < count; i++) {
+				bool is_closed = false;
+				Arena::Scope request_memory(*ctx.arena);  // As the server does per request
+				std::optional<HttpRequest> req = HttpServer::get_request(ctx, is_closed);
+				if (!req || is_closed)
+					abort();
+				keep(req);
+			}
+			done += count;
+		}
+
+		b.pause();
+		close(fds[0]);
+		close(fds[1]);
+		b.resume();
+	}
+};
+
+static const std::string curl_get = "GET /p/Ab3dE9 HTTP/1.1\r\n"
+									"Host: paste.example.com\r\n"
+									"User-Agent: curl/8.5.0\r\n"
+									"Accept: */*\r\n\r\n";
+
+static const std::string browser_get
+  = "GET /p/Ab3dE9 HTTP/1.1\r\n"
+	"Host: paste.example.com\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Referer: https://paste.example.com/\r\n"
+	"Connection: keep-alive\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Priority: u=0, i\r\n\r\n";
+
+static std::string post_form(size_t size)
+{
+	std::string body = "expiration=1h&content=" + std::string(size, 'a');
+	return "POST /paste HTTP/1.1\r\n"
+		   "Host: paste.example.com\r\n"
+		   "User-Agent: curl/8.5.0\r\n"
+		   "Content-Type: application/x-www-form-urlencoded\r\n"
+		   "Content-Length: "
+		 + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+static std::string post_chunked(size_t size, size_t chunk)
+{
+	std::string req = "PUT /paste HTTP/1.1\r\n"
+					  "Host: paste.example.com\r\n"
+					  "Transfer-Encoding: chunked\r\n\r\n";
+	char len[16];
+	for (size_t sent = 0; sent < size; sent += chunk) {
+		size_t n = std::min(chunk, size - sent);
+		snprintf(len, sizeof(len), "%zx\r\n", n);
+		req.append(len).append(n, 'a').append("\r\n");
+	}
+	return req + "0\r\n\r\n";
+}
+
+BENCHMARK(parse_curl_get, "get_request/curl_get")
+{
+	ParserBench::run(b, curl_get);
+}
+
+BENCHMARK(parse_browser_get, "get_request/browser_get")
+{
+	ParserBench::run(b, browser_get);
+}
+
+BENCHMARK(parse_post_4k, "get_request/post_form_4k")
+{
+	static const std::string req = post_form(4 << 10);
+	ParserBench::run(b, req);
+}
+
+BENCHMARK(parse_chunked_16k, "get_request/chunked_16k")
+{
+	static const std::string req = post_chunked(16 << 10, 1 << 10);
+	ParserBench::run(b, req);
+}
+
+BENCHMARK(serialize_small, "HttpResponse/serialize_small")
+{
+	b.pause();
+	HttpResponse response;
+	response.setContentType("application/json");
+	response.setBody("{\"status\":\"ok\"}");
+	b.resume();
+	for (size_t i = 0; i < b.n; i++)
+		keep(response.serialize());
+}
+
+BENCHMARK(serialize_parts, "HttpResponse/serialize_parts_32k")
+{
+	b.pause();
+	HttpResponse response;
+	response.setContentType("text/html");
+	response.addHeader("Vary", "Accept-Encoding");
+	response.appendStaticBody("<!DOCTYPE html><html><head><title>Paste</title></head><body><pre>");
+	response.appendBody(std::pmr::string(32 << 10, 'x'));
+	response.appendStaticBody("</pre></body></html>");
+	b.setBytes(response.getBodySize());
+	b.resume();
+	for (size_t i = 0; i < b.n; i++)
+		keep(response.serialize());
+}
+
+// What the server actually does per response: the head only, the body goes out as iovecs
+BENCHMARK(serialize_head, "HttpResponse/serialize_head")
+{
+	b.pause();
+	HttpResponse response;
+	response.setContentType("text/html");
+	response.addHeader("Vary", "Accept-Encoding");
+	response.appendStaticBody("<!DOCTYPE html>");
+	response.appendBody(std::pmr::string(32 << 10, 'x'));
+	b.resume();
+	for (size_t i = 0; i < b.n; i++)
+		keep(response.serializeHead());
+}
+
+// A constant page: status and Date lines into a reused buffer, everything else is prebuilt
+BENCHMARK(prepared_head, "HttpResponse/prepared_head")
+{
+	b.pause();
+	HttpResponse page;
+	page.setContentType("application/json");
+	page.setBody("{\"status\":\"ok\"}");
+	auto prepared = HttpResponse::prepare(std::move(page));
+	std::string head;
+	std::vector<struct iovec> iov;
+	b.resume();
+	for (size_t i = 0; i < b.n; i++) {
+		HttpResponse response(prepared);
+		response.serializeHead(head);
+		response.toIovecs(head, iov);
+		keep(iov);
+	}
+}
+
+// One task at a time: queueing, waking a worker and getting the result back
+BENCHMARK(threadpool_roundtrip, "ThreadPool/roundtrip")
+{
+	b.pause();
+	ThreadPool pool(1);
+	std::atomic<uint64_t> done = 0;
+	b.resume();
+	for (size_t i = 0; i < b.n; i++) {
+		pool.addTask([&done] {
+			done.fetch_add(1, std::memory_order_release);
+			done.notify_one();
+		});
+		for (uint64_t seen; (seen = done.load(std::memory_order_acquire)) <= i;)
+			done.wait(seen, std::memory_order_acquire);
+	}
+	b.pause();
+}
+
+// Throughput with the queue kept full, as under load
+BENCHMARK(threadpool_batch, "ThreadPool/batch_4_workers")
+{
+	b.pause();
+	ThreadPool pool(4);
+	std::atomic<uint64_t> done = 0;
+	b.resume();
+	for (size_t i = 0; i < b.n; i++)
+		pool.addTask([&done] { done.fetch_add(1, std::memory_order_relaxed); });
+	while (done.load(std::memory_order_relaxed) < b.n)
+		std::this_thread::yield();
+	b.pause();
+}
@@ -0,0 +1,169 @@
+#include "cluster.hpp"
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
+#include <strings.h>
+
+#include "http/metrics.hpp"
+
+// Stable across processes and builds, every node must place IDs the same way
+static uint64_t ring_hash(std::string_view s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;	 // FNV-1a, then splitmix64's finalizer to spread it
+	for (unsigned char c : s) {
+		h ^= c;
+		h *= 0x100000001b3ULL;
+	}
+	h ^= h >> 30;
+	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;
+	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
+
+Cluster &Cluster::instance()
+{
+	static Cluster cluster;
+	return cluster;
+}
+
+void Cluster::configure(std::string_view list, std::string_view self_entry, size_t n_replicas,
+						std::string_view shared_key)
+{
+	nodes.clear();
+	ring.clear();
+	self = -1;
+	self_name = self_entry;
+	if (shared_key.empty())
+		throw std::invalid_argument("Cluster mode needs a key shared by every node");
+	key = shared_key;
+
+	while (!list.empty()) {
+		size_t comma = list.find(',');
+		std::string_view entry = list.substr(0, comma);
+		list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+		if (entry.empty())
+			continue;
+
+		// "host:port", or "[v6]:port"
+		size_t colon = entry.rfind(':');
+		int port = 0;
+		if (colon == std::string_view::npos
+			|| std::from_chars(entry.data() + colon + 1, entry.data() + entry.size(), port).ec
+				 != std::errc()
+			|| port <= 0 || port > 65535)
+			throw std::invalid_argument("Cluster nodes are host:port, not " + std::string(entry));
+		std::string_view host = entry.substr(0, colon);
+		if (host.size() > 2 && host.front() == '[' && host.back() == ']')
+			host = host.substr(1, host.size() - 2);
+
+		auto same = [entry](const Node &n) { return n.name == entry; };
+		if (std::any_of(nodes.begin(), nodes.end(), same))
+			throw std::invalid_argument("Cluster node " + std::string(entry) + " is listed twice");
+		Node &node = nodes.emplace_back();
+		node.name = entry;
+		if (entry == self_entry)
+			self = nodes.size() - 1;
+		else
+			node.pool = std::make_unique<UpstreamPool>(std::string(host), port);
+	}
+	if (nodes.empty())
+		throw std::invalid_argument("Cluster mode needs at least one node");
+	replicas = std::clamp<size_t>(n_replicas, 1, std::min(max_replicas, nodes.size()));
+
+	// Points come from the names, so a node keeps its share whatever else is in the list
+	for (size_t i = 0; i < nodes.size(); i++) {
+		for (int v = 0; v < vnodes; v++)
+			ring.emplace_back(ring_hash(nodes[i].name + "#" + std::to_string(v)), i);
+	}
+	std::sort(ring.begin(), ring.end());
+}
+
+std::vector<size_t> Cluster::placement(std::string_view id) const
+{
+	std::vector<size_t> found;
+	found.reserve(replicas);
+	auto it = std::lower_bound(ring.begin(), ring.end(), std::pair(ring_hash(id), uint32_t(0)));
+	for (size_t step = 0; step < ring.size() && found.size() < replicas; step++, it++) {
+		if (it == ring.end())
+			it = ring.begin();
+		if (std::find(found.begin(), found.end(), it->second) == found.end())
+			found.push_back(it->second);
+	}
+	return found;
+}
+
+bool Cluster::owns(std::string_view id) const
+{
+	auto it = std::lower_bound(ring.begin(), ring.end(), std::pair(ring_hash(id), uint32_t(0)));
+	return int((it == ring.end() ? ring.front() : *it).second) == self;
+}
+
+bool Cluster::holds(std::string_view id) const
+{
+	std::vector<size_t> nodes = placement(id);
+	return self >= 0 && std::find(nodes.begin(), nodes.end(), size_t(self)) != nodes.end();
+}
+
+// Connection specific, or rewritten below
+static bool dropped_header(std::string_view name)
+{
+	static constexpr std::string_view dropped_headers[] = {
+		"Connection", "Keep-Alive", "Transfer-Encoding", "Content-Length", "Expect",
+		"Upgrade", "HTTP2-Settings", "TE", Cluster::node_header, Cluster::key_header
+	};
+	for (std::string_view dropped : dropped_headers) {
+		if (name.size() == dropped.size()
+			&& strncasecmp(name.data(), dropped.data(), name.size()) == 0)
+			return true;
+	}
+	return false;
+}
+
+bool Cluster::fromNode(const HttpRequest &request) const
+{
+	if (key.empty() || request.getHeader(node_header).empty())
+		return false;
+	// Compares every byte whatever the first difference, so the time doesn't give the key away
+	std::string_view given = request.getHeader(key_header);
+	unsigned char diff = given.size() != key.size();
+	for (size_t i = 0; i < given.size(); i++)
+		diff |= given[i] ^ key[i % key.size()];
+	return diff == 0;
+}
+
+void Cluster::appendNodeHeaders(std::string &request) const
+{
+	request.append(node_header).append(": ").append(self_name).append("\r\n");
+	request.append(key_header).append(": ").append(key).append("\r\n");
+}
+
+std::optional<UpstreamPool::Response> Cluster::forward(size_t node,
+														const HttpRequest &request) const
+{
+	std::string forwarded;
+	forwarded.reserve(512 + request.getBody().size());
+	forwarded.append(request.getMethod()).append(" ").append(request.getPath());
+	if (!request.getQuery().empty())
+		forwarded.append("?").append(request.getQuery());
+	forwarded.append(" HTTP/1.1\r\n");
+	for (const auto &[key, value] : request.getHeaders()) {
+		if (!dropped_header(key))
+			forwarded.append(key).append(": ").append(value).append("\r\n");
+	}
+	appendNodeHeaders(forwarded);
+	forwarded.append("Content-Length: ").append(std::to_string(request.getBody().size()));
+	forwarded.append("\r\n\r\n").append(request.getBody());
+	return send(node, forwarded);
+}
+
+std::optional<UpstreamPool::Response> Cluster::send(size_t node, std::string_view request,
+													size_t max_body) const
+{
+	if (!nodes[node].pool)
+		return std::nullopt;
+	std::optional<UpstreamPool::Response> response = nodes[node].pool->send(request, max_body);
+	Metrics::add(response ? Metrics::CLUSTER_REQUESTS : Metrics::CLUSTER_UNREACHABLE);
+	return response;
+}
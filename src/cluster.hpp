@@ -0,0 +1,82 @@
+#ifndef CLUSTER_HPP
+#define CLUSTER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "http/httprequest.hpp"
+#include "http/upstream.hpp"
+
+// Cluster mode: pastes spread over several nodes by a consistent-hash ring over their IDs. Each
+// node has vnodes points on the ring, and an ID belongs to the first node after the ID's hash.
+// With replicas > 1 it's also copied to the next distinct nodes on the ring, which serve it if
+// the owner can't. Adding or removing a node only moves the IDs next to its points.
+//
+// Uploads get an ID the receiving node owns. Reads of an ID a node doesn't hold are forwarded to
+// the nodes that should, over pooled keep-alive connections. Every node must be started with
+// the same node list
+class Cluster {
+   public:
+	static constexpr int vnodes = 128;
+	static constexpr size_t max_replicas = 8;
+	// On requests from one node to another, with the sender's name. They're never forwarded
+	// again, so a paste that's nowhere can't bounce around
+	static constexpr std::string_view node_header = "X-Posthaste-Node";
+	// With the cluster's shared secret. A node header without it is a client's, and ignored
+	static constexpr std::string_view key_header = "X-Posthaste-Key";
+
+   private:
+	struct Node {
+		std::string name;  // "host:port", as in the node list
+		std::unique_ptr<UpstreamPool> pool;	 // None for this node
+	};
+	std::vector<Node> nodes;
+	std::vector<std::pair<uint64_t, uint32_t>> ring;  // Point and node, sorted by point
+	std::string self_name;
+	std::string key;
+	int self = -1;	// In nodes, -1 if this node stores nothing and forwards everything
+	size_t replicas = 1;
+
+	Cluster() = default;
+
+   public:
+	static Cluster &instance();
+
+	// nodes is "host:port,host:port,...", self this node's entry. A self that isn't in the list
+	// makes a node that only forwards. key is the secret every node shares. Throws
+	// invalid_argument on a malformed list or an empty key
+	void configure(std::string_view nodes, std::string_view self, size_t replicas,
+				   std::string_view key);
+	bool enabled() const { return !nodes.empty(); }
+	bool isMember() const { return self >= 0; }
+	size_t size() const { return nodes.size(); }
+	size_t copies() const { return replicas; }  // Of each paste, owner included
+	bool isSelf(size_t node) const { return int(node) == self; }
+
+	// The nodes that hold id, its owner first
+	std::vector<size_t> placement(std::string_view id) const;
+	bool owns(std::string_view id) const;
+	bool holds(std::string_view id) const;	// As owner or replica
+
+	// Whether request came from another node, with the right key
+	bool fromNode(const HttpRequest &request) const;
+	// The node header and key header lines, for requests built here
+	void appendNodeHeaders(std::string &request) const;
+
+	// request as sent by the client, rewritten for a keep-alive HTTP/1.1 connection. nullopt if
+	// the node can't be reached
+	std::optional<UpstreamPool::Response> forward(size_t node, const HttpRequest &request) const;
+	// A request built here, it must carry the node headers. max_body as UpstreamPool::send's
+	std::optional<UpstreamPool::Response> send(size_t node, std::string_view request,
+											   size_t max_body = SIZE_MAX) const;
+	const std::string &name() const { return self_name; }
+	const std::string &name(size_t node) const { return nodes[node].name; }
+};
+
+#endif	// !CLUSTER_HPP
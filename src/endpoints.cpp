@@ -1,13 +1,27 @@
 #include "endpoints.hpp"
+#include <algorithm>
+#include <charconv>
 #include <cstddef>
 #include <ctime>
-#include <filesystem>
-#include <fstream>
-#include <iomanip>
+#include <fcntl.h>
+#include <functional>
+#include <memory_resource>
 #include <optional>
+#include <stdexcept>
 #include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
 
+#include "cluster.hpp"
+#include "http/feeds.hpp"
 #include "http/httpresponse.hpp"
+#include "http/metrics.hpp"
+#include "idallocator.hpp"
+#include "searchindex.hpp"
+#include "storage.hpp"
+#include "template.hpp"
 #include "utils.hpp"
 
 // Curlable menu
@@ -37,87 +51,341 @@ static constexpr std::string_view HELP_MENU =
     GR "     # 3. Pipe from stdin (Shell substitution required)" R "\n"
        "     " G "$ curl --data-urlencode \"content=$(cat)\" -d \"expiration=1h\" " HOST "/paste" R "\n\n"
 
+    GR "     # 4. Upload a file as-is (No escaping, defaults to 1d expiration)" R "\n"
+       "     " G "$ curl -T main.cpp \"" HOST "/paste?expiration=1h\"" R "\n\n"
+
+    GR "     # 5. Many files in one request (Size, optional expiration, then the file)" R "\n"
+       "     " G "$ for f in *.log; do echo \"$(stat -c%s $f) 1h\"; cat $f; done | curl --data-binary @- " HOST "/pastes" R "\n"
+       "     " G "$ curl \"" HOST "/pastes?ids=<id>,<id>\"" R "\n\n"
+
+    GR "     # 6. A paste that grows (?append=1 gives a write token), and following it" R "\n"
+       "     " G "$ echo \"Build 1234\" | curl -T - \"" HOST "/paste?append=1\"" R "\n"
+       "     " G "$ curl -T more.log -H \"X-Write-Token: <token>\" " HOST "/p/<id>/append" R "\n"
+       "     " G "$ curl -N \"" HOST "/p/<id>?follow=1\"" R "\n\n"
+
+    GR "     # 7. Find the pastes that have some text, and the lines it's in (&i=1 for any case)" R "\n"
+       "     " G "$ curl \"" HOST "/search?q=connection%20refused\"" R "\n\n"
+
     B "   OPTIONS" R "\n"
-       "     " BL "-d \"expiration=...\"" R "    -1, 1h, 1d, 1w\n\n"
+       "     " BL "-d \"expiration=...\"" R "    -1, 1h, 1d, 1w\n"
+       "     " BL "?expiration=..." R "         Same, for raw uploads (or " BL "X-Expiration" R " header)\n\n"
 
     B "   EXAMPLES" R "\n"
     GR "     # Paste file with 1 hour expiration" R "\n"
        "     " G "$ curl --data-urlencode \"content@log.txt\" -d \"expiration=1h\" " HOST "/paste" R "\n\n";
 
 
-HttpResponse serve_file(const HttpRequest &, std::string filename)
+static constexpr std::string_view PASTE_PAGE = R"(
+    <!DOCTYPE html>
+    <html>
+    <head>
+        <title>Paste {{id}}</title>
+        <style>
+            body { background: #1a1b26; color: #a9b1d6; font-family: monospace; padding: 20px; }
+            .code-block { 
+                background: #16161e; 
+                padding: 20px; 
+                border-radius: 8px; 
+                border: 1px solid #292e42; 
+                white-space: pre-wrap; 
+                overflow-x: auto;
+            }
+            .header {
+                display: flex;
+                justify-content: space-between;
+                align-items: center;
+                margin-bottom: 20px;
+            }
+            a { color: #7aa2f7; text-decoration: none; }
+            .meta { color: #565f89; font-size: 0.85rem; } 
+        </style>
+    </head>
+    <body>
+        <div class="header">
+            <a href="/">&larr; Create New Paste</a>
+            <span class="meta">Expires: {{expiration}}</span>
+        </div>
+        <div class="code-block">{{paste}}</div>
+    </body>
+    </html>
+    )";
+
+static constexpr auto paste_page = split_template<count_slots(PASTE_PAGE)>(PASTE_PAGE);
+static_assert(paste_page.size() == 4);
+
+// Responses that never change are serialized (and compressed) once, at startup
+static std::shared_ptr<const HttpResponse::Prepared> constant_page(int code, std::string body,
+																   std::string type = "")
 {
-	std::ifstream f(filename, std::ios::ate);
+	HttpResponse response;
+	response.setStatusCode(code);
+	response.setBody(std::move(body));
+	if (!type.empty())
+		response.setContentType(std::move(type));
+	return HttpResponse::prepare(std::move(response));
+}
 
-	if (!f.is_open()) {
-		HttpResponse response;
-		response.setStatusCode(404);
-		response.setBody("<h1>404 Not Found. Failed to serve file</h1>");
-		return response;
+static const auto help_page = constant_page(200, std::string(HELP_MENU), "text/plain");
+static const auto file_not_found = constant_page(404, "<h1>404 Not Found. Failed to serve file</h1>");
+static const auto paste_not_found = constant_page(404, "<h1>Not found</h1>");
+static const auto invalid_paste_id = constant_page(400, "<h1>Invalid Paste ID</h1>");
+static const auto method_not_allowed = constant_page(403, "<h1>403 Method Not Allowed</h1>");
+static const auto malformed_body = constant_page(400, "<h1>Malformed Body</h1>");
+static const auto incorrect_body = constant_page(400, "<h1>Incorrect Body</h1>");
+static const auto internal_error = constant_page(500, "<h1>Internal Server Error</h1>");
+static const auto bad_gateway = constant_page(502, "<h1>502 Bad Gateway</h1>");
+static const auto replica_stored = constant_page(204, "");
+static const auto not_a_replica = constant_page(403, "<h1>403 Not a replica of this paste</h1>");
+static const auto appended = constant_page(204, "");
+static const auto wrong_token = constant_page(403, "<h1>403 Wrong write token</h1>");
+static const auto paste_sealed = constant_page(409, "<h1>409 Paste is sealed</h1>");
+static const auto batch_too_large = constant_page(413, "<h1>413 Too many pastes in one batch</h1>");
+static const auto batch_content_too_large =
+  constant_page(413, "<h1>413 Pastes too large for one batch</h1>");
+static const auto query_too_short =
+  constant_page(400, "<h1>400 Search for at least 3 characters</h1>");
+
+// Appends n in decimal, std::to_string would go through a std::string
+static void append_number(std::pmr::string &out, long long n)
+{
+	char digits[24];
+	auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), n);
+	out.append(digits, end);
+}
+
+HttpResponse serve_file(const HttpRequest &req, const char *filename)
+{
+	int fd = open(filename, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		if (fd >= 0)
+			close(fd);
+		return HttpResponse(file_not_found);
 	}
 
-	HttpResponse response;
+	// Into the request's arena, along with everything else the response needs
+	std::pmr::string s(st.st_size, '\0', req.getAllocator());
+	size_t got = 0;
+	while (got < s.size()) {
+		ssize_t n = pread(fd, s.data() + got, s.size() - got, got);
+		if (n <= 0)
+			break;
+		got += n;
+	}
+	close(fd);
+	s.resize(got);
 
-	std::size_t size = f.tellg();
-	f.seekg(0);
-	std::string s(size, '\0');
-	f.read(&s[0], size);
+	HttpResponse response(req.getAllocator());
+	std::pmr::string key("file:", req.getAllocator());
+	key.append(filename).append(":");
+	append_number(key, st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec);
+	key.append(":");
+	append_number(key, got);
+	response.setCacheKey(key);
 
 	response.setStatusCode(200);
 	response.setContentType("text/html");
-	response.setBody(std::move(s));
+	response.appendBody(std::move(s));
 
 	return response;
 }
 
 HttpResponse root_endpoint(const HttpRequest &req) {
-	std::optional<std::string> user_agent = req.getHeader("User-Agent");
-	if (!user_agent || user_agent->rfind("curl", 0) != 0){
+	if (!req.getHeader("User-Agent").starts_with("curl")){
 		return serve_file(req, "index.html");
 	}
 
-	HttpResponse response;
+	return HttpResponse(help_page);
+}
 
-	response.setBody(std::string(HELP_MENU));
+// Expiration for uploads that don't carry it in the body: ?expiration=1h, the X-Expiration
+// header, or a day by default. The query is decoded into storage
+static std::string_view raw_expiration(const HttpRequest &req, std::pmr::string &storage)
+{
+	storage = req.getQuery();
+	if (auto query = parse_form_data(storage)) {
+		if (auto expiration = form_value(*query, "expiration"))
+			return *expiration;
+	}
 
-	response.setContentType("text/plain");
+	std::string_view header = req.getHeader("X-Expiration");
+	if (!header.empty())
+		return header;
+	return "1d";
+}
+
+// ?<name>=1
+static bool query_flag(const HttpRequest &req, std::string_view name)
+{
+	if (req.getQuery().empty())
+		return false;
+	std::pmr::string query(req.getQuery(), req.getAllocator());
+	auto fields = parse_form_data(query);
+	return fields && form_value(*fields, name) == "1";
+}
+
+// What another node answered, passed on to our client
+static HttpResponse relayed(const UpstreamPool::Response &upstream, const HttpRequest &req)
+{
+	HttpResponse response(req.getAllocator());
+	response.setStatusCode(upstream.status);
+	for (std::string_view name : { "Content-Type", "Location", "Retry-After" }) {
+		std::string_view value = upstream.header(name);
+		if (!value.empty())
+			response.addHeader(name, value);
+	}
+	// Already compressed for this client, HttpServer leaves it alone then. Otherwise it adds
+	// its own Vary if it compresses
+	std::string_view encoding = upstream.header("Content-Encoding");
+	if (!encoding.empty()) {
+		response.addHeader("Content-Encoding", encoding);
+		response.addHeader("Vary", "Accept-Encoding");
+	}
+	response.appendBody(std::pmr::string(upstream.body, req.getAllocator()));
 	return response;
 }
 
-HttpResponse handle_paste(const HttpRequest &req)
+// Forwards to the nodes in turn, starting with first, until one answers
+static HttpResponse forward_upload(const HttpRequest &req, size_t first)
 {
-	HttpResponse response;
-	if (req.getMethod() != "POST") {
-		response.setStatusCode(403);
-		response.setBody("<h1>403 Method Not Allowed</h1>");
-		return response;
+	Cluster &cluster = Cluster::instance();
+	for (size_t i = 0; i < cluster.size(); i++) {
+		size_t node = (first + i) % cluster.size();
+		if (cluster.isSelf(node))
+			continue;
+		if (auto upstream = cluster.forward(node, req))
+			return relayed(*upstream, req);
 	}
+	return HttpResponse(bad_gateway);
+}
 
-	auto v = req.getBody();
-	auto form_data = parse_form_data(std::string(v.begin(), v.end()));
+// Copies a new paste to the other nodes that hold its ID. Synchronous, so once the client has
+// its URL the paste can be read from any of them. A replica that's down misses it, and its
+// reads go to the owner instead
+static void replicate(const std::string &id, std::string_view content, long long expires_at,
+					  std::string_view token_hash)
+{
+	Cluster &cluster = Cluster::instance();
+	std::string request;
+	for (size_t node : cluster.placement(id)) {
+		if (cluster.isSelf(node))
+			continue;
+		request.assign("PUT /replica/").append(id);
+		request.append("?expires=").append(std::to_string(expires_at));
+		if (!token_hash.empty())
+			request.append("&key=").append(token_hash);
+		request.append(" HTTP/1.1\r\nHost: ").append(cluster.name(node)).append("\r\n");
+		cluster.appendNodeHeaders(request);
+		request.append("Content-Length: ").append(std::to_string(content.size()));
+		request.append("\r\n\r\n").append(content);
+		auto response = cluster.send(node, request);
+		if (!response || response->status != 204)
+			Metrics::add(Metrics::CLUSTER_REPLICA_FAILED);
+	}
+}
 
-	auto it_content = form_data.find("content");
-	auto it_expiration = form_data.find("expiration");
-	if (it_content == form_data.end() || it_expiration == form_data.end()) {
-		response.setStatusCode(400);
-		response.setBody("<h1>Incorrect Body</h1>");
-		return response;
+// Saves a new paste under a fresh ID, and copies it to the other nodes that hold it. In cluster
+// mode only IDs this node owns, so reads go straight to it. False if none of the IDs tried were,
+// id is the last of them then
+static bool store_new_paste(std::string &id, std::string_view content, long long expires_at,
+							std::string_view token_hash = {})
+{
+	Cluster &cluster = Cluster::instance();
+	std::function<bool(std::string_view)> owned;
+	if (cluster.enabled())
+		owned = [&cluster](std::string_view candidate) { return cluster.owns(candidate); };
+
+	// A taken ID only gets past the allocator if something else wrote to p/, so retrying a
+	// handful of times is plenty
+	int attempts = 0;
+	do {
+		if (++attempts > 8)
+			throw std::runtime_error("Could not allocate a paste ID");
+		id = IdAllocator::instance().allocate(owned);
+		// Thousands of candidates and none ours, this node's share of the ring is tiny
+		if (owned && !owned(id))
+			return false;
+	} while (!save_paste_to_disk(id, content, expires_at, token_hash));
+	if (cluster.enabled())
+		replicate(id, content, expires_at, token_hash);
+	return true;
+}
+
+HttpResponse handle_paste(const HttpRequest &req)
+{
+	std::string_view method = req.getMethod();
+	if (method != "POST" && method != "PUT")
+		return HttpResponse(method_not_allowed);
+
+	// A node outside the ring stores nothing, the upload goes to one that does
+	Cluster &cluster = Cluster::instance();
+	bool from_node = cluster.fromNode(req);
+	if (cluster.enabled() && !cluster.isMember()) {
+		if (from_node)	// Someone's list is wrong, don't bounce it back
+			return HttpResponse(bad_gateway);
+		return forward_upload(req, cluster.placement(generate_id())[0]);  // Spread like IDs
+	}
+
+	std::string_view content_type = req.getHeader("Content-Type");
+	std::string_view type = media_type(content_type);
+
+	// Raw uploads and the multipart file are used straight from the request body. Only the
+	// urlencoded form is decoded, from the body into decoded
+	std::pmr::string decoded(req.getAllocator());
+	std::optional<std::string_view> content, expiration;
+	if (method == "PUT" || type == "text/plain" || type == "application/octet-stream") {
+		content = req.getBody();
+		expiration = raw_expiration(req, decoded);
+	} else if (auto boundary = multipart_boundary(content_type)) {
+		auto parts = parse_multipart(req.getBody(), *boundary);
+		if (!parts)
+			return HttpResponse(malformed_body);
+		for (const MultipartPart &part : *parts) {
+			// A picked file wins over the textarea, browsers send the file field even if empty
+			if (part.name == "file" && !part.filename.empty())
+				content = part.data;
+			else if (part.name == "content" && (!content || content->empty()))
+				content = part.data;
+			else if (part.name == "expiration")
+				expiration = part.data;
+		}
+		if (!expiration)
+			expiration = raw_expiration(req, decoded);
+	} else {
+		auto form_data = parse_form_data(req.getBody(), decoded);
+		if (!form_data)
+			return HttpResponse(malformed_body);
+		content = form_value(*form_data, "content");
+		expiration = form_value(*form_data, "expiration");
 	}
 
-	std::string id = generate_id();
+	if (!content || !expiration)
+		return HttpResponse(incorrect_body);
+
+	// ?append=1 makes a paste that can grow, for whoever gets its write token
+	std::string id, token;
+	if (query_flag(req, "append"))
+		token = generate_id(24);
 	try {
-		save_paste_to_disk(id, it_content->second, it_expiration->second);
+		if (!store_new_paste(id, *content, expiration_time(*expiration),
+							 token.empty() ? "" : write_token_hash(token)))
+			return from_node ? HttpResponse(bad_gateway)
+							 : forward_upload(req, cluster.placement(id)[0]);
 	} catch (std::exception &ex) {
-		response.setStatusCode(500);
-		response.setBody("<h1>Internal Server Error</h1>");
-		return response;
+		return HttpResponse(internal_error);
 	}
 
-	std::string url = "/p/" + id;
-
-	std::optional<std::string> user_agent = req.getHeader("User-Agent");
-	if (user_agent && user_agent->rfind("curl", 0) == 0){
-		response.setBody(url + "\n");
+	std::pmr::string url("/p/", req.getAllocator());
+	url.append(id);
+	HttpResponse response(req.getAllocator());
+	if (!token.empty())
+		response.addHeader("X-Write-Token", token);
+
+	if (req.getHeader("User-Agent").starts_with("curl")){
+		url.append("\n");
+		if (!token.empty())	 // Ready to paste into the next curl
+			url.append("X-Write-Token: ").append(token).append("\n");
+		response.appendBody(std::move(url));
 		return response;
 	}
 
@@ -127,131 +395,546 @@ HttpResponse handle_paste(const HttpRequest &req)
 	return response;
 }
 
-HttpResponse show_paste(const HttpRequest &req)
+// Appends to a paste stored here, and hands the new bytes to whoever is following it
+static HttpResponse apply_append(const HttpRequest &req, std::string_view id, bool done)
+{
+	std::string_view token = req.getHeader("X-Write-Token");
+	size_t offset = 0;
+	AppendResult result;
+	try {
+		result = append_paste(id, token, req.getBody(), done, offset);
+	} catch (std::exception &ex) {
+		return HttpResponse(internal_error);
+	}
+	switch (result) {
+	case AppendResult::MISSING:
+		return HttpResponse(paste_not_found);
+	case AppendResult::WRONG_TOKEN:
+		return HttpResponse(wrong_token);
+	case AppendResult::SEALED:
+		return HttpResponse(paste_sealed);
+	case AppendResult::APPENDED:
+		break;
+	}
+	Feeds::publish(id, offset, req.getBody());
+	if (done)
+		Feeds::end(id);
+	return HttpResponse(appended);
+}
+
+// POST /p/<id>/append, with the token the upload gave in X-Write-Token. ?done=1 seals the paste
+// after this, and ends the responses of everyone following it. In cluster mode a node that holds
+// the paste takes the append and copies it to the others that do, like new pastes
+static HttpResponse append_to_paste(const HttpRequest &req, std::string_view id)
 {
-	std::string path = req.getPath();
+	std::string_view method = req.getMethod();
+	if (method != "POST" && method != "PUT")
+		return HttpResponse(method_not_allowed);
+
+	Cluster &cluster = Cluster::instance();
+	if (cluster.enabled() && !cluster.holds(id)) {
+		if (cluster.fromNode(req))
+			return HttpResponse(paste_not_found);
+		for (size_t node : cluster.placement(id)) {
+			if (auto upstream = cluster.forward(node, req))
+				return relayed(*upstream, req);
+		}
+		return HttpResponse(bad_gateway);
+	}
 
-	HttpResponse response;
-	if (path.size() <= 6) {
-		response.setStatusCode(404);
-		response.setBody("<h1>Not found</h1>");
+	bool done = query_flag(req, "done");
+	HttpResponse response = apply_append(req, id, done);
+	if (!cluster.enabled() || response.getStatusCode() != 204)
 		return response;
+
+	std::string request;
+	for (size_t node : cluster.placement(id)) {
+		if (cluster.isSelf(node))
+			continue;
+		request.assign("PUT /replica/").append(id).append(done ? "?append=1&done=1" : "?append=1");
+		request.append(" HTTP/1.1\r\nHost: ").append(cluster.name(node)).append("\r\n");
+		cluster.appendNodeHeaders(request);
+		request.append("X-Write-Token: ").append(req.getHeader("X-Write-Token"));
+		request.append("\r\nContent-Length: ").append(std::to_string(req.getBody().size()));
+		request.append("\r\n\r\n").append(req.getBody());
+		auto upstream = cluster.send(node, request);
+		if (!upstream || upstream->status != 204)
+			Metrics::add(Metrics::CLUSTER_REPLICA_FAILED);
+	}
+	return response;
+}
+
+// Not here, but maybe on another node that holds the ID: the owner first, then its replicas,
+// which also cover for a replica that missed the write. Requests from a node are answered from
+// what's here only
+static HttpResponse missing_paste(const HttpRequest &req, std::string_view id)
+{
+	Cluster &cluster = Cluster::instance();
+	if (!cluster.enabled() || cluster.fromNode(req))
+		return HttpResponse(paste_not_found);
+
+	bool reached = false;
+	for (size_t node : cluster.placement(id)) {
+		if (cluster.isSelf(node))
+			continue;
+		std::optional<UpstreamPool::Response> upstream = cluster.forward(node, req);
+		if (upstream && upstream->status != 404)
+			return relayed(*upstream, req);
+		reached |= upstream.has_value();
 	}
+	return HttpResponse(reached || cluster.holds(id) ? paste_not_found : bad_gateway);
+}
+
+HttpResponse show_paste(const HttpRequest &req)
+{
+	std::string_view path = req.getPath();
+
+	if (path.size() <= 6)
+		return HttpResponse(paste_not_found);
 
-	std::string paste_id = path.substr(3);
+	std::string_view paste_id = path.substr(3);
+	bool append = paste_id.ends_with("/append");  // More content for the paste comes here too
+	if (append)
+		paste_id.remove_suffix(std::string_view("/append").size());
 
 	// We don't want /p/../../../danger
 	if (paste_id.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789")
-		!= std::string::npos) {
-		HttpResponse response;
-		response.setStatusCode(400);
-		response.setBody("<h1>Invalid Paste ID</h1>");
+		!= std::string_view::npos)
+		return HttpResponse(invalid_paste_id);
+	if (append)
+		return append_to_paste(req, paste_id);
+
+	std::optional<StoredPaste> paste = open_paste(paste_id);
+	if (!paste)
+		return missing_paste(req, paste_id);
+	long long expiration = paste->expiration;
+	std::size_t size = paste->size;
+	std::pmr::polymorphic_allocator<char> alloc = req.getAllocator();
+	HttpResponse response(alloc);
+
+	// ?follow=1 on a paste that can grow: what's appended later keeps coming in the same
+	// response, like tail -f. A node asking for it only ever gets what there is
+	bool follow = paste->appendable && !Cluster::instance().fromNode(req)
+				  && query_flag(req, "follow");
+
+	if (follow || req.getHeader("User-Agent").starts_with("curl")){
+		response.setContentType("text/plain");
+		// Stored bytes go straight from the page cache to the socket when the client can take
+		// them as they are, compressed ones included
+		Encoding accepted = negotiate_encoding(req.getHeader("Accept-Encoding"));
+		if (paste->encoding != Encoding::IDENTITY) {
+			response.addHeader("Vary", "Accept-Encoding");
+			if (paste->encoding != accepted) {
+				std::pmr::string content(alloc);
+				read_paste(*paste, [&content](std::string_view chunk) { content.append(chunk); });
+				response.appendBody(std::move(content));
+				return response;
+			}
+			response.addHeader("Content-Encoding", encoding_name(paste->encoding));
+		}
+		response.setFileBody(paste->release(), size);
+		if (follow)
+			response.setFeed(paste_id);
 		return response;
 	}
 
-	std::string dirpath = "p/" + paste_id.substr(0, 1) + "/" + paste_id.substr(1, 1) + "/";
-	std::string filepath = dirpath + paste_id.substr(2);
-	std::string metapath = dirpath + paste_id.substr(2) + ".meta";
+	std::pmr::string format_date("Never", alloc);
+	if (expiration != -1) {
+		std::time_t t = static_cast<std::time_t>(expiration);
+		std::tm tm;
+		localtime_r(&t, &tm);
+		char date[32];
+		format_date.assign(date, std::strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm));
+	}
 
-	std::ifstream f(filepath, std::ios::ate);
-	if (!f.is_open()) {
-		response.setStatusCode(404);
-		response.setBody("<h1>Not found</h1>");
-		return response;
+	// The paste is read (and inflated) in chunks that are escaped straight into the page, so the
+	// raw content is never held in memory as a whole
+	std::pmr::string escaped(alloc);
+	escaped.reserve(size + (size >> 3));
+	read_paste(*paste, [&escaped](std::string_view chunk) { html_escape(escaped, chunk); });
+
+	response.appendStaticBody(paste_page[0]);
+	response.appendBody(std::pmr::string(paste_id, alloc));
+	response.appendStaticBody(paste_page[1]);
+	response.appendBody(std::move(format_date));
+	response.appendStaticBody(paste_page[2]);
+	response.appendBody(std::move(escaped));
+	response.appendStaticBody(paste_page[3]);
+	response.setContentType("text/html; charset=utf-8");
+	std::pmr::string key("paste:", alloc);
+	key.append(paste_id).append(":");
+	append_number(key, size);
+	key.append(":html");
+	response.setCacheKey(key);
+	return response;
+}
+
+// Batches: "<size>[ <expiration>]\n<content>\n" for every paste, in both directions. The content
+// is taken as is, no escaping, and the newline after it is only there to keep the stream
+// readable. Uploads with one request, one parse and one response for all of them
+static constexpr size_t max_batch_pastes = 1024;
+static constexpr size_t max_batch_ids = 256;
+static constexpr size_t max_batch_bytes = 64 << 20;	 // Of content fetched, as big as an upload
+
+struct BatchEntry {
+	std::string_view content;
+	long long expires_at;
+};
+
+// False on bad framing. Pastes without their own expiration get expires_at
+static bool parse_batch(std::string_view body, long long expires_at,
+						std::pmr::vector<BatchEntry> &entries)
+{
+	while (!body.empty()) {
+		if (body.front() == '\n') {	 // Between pastes, or at the end
+			body.remove_prefix(1);
+			continue;
+		}
+		size_t eol = body.find('\n');
+		if (eol == std::string_view::npos)
+			return false;
+		std::string_view line = body.substr(0, eol);
+		if (line.ends_with('\r'))
+			line.remove_suffix(1);
+		body.remove_prefix(eol + 1);
+
+		size_t size;
+		auto [rest, ec] = std::from_chars(line.data(), line.data() + line.size(), size);
+		if (ec != std::errc() || size > body.size())
+			return false;
+		std::string_view expiration(rest, line.data() + line.size() - rest);
+		BatchEntry &entry = entries.emplace_back(body.substr(0, size), expires_at);
+		if (!expiration.empty()) {
+			if (expiration.front() != ' ')
+				return false;
+			entry.expires_at = expiration_time(expiration.substr(1));
+		}
+		body.remove_prefix(size);
+		if (entries.size() > max_batch_pastes)
+			return true;
 	}
+	return !entries.empty();
+}
 
-	std::ifstream meta(metapath);
-	if (!meta.is_open()) {
-		response.setStatusCode(404);
-		response.setBody("<h1>Not found</h1>");
-		return response;
+// One "/p/<id>" line per paste, in the order they came. A paste that couldn't be stored gets a
+// "-" line, the others are kept
+static HttpResponse upload_batch(const HttpRequest &req)
+{
+	Cluster &cluster = Cluster::instance();
+	bool from_node = cluster.fromNode(req);
+	if (cluster.enabled() && !cluster.isMember()) {
+		if (from_node)
+			return HttpResponse(bad_gateway);
+		return forward_upload(req, cluster.placement(generate_id())[0]);
 	}
 
-	long long expiration;
-	meta >> expiration;
+	std::pmr::string decoded(req.getAllocator());
+	std::pmr::vector<BatchEntry> entries(req.getAllocator());
+	if (!parse_batch(req.getBody(), expiration_time(raw_expiration(req, decoded)), entries))
+		return HttpResponse(malformed_body);
+	if (entries.size() > max_batch_pastes)
+		return HttpResponse(batch_too_large);
+
+	std::pmr::string urls(req.getAllocator());
+	urls.reserve(entries.size() * 16);
+	std::string id;
+	size_t stored = 0;
+	for (const BatchEntry &entry : entries) {
+		bool ok = false;
+		try {
+			ok = store_new_paste(id, entry.content, entry.expires_at);
+		} catch (std::exception &ex) {
+		}
+		// This node owns next to nothing, all of it goes to one that does
+		if (!ok && stored == 0 && cluster.enabled() && !id.empty() && !cluster.owns(id))
+			return from_node ? HttpResponse(bad_gateway)
+							 : forward_upload(req, cluster.placement(id)[0]);
+		if (!ok) {
+			urls.append("-\n");
+			continue;
+		}
+		stored++;
+		urls.append("/p/").append(id).append("\n");
+	}
+	if (stored == 0)
+		return HttpResponse(internal_error);
 
-	if (expiration != -1 && std::time(nullptr) > expiration) {
-		f.close();
-		meta.close();
-		std::filesystem::remove(filepath);
-		std::filesystem::remove(metapath);
+	HttpResponse response(req.getAllocator());
+	response.setContentType("text/plain");
+	response.appendBody(std::move(urls));
+	return response;
+}
 
-		if (std::filesystem::is_empty(dirpath))
-			std::filesystem::remove(dirpath);
+// A paste another node holds, decoded. One over max_size isn't read, too_large says so
+static std::optional<std::string> remote_paste(std::string_view id, size_t max_size,
+											   bool &too_large)
+{
+	Cluster &cluster = Cluster::instance();
+	std::string request;
+	for (size_t node : cluster.placement(id)) {
+		if (cluster.isSelf(node))
+			continue;
+		request.assign("GET /p/").append(id).append(" HTTP/1.1\r\nHost: ").append(cluster.name(node));
+		request.append("\r\nUser-Agent: curl\r\n");
+		cluster.appendNodeHeaders(request);
+		request.append("\r\n");
+		std::optional<UpstreamPool::Response> upstream = cluster.send(node, request, max_size);
+		if (upstream && upstream->status == 200) {
+			too_large = upstream->too_large;
+			return too_large ? std::nullopt : std::optional(std::move(upstream->body));
+		}
+	}
+	return std::nullopt;
+}
 
-		response.setStatusCode(404);
-		response.setBody("<h1>Not found</h1>");
-		return response;
+// ?ids=a,b,c, answered as "<size> <id>\n<content>\n" for each, and "- <id>\n" for the ones that
+// don't exist. An ID asked for twice is answered once, and past max_batch_bytes of content the
+// whole batch is a 413. Compressed pastes are inflated here, HttpServer gzips the whole batch
+// instead
+static HttpResponse fetch_batch(const HttpRequest &req)
+{
+	std::pmr::string query(req.getQuery(), req.getAllocator());
+	auto fields = parse_form_data(query);
+	std::optional<std::string_view> ids;
+	if (!fields || !(ids = form_value(*fields, "ids")) || ids->empty())
+		return HttpResponse(incorrect_body);
+
+	Cluster &cluster = Cluster::instance();
+	bool ask_nodes = cluster.enabled() && !cluster.fromNode(req);
+	std::pmr::string out(req.getAllocator());
+	std::pmr::string content(req.getAllocator());
+	std::pmr::vector<std::string_view> seen(req.getAllocator());
+	size_t count = 0, fetched = 0;
+	for (std::string_view list = *ids; !list.empty();) {
+		size_t comma = list.find(',');
+		std::string_view id = list.substr(0, comma);
+		list.remove_prefix(comma == std::string_view::npos ? list.size() : comma + 1);
+		if (id.empty())
+			continue;
+		if (++count > max_batch_ids)
+			return HttpResponse(batch_too_large);
+		if (id.find_first_not_of(
+				"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789")
+			!= std::string_view::npos)
+			return HttpResponse(invalid_paste_id);
+		if (std::find(seen.begin(), seen.end(), id) != seen.end())
+			continue;
+		seen.push_back(id);
+
+		// What's left of max_batch_bytes, a paste going over it isn't kept past that
+		size_t room = max_batch_bytes - fetched;
+		bool too_large = false;
+		content.clear();
+		if (std::optional<StoredPaste> paste = open_paste(id)) {
+			too_large = paste->encoding == Encoding::IDENTITY && paste->size > room;
+			if (!too_large)
+				read_paste(*paste, [&](std::string_view chunk) {
+					if (content.size() + chunk.size() > room)
+						too_large = true;
+					else
+						content.append(chunk);
+				});
+		} else if (std::optional<std::string> remote;
+				   ask_nodes && (remote = remote_paste(id, room, too_large))) {
+			content.assign(*remote);
+		} else if (!too_large) {
+			out.append("- ").append(id).append("\n");
+			continue;
+		}
+		if (too_large)
+			return HttpResponse(batch_content_too_large);
+		fetched += content.size();
+		append_number(out, content.size());
+		out.append(" ").append(id).append("\n").append(content).append("\n");
 	}
+	if (count == 0)
+		return HttpResponse(incorrect_body);
+
+	HttpResponse response(req.getAllocator());
+	response.setContentType("text/plain");
+	response.appendBody(std::move(out));
+	return response;
+}
 
-	std::size_t size = f.tellg();
-	f.seekg(0);
-	std::string paste(size, '\0');
-	f.read(&paste[0], size);
+HttpResponse handle_batch(const HttpRequest &req)
+{
+	std::string_view method = req.getMethod();
+	if (method == "POST" || method == "PUT")
+		return upload_batch(req);
+	if (method == "GET" || method == "HEAD")
+		return fetch_batch(req);
+	return HttpResponse(method_not_allowed);
+}
 
-	std::string format_date;
-	if (expiration == -1) {
-		format_date = "Never";
-	} else {
-		std::time_t t = static_cast<std::time_t>(expiration);
-		std::tm tm;
-		localtime_r(&t, &tm);
-		std::stringstream cpp_yousuck_sometimes;
-		cpp_yousuck_sometimes << std::put_time(&tm, "%Y-%m-%d %H:%M:%S");
-		format_date = cpp_yousuck_sometimes.str();
+// Search results: "/p/<id>\n" for each paste that has the query, and under it "  <n>: <line>\n"
+// for the first lines it's in
+static constexpr size_t search_results = 20, max_search_results = 100;
+static constexpr size_t search_lines = 3;
+static constexpr size_t snippet_width = 160;	// Longer lines are cut around the match
+// Most of a query's candidates can be false positives, they're only read this far
+static constexpr size_t max_search_candidates = 1000;
+static constexpr size_t max_search_read = 64 << 20;
+
+// Finds query in content and appends the lines it's in. False if it isn't there, the index only
+// says it may be
+static bool search_lines_of(std::string_view content, std::string_view query, bool ignore_case,
+							std::pmr::string &out)
+{
+	// Folding keeps every byte where it was, so offsets in the copy are offsets in content
+	thread_local std::string folded_content, folded_query;
+	std::string_view haystack = content, needle = query;
+	if (ignore_case) {
+		auto fold = [](char c) { return c >= 'A' && c <= 'Z' ? char(c + ('a' - 'A')) : c; };
+		folded_content.resize(content.size());
+		std::transform(content.begin(), content.end(), folded_content.begin(), fold);
+		folded_query.resize(query.size());
+		std::transform(query.begin(), query.end(), folded_query.begin(), fold);
+		haystack = folded_content;
+		needle = folded_query;
 	}
 
-	std::string page;
-	page.reserve(4096 + size);
+	size_t found = 0, line_number = 1, counted = 0;
+	for (size_t pos = haystack.find(needle); pos != std::string_view::npos && found < search_lines;
+		 pos = haystack.find(needle, pos)) {
+		size_t start = content.rfind('\n', pos);
+		start = start == std::string_view::npos ? 0 : start + 1;
+		size_t end = std::min(content.find('\n', pos + needle.size()), content.size());
+		line_number += std::count(content.begin() + counted, content.begin() + start, '\n');
+		counted = start;
+
+		std::string_view line = content.substr(start, end - start);
+		if (line.ends_with('\r'))
+			line.remove_suffix(1);
+		out.append("  ");
+		append_number(out, line_number);
+		out.append(": ");
+		if (line.size() <= snippet_width) {
+			out.append(line);
+		} else {
+			size_t at = pos - start, from = 0;
+			if (at > snippet_width / 2)
+				from = std::min(at - snippet_width / 2, line.size() - snippet_width);
+			out.append(from ? "..." : "").append(line.substr(from, snippet_width));
+			out.append(from + snippet_width < line.size() ? "..." : "");
+		}
+		out.append("\n");
+		found++;
+		pos = end;
+	}
+	return found > 0;
+}
 
-	std::optional<std::string> user_agent = req.getHeader("User-Agent");
-	if (user_agent && user_agent->rfind("curl", 0) == 0){
-		response.setBody(std::move(paste));
-		response.setContentType("text/plain");
-		return response;
+// The results of another node, for the pastes that aren't in out yet
+static void merge_results(std::string_view body, std::pmr::string &out,
+						  std::unordered_set<std::string> &seen, size_t &results, size_t limit)
+{
+	bool keep = false;
+	while (!body.empty()) {
+		size_t eol = body.find('\n');
+		std::string_view line = body.substr(0, eol == std::string_view::npos ? body.size() : eol + 1);
+		body.remove_prefix(line.size());
+		if (line.starts_with("/p/")) {
+			std::string id(line.substr(3, line.find_first_of("\n") - 3));
+			keep = results < limit && seen.insert(id).second;
+			results += keep;
+		}
+		if (keep)
+			out.append(line);
 	}
+}
 
-	page += R"(
-    <!DOCTYPE html>
-    <html>
-    <head>
-        <title>Paste )" ;
-	page += paste_id;
-	page += R"(</title>
-        <style>
-            body { background: #1a1b26; color: #a9b1d6; font-family: monospace; padding: 20px; }
-            .code-block { 
-                background: #16161e; 
-                padding: 20px; 
-                border-radius: 8px; 
-                border: 1px solid #292e42; 
-                white-space: pre-wrap; 
-                overflow-x: auto;
-            }
-            .header {
-                display: flex;
-                justify-content: space-between;
-                align-items: center;
-                margin-bottom: 20px;
-            }
-            a { color: #7aa2f7; text-decoration: none; }
-            .meta { color: #565f89; font-size: 0.85rem; } 
-        </style>
-    </head>
-    <body>
-        <div class="header">
-            <a href="/">&larr; Create New Paste</a>
-            <span class="meta">Expires: )";
-	page += format_date;
-	page += R"(</span>
-        </div>
-        <div class="code-block">)"
-					   + html_escape(paste) + R"(</div>
-    </body>
-    </html>
-    )";
+// GET /search?q=<text>[&i=1][&limit=<n>]. Candidates come from the index and are read to check
+// them, newest first, up to max_search_candidates of them and max_search_read bytes. Of each
+// only the first max_indexed bytes are checked, what the index takes of one add. In cluster
+// mode every node searches what it holds, and the node the client asked merges their results
+HttpResponse handle_search(const HttpRequest &req)
+{
+	if (req.getMethod() != "GET" && req.getMethod() != "HEAD")
+		return HttpResponse(method_not_allowed);
+	std::pmr::string query(req.getQuery(), req.getAllocator());
+	auto fields = parse_form_data(query);
+	std::optional<std::string_view> q;
+	if (!fields || !(q = form_value(*fields, "q")) || q->size() < SearchIndex::min_query)
+		return HttpResponse(query_too_short);
+	bool ignore_case = form_value(*fields, "i") == "1";
+	size_t limit = search_results;
+	if (auto value = form_value(*fields, "limit")) {
+		std::from_chars(value->data(), value->data() + value->size(), limit);
+		limit = std::clamp<size_t>(limit, 1, max_search_results);
+	}
+	Metrics::add(Metrics::SEARCHES);
+
+	std::pmr::string out(req.getAllocator());
+	std::unordered_set<std::string> seen;
+	size_t results = 0, checked = 0, read = 0;
+	std::string content;
+	SearchIndex::instance().candidates(*q, [&](std::string_view id) {
+		if (++checked > max_search_candidates || read >= max_search_read)
+			return false;
+		std::optional<StoredPaste> paste = open_paste(id);
+		if (!paste)
+			return true;
+		content.clear();
+		read_paste(*paste, [&content](std::string_view chunk) { content.append(chunk); },
+				   std::min(SearchIndex::max_indexed, max_search_read - read));
+		read += content.size();
+		size_t before = out.size();
+		out.append("/p/").append(id).append("\n");
+		if (!search_lines_of(content, *q, ignore_case, out)) {
+			out.resize(before);
+			Metrics::add(Metrics::SEARCH_MISSES);
+			return true;
+		}
+		Metrics::add(Metrics::SEARCH_MATCHES);
+		seen.emplace(id);
+		return ++results < limit;
+	});
+
+	Cluster &cluster = Cluster::instance();
+	if (cluster.enabled() && !cluster.fromNode(req)) {
+		for (size_t node = 0; node < cluster.size() && results < limit; node++) {
+			if (cluster.isSelf(node))
+				continue;
+			auto upstream = cluster.forward(node, req);
+			if (upstream && upstream->status == 200)
+				merge_results(upstream->body, out, seen, results, limit);
+		}
+	}
 
-	response.setBody(std::move(page));
-	response.setContentType("text/html; charset=utf-8");
+	HttpResponse response(req.getAllocator());
+	response.setContentType("text/plain");
+	response.appendBody(std::move(out));
 	return response;
 }
+
+HttpResponse store_replica(const HttpRequest &req)
+{
+	if (req.getMethod() != "PUT")
+		return HttpResponse(method_not_allowed);
+	// Only nodes send these, and only for IDs the ring gives this node
+	std::string id(req.getPath().substr(std::string_view("/replica/").size()));
+	Cluster &cluster = Cluster::instance();
+	if (!cluster.fromNode(req) || !cluster.holds(id))
+		return HttpResponse(not_a_replica);
+
+	std::pmr::string query(req.getQuery(), req.getAllocator());
+	long long expires_at = 0;
+	auto fields = parse_form_data(query);
+	if (fields && form_value(*fields, "append") == "1")
+		return apply_append(req, id, form_value(*fields, "done") == "1");
+	std::optional<std::string_view> expires;
+	if (!fields || !(expires = form_value(*fields, "expires"))
+		|| std::from_chars(expires->data(), expires->data() + expires->size(), expires_at).ec
+			 != std::errc())
+		return HttpResponse(incorrect_body);
+
+	try {
+		// Already there is fine, the owner may be retrying
+		IdAllocator::instance().insert(id);
+		save_paste_to_disk(id, req.getBody(), expires_at,
+						   form_value(*fields, "key").value_or(""));
+	} catch (std::exception &ex) {
+		return HttpResponse(invalid_paste_id);
+	}
+	return HttpResponse(replica_stored);
+}
@@ -7,5 +7,11 @@
 HttpResponse root_endpoint(const HttpRequest &req);
 HttpResponse handle_paste(const HttpRequest &req);
 HttpResponse show_paste(const HttpRequest &req);
+// Many pastes in one request, POST to upload and GET ?ids= to fetch
+HttpResponse handle_batch(const HttpRequest &req);
+// Pastes that have some text in them, with -i <dir>
+HttpResponse handle_search(const HttpRequest &req);
+// Cluster mode: copies of pastes other nodes own, sent by them
+HttpResponse store_replica(const HttpRequest &req);
 
 #endif	// !ENDPOINTS_HPP
@@ -0,0 +1,186 @@
+#include "accesslog.hpp"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <unistd.h>
+
+#include "metrics.hpp"
+
+static std::atomic<uint64_t> next_log_id = 1;
+
+AccessLog::AccessLog(const std::string &path) : id(next_log_id++)
+{
+	fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "open " + path);
+	writer = std::thread([this] { run(); });
+}
+
+AccessLog::~AccessLog()
+{
+	{
+		std::lock_guard lock(stop_mutex);
+		stop = true;
+	}
+	stop_cv.notify_one();
+	writer.join();
+	close(fd);
+}
+
+AccessLog::Ring &AccessLog::localRing()
+{
+	thread_local uint64_t cached_id = 0;
+	thread_local Ring *cached_ring = nullptr;
+	if (cached_id == id)
+		return *cached_ring;
+
+	std::lock_guard lock(rings_mutex);
+	rings.push_back(std::make_unique<Ring>());
+	cached_id = id;
+	cached_ring = rings.back().get();
+	return *cached_ring;
+}
+
+void AccessLog::log(const struct sockaddr_storage &peer, std::string_view method,
+					std::string_view path, int status, uint64_t bytes_out, uint64_t duration_ns)
+{
+	Ring &ring = localRing();
+	uint64_t head = ring.head.load(std::memory_order_relaxed);
+	if (head - ring.tail.load(std::memory_order_acquire) >= ring_size) {
+		Metrics::add(Metrics::ACCESS_LOG_DROPPED);
+		return;
+	}
+
+	Record &r = ring.records[head & (ring_size - 1)];
+	r.timestamp_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+					   std::chrono::system_clock::now().time_since_epoch())
+					   .count();
+	r.duration_ns = duration_ns;
+	r.bytes_out = bytes_out;
+	r.status = status;
+	r.method_len = std::min(method.size(), sizeof(r.method));
+	memcpy(r.method, method.data(), r.method_len);
+	r.path_len = std::min(path.size(), sizeof(r.path));
+	memcpy(r.path, path.data(), r.path_len);
+
+	r.family = peer.ss_family;
+	if (peer.ss_family == AF_INET6) {
+		const auto *in6 = reinterpret_cast<const struct sockaddr_in6 *>(&peer);
+		memcpy(r.addr, &in6->sin6_addr, 16);
+		r.port = ntohs(in6->sin6_port);
+	} else {
+		const auto *in = reinterpret_cast<const struct sockaddr_in *>(&peer);
+		memcpy(r.addr, &in->sin_addr, 4);
+		r.port = ntohs(in->sin_port);
+	}
+
+	ring.head.store(head + 1, std::memory_order_release);
+}
+
+// Appends s as the contents of a JSON string (without the quotes)
+static void append_json(std::string &out, std::string_view s)
+{
+	for (unsigned char c : s) {
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (c < 0x20 || c >= 0x7f) {
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			out += esc;
+		} else {
+			out += c;
+		}
+	}
+}
+
+static void format_record(std::string &out, const AccessLog::Record &r)
+{
+	char buf[64];
+	std::time_t secs = r.timestamp_ns / 1000000000;
+	std::tm tm;
+	gmtime_r(&secs, &tm);
+	size_t n = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(buf + n, sizeof(buf) - n, ".%03dZ", static_cast<int>(r.timestamp_ns / 1000000 % 1000));
+	out.append("{\"time\":\"").append(buf).append("\",\"peer\":\"");
+
+	char addr[INET6_ADDRSTRLEN] = "";
+	inet_ntop(r.family == AF_INET6 ? AF_INET6 : AF_INET, r.addr, addr, sizeof(addr));
+	out.append(addr).append("\",\"port\":").append(std::to_string(r.port));
+
+	out.append(",\"method\":\"");
+	append_json(out, std::string_view(r.method, r.method_len));
+	out.append("\",\"path\":\"");
+	append_json(out, std::string_view(r.path, r.path_len));
+	out.append("\",\"status\":").append(std::to_string(r.status));
+	out.append(",\"bytes\":").append(std::to_string(r.bytes_out));
+	snprintf(buf, sizeof(buf), ",\"duration_ms\":%.3f}\n", r.duration_ns / 1e6);
+	out.append(buf);
+}
+
+void AccessLog::drain()
+{
+	thread_local std::vector<std::string> chunks;
+	chunks.clear();
+
+	{
+		std::lock_guard lock(rings_mutex);
+		for (const auto &ring : rings) {
+			uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+			uint64_t head = ring->head.load(std::memory_order_acquire);
+			if (tail == head)
+				continue;
+
+			std::string &chunk = chunks.emplace_back();
+			chunk.reserve((head - tail) * 160);
+			for (; tail != head; tail++)
+				format_record(chunk, ring->records[tail & (ring_size - 1)]);
+			// Only now can the worker reuse the slots
+			ring->tail.store(head, std::memory_order_release);
+		}
+	}
+
+	std::vector<struct iovec> iov;
+	for (std::string &chunk : chunks)
+		iov.push_back({ chunk.data(), chunk.size() });
+
+	size_t first = 0;
+	while (first < iov.size()) {
+		ssize_t n = writev(fd, &iov[first], std::min<size_t>(iov.size() - first, IOV_MAX));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("access log");
+			return;
+		}
+		size_t written = n;
+		while (first < iov.size() && written >= iov[first].iov_len)
+			written -= iov[first++].iov_len;
+		if (first < iov.size()) {
+			iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + written;
+			iov[first].iov_len -= written;
+		}
+	}
+}
+
+void AccessLog::run()
+{
+	std::unique_lock lock(stop_mutex);
+	while (!stop) {
+		stop_cv.wait_for(lock, std::chrono::milliseconds(flush_interval_ms));
+		lock.unlock();
+		drain();
+		lock.lock();
+	}
+	lock.unlock();
+	drain();  // Whatever came in while stopping
+}
@@ -0,0 +1,71 @@
+#ifndef ACCESSLOG_HPP
+#define ACCESSLOG_HPP
+
+#include <array>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+#include <thread>
+#include <vector>
+
+// Structured (JSON lines) access log that never blocks a worker.
+//
+// Each worker thread gets its own single-producer single-consumer ring of fixed-size records,
+// so logging a request is a copy into the ring and a release store. A background thread drains
+// all rings, formats the records and writes them out with one writev per round. If a ring is
+// full the record is dropped and counted (posthaste_access_log_dropped_total) instead of waiting
+// for the writer
+class AccessLog {
+   public:
+	struct Record {
+		int64_t timestamp_ns;  // Wall clock, when the request finished
+		uint64_t duration_ns;
+		uint64_t bytes_out;
+		uint16_t status;
+		uint8_t method_len, path_len;
+		char method[8];
+		char path[110];	 // Truncated, long paths are almost always scanners anyway
+		uint8_t family;	 // AF_INET or AF_INET6
+		uint16_t port;
+		uint8_t addr[16];
+	};
+
+	explicit AccessLog(const std::string &path);
+	AccessLog(const AccessLog &) = delete;
+	AccessLog &operator=(const AccessLog &) = delete;
+	~AccessLog();
+
+	void log(const struct sockaddr_storage &peer, std::string_view method, std::string_view path,
+			 int status, uint64_t bytes_out, uint64_t duration_ns);
+
+   private:
+	static constexpr size_t ring_size = 4096;  // Records per worker, must be a power of two
+	static constexpr int flush_interval_ms = 100;
+
+	struct Ring {
+		alignas(64) std::atomic<uint64_t> head = 0;	 // Written by the worker
+		alignas(64) std::atomic<uint64_t> tail = 0;	 // Written by the log thread
+		std::array<Record, ring_size> records;
+	};
+
+	int fd;
+	uint64_t id;  // Tells apart instances in the threads' ring cache
+	std::vector<std::unique_ptr<Ring>> rings;
+	std::mutex rings_mutex;	 // Only taken when a thread logs for the first time, and to drain
+
+	bool stop = false;
+	std::mutex stop_mutex;
+	std::condition_variable stop_cv;
+	std::thread writer;
+
+	Ring &localRing();
+	void drain();
+	void run();
+};
+
+#endif	// !ACCESSLOG_HPP
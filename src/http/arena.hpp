@@ -0,0 +1,91 @@
+#ifndef ARENA_HPP
+#define ARENA_HPP
+
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+#include <optional>
+
+#include "bufferpool.hpp"
+
+// Memory for one request at a time. Parser strings, headers, the handler's scratch and the
+// response all bump a pointer through a block from the BufferPool, taken on the first
+// allocation, and are dropped together by reset() once the response is out, which also gives
+// the block back. Only requests that outgrow the block get more from the global allocator,
+// until the next reset
+class Arena : public std::pmr::memory_resource {
+   public:
+	static constexpr size_t block_size = 16 << 10;	// A browser GET and its page, with room to spare
+	static_assert(BufferPool::classSize(block_size) == block_size);
+	// Bodies and pages past this go straight to the global allocator and are freed as usual.
+	// Growing one in the arena would leave every smaller copy behind until the reset
+	static constexpr size_t large_size = 4 << 10;
+
+   private:
+	BufferPool::Buffer block;
+	std::optional<std::pmr::monotonic_buffer_resource> small;
+
+	// Plain operator new rather than new_delete_resource(), which always takes the slower
+	// aligned path
+	void *do_allocate(size_t bytes, size_t alignment) override
+	{
+		if (bytes <= large_size) {
+			if (!small) {
+				block = BufferPool::acquire(block_size);
+				small.emplace(block.data(), block.size());
+			}
+			return small->allocate(bytes, alignment);
+		}
+		if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			return ::operator new(bytes, std::align_val_t(alignment));
+		return ::operator new(bytes);
+	}
+
+	void do_deallocate(void *p, size_t bytes, size_t alignment) override
+	{
+		if (bytes <= large_size)  // Sizes always match, pmr passes them back
+			return;
+		if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+			::operator delete(p, bytes, std::align_val_t(alignment));
+		else
+			::operator delete(p, bytes);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+	{
+		return this == &other;
+	}
+
+   public:
+	Arena() = default;
+	Arena(const Arena &) = delete;
+	Arena &operator=(const Arena &) = delete;
+
+	std::pmr::memory_resource *get() { return this; }
+	// Nothing allocated from the arena may be touched after this
+	void reset()
+	{
+		small.reset();
+		block.release();
+	}
+
+	// Resets the arena when it goes out of scope. Declared before the objects living in the
+	// arena, so their destructors run first
+	class Scope {
+	   private:
+		Arena *arena;
+
+	   public:
+		explicit Scope(Arena &a) : arena(&a) {}
+		Scope(const Scope &) = delete;
+		Scope &operator=(const Scope &) = delete;
+		~Scope()
+		{
+			if (arena)
+				arena->reset();
+		}
+		void dismiss() { arena = nullptr; }
+	};
+};
+
+#endif	// !ARENA_HPP
@@ -0,0 +1,138 @@
+#include "bufferpool.hpp"
+#include <algorithm>
+#include <mutex>
+#include <new>
+#include <vector>
+
+namespace {
+
+constexpr size_t n_classes = BufferPool::class_sizes.size();
+// Past this a class's shared list frees what it gets. Enough for a burst of big uploads
+constexpr size_t shared_bytes_max = 32 << 20;
+constexpr size_t max_nodes = 8;	 // Nodes past it share lists with a lower one
+
+constexpr size_t local_max(size_t size_class)
+{
+	return std::min<size_t>(16, (1 << 20) / BufferPool::class_sizes[size_class]);
+}
+
+struct Shared {
+	std::mutex mutex;
+	std::vector<char *> free;
+};
+
+thread_local size_t node = 0;	 // See setNode()
+
+// The calling thread's node's. Never freed, threads may still give blocks back during exit
+std::array<Shared, n_classes> &shared()
+{
+	static auto *nodes = new std::array<std::array<Shared, n_classes>, max_nodes>();
+	return (*nodes)[node];
+}
+
+void free_block(char *block, size_t size_class)
+{
+	::operator delete(block, BufferPool::class_sizes[size_class]);
+}
+
+// Moves n blocks from the back of the thread's list to the shared one
+void give_back(std::vector<char *> &local, size_t size_class, size_t n)
+{
+	Shared &s = shared()[size_class];
+	size_t keep = local.size() - n;
+	{
+		std::lock_guard lock(s.mutex);
+		size_t room = shared_bytes_max / BufferPool::class_sizes[size_class] - s.free.size();
+		size_t moved = std::min(n, room);
+		s.free.insert(s.free.end(), local.begin() + keep, local.begin() + keep + moved);
+		keep += moved;
+	}
+	for (size_t i = keep; i < local.size(); i++)
+		free_block(local[i], size_class);
+	local.resize(local.size() - n);
+}
+
+// Whether the thread's cache is there to use. Plain, so it outlives the cache at thread exit,
+// when destructors of other thread_locals may still give blocks back
+enum class CacheState : uint8_t { UNBORN, ALIVE, DEAD };
+thread_local CacheState cache_state = CacheState::UNBORN;
+
+struct LocalCache {
+	std::array<std::vector<char *>, n_classes> free;
+
+	LocalCache()
+	{
+		for (size_t c = 0; c < n_classes; c++)
+			free[c].reserve(local_max(c));
+		cache_state = CacheState::ALIVE;
+	}
+
+	~LocalCache()
+	{
+		cache_state = CacheState::DEAD;
+		for (size_t c = 0; c < n_classes; c++)
+			give_back(free[c], c, free[c].size());
+	}
+};
+
+// nullptr once the thread's cache is destroyed, blocks then go straight to the shared lists
+LocalCache *local()
+{
+	if (cache_state == CacheState::DEAD)
+		return nullptr;
+	thread_local LocalCache cache;
+	return &cache;
+}
+
+}  // namespace
+
+BufferPool::Buffer BufferPool::acquire(size_t size)
+{
+	uint8_t c = classFor(size);
+	LocalCache *cache = local();
+	if (!cache) {
+		Shared &s = shared()[c];
+		std::unique_lock lock(s.mutex);
+		if (s.free.empty()) {
+			lock.unlock();
+			return Buffer(static_cast<char *>(::operator new(class_sizes[c])), c);
+		}
+		char *block = s.free.back();
+		s.free.pop_back();
+		return Buffer(block, c);
+	}
+	std::vector<char *> &mine = cache->free[c];
+	if (mine.empty()) {	 // Half a list's worth at once, so the lock is taken less often
+		Shared &s = shared()[c];
+		std::lock_guard lock(s.mutex);
+		size_t n = std::min(s.free.size(), std::max<size_t>(1, local_max(c) / 2));
+		mine.insert(mine.end(), s.free.end() - n, s.free.end());
+		s.free.resize(s.free.size() - n);
+	}
+	if (mine.empty())
+		return Buffer(static_cast<char *>(::operator new(class_sizes[c])), c);
+	char *block = mine.back();
+	mine.pop_back();
+	return Buffer(block, c);
+}
+
+void BufferPool::setNode(int n)
+{
+	node = size_t(n) % max_nodes;
+}
+
+void BufferPool::Buffer::release()
+{
+	if (!ptr)
+		return;
+	LocalCache *cache = local();
+	if (!cache) {
+		std::vector<char *> one { std::exchange(ptr, nullptr) };
+		give_back(one, size_class, 1);
+		return;
+	}
+	std::vector<char *> &mine = cache->free[size_class];
+	if (mine.size() >= local_max(size_class))
+		give_back(mine, size_class, mine.size() / 2 + 1);
+	mine.push_back(std::exchange(ptr, nullptr));
+}
@@ -0,0 +1,67 @@
+#ifndef BUFFER_POOL_HPP
+#define BUFFER_POOL_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+// Process wide pool of memory blocks in a few size classes, for socket reads and request
+// arenas. Connections only hold a block while they have a request in flight, so an idle one
+// costs next to nothing and the blocks go to whoever is busy.
+//
+// Each thread keeps a few blocks of every class to itself, so taking and giving one back is
+// usually a vector push and pop. The rest sit in a shared list per class, up to a cap, past
+// which they're freed. There's a set of shared lists per NUMA node, so pinned workers trade
+// blocks with the workers of their own node only. Blocks are first touched by the thread that
+// takes them new, so they mostly stay on that node
+class BufferPool {
+   public:
+	static constexpr std::array<size_t, 4> class_sizes = { 2 << 10, 16 << 10, 64 << 10, 256 << 10 };
+	static constexpr size_t min_size = class_sizes.front();
+	static constexpr size_t max_size = class_sizes.back();
+
+	class Buffer {
+	   private:
+		char *ptr = nullptr;
+		uint8_t size_class = 0;
+
+	   public:
+		Buffer() = default;
+		Buffer(char *p, uint8_t c) : ptr(p), size_class(c) {}
+		Buffer(Buffer &&b) noexcept : ptr(std::exchange(b.ptr, nullptr)), size_class(b.size_class) {}
+		Buffer &operator=(Buffer &&b) noexcept
+		{
+			if (this != &b) {
+				release();
+				ptr = std::exchange(b.ptr, nullptr);
+				size_class = b.size_class;
+			}
+			return *this;
+		}
+		Buffer(const Buffer &) = delete;
+		Buffer &operator=(const Buffer &) = delete;
+		~Buffer() { release(); }
+
+		void release();	 // Back to the pool, if it held anything
+		char *data() const { return ptr; }
+		size_t size() const { return ptr ? class_sizes[size_class] : 0; }
+		explicit operator bool() const { return ptr != nullptr; }
+	};
+
+	// The smallest block of at least size bytes, or the largest there is
+	static Buffer acquire(size_t size);
+	// The calling thread's NUMA node, whose shared lists it uses from now on. Node 0 until set
+	static void setNode(int node);
+
+	static constexpr uint8_t classFor(size_t size)
+	{
+		uint8_t c = 0;
+		while (c + 1u < class_sizes.size() && class_sizes[c] < size)
+			c++;
+		return c;
+	}
+	static constexpr size_t classSize(size_t size) { return class_sizes[classFor(size)]; }
+};
+
+#endif	// !BUFFER_POOL_HPP
@@ -0,0 +1,164 @@
+#include "capture.hpp"
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <system_error>
+#include <unistd.h>
+
+static std::atomic<uint64_t> next_capture_id = 1;
+
+static int64_t monotonic_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			 std::chrono::steady_clock::now().time_since_epoch())
+	  .count();
+}
+
+TrafficCapture::TrafficCapture(const std::string &path) : id(next_capture_id++)
+{
+	fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "open " + path);
+
+	FileHeader header;
+	memcpy(header.magic, magic, sizeof(magic));
+	header.start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+						std::chrono::system_clock::now().time_since_epoch())
+						.count();
+	if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+		int error = errno;
+		::close(fd);
+		throw std::system_error(error, std::generic_category(), "write " + path);
+	}
+	start_ns = monotonic_ns();
+	writer = std::thread([this] { run(); });
+}
+
+TrafficCapture::~TrafficCapture()
+{
+	{
+		std::lock_guard lock(stop_mutex);
+		stop = true;
+	}
+	stop_cv.notify_one();
+	writer.join();
+	::close(fd);
+}
+
+TrafficCapture::Buffer &TrafficCapture::localBuffer()
+{
+	thread_local uint64_t cached_id = 0;
+	thread_local Buffer *cached_buffer = nullptr;
+	if (cached_id == id)
+		return *cached_buffer;
+
+	std::lock_guard lock(buffers_mutex);
+	buffers.push_back(std::make_unique<Buffer>());
+	cached_id = id;
+	cached_buffer = buffers.back().get();
+	return *cached_buffer;
+}
+
+void TrafficCapture::append(RecordType type, uint32_t conn, const void *payload, uint32_t len)
+{
+	RecordHeader header { type, conn, uint64_t(monotonic_ns() - start_ns), len };
+	Buffer &buffer = localBuffer();
+	std::lock_guard lock(buffer.mutex);	 // Only the writer thread ever contends
+	buffer.data.append(reinterpret_cast<const char *>(&header), sizeof(header));
+	buffer.data.append(static_cast<const char *>(payload), len);
+}
+
+void TrafficCapture::open(uint32_t conn)
+{
+	append(OPEN, conn, nullptr, 0);
+}
+
+void TrafficCapture::data(uint32_t conn, const char *bytes, size_t len)
+{
+	append(DATA, conn, bytes, len);
+}
+
+void TrafficCapture::close(uint32_t conn)
+{
+	append(CLOSE, conn, nullptr, 0);
+}
+
+void TrafficCapture::response(uint32_t conn, uint64_t request_end, const HttpResponse &response)
+{
+	ResponseInfo info;
+	info.request_end = request_end;
+	info.body_size = response.getBodySize();
+	info.status = response.getStatusCode();
+
+	uint64_t h = hash_seed;
+	for (std::string_view part : response.getBodyParts())
+		h = hash(h, part.data(), part.size());
+	// File bodies went out with sendfile, read them again. Only costs anything when capturing
+	if (response.getFileFd() >= 0) {
+		char buf[64 << 10];
+		off_t offset = 0;
+		while (size_t(offset) < response.getFileSize()) {
+			ssize_t n = pread(response.getFileFd(), buf, sizeof(buf), offset);
+			if (n <= 0)
+				break;
+			h = hash(h, buf, n);
+			offset += n;
+		}
+	}
+	info.body_hash = h;
+
+	append(RESPONSE, conn, &info, sizeof(info));
+}
+
+void TrafficCapture::drain()
+{
+	std::vector<std::string> chunks;
+	{
+		std::lock_guard lock(buffers_mutex);
+		for (const auto &buffer : buffers) {
+			std::lock_guard buffer_lock(buffer->mutex);
+			if (!buffer->data.empty())
+				chunks.push_back(std::move(buffer->data));
+			buffer->data.clear();
+		}
+	}
+
+	std::vector<struct iovec> iov;
+	for (std::string &chunk : chunks)
+		iov.push_back({ chunk.data(), chunk.size() });
+
+	size_t first = 0;
+	while (first < iov.size()) {
+		ssize_t n = writev(fd, &iov[first], std::min<size_t>(iov.size() - first, IOV_MAX));
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("capture");
+			return;
+		}
+		size_t written = n;
+		while (first < iov.size() && written >= iov[first].iov_len)
+			written -= iov[first++].iov_len;
+		if (first < iov.size()) {
+			iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + written;
+			iov[first].iov_len -= written;
+		}
+	}
+}
+
+void TrafficCapture::run()
+{
+	std::unique_lock lock(stop_mutex);
+	while (!stop) {
+		stop_cv.wait_for(lock, std::chrono::milliseconds(flush_interval_ms));
+		lock.unlock();
+		drain();
+		lock.lock();
+	}
+	lock.unlock();
+	drain();  // Whatever came in while stopping
+}
@@ -0,0 +1,92 @@
+#ifndef CAPTURE_HPP
+#define CAPTURE_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "httpresponse.hpp"
+
+// Records incoming traffic to a compact binary file that tools/replay.cpp can reissue against
+// a server. Client bytes are stored exactly as received (partial reads, pipelining and all),
+// and every response is summarized so a replay can tell whether it got the same answers.
+//
+// File layout: a FileHeader, then records. Each one is a RecordHeader followed by len bytes of
+// payload: nothing for OPEN and CLOSE, the raw bytes for DATA and a ResponseInfo for RESPONSE.
+// Each thread buffers its own records and a connection moves between workers, so the file is
+// not in timestamp order: readers sort by it.
+//
+// Workers append to a buffer of their own; a background thread moves them to the file every
+// 100 ms with one writev
+class TrafficCapture {
+   public:
+	enum RecordType : uint8_t { OPEN = 1, DATA, RESPONSE, CLOSE };
+
+	struct [[gnu::packed]] FileHeader {
+		char magic[8];	  // "PHCAP001"
+		int64_t start_ns;  // Wall clock when the capture began
+	};
+	struct [[gnu::packed]] RecordHeader {
+		uint8_t type;
+		uint32_t conn;
+		uint64_t ts_ns;	 // Since the capture began
+		uint32_t len;
+	};
+	struct [[gnu::packed]] ResponseInfo {
+		uint64_t request_end;  // Offset in the connection's input just past the request
+		uint64_t body_size;
+		uint64_t body_hash;	 // FNV-1a 64 of the body as sent
+		uint16_t status;
+	};
+
+	static constexpr char magic[8] = { 'P', 'H', 'C', 'A', 'P', '0', '0', '1' };
+
+	explicit TrafficCapture(const std::string &path);
+	TrafficCapture(const TrafficCapture &) = delete;
+	TrafficCapture &operator=(const TrafficCapture &) = delete;
+	~TrafficCapture();
+
+	void open(uint32_t conn);
+	void data(uint32_t conn, const char *bytes, size_t len);
+	void response(uint32_t conn, uint64_t request_end, const HttpResponse &response);
+	void close(uint32_t conn);
+
+	static constexpr uint64_t hash_seed = 0xcbf29ce484222325;
+	static uint64_t hash(uint64_t h, const char *data, size_t len)
+	{
+		for (size_t i = 0; i < len; i++)
+			h = (h ^ static_cast<unsigned char>(data[i])) * 0x100000001b3;
+		return h;
+	}
+
+   private:
+	static constexpr int flush_interval_ms = 100;
+
+	struct Buffer {
+		std::mutex mutex;
+		std::string data;
+	};
+
+	int fd;
+	uint64_t id;  // Tells apart instances in the threads' buffer cache
+	uint64_t start_ns;
+	std::vector<std::unique_ptr<Buffer>> buffers;
+	std::mutex buffers_mutex;
+
+	bool stop = false;
+	std::mutex stop_mutex;
+	std::condition_variable stop_cv;
+	std::thread writer;
+
+	Buffer &localBuffer();
+	void append(RecordType type, uint32_t conn, const void *payload, uint32_t len);
+	void drain();
+	void run();
+};
+
+#endif	// !CAPTURE_HPP
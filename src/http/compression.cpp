@@ -0,0 +1,179 @@
+#include "compression.hpp"
+#include <algorithm>
+#include <charconv>
+#include <stdexcept>
+#include <strings.h>
+#include <zlib.h>
+
+static std::string_view trim(std::string_view s)
+{
+	size_t start = s.find_first_not_of(" \t");
+	if (start == std::string_view::npos)
+		return {};
+	return s.substr(start, s.find_last_not_of(" \t") - start + 1);
+}
+
+Encoding negotiate_encoding(std::string_view accept_encoding)
+{
+	// "gzip, deflate;q=0.5, br" / "gzip;q=0" / "*". gzip's own q wins over the one of "*",
+	// wherever each comes (RFC 9110 12.5.3). -1 while not listed
+	double gzip_q = -1, any_q = -1;
+	size_t pos = 0;
+	while (pos < accept_encoding.size()) {
+		size_t next = accept_encoding.find(',', pos);
+		if (next == std::string_view::npos)
+			next = accept_encoding.size();
+		std::string_view item = accept_encoding.substr(pos, next - pos);
+		pos = next + 1;
+
+		size_t semicolon = item.find(';');
+		std::string_view coding = trim(item.substr(0, semicolon));
+		double q = 1;
+		while (semicolon != std::string_view::npos) {
+			item.remove_prefix(semicolon + 1);
+			semicolon = item.find(';');
+			std::string_view param = trim(item.substr(0, semicolon));
+			if (param.size() > 2 && strncasecmp(param.data(), "q=", 2) == 0)
+				std::from_chars(param.data() + 2, param.data() + param.size(), q);
+		}
+
+		if (coding.size() == 4 && strncasecmp(coding.data(), "gzip", 4) == 0)
+			gzip_q = q;
+		else if (coding == "*")
+			any_q = q;
+	}
+	return (gzip_q >= 0 ? gzip_q : any_q) > 0 ? Encoding::GZIP : Encoding::IDENTITY;
+}
+
+const char *encoding_name(Encoding encoding)
+{
+	switch (encoding) {
+	case Encoding::GZIP:
+		return "gzip";
+	case Encoding::IDENTITY:
+		break;
+	}
+	return "identity";
+}
+
+bool is_compressible(std::string_view content_type)
+{
+	return content_type.starts_with("text/") || content_type.find("json") != std::string_view::npos ||
+		   content_type.find("javascript") != std::string_view::npos ||
+		   content_type.find("xml") != std::string_view::npos;
+}
+
+std::string gzip_compress(const std::vector<std::string_view> &parts, int level)
+{
+	z_stream zs = {};
+	// 15 window bits + 16 asks zlib for a gzip header and trailer instead of raw zlib framing
+	if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		throw std::runtime_error("deflateInit2 failed");
+
+	size_t total = 0;
+	for (std::string_view part : parts)
+		total += part.size();
+
+	// deflateBound is an upper limit for one-shot deflation, so this is normally the only
+	// allocation. The buffer still grows if a multi-part stream needs more
+	std::string out(deflateBound(&zs, total), '\0');
+	zs.next_out = reinterpret_cast<Bytef *>(out.data());
+	zs.avail_out = out.size();
+
+	auto run = [&](int flush) {
+		for (;;) {
+			int ret = deflate(&zs, flush);
+			if (ret == Z_STREAM_ERROR) {
+				deflateEnd(&zs);
+				throw std::runtime_error("deflate failed");
+			}
+			if (zs.avail_out == 0) {
+				out.resize(out.size() * 2);
+				zs.next_out = reinterpret_cast<Bytef *>(out.data() + zs.total_out);
+				zs.avail_out = out.size() - zs.total_out;
+				continue;
+			}
+			if (flush == Z_FINISH ? ret == Z_STREAM_END : zs.avail_in == 0)
+				return;
+		}
+	};
+
+	for (std::string_view part : parts) {
+		zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(part.data()));
+		zs.avail_in = part.size();
+		run(Z_NO_FLUSH);
+	}
+	run(Z_FINISH);
+
+	out.resize(zs.total_out);
+	deflateEnd(&zs);
+	return out;
+}
+
+void gzip_decompress(std::string_view data, const std::function<void(std::string_view)> &sink,
+					 size_t max_size)
+{
+	z_stream zs = {};
+	if (inflateInit2(&zs, 15 + 16) != Z_OK)
+		throw std::runtime_error("inflateInit2 failed");
+
+	thread_local char chunk[1 << 16];
+	zs.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data.data()));
+	zs.avail_in = data.size();
+
+	int ret;
+	do {
+		zs.next_out = reinterpret_cast<Bytef *>(chunk);
+		zs.avail_out = sizeof(chunk);
+		ret = inflate(&zs, Z_NO_FLUSH);
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			inflateEnd(&zs);
+			throw std::runtime_error("Corrupt gzip data");
+		}
+		size_t n = std::min(sizeof(chunk) - zs.avail_out, max_size);
+		if (n)
+			sink(std::string_view(chunk, n));
+		if ((max_size -= n) == 0) {
+			inflateEnd(&zs);
+			return;
+		}
+	} while (ret != Z_STREAM_END && (zs.avail_in > 0 || zs.avail_out == 0));
+
+	inflateEnd(&zs);
+	if (ret != Z_STREAM_END)
+		throw std::runtime_error("Truncated gzip data");
+}
+
+CompressionCache::CompressionCache(size_t max_bytes) : max_bytes(max_bytes)
+{
+}
+
+std::shared_ptr<const std::string> CompressionCache::get(const std::string &key)
+{
+	std::lock_guard lock(mutex);
+	auto it = index.find(key);
+	if (it == index.end())
+		return nullptr;
+	lru.splice(lru.begin(), lru, it->second);
+	return it->second->second;
+}
+
+void CompressionCache::put(const std::string &key, std::shared_ptr<const std::string> value)
+{
+	if (value->size() > max_bytes / 8)	// One huge paste shouldn't flush everything else
+		return;
+
+	std::lock_guard lock(mutex);
+	if (index.contains(key))
+		return;
+
+	bytes += value->size();
+	lru.emplace_front(key, std::move(value));
+	index[key] = lru.begin();
+
+	while (bytes > max_bytes) {
+		bytes -= lru.back().second->size();
+		index.erase(lru.back().first);
+		lru.pop_back();
+	}
+}
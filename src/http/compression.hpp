@@ -0,0 +1,55 @@
+#ifndef COMPRESSION_HPP
+#define COMPRESSION_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Content-Encoding support. Only gzip for now (zlib is everywhere), zstd would slot in as
+// another Encoding
+enum class Encoding { IDENTITY, GZIP };
+
+static constexpr size_t compress_min_size = 1024;	// Below this headers outweigh the savings
+static constexpr size_t compress_fast_size = 1 << 20;  // Above this favour speed over ratio
+
+// Picks the best encoding the client takes, from an Accept-Encoding value (q-values honoured)
+Encoding negotiate_encoding(std::string_view accept_encoding);
+const char *encoding_name(Encoding encoding);
+// Only text-like types are worth it, images and archives are compressed already
+bool is_compressible(std::string_view content_type);
+
+// Compresses the parts as one stream without joining them first
+std::string gzip_compress(const std::vector<std::string_view> &parts, int level);
+// Hands the inflated data to sink in chunks of up to 64 KiB. Throws on corrupt input. Stops
+// after max_size bytes, without inflating the rest
+void gzip_decompress(std::string_view data, const std::function<void(std::string_view)> &sink,
+					 size_t max_size = SIZE_MAX);
+
+// Compressed bodies of responses that opted in with a cache key (static files, pastes), so hot
+// content is compressed once. LRU bounded by total bytes, shared between workers
+class CompressionCache {
+   private:
+	using Entry = std::pair<std::string, std::shared_ptr<const std::string>>;
+
+	size_t max_bytes, bytes = 0;
+	std::list<Entry> lru;  // Front is the most recently used
+	std::unordered_map<std::string, std::list<Entry>::iterator> index;
+	std::mutex mutex;
+
+   public:
+	explicit CompressionCache(size_t max_bytes);
+	CompressionCache(const CompressionCache &) = delete;
+	CompressionCache &operator=(const CompressionCache &) = delete;
+
+	std::shared_ptr<const std::string> get(const std::string &key);
+	void put(const std::string &key, std::shared_ptr<const std::string> value);
+};
+
+#endif	// !COMPRESSION_HPP
@@ -0,0 +1,246 @@
+#include "feeds.hpp"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <functional>
+#include <mutex>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+#include "metrics.hpp"
+
+namespace {
+
+struct TopicHash {
+	using is_transparent = void;
+	size_t operator()(std::string_view topic) const { return std::hash<std::string_view>()(topic); }
+};
+
+// Everything about a follower is only touched under its topic's shard lock
+struct Shard {
+	std::mutex mutex;
+	std::unordered_map<std::string, std::vector<std::shared_ptr<Feeds::Follower>>, TopicHash,
+					   std::equal_to<>>
+	  topics;
+};
+
+bool (*ended_check)(std::string_view topic) = nullptr;
+
+std::array<Shard, Feeds::shards> &all_shards()
+{
+	static std::array<Shard, Feeds::shards> shards;
+	return shards;
+}
+
+Shard &shard_for(std::string_view topic)
+{
+	return all_shards()[TopicHash()(topic) % Feeds::shards];
+}
+
+// "<hex size>\r\n<data>\r\n"
+void frame(std::string &out, std::string_view data)
+{
+	char size[16];
+	auto [end, ec] = std::to_chars(size, size + sizeof(size), data.size(), 16);
+	out.append(size, end).append("\r\n").append(data).append("\r\n");
+}
+
+// Shutting both sides wakes epoll for it, and the connection is closed from there
+void drop(Feeds::Follower &f)
+{
+	f.gone = true;
+	f.pending.clear();
+	shutdown(f.fd, SHUT_RDWR);
+	Metrics::add(Metrics::FOLLOWERS_DROPPED);
+}
+
+// Sends what the socket takes of pending, and shuts the write side once the last chunk is out
+void flush(Feeds::Follower &f)
+{
+	while (!f.pending.empty()) {
+		ssize_t n = send(f.fd, f.pending.data(), f.pending.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0) {
+			drop(f);
+			return;
+		}
+		Metrics::add(Metrics::BYTES_OUT, n);
+		f.pending.erase(0, n);
+	}
+	if (f.ended)
+		shutdown(f.fd, SHUT_WR);
+}
+
+void deliver(Feeds::Follower &f, std::string_view framed)
+{
+	if (f.pending.size() + framed.size() > Feeds::max_pending) {
+		drop(f);
+		return;
+	}
+	f.pending.append(framed);
+	flush(f);
+}
+
+// Reads what the follower is missing up to offset from the file. False if it had to be dropped
+bool catch_up(Feeds::Follower &f, size_t offset)
+{
+	thread_local char chunk[64 << 10];
+	thread_local std::string framed;
+	while (f.offset < offset && !f.gone) {
+		ssize_t n = pread(f.file_fd, chunk, std::min(sizeof(chunk), offset - f.offset), f.offset);
+		if (n <= 0) {
+			drop(f);
+			break;
+		}
+		framed.clear();
+		frame(framed, std::string_view(chunk, n));
+		deliver(f, framed);
+		f.offset += n;
+	}
+	return !f.gone;
+}
+
+// Up to the end of the file, for bytes that may have been written without a publish reaching
+// this follower yet
+bool catch_up(Feeds::Follower &f)
+{
+	struct stat st;
+	if (fstat(f.file_fd, &st) < 0) {
+		drop(f);
+		return false;
+	}
+	return catch_up(f, st.st_size);
+}
+
+void finish(Feeds::Follower &f)
+{
+	if (f.gone || f.ended || !catch_up(f))
+		return;
+	f.ended = true;
+	deliver(f, "0\r\n\r\n");
+}
+
+}  // namespace
+
+Feeds::Follower::Follower(int f, int file, std::string_view t, size_t o)
+	: fd(f), file_fd(file), topic(t), offset(o)
+{
+}
+
+Feeds::Follower::~Follower()
+{
+	if (file_fd >= 0)
+		close(file_fd);
+}
+
+std::shared_ptr<Feeds::Follower> Feeds::follow(std::string_view topic, int fd, int file_fd,
+											   size_t offset)
+{
+	auto follower = std::make_shared<Follower>(fd, file_fd, topic, offset);
+	Shard &shard = shard_for(topic);
+	std::lock_guard lock(shard.mutex);
+	shard.topics.try_emplace(std::string(topic)).first->second.push_back(follower);
+	// Whatever was published since its response was put together, it wasn't here to get it.
+	// Nor was it for an end() in that time, which is checked under the lock end() takes
+	if (ended_check && ended_check(topic))
+		finish(*follower);
+	else
+		catch_up(*follower);
+	Metrics::add(Metrics::FOLLOWERS_PARKED);
+	return follower;
+}
+
+void Feeds::publish(std::string_view topic, size_t offset, std::string_view data)
+{
+	if (data.empty())
+		return;
+	Shard &shard = shard_for(topic);
+	std::lock_guard lock(shard.mutex);
+	auto it = shard.topics.find(topic);
+	if (it == shard.topics.end())
+		return;
+
+	// Framed once for everyone that's up to date, which is everyone most of the time
+	std::string framed;
+	for (const std::shared_ptr<Follower> &f : it->second) {
+		if (f->gone || f->ended || f->offset >= offset + data.size())
+			continue;
+		if (f->offset < offset && !catch_up(*f, offset))
+			continue;
+		if (f->offset == offset) {
+			if (framed.empty())
+				frame(framed, data);
+			deliver(*f, framed);
+		} else {  // Partly sent already, by a catch up
+			std::string rest;
+			frame(rest, data.substr(f->offset - offset));
+			deliver(*f, rest);
+		}
+		f->offset = offset + data.size();
+	}
+}
+
+void Feeds::end(std::string_view topic)
+{
+	Shard &shard = shard_for(topic);
+	std::lock_guard lock(shard.mutex);
+	auto it = shard.topics.find(topic);
+	if (it == shard.topics.end())
+		return;
+	for (const std::shared_ptr<Follower> &f : it->second)
+		finish(*f);
+}
+
+void Feeds::setEndedCheck(bool (*ended)(std::string_view topic))
+{
+	ended_check = ended;
+}
+
+void Feeds::endAll()
+{
+	for (Shard &shard : all_shards()) {
+		std::lock_guard lock(shard.mutex);
+		for (auto &[topic, followers] : shard.topics) {
+			for (const std::shared_ptr<Follower> &f : followers)
+				finish(*f);
+		}
+	}
+}
+
+bool Feeds::service(Follower &f)
+{
+	Shard &shard = shard_for(f.topic);
+	std::lock_guard lock(shard.mutex);
+
+	// Nothing the client sends means anything now, it's read to notice when it closes
+	char scratch[512];
+	for (;;) {
+		ssize_t n = recv(f.fd, scratch, sizeof(scratch), MSG_DONTWAIT);
+		if (n > 0 || (n < 0 && errno == EINTR))
+			continue;
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+			f.gone = true;
+		break;
+	}
+	if (!f.gone)
+		flush(f);
+	if (!f.gone)
+		return true;
+
+	auto it = shard.topics.find(f.topic);
+	if (it != shard.topics.end()) {
+		std::erase_if(it->second,
+					  [&f](const std::shared_ptr<Follower> &p) { return p.get() == &f; });
+		if (it->second.empty())
+			shard.topics.erase(it);
+	}
+	Metrics::add(Metrics::FOLLOWERS_LEFT);
+	return false;
+}
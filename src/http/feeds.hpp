@@ -0,0 +1,55 @@
+#ifndef FEEDS_HPP
+#define FEEDS_HPP
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Responses that keep going: a client following a topic is sent what there is so far, and then
+// its connection is parked and gets everything published to the topic as more chunks of the
+// body. A parked connection costs a Follower and its epoll registration, no read buffer, arena
+// or worker.
+//
+// Topics are byte streams, the content of a growing file. Publishes say where their bytes go,
+// so a follower that missed some (it parked while they were written, or two raced) reads the
+// gap from the file. Followers are written from whichever thread publishes, never blocking:
+// what a socket doesn't take waits until epoll says it drained, and a follower that falls
+// max_pending behind is dropped
+class Feeds {
+   public:
+	static constexpr size_t max_pending = 4 << 20;
+	static constexpr size_t shards = 64;
+
+	struct Follower {
+		int fd;
+		int file_fd;  // Owned, where the topic's bytes can be read from
+		std::string topic;
+		size_t offset;	// Bytes of the topic sent, or in pending
+		std::string pending;  // Framed, the socket didn't take it yet
+		bool ended = false;	 // The last chunk is queued, the write side is shut once it's out
+		bool gone = false;	// Closed by the client, or dropped
+
+		Follower(int fd, int file_fd, std::string_view topic, size_t offset);
+		Follower(const Follower &) = delete;
+		Follower &operator=(const Follower &) = delete;
+		~Follower();
+	};
+
+	// Parks fd on topic, after it was sent its first offset bytes. Takes file_fd
+	static std::shared_ptr<Follower> follow(std::string_view topic, int fd, int file_fd,
+											size_t offset);
+	// data was written at offset of topic, once it's in the file
+	static void publish(std::string_view topic, size_t offset, std::string_view data);
+	// Sends the last chunk to everyone following topic, once they have the whole file
+	static void end(std::string_view topic);
+	// Whether topic has ended, asked when a follower comes: it may have missed the end() call.
+	// Must already say so by the time end() is called
+	static void setEndedCheck(bool (*ended)(std::string_view topic));
+	static void endAll();  // When draining
+	// On an epoll event for a follower's socket. False once the connection should be closed,
+	// it's no longer following anything then
+	static bool service(Follower &follower);
+};
+
+#endif	// !FEEDS_HPP
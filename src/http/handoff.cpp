@@ -0,0 +1,163 @@
+#include "handoff.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <utility>
+
+static constexpr char ready_byte = 'R';
+static constexpr int take_timeout_s = 5;  // A wedged old server shouldn't hang the new one
+
+static bool make_address(const std::string &path, struct sockaddr_un &addr)
+{
+	addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "Handoff socket path too long: %s\n", path.c_str());
+		return false;
+	}
+	memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+	return true;
+}
+
+Handoff::Handoff(std::string p) : path(std::move(p)) {}
+
+Handoff::~Handoff()
+{
+	close();
+}
+
+int Handoff::takeListener(int *tls_listener)
+{
+	struct sockaddr_un addr;
+	if (!make_address(path, addr))
+		return -1;
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return -1;
+	// Nobody there (or a stale socket file) is the normal cold start
+	if (connect(fd, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) < 0) {
+		::close(fd);
+		return -1;
+	}
+	struct timeval timeout = { take_timeout_s, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	char byte;
+	struct iovec iov = { &byte, 1 };
+	alignas(struct cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))];
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	int listeners[2] = { -1, -1 };
+	if (recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) == 1) {
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+			size_t n = std::min<size_t>((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int), 2);
+			memcpy(listeners, CMSG_DATA(cmsg), n * sizeof(int));
+		}
+	}
+	// The old server may have had TLS on when we don't, or the other way round
+	if (tls_listener)
+		*tls_listener = listeners[1];
+	else if (listeners[1] >= 0)
+		::close(listeners[1]);
+	if (listeners[0] < 0) {
+		::close(fd);
+		return -1;
+	}
+	peer = fd;	// Answered in listen()
+	return listeners[0];
+}
+
+bool Handoff::listen()
+{
+	struct sockaddr_un addr;
+	if (!make_address(path, addr))
+		return false;
+	server = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (server < 0) {
+		perror("handoff socket");
+		return false;
+	}
+	unlink(path.c_str());
+	// Whoever can connect gets our listening socket, keep it to this user
+	mode_t old_mask = umask(077);
+	int bound = bind(server, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+	umask(old_mask);
+	if (bound < 0 || ::listen(server, 1) < 0) {
+		perror("handoff bind");
+		::close(server);
+		server = -1;
+		return false;
+	}
+
+	if (peer >= 0) {
+		if (send(peer, &ready_byte, 1, MSG_NOSIGNAL) != 1)
+			perror("handoff ready");
+		::close(peer);
+		peer = -1;
+	}
+	return true;
+}
+
+void Handoff::close()
+{
+	if (server >= 0)
+		::close(server);
+	if (peer >= 0)
+		::close(peer);
+	server = peer = -1;
+}
+
+void Handoff::giveListener(int listener, int tls_listener)
+{
+	int fd = accept4(server, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (fd < 0)
+		return;
+	if (peer >= 0) {  // One upgrade at a time
+		::close(fd);
+		return;
+	}
+
+	char byte = 'L';
+	struct iovec iov = { &byte, 1 };
+	int listeners[2] = { listener, tls_listener };
+	size_t n = tls_listener >= 0 ? 2 : 1;
+	alignas(struct cmsghdr) char control[CMSG_SPACE(2 * sizeof(int))] = {};
+	struct msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = CMSG_SPACE(n * sizeof(int));
+	struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(n * sizeof(int));
+	memcpy(CMSG_DATA(cmsg), listeners, n * sizeof(int));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL) != 1) {
+		perror("handoff send");
+		::close(fd);
+		return;
+	}
+	peer = fd;
+}
+
+std::optional<bool> Handoff::upgradeResult()
+{
+	char byte;
+	ssize_t n = recv(peer, &byte, 1, 0);
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return std::nullopt;
+	::close(peer);
+	peer = -1;
+	return n == 1 && byte == ready_byte;
+}
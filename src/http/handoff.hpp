@@ -0,0 +1,43 @@
+#ifndef HANDOFF_HPP
+#define HANDOFF_HPP
+
+#include <optional>
+#include <string>
+
+// Zero downtime upgrades. A running server listens on a Unix socket at path. A new server started
+// with the same path connects to it and gets the listening TCP sockets over SCM_RIGHTS, so the
+// kernel accept queue is never closed and no connection is refused or reset. Once the new
+// server is accepting it says so, takes over path for the next upgrade, and the old one stops
+// accepting and drains. If the new server dies before that the old one just keeps going
+class Handoff {
+   private:
+	std::string path;
+	int server = -1;  // Where new servers ask for the listener
+	int peer = -1;	  // The other side of an upgrade in progress
+
+   public:
+	explicit Handoff(std::string path);
+	Handoff(const Handoff &) = delete;
+	Handoff &operator=(const Handoff &) = delete;
+	~Handoff();
+
+	// New server: the listening socket of the server running at path, -1 if there's none.
+	// tls_listener gets its TLS one, -1 if it had none
+	int takeListener(int *tls_listener = nullptr);
+	// Listens at path for the next upgrade, and tells the old server (if any) we're accepting
+	bool listen();
+	// Stops listening without removing path, it belongs to the new server by now
+	void close();
+
+	int getSocket() const { return server; }
+	int getPeer() const { return peer; }
+
+	// Old server, when getSocket() is readable: hands listener, and tls_listener if there is
+	// one, to whoever connected
+	void giveListener(int listener, int tls_listener = -1);
+	// Old server, when getPeer() is readable: true if the new server took over, false if it
+	// went away without doing so, nothing yet otherwise
+	std::optional<bool> upgradeResult();
+};
+
+#endif	// !HANDOFF_HPP
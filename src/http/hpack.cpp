@@ -0,0 +1,366 @@
+#include "hpack.hpp"
+#include <charconv>
+
+namespace {
+
+// RFC 7541 Appendix A, index 1 is the first
+constexpr std::pair<std::string_view, std::string_view> static_table[] = {
+	{ ":authority", "" },
+	{ ":method", "GET" },
+	{ ":method", "POST" },
+	{ ":path", "/" },
+	{ ":path", "/index.html" },
+	{ ":scheme", "http" },
+	{ ":scheme", "https" },
+	{ ":status", "200" },
+	{ ":status", "204" },
+	{ ":status", "206" },
+	{ ":status", "304" },
+	{ ":status", "400" },
+	{ ":status", "404" },
+	{ ":status", "500" },
+	{ "accept-charset", "" },
+	{ "accept-encoding", "gzip, deflate" },
+	{ "accept-language", "" },
+	{ "accept-ranges", "" },
+	{ "accept", "" },
+	{ "access-control-allow-origin", "" },
+	{ "age", "" },
+	{ "allow", "" },
+	{ "authorization", "" },
+	{ "cache-control", "" },
+	{ "content-disposition", "" },
+	{ "content-encoding", "" },
+	{ "content-language", "" },
+	{ "content-length", "" },
+	{ "content-location", "" },
+	{ "content-range", "" },
+	{ "content-type", "" },
+	{ "cookie", "" },
+	{ "date", "" },
+	{ "etag", "" },
+	{ "expect", "" },
+	{ "expires", "" },
+	{ "from", "" },
+	{ "host", "" },
+	{ "if-match", "" },
+	{ "if-modified-since", "" },
+	{ "if-none-match", "" },
+	{ "if-range", "" },
+	{ "if-unmodified-since", "" },
+	{ "last-modified", "" },
+	{ "link", "" },
+	{ "location", "" },
+	{ "max-forwards", "" },
+	{ "proxy-authenticate", "" },
+	{ "proxy-authorization", "" },
+	{ "range", "" },
+	{ "referer", "" },
+	{ "refresh", "" },
+	{ "retry-after", "" },
+	{ "server", "" },
+	{ "set-cookie", "" },
+	{ "strict-transport-security", "" },
+	{ "transfer-encoding", "" },
+	{ "user-agent", "" },
+	{ "vary", "" },
+	{ "via", "" },
+	{ "www-authenticate", "" },
+};
+
+// RFC 7541 Appendix B, by symbol. 256 is EOS
+constexpr struct {
+	uint32_t code;
+	uint8_t bits;
+} huffman_codes[257] = {
+	{ 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+	{ 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+	{ 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+	{ 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+	{ 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+	{ 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+	{ 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+	{ 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+	{ 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+	{ 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+	{ 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+	{ 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+	{ 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+	{ 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+	{ 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+	{ 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+	{ 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+	{ 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+	{ 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+	{ 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+	{ 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+	{ 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+	{ 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+	{ 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+	{ 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+	{ 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+	{ 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+	{ 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+	{ 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+	{ 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+	{ 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+	{ 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+	{ 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+	{ 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+	{ 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+	{ 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+	{ 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+	{ 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+	{ 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+	{ 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+	{ 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+	{ 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+	{ 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+	{ 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+	{ 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+	{ 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+	{ 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+	{ 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+	{ 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+	{ 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+	{ 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+	{ 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+	{ 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+	{ 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+	{ 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+	{ 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+	{ 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+	{ 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+	{ 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+	{ 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+	{ 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+	{ 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+	{ 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+	{ 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+	{ 0x3fffffff, 30 },
+};
+
+constexpr size_t static_count = std::size(static_table);
+
+struct HuffmanNode {
+	uint16_t child[2] = { 0, 0 };  // 0 for none, the root is never a child
+	int16_t symbol = -1;
+};
+
+// A bit at a time down the code tree. Header values are short, it's not worth a table driven
+// decoder
+std::vector<HuffmanNode> build_huffman_tree()
+{
+	std::vector<HuffmanNode> tree(1);
+	for (size_t symbol = 0; symbol < std::size(huffman_codes); symbol++) {
+		size_t node = 0;
+		for (int bit = huffman_codes[symbol].bits - 1; bit >= 0; bit--) {
+			int b = huffman_codes[symbol].code >> bit & 1;
+			if (!tree[node].child[b]) {
+				tree[node].child[b] = tree.size();
+				tree.emplace_back();
+			}
+			node = tree[node].child[b];
+		}
+		tree[node].symbol = symbol;
+	}
+	return tree;
+}
+
+bool huffman_decode(std::string_view in, std::string &out)
+{
+	static const std::vector<HuffmanNode> tree = build_huffman_tree();
+	size_t node = 0, pending_bits = 0;
+	bool all_ones = true;
+	for (unsigned char byte : in) {
+		for (int bit = 7; bit >= 0; bit--) {
+			int b = byte >> bit & 1;
+			node = tree[node].child[b];
+			if (!node)
+				return false;
+			pending_bits++;
+			all_ones &= b;
+			if (int symbol = tree[node].symbol; symbol >= 0) {
+				if (symbol == 256)	// EOS is never sent, it only pads
+					return false;
+				out += char(symbol);
+				node = pending_bits = 0;
+				all_ones = true;
+			}
+		}
+	}
+	// Padding is the start of EOS, all ones and less than a byte
+	return pending_bits <= 7 && all_ones;
+}
+
+// Integer with an N bit prefix (RFC 7541 5.1), from in[pos]
+bool read_int(std::string_view in, size_t &pos, int prefix_bits, uint64_t &value)
+{
+	if (pos >= in.size())
+		return false;
+	uint64_t max_prefix = (1u << prefix_bits) - 1;
+	value = uint8_t(in[pos++]) & max_prefix;
+	if (value < max_prefix)
+		return true;
+	for (int shift = 0; shift <= 28; shift += 7) {	// Nothing sane needs more than 4 bytes
+		if (pos >= in.size())
+			return false;
+		uint8_t byte = in[pos++];
+		value += uint64_t(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+bool read_string(std::string_view in, size_t &pos, std::string &out)
+{
+	if (pos >= in.size())
+		return false;
+	bool huffman = in[pos] & 0x80;
+	uint64_t length;
+	if (!read_int(in, pos, 7, length) || length > in.size() - pos)
+		return false;
+	std::string_view raw = in.substr(pos, length);
+	pos += length;
+	out.clear();
+	if (huffman)
+		return huffman_decode(raw, out);
+	out.assign(raw);
+	return true;
+}
+
+void write_int(std::string &out, uint8_t first, int prefix_bits, uint64_t value)
+{
+	uint64_t max_prefix = (1u << prefix_bits) - 1;
+	if (value < max_prefix) {
+		out += char(first | value);
+		return;
+	}
+	out += char(first | max_prefix);
+	for (value -= max_prefix; value >= 0x80; value >>= 7)
+		out += char((value & 0x7f) | 0x80);
+	out += char(value);
+}
+
+void write_string(std::string &out, std::string_view s)
+{
+	write_int(out, 0, 7, s.size());
+	out.append(s);
+}
+
+}  // namespace
+
+bool HpackDecoder::lookup(uint64_t index, std::string_view &name, std::string_view &value) const
+{
+	if (index == 0)
+		return false;
+	if (index <= static_count) {
+		name = static_table[index - 1].first;
+		value = static_table[index - 1].second;
+		return true;
+	}
+	if (index - static_count > dynamic.size())
+		return false;
+	const Header &header = dynamic[index - static_count - 1];
+	name = header.first;
+	value = header.second;
+	return true;
+}
+
+void HpackDecoder::evict(size_t limit)
+{
+	while (dynamic_size > limit) {
+		dynamic_size -= dynamic.back().first.size() + dynamic.back().second.size() + 32;
+		dynamic.pop_back();
+	}
+}
+
+void HpackDecoder::insert(Header header)
+{
+	size_t size = header.first.size() + header.second.size() + 32;
+	if (size > max_size) {	// Too big for the table, which it empties
+		evict(0);
+		return;
+	}
+	evict(max_size - size);
+	dynamic.push_front(std::move(header));
+	dynamic_size += size;
+}
+
+bool HpackDecoder::decode(std::string_view block, std::vector<Header> &headers, size_t max_list)
+{
+	size_t pos = 0, list_size = 0;
+	bool started = false;
+	while (pos < block.size()) {
+		uint8_t first = block[pos];
+		Header header;
+		std::string_view name, value;
+		if (first & 0x80) {	 // Indexed
+			uint64_t index;
+			if (!read_int(block, pos, 7, index) || !lookup(index, name, value))
+				return false;
+			header = { std::string(name), std::string(value) };
+		} else if ((first & 0xe0) == 0x20) {  // Table size update, only before any header
+			uint64_t size;
+			if (started || !read_int(block, pos, 5, size) || size > table_size)
+				return false;
+			max_size = size;
+			evict(max_size);
+			continue;
+		} else {
+			// Literal, with incremental indexing (01), without (0000) or never indexed (0001)
+			bool indexing = first & 0x40;
+			uint64_t index;
+			if (!read_int(block, pos, indexing ? 6 : 4, index))
+				return false;
+			if (index) {
+				if (!lookup(index, name, value))
+					return false;
+				header.first = name;
+			} else if (!read_string(block, pos, header.first)) {
+				return false;
+			}
+			if (!read_string(block, pos, header.second))
+				return false;
+			if (indexing)
+				insert(header);
+		}
+		started = true;
+		list_size += header.first.size() + header.second.size() + 32;
+		if (list_size > max_list)
+			return false;
+		headers.push_back(std::move(header));
+	}
+	return true;
+}
+
+void HpackEncoder::status(std::string &out, int code)
+{
+	// Indexes 8 to 14 are :status with these values
+	static constexpr int indexed[] = { 200, 204, 206, 304, 400, 404, 500 };
+	for (size_t i = 0; i < std::size(indexed); i++) {
+		if (indexed[i] == code) {
+			out += char(0x80 | (8 + i));
+			return;
+		}
+	}
+	char digits[8];
+	auto [end, ec] = std::to_chars(digits, digits + sizeof(digits), code);
+	write_int(out, 0, 4, 8);
+	write_string(out, std::string_view(digits, end - digits));
+}
+
+void HpackEncoder::header(std::string &out, std::string_view name, std::string_view value)
+{
+	// Literal without indexing, with the name's index if it has one
+	size_t index = 0;
+	for (size_t i = 0; i < static_count && !index; i++) {
+		if (static_table[i].first == name)
+			index = i + 1;
+	}
+	write_int(out, 0, 4, index);
+	if (!index)
+		write_string(out, name);
+	write_string(out, value);
+}
@@ -0,0 +1,43 @@
+#ifndef HPACK_HPP
+#define HPACK_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// HPACK (RFC 7541), the header compression of HTTP/2. One decoder per connection, it keeps the
+// dynamic table the client builds up across requests
+class HpackDecoder {
+   public:
+	using Header = std::pair<std::string, std::string>;
+	static constexpr size_t table_size = 4096;	// The default, we never ask for another
+
+   private:
+	std::deque<Header> dynamic;	 // Newest first, as indexed
+	size_t dynamic_size = 0;	 // RFC size, 32 bytes of overhead per entry
+	size_t max_size = table_size;
+
+	bool lookup(uint64_t index, std::string_view &name, std::string_view &value) const;
+	void insert(Header header);
+	void evict(size_t limit);
+
+   public:
+	// Appends the headers of a complete header block. False if it's malformed or decodes to
+	// more than max_list bytes, either way the connection can't go on (its table is unknown)
+	bool decode(std::string_view block, std::vector<Header> &headers, size_t max_list);
+};
+
+// Responses are encoded without the dynamic table, so there is no state to keep in sync. Names
+// in the static table are sent as their index
+class HpackEncoder {
+   public:
+	static void status(std::string &out, int code);
+	// The name must be lowercase
+	static void header(std::string &out, std::string_view name, std::string_view value);
+};
+
+#endif	// !HPACK_HPP
@@ -0,0 +1,599 @@
+#include "http2.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <unistd.h>
+#include <utility>
+
+namespace {
+
+uint32_t read16(const char *p)
+{
+	return uint32_t(uint8_t(p[0])) << 8 | uint8_t(p[1]);
+}
+
+uint32_t read24(const char *p)
+{
+	return read16(p) << 8 | uint8_t(p[2]);
+}
+
+uint32_t read32(const char *p)
+{
+	return read16(p) << 16 | read16(p + 2);
+}
+
+void put32(std::string &out, uint32_t value)
+{
+	out += char(value >> 24);
+	out += char(value >> 16);
+	out += char(value >> 8);
+	out += char(value);
+}
+
+// The payload without the padding. False if the padding claims more than the frame has
+bool unpad(uint8_t flags, uint8_t padded_flag, std::string_view &payload)
+{
+	if (!(flags & padded_flag))
+		return true;
+	if (payload.empty())
+		return false;
+	size_t padding = uint8_t(payload[0]);
+	if (padding >= payload.size())
+		return false;
+	payload = payload.substr(1, payload.size() - 1 - padding);
+	return true;
+}
+
+// HTTP2-Settings is base64url without padding, plain base64 is taken too
+bool base64_decode(std::string_view in, std::string &out)
+{
+	uint32_t bits = 0;
+	int n_bits = 0;
+	for (char c : in) {
+		uint32_t v;
+		if (c >= 'A' && c <= 'Z')
+			v = c - 'A';
+		else if (c >= 'a' && c <= 'z')
+			v = c - 'a' + 26;
+		else if (c >= '0' && c <= '9')
+			v = c - '0' + 52;
+		else if (c == '-' || c == '+')
+			v = 62;
+		else if (c == '_' || c == '/')
+			v = 63;
+		else if (c == '=')
+			break;
+		else
+			return false;
+		bits = bits << 6 | v;
+		n_bits += 6;
+		if (n_bits >= 8) {
+			n_bits -= 8;
+			out += char(bits >> n_bits);
+		}
+	}
+	return true;
+}
+
+// Connection specific, HTTP/2 has its own framing for all of them
+bool hop_by_hop(std::string_view name)
+{
+	return name == "connection" || name == "keep-alive" || name == "transfer-encoding"
+		   || name == "upgrade" || name == "proxy-connection";
+}
+
+}  // namespace
+
+Http2Connection::Http2Connection(size_t preface_seen) : preface_left(preface.size() - preface_seen)
+{
+	// Ours go out first, the client may send everything before even reading them
+	std::string settings;
+	auto setting = [&settings](uint16_t id, uint32_t value) {
+		settings += char(id >> 8);
+		settings += char(id);
+		put32(settings, value);
+	};
+	setting(0x3, max_streams);	// MAX_CONCURRENT_STREAMS
+	setting(0x4, stream_window);  // INITIAL_WINDOW_SIZE
+	setting(0x6, max_header_list);	// MAX_HEADER_LIST_SIZE
+	frame(SETTINGS, 0, 0, settings);
+	// The connection window can only grow through WINDOW_UPDATE
+	windowUpdate(0, connection_window - default_window);
+}
+
+void Http2Connection::frame(FrameType type, uint8_t flags, uint32_t stream,
+							std::string_view payload)
+{
+	out += char(payload.size() >> 16);
+	out += char(payload.size() >> 8);
+	out += char(payload.size());
+	out += char(type);
+	out += char(flags);
+	put32(out, stream);
+	out.append(payload);
+}
+
+void Http2Connection::windowUpdate(uint32_t stream, uint32_t increment)
+{
+	std::string payload;
+	put32(payload, increment);
+	frame(WINDOW_UPDATE, 0, stream, payload);
+}
+
+void Http2Connection::reset(uint32_t stream, Error error)
+{
+	std::string payload;
+	put32(payload, error);
+	frame(RST_STREAM, 0, stream, payload);
+	streams.erase(stream);
+}
+
+bool Http2Connection::fail(Error error)
+{
+	std::string payload;
+	put32(payload, last_stream);
+	put32(payload, error);
+	frame(GOAWAY, 0, 0, payload);
+	going_away = true;
+	streams.clear();
+	return false;
+}
+
+void Http2Connection::goAway()
+{
+	if (going_away)
+		return;
+	std::string payload;
+	put32(payload, last_stream);
+	put32(payload, NO_ERROR);
+	frame(GOAWAY, 0, 0, payload);
+	going_away = true;
+}
+
+bool Http2Connection::upgrade(std::string_view settings)
+{
+	std::string payload;
+	if (!base64_decode(settings, payload) || payload.size() % 6 || !applySettings(payload))
+		return false;
+	// The 101 acknowledges them, no SETTINGS ACK. The request came whole, there's no more of it
+	last_stream = 1;
+	streams[1].received = true;
+	streams[1].send_window = peer_initial_window;
+	return true;
+}
+
+bool Http2Connection::receive(std::string_view data, std::vector<Request> &ready)
+{
+	if (preface_left) {
+		size_t n = std::min(preface_left, data.size());
+		if (data.substr(0, n) != preface.substr(preface.size() - preface_left, n))
+			return fail(PROTOCOL_ERROR);
+		preface_left -= n;
+		data.remove_prefix(n);
+	}
+
+	// Frames that came whole are parsed where they are, only a partial one is kept
+	if (!in.empty()) {
+		in.append(data);
+		data = in;
+	}
+	size_t pos = 0;
+	while (data.size() - pos >= frame_header_size) {
+		const char *header = data.data() + pos;
+		uint32_t length = read24(header);
+		// We never raise SETTINGS_MAX_FRAME_SIZE
+		if (length > default_frame_size)
+			return fail(FRAME_SIZE_ERROR);
+		if (data.size() - pos - frame_header_size < length)
+			break;
+		std::string_view payload = data.substr(pos + frame_header_size, length);
+		pos += frame_header_size + length;
+		if (!process(FrameType(header[3]), header[4], read32(header + 5) & 0x7fffffff, payload,
+					 ready))
+			return false;
+	}
+	in = std::string(data.substr(pos));
+
+	flushData();
+	return true;
+}
+
+bool Http2Connection::process(FrameType type, uint8_t flags, uint32_t stream,
+							  std::string_view payload, std::vector<Request> &ready)
+{
+	// Nothing may come between a HEADERS and the CONTINUATION that ends its block
+	if (header_stream && (type != CONTINUATION || stream != header_stream))
+		return fail(PROTOCOL_ERROR);
+
+	switch (type) {
+	case DATA: return onData(flags, stream, payload, ready);
+	case HEADERS: return onHeaders(flags, stream, payload, ready);
+	case CONTINUATION:
+		if (!header_stream)
+			return fail(PROTOCOL_ERROR);
+		// Compressed it can't be much bigger than decoded, this is only to bound the buffer
+		if (header_block.size() + payload.size() > 2 * max_header_list)
+			return fail(PROTOCOL_ERROR);
+		header_block.append(payload);
+		return flags & END_HEADERS ? endHeaders(ready) : true;
+	case PRIORITY:	// Streams are answered in order anyway
+		if (!stream)
+			return fail(PROTOCOL_ERROR);
+		return payload.size() == 5 ? true : fail(FRAME_SIZE_ERROR);
+	case RST_STREAM:
+		if (!stream || stream > last_stream)
+			return fail(PROTOCOL_ERROR);
+		if (payload.size() != 4)
+			return fail(FRAME_SIZE_ERROR);
+		streams.erase(stream);
+		return true;
+	case SETTINGS: return onSettings(flags, stream, payload);
+	case PUSH_PROMISE: return fail(PROTOCOL_ERROR);	 // Only servers push
+	case PING:
+		if (stream)
+			return fail(PROTOCOL_ERROR);
+		if (payload.size() != 8)
+			return fail(FRAME_SIZE_ERROR);
+		if (!(flags & ACK))
+			frame(PING, ACK, 0, payload);
+		return true;
+	case GOAWAY:  // The client is leaving, what's open still gets its response
+		if (stream)
+			return fail(PROTOCOL_ERROR);
+		going_away = true;
+		return true;
+	case WINDOW_UPDATE: return onWindowUpdate(stream, payload);
+	default: return true;  // Unknown types must be ignored
+	}
+}
+
+bool Http2Connection::onHeaders(uint8_t flags, uint32_t stream, std::string_view payload,
+								std::vector<Request> &ready)
+{
+	if (!stream || !(stream & 1))
+		return fail(PROTOCOL_ERROR);
+	if (!unpad(flags, PADDED, payload))
+		return fail(PROTOCOL_ERROR);
+	if (flags & PRIORITY_INFO) {
+		if (payload.size() < 5)
+			return fail(FRAME_SIZE_ERROR);
+		payload.remove_prefix(5);
+	}
+	header_stream = stream;
+	header_end_stream = flags & END_STREAM;
+	header_block.assign(payload);
+	return flags & END_HEADERS ? endHeaders(ready) : true;
+}
+
+bool Http2Connection::endHeaders(std::vector<Request> &ready)
+{
+	uint32_t id = std::exchange(header_stream, 0);
+	// Decoded even for a stream that's refused, or the dynamic table would get out of sync
+	std::vector<HpackDecoder::Header> headers;
+	if (!decoder.decode(header_block, headers, max_header_list))
+		return fail(COMPRESSION_ERROR);
+
+	auto it = streams.find(id);
+	if (it != streams.end()) {	// Trailers, which nothing here uses
+		if (it->second.received || !header_end_stream) {
+			reset(id, PROTOCOL_ERROR);
+			return true;
+		}
+		it->second.received = true;
+		it->second.request.setBody(std::move(it->second.request_body));
+		ready.push_back({ id, std::move(it->second.request) });
+		return true;
+	}
+	if (id <= last_stream)	// Already closed
+		return fail(STREAM_CLOSED);
+	last_stream = id;
+	if (going_away)
+		return true;
+	if (streams.size() >= max_streams) {
+		reset(id, REFUSED_STREAM);
+		return true;
+	}
+
+	HttpRequest request;
+	std::string_view authority;
+	bool pseudo_done = false, malformed = false;
+	for (const auto &[name, value] : headers) {
+		if (name.starts_with(':')) {
+			if (pseudo_done)
+				malformed = true;
+			else if (name == ":method")
+				request.setMethod(value);
+			else if (name == ":path") {
+				std::string_view target = value;
+				size_t query_start = target.find('?');
+				if (query_start != std::string_view::npos) {
+					request.setQuery(target.substr(query_start + 1));
+					target = target.substr(0, query_start);
+				}
+				request.setPath(target);
+			} else if (name == ":authority")
+				authority = value;
+			else if (name != ":scheme")
+				malformed = true;
+			continue;
+		}
+		pseudo_done = true;
+		auto upper = [](char c) { return c >= 'A' && c <= 'Z'; };
+		if (hop_by_hop(name) || std::any_of(name.begin(), name.end(), upper))
+			malformed = true;
+		request.addHeader(name, value);
+	}
+	if (malformed || request.getMethod().empty() || request.getPath().empty()) {
+		reset(id, PROTOCOL_ERROR);
+		return true;
+	}
+	// Handlers look for Host, as they would over HTTP/1.1
+	if (!authority.empty() && request.getHeader("host").empty())
+		request.addHeader("host", authority);
+	request.setVersion("HTTP/2.0");
+
+	Stream &s = streams[id];
+	s.send_window = peer_initial_window;
+	if (header_end_stream) {
+		s.received = true;
+		ready.push_back({ id, std::move(request) });
+	} else
+		s.request = std::move(request);
+	return true;
+}
+
+bool Http2Connection::onData(uint8_t flags, uint32_t stream, std::string_view payload,
+							 std::vector<Request> &ready)
+{
+	if (!stream)
+		return fail(PROTOCOL_ERROR);
+	// Counts against the connection window whatever the stream is, padding included
+	size_t flow = payload.size();
+	if (int64_t(flow) > recv_window)
+		return fail(FLOW_CONTROL_ERROR);
+	recv_window -= flow;
+	unacked += flow;
+	if (unacked >= connection_window / 2) {
+		windowUpdate(0, unacked);
+		recv_window += std::exchange(unacked, 0);
+	}
+	if (!unpad(flags, PADDED, payload))
+		return fail(PROTOCOL_ERROR);
+
+	auto it = streams.find(stream);
+	if (it == streams.end() || it->second.received) {
+		if (stream > last_stream)  // Never opened
+			return fail(PROTOCOL_ERROR);
+		// Reset, or its body came already. Either way the client gets told once
+		if (it != streams.end())
+			reset(stream, STREAM_CLOSED);
+		return true;
+	}
+	Stream &s = it->second;
+	if (int64_t(flow) > s.recv_window) {
+		reset(stream, FLOW_CONTROL_ERROR);
+		return true;
+	}
+	s.recv_window -= flow;
+	if (s.request_body.size() + payload.size() > max_body) {
+		// As over HTTP/1.1, without reading the rest. Once the 413 is out, RST_STREAM(NO_ERROR)
+		// tells the client to stop sending it (RFC 9113 8.1)
+		static const auto payload_too_large = [] {
+			HttpResponse response;
+			response.setStatusCode(413);
+			response.setBody("<h1>413 Content Too Large</h1>");
+			return HttpResponse::prepare(std::move(response));
+		}();
+		s.received = true;
+		std::pmr::string().swap(s.request_body);
+		respond(stream, HttpResponse(payload_too_large));
+		if (!streams.contains(stream)) {
+			std::string code;
+			put32(code, NO_ERROR);
+			frame(RST_STREAM, 0, stream, code);
+		}
+		return true;
+	}
+	if (buffered() + payload.size() > max_buffered) {
+		reset(stream, REFUSED_STREAM);
+		return true;
+	}
+	s.request_body.append(payload);
+	if (flags & END_STREAM) {
+		s.received = true;
+		s.request.setBody(std::move(s.request_body));
+		ready.push_back({ stream, std::move(s.request) });
+		return true;
+	}
+	s.unacked += flow;
+	if (s.unacked >= stream_window / 2) {
+		windowUpdate(stream, s.unacked);
+		s.recv_window += std::exchange(s.unacked, 0);
+	}
+	return true;
+}
+
+bool Http2Connection::onSettings(uint8_t flags, uint32_t stream, std::string_view payload)
+{
+	if (stream)
+		return fail(PROTOCOL_ERROR);
+	if (flags & ACK)
+		return payload.empty() ? true : fail(FRAME_SIZE_ERROR);
+	if (payload.size() % 6)
+		return fail(FRAME_SIZE_ERROR);
+	if (!applySettings(payload))
+		return false;
+	frame(SETTINGS, ACK, 0, {});
+	return true;
+}
+
+bool Http2Connection::applySettings(std::string_view payload)
+{
+	for (size_t i = 0; i + 6 <= payload.size(); i += 6) {
+		uint32_t value = read32(payload.data() + i + 2);
+		switch (read16(payload.data() + i)) {
+		case 0x2:  // ENABLE_PUSH, we never push anyway
+			if (value > 1)
+				return fail(PROTOCOL_ERROR);
+			break;
+		case 0x4:  // INITIAL_WINDOW_SIZE, streams already open move by the difference
+			if (value > 0x7fffffff)
+				return fail(FLOW_CONTROL_ERROR);
+			for (auto &[id, s] : streams) {
+				// One going over the maximum fails the whole connection (RFC 9113 6.9.2)
+				if ((s.send_window += int64_t(value) - peer_initial_window) > 0x7fffffff)
+					return fail(FLOW_CONTROL_ERROR);
+			}
+			peer_initial_window = value;
+			break;
+		case 0x5:  // MAX_FRAME_SIZE
+			if (value < default_frame_size || value > 0xffffff)
+				return fail(PROTOCOL_ERROR);
+			peer_frame_size = value;
+			break;
+		}
+	}
+	return true;
+}
+
+bool Http2Connection::onWindowUpdate(uint32_t stream, std::string_view payload)
+{
+	if (payload.size() != 4)
+		return fail(FRAME_SIZE_ERROR);
+	uint32_t increment = read32(payload.data()) & 0x7fffffff;
+	if (!stream) {
+		if (!increment)
+			return fail(PROTOCOL_ERROR);
+		send_window += increment;
+		return send_window > 0x7fffffff ? fail(FLOW_CONTROL_ERROR) : true;
+	}
+	auto it = streams.find(stream);
+	if (it == streams.end())  // Can still come for a stream that just ended
+		return true;
+	if (!increment)
+		reset(stream, PROTOCOL_ERROR);
+	else if ((it->second.send_window += increment) > 0x7fffffff)
+		reset(stream, FLOW_CONTROL_ERROR);
+	return true;
+}
+
+void Http2Connection::respond(uint32_t stream, HttpResponse response)
+{
+	auto it = streams.find(stream);
+	if (it == streams.end())  // The client reset it meanwhile
+		return;
+	Stream &s = it->second;
+
+	std::string block;
+	HpackEncoder::status(block, response.getStatusCode());
+	std::string name;
+	for (const auto &[key, value] : response.getHeaders()) {
+		name.assign(key);
+		for (char &c : name)
+			c = c >= 'A' && c <= 'Z' ? c + 32 : c;
+		if (!hop_by_hop(name))
+			HpackEncoder::header(block, name, value);
+	}
+	char length[20];
+	auto [length_end, ec] = std::to_chars(length, length + sizeof(length), response.getBodySize());
+	HpackEncoder::header(block, "content-length", std::string_view(length, length_end - length));
+	std::string_view date = HttpResponse::dateLine();  // "Date: ...\r\n"
+	HpackEncoder::header(block, "date", date.substr(6, date.size() - 8));
+
+	// Kept with the stream until it's all sent, the file read a window at a time
+	s.body_size = response.getBodySize();
+	s.response.emplace(std::move(response));
+	s.parts = s.response->getBodyParts();
+
+	// The block split at the client's frame size, in HEADERS and CONTINUATION
+	bool end_stream = !s.body_size;
+	std::string_view rest = block;
+	FrameType type = HEADERS;
+	do {
+		std::string_view part = rest.substr(0, peer_frame_size);
+		rest.remove_prefix(part.size());
+		uint8_t flags = (rest.empty() ? END_HEADERS : 0)
+						| (type == HEADERS && end_stream ? END_STREAM : 0);
+		frame(type, flags, stream, part);
+		type = CONTINUATION;
+	} while (!rest.empty());
+
+	if (end_stream) {
+		streams.erase(it);
+		return;
+	}
+	s.responding = true;
+	flushData();
+}
+
+size_t Http2Connection::buffered() const
+{
+	size_t total = 0;
+	for (const auto &[id, s] : streams)
+		total += s.request_body.size();
+	return total;
+}
+
+void Http2Connection::flushData()
+{
+	for (auto it = streams.begin(); it != streams.end();) {
+		Stream &s = it->second;
+		if (!s.responding) {
+			++it;
+			continue;
+		}
+		bool failed = false;
+		while (s.body_sent < s.body_size && s.send_window > 0 && send_window > 0) {
+			size_t n = std::min<int64_t>({ int64_t(s.body_size - s.body_sent), s.send_window,
+										   send_window, int64_t(peer_frame_size) });
+			if (!fill(s, n)) {
+				failed = true;
+				break;
+			}
+			bool last = s.body_sent + n == s.body_size;
+			frame(DATA, last ? END_STREAM : 0, it->first, chunk);
+			s.body_sent += n;
+			s.send_window -= n;
+			send_window -= n;
+		}
+		if (failed) {  // The file was shorter than it said, the rest of it can't come
+			std::string payload;
+			put32(payload, INTERNAL_ERROR);
+			frame(RST_STREAM, 0, it->first, payload);
+		}
+		if (failed || s.body_sent == s.body_size)
+			it = streams.erase(it);
+		else
+			++it;
+	}
+}
+
+bool Http2Connection::fill(Stream &s, size_t n)
+{
+	chunk.clear();
+	size_t offset = s.body_sent;
+	for (std::string_view part : s.parts) {
+		if (offset >= part.size()) {
+			offset -= part.size();
+			continue;
+		}
+		part = part.substr(offset, n - chunk.size());
+		chunk.append(part);
+		offset = 0;
+		if (chunk.size() == n)
+			return true;
+	}
+	// The rest from the file, offset being where in it
+	size_t start = chunk.size();
+	chunk.resize(n);
+	while (start < n) {
+		ssize_t got = pread(s.response->getFileFd(), chunk.data() + start, n - start, offset);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return false;
+		start += got;
+		offset += got;
+	}
+	return true;
+}
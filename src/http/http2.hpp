@@ -0,0 +1,153 @@
+#ifndef HTTP2_HPP
+#define HTTP2_HPP
+
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "hpack.hpp"
+#include "httprequest.hpp"
+#include "httpresponse.hpp"
+
+// HTTP/2 (RFC 9113) on one connection, without the socket. Bytes read go into receive(), which
+// parses frames, keeps the HPACK and flow control state and hands back every request whose
+// headers and body are complete. Their responses go into respond(), and come out as frames in
+// output(), DATA as far as the client's flow control windows let it. The rest waits for the
+// client's WINDOW_UPDATE, which comes through receive() like everything else.
+//
+// Requests use the global allocator, several streams can be half received at once and each
+// would pin the connection's arena
+class Http2Connection {
+   public:
+	static constexpr std::string_view preface = "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n";
+	// What an HTTP/1.1 parser reads of the preface as a request, before the "SM" body
+	static constexpr size_t preface_request_size = 18;
+
+	static constexpr uint32_t max_streams = 100;	 // Open at once
+	static constexpr uint32_t stream_window = 1 << 20;	 // How much a stream can send us ahead
+	static constexpr uint32_t connection_window = 16 << 20;
+	static constexpr uint32_t max_header_list = 64 << 10;
+	// A stream's request body, as HttpServer::max_body, over it the stream gets a 413. And all
+	// the connection's half received bodies together, the stream going over that is refused
+	static constexpr size_t max_body = 64 << 20;
+	static constexpr size_t max_buffered = max_body;
+
+	struct Request {
+		uint32_t stream;
+		HttpRequest request;
+	};
+
+   private:
+	enum FrameType : uint8_t {
+		DATA,
+		HEADERS,
+		PRIORITY,
+		RST_STREAM,
+		SETTINGS,
+		PUSH_PROMISE,
+		PING,
+		GOAWAY,
+		WINDOW_UPDATE,
+		CONTINUATION
+	};
+	enum Error : uint32_t {
+		NO_ERROR,
+		PROTOCOL_ERROR,
+		INTERNAL_ERROR,
+		FLOW_CONTROL_ERROR,
+		SETTINGS_TIMEOUT,
+		STREAM_CLOSED,
+		FRAME_SIZE_ERROR,
+		REFUSED_STREAM,
+		CANCEL,
+		COMPRESSION_ERROR
+	};
+	enum Flags : uint8_t {
+		END_STREAM = 0x1,
+		ACK = 0x1,	// SETTINGS and PING
+		END_HEADERS = 0x4,
+		PADDED = 0x8,
+		PRIORITY_INFO = 0x20
+	};
+	static constexpr size_t frame_header_size = 9;
+	static constexpr uint32_t default_window = 65535, default_frame_size = 16384;
+
+	struct Stream {
+		HttpRequest request;
+		std::pmr::string request_body;
+		bool received = false;	// END_STREAM came, the request was handed out
+		int64_t send_window = default_window;
+		int64_t recv_window = stream_window;
+		uint32_t unacked = 0;  // Received but not given back with WINDOW_UPDATE yet
+		std::optional<HttpResponse> response;	// Being sent, its body from body_sent on
+		std::vector<std::string_view> parts;	// Of response's body, its file after them
+		size_t body_size = 0, body_sent = 0;
+		bool responding = false;  // HEADERS sent, what's left is in response
+	};
+	// Ordered, so lower streams get the window first. Gone once their response is all sent
+	std::map<uint32_t, Stream> streams;
+	uint32_t last_stream = 0;
+
+	HpackDecoder decoder;
+	std::string in;	 // Bytes of a frame that hasn't fully arrived yet
+	std::string out;
+	size_t preface_left;
+	std::string header_block;  // Across CONTINUATION frames
+	uint32_t header_stream = 0;	 // The stream whose header block is incomplete, 0 if none
+	bool header_end_stream = false;
+
+	int64_t send_window = default_window;  // The connection's, as the client lets us send
+	int64_t recv_window = connection_window;
+	uint32_t peer_initial_window = default_window;
+	uint32_t peer_frame_size = default_frame_size;
+	uint32_t unacked = 0;
+	bool going_away = false;
+	std::string chunk;	// A DATA frame's payload, as fill() gathers it
+
+	void frame(FrameType type, uint8_t flags, uint32_t stream, std::string_view payload);
+	void windowUpdate(uint32_t stream, uint32_t increment);
+	void reset(uint32_t stream, Error error);
+	bool fail(Error error);	 // GOAWAY, always false
+	bool process(FrameType type, uint8_t flags, uint32_t stream, std::string_view payload,
+				 std::vector<Request> &ready);
+	bool onHeaders(uint8_t flags, uint32_t stream, std::string_view payload,
+				   std::vector<Request> &ready);
+	bool onData(uint8_t flags, uint32_t stream, std::string_view payload,
+				std::vector<Request> &ready);
+	bool onSettings(uint8_t flags, uint32_t stream, std::string_view payload);
+	bool applySettings(std::string_view payload);
+	bool onWindowUpdate(uint32_t stream, std::string_view payload);
+	bool endHeaders(std::vector<Request> &ready);
+	void flushData();
+	// The stream's next n body bytes into chunk, reading the file if they're in it. False if
+	// it's shorter than it said
+	bool fill(Stream &s, size_t n);
+	size_t buffered() const;  // Request body bytes held, of every stream
+
+   public:
+	// preface_seen is how much of the client preface was already read by someone else
+	explicit Http2Connection(size_t preface_seen = 0);
+
+	// h2c upgrade: request, already read over HTTP/1.1, becomes stream 1 and is answered
+	// through respond() like any other. settings is its HTTP2-Settings header. False if that's
+	// malformed
+	bool upgrade(std::string_view settings);
+
+	// Complete requests are appended to ready. False on a connection error, the GOAWAY for it
+	// is in output() and the connection must be closed once it's sent
+	bool receive(std::string_view data, std::vector<Request> &ready);
+	void respond(uint32_t stream, HttpResponse response);
+	// Stops taking new streams, the ones open still get their responses
+	void goAway();
+
+	std::string &output() { return out; }
+	// Nothing left to answer after a GOAWAY, sent or received
+	bool isDone() const { return going_away && streams.empty(); }
+	// No stream open, nor any of one on the way
+	bool isIdle() const { return streams.empty() && in.empty() && header_stream == 0; }
+};
+
+#endif	// !HTTP2_HPP
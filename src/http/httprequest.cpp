@@ -1,44 +1,74 @@
 #include "httprequest.hpp"
 #include <string>
+#include <strings.h>
 
-void HttpRequest::addHeader(const std::string &key, const std::string &value)
+HttpRequest::HttpRequest(allocator_type alloc)
+	: method(alloc), path(alloc), query(alloc), version(alloc), body(alloc), headers(alloc)
 {
-	headers[key] = value;
 }
 
-void HttpRequest::setMethod(std::string m)
+HttpRequest::HttpRequest(const HttpRequest &other, allocator_type alloc)
+	: method(other.method, alloc),
+	  path(other.path, alloc),
+	  query(other.query, alloc),
+	  version(other.version, alloc),
+	  body(other.body, alloc),
+	  headers(other.headers, alloc)
 {
-	method = std::move(m);
 }
-void HttpRequest::setPath(std::string p)
+
+HttpRequest::allocator_type HttpRequest::getAllocator() const
+{
+	return headers.get_allocator();
+}
+
+void HttpRequest::addHeader(std::string_view key, std::string_view value)
+{
+	headers.emplace_back(key, value);
+}
+
+void HttpRequest::setMethod(std::string_view m)
+{
+	method = m;
+}
+void HttpRequest::setPath(std::string_view p)
 {
-	path = std::move(p);
+	path = p;
 }
-void HttpRequest::setVersion(std::string v)
+void HttpRequest::setQuery(std::string_view q)
 {
-	version = std::move(v);
+	query = q;
 }
-void HttpRequest::setBody(std::string b)
+void HttpRequest::setVersion(std::string_view v)
+{
+	version = v;
+}
+void HttpRequest::setBody(std::pmr::string b)
 {
 	body = std::move(b);
 }
 
-const std::string &HttpRequest::getMethod() const
+std::string_view HttpRequest::getMethod() const
 {
 	return method;
 }
 
-const std::string &HttpRequest::getPath() const
+std::string_view HttpRequest::getPath() const
 {
 	return path;
 }
 
-const std::string &HttpRequest::getVersion() const
+std::string_view HttpRequest::getQuery() const
+{
+	return query;
+}
+
+std::string_view HttpRequest::getVersion() const
 {
 	return version;
 }
 
-const std::string &HttpRequest::getBody() const
+std::string_view HttpRequest::getBody() const
 {
 	return body;
 }
@@ -47,20 +77,30 @@ std::string HttpRequest::serialize() const
 {
 	std::string serialized;
 
-	serialized.append(method).append(" ").append(path).append(" ").append(version).append("\r\n");
+	serialized.append(method).append(" ").append(path);
+	if (!query.empty())
+		serialized.append("?").append(query);
+	serialized.append(" ").append(version).append("\r\n");
 
-	for (auto it = headers.begin(); it != headers.end(); it++)
-		serialized.append(it->first).append(":").append(it->second).append("\r\n");
+	for (const auto &[key, value] : headers)
+		serialized.append(key).append(":").append(value).append("\r\n");
 
-	serialized.append(std::string(body.begin(), body.end()));
+	serialized.append(body);
 
 	return serialized;
 }
 
-std::optional<const std::string> HttpRequest::getHeader(const std::string &h) const
+const HttpRequest::Headers &HttpRequest::getHeaders() const
+{
+	return headers;
+}
+
+std::string_view HttpRequest::getHeader(std::string_view h) const
 {
-	auto it = headers.find(h);
-	if (it == headers.end())
-		return "";
-	return it->second;
+	// From the back, so the last of repeated headers wins like it did with the map
+	for (auto it = headers.rbegin(); it != headers.rend(); it++) {
+		if (it->first.size() == h.size() && strncasecmp(it->first.data(), h.data(), h.size()) == 0)
+			return it->second;
+	}
+	return {};
 }
@@ -1,36 +1,55 @@
 #ifndef HTTP_REQUEST
 #define HTTP_REQUEST
 
-#include <map>
-#include <optional>
+#include <memory_resource>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
+// Everything lives in the request's allocator, which the server points at the connection's
+// arena. Handlers can allocate their scratch from it too (getAllocator()), it's all dropped
+// together once the response is sent
 class HttpRequest {
+   public:
+	using allocator_type = std::pmr::polymorphic_allocator<char>;
+	using Headers = std::pmr::vector<std::pair<std::pmr::string, std::pmr::string>>;
+
    private:
-	std::string method;
-	std::string path;
-	std::string version;
-	std::string body;
-	std::map<std::string, std::string> headers;
+	std::pmr::string method;
+	std::pmr::string path;
+	std::pmr::string query;	 // Whatever follows '?' in the target, without it
+	std::pmr::string version;
+	std::pmr::string body;
+	// Few enough that a linear search beats a map, and no node per header
+	Headers headers;
 
    public:
-	HttpRequest() = default;
+	explicit HttpRequest(allocator_type alloc = {});
+	HttpRequest(const HttpRequest &other, allocator_type alloc);
 	HttpRequest(const HttpRequest &) = default;
 	HttpRequest(HttpRequest &&) = default;
 	HttpRequest &operator=(const HttpRequest &) = default;
 	HttpRequest &operator=(HttpRequest &&) = default;
 
-	const std::string &getMethod() const;
-	const std::string &getPath() const;
-	const std::string &getVersion() const;
-	const std::string &getBody() const;
-	std::optional<const std::string> getHeader(const std::string &) const;
-
-	void setMethod(std::string);
-	void setPath(std::string);
-	void setVersion(std::string);
-	void setBody(std::string);
-	void addHeader(const std::string &key, const std::string &value);
+	allocator_type getAllocator() const;
+
+	std::string_view getMethod() const;
+	std::string_view getPath() const;
+	std::string_view getQuery() const;
+	std::string_view getVersion() const;
+	std::string_view getBody() const;
+	// Case insensitive, empty if missing. A repeated header gives its last value
+	std::string_view getHeader(std::string_view) const;
+	// In the order they came, as sent
+	const Headers &getHeaders() const;
+
+	void setMethod(std::string_view);
+	void setPath(std::string_view);
+	void setQuery(std::string_view);
+	void setVersion(std::string_view);
+	void setBody(std::pmr::string);	 // Moved in as is if it's from the same allocator
+	void addHeader(std::string_view key, std::string_view value);
 
 	std::string serialize() const;
 };
@@ -1,56 +1,468 @@
 #include "httpresponse.hpp"
+#include "compression.hpp"
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <ctime>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+
+HttpResponse::FileBody::FileBody(FileBody &&f) noexcept : fd(std::exchange(f.fd, -1)), size(f.size)
+{
+}
+
+HttpResponse::FileBody::~FileBody()
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+HttpResponse::HttpResponse(allocator_type alloc)
+	: body(alloc), parts(alloc), owned_parts(alloc), shared_parts(alloc), cache_key(alloc),
+	  feed(alloc), headers(alloc)
+{
+}
+
+HttpResponse::HttpResponse(std::shared_ptr<const Prepared> p, allocator_type alloc)
+	: HttpResponse(alloc)
+{
+	prepared = std::move(p);
+}
+
+HttpResponse::allocator_type HttpResponse::getAllocator() const
+{
+	return headers.get_allocator();
+}
+
+std::shared_ptr<const HttpResponse::Prepared> HttpResponse::prepare(HttpResponse response)
+{
+	auto prepared = std::make_shared<Prepared>();
+	prepared->code = response.getStatusCode();
+	response.materialize();
+
+	std::string body;
+	for (std::string_view part : response.getBodyParts())
+		body.append(part);
+
+	auto fill = [](Prepared::Variant &variant, Headers headers, std::string body) {
+		variant.headers = std::move(headers);
+		variant.body = std::move(body);
+		for (const auto &[key, value] : variant.headers)
+			variant.tail.append(key).append(": ").append(value).append("\r\n");
+		variant.tail.append("Content-Length: ").append(std::to_string(variant.body.size()));
+		variant.tail.append("\r\n\r\n").append(variant.body);
+	};
+
+	// Compressed once here, at the best level, instead of through HttpServer's cache
+	std::optional<std::string_view> type = response.getHeader("Content-Type");
+	bool compressible = body.size() >= compress_min_size && type && is_compressible(*type)
+						&& !response.getHeader("Content-Encoding");
+	Headers headers = std::move(response.headers);
+	if (compressible) {
+		headers.emplace_back("Vary", "Accept-Encoding");
+		Headers gzip_headers = headers;
+		gzip_headers.emplace_back("Content-Encoding", encoding_name(Encoding::GZIP));
+		fill(prepared->gzip, std::move(gzip_headers), gzip_compress({ body }, 9));
+		prepared->has_gzip = true;
+	}
+	fill(prepared->plain, std::move(headers), std::move(body));
+	return prepared;
+}
+
+const HttpResponse::Prepared::Variant &HttpResponse::variant() const
+{
+	return prepared_gzip ? prepared->gzip : prepared->plain;
+}
+
+void HttpResponse::materialize()
+{
+	if (!prepared)
+		return;
+	std::shared_ptr<const Prepared> p = std::move(prepared);
+	const Prepared::Variant &v = prepared_gzip ? p->gzip : p->plain;
+	code = p->code;
+	headers = v.headers;
+	// Shares ownership of the whole Prepared, the body is not copied
+	appendBody(std::shared_ptr<const std::string>(p, &v.body));
+}
+
+bool HttpResponse::isPrepared() const
+{
+	return prepared != nullptr;
+}
+
+bool HttpResponse::usePreparedGzip()
+{
+	if (!prepared || !prepared->has_gzip)
+		return false;
+	prepared_gzip = true;
+	return true;
+}
 
 void HttpResponse::setStatusCode(int code)
 {
+	materialize();
 	this->code = code;
 }
 
-void HttpResponse::setContentType(std::string type)
+void HttpResponse::setContentType(std::string_view type)
 {
-	headers["Content-Type"] = std::move(type);
+	addHeader("Content-Type", type);
 }
 
-void HttpResponse::setBody(std::string body)
+void HttpResponse::setBody(std::string_view body)
 {
+	materialize();
 	this->body = body;
-	headers["Content-Length"] = std::to_string(body.size());
+	parts.clear();
+	owned_parts.clear();
+	shared_parts.clear();
+	if (file.fd >= 0)
+		close(std::exchange(file.fd, -1));
 }
 
-void HttpResponse::addHeader(const std::string &key, const std::string &value)
+void HttpResponse::appendBody(std::pmr::string part)
 {
-	headers[key] = value;
+	materialize();
+	if (part.empty())
+		return;
+	owned_parts.push_back(std::move(part));
+	parts.push_back(owned_parts.back());
 }
 
-std::string HttpResponse::serialize() const
+void HttpResponse::appendBody(std::shared_ptr<const std::string> part)
 {
-	std::string ss;
+	materialize();
+	if (part->empty())
+		return;
+	parts.push_back(*part);
+	shared_parts.push_back(std::move(part));
+}
 
-	ss.append(getStatusText(this->code)).append("\r\n");
+void HttpResponse::appendStaticBody(std::string_view part)
+{
+	materialize();
+	if (!part.empty())
+		parts.push_back(part);
+}
+
+void HttpResponse::addHeader(std::string_view key, std::string_view value)
+{
+	materialize();
+	for (auto &header : headers) {
+		if (header.first == key) {
+			header.second = value;
+			return;
+		}
+	}
+	headers.emplace_back(key, value);
+}
+
+void HttpResponse::setFileBody(int fd, size_t size)
+{
+	materialize();
+	if (file.fd >= 0)
+		close(file.fd);
+	file.fd = fd;
+	file.size = size;
+}
+
+int HttpResponse::getFileFd() const
+{
+	return file.fd;
+}
+
+size_t HttpResponse::getFileSize() const
+{
+	return file.fd >= 0 ? file.size : 0;
+}
+
+void HttpResponse::setCacheKey(std::string_view key)
+{
+	materialize();
+	cache_key = key;
+}
+
+std::string_view HttpResponse::getCacheKey() const
+{
+	return cache_key;
+}
+
+void HttpResponse::setFeed(std::string_view topic)
+{
+	materialize();
+	feed = topic;
+}
+
+std::string_view HttpResponse::getFeed() const
+{
+	return feed;
+}
+
+int HttpResponse::getStatusCode() const
+{
+	return prepared ? prepared->code : code;
+}
+
+std::optional<std::string_view> HttpResponse::getHeader(std::string_view key) const
+{
+	for (const auto &header : prepared ? variant().headers : headers) {
+		if (header.first == key)
+			return header.second;
+	}
+	return std::nullopt;
+}
+
+const HttpResponse::Headers &HttpResponse::getHeaders() const
+{
+	return prepared ? variant().headers : headers;
+}
+
+size_t HttpResponse::getBodySize() const
+{
+	if (prepared)
+		return variant().body.size();
+	size_t size = body.size();
+	for (std::string_view part : parts)
+		size += part.size();
+	return size + getFileSize();
+}
+
+std::vector<std::string_view> HttpResponse::getBodyParts() const
+{
+	if (prepared)
+		return { variant().body };
+	std::vector<std::string_view> all;
+	all.reserve(parts.size() + 1);
+	if (!body.empty())
+		all.push_back(body);
+	all.insert(all.end(), parts.begin(), parts.end());
+	return all;
+}
+
+void HttpResponse::serializeHead(std::string &out) const
+{
+	out.assign(statusLine(getStatusCode()));
+	out.append(dateLine());
+	if (prepared)  // The rest is in the prepared tail
+		return;
 
 	for (const auto &p : this->headers)
-		ss.append(p.first).append(": ").append(p.second).append("\r\n");
+		out.append(p.first).append(": ").append(p.second).append("\r\n");
+
+	// A feed has no end yet, HttpServer sends the body as its first chunk
+	if (!feed.empty()) {
+		out.append("Transfer-Encoding: chunked\r\n\r\n");
+		return;
+	}
+	// Always sent, a keep-alive client can't tell where a response ends otherwise
+	out.append("Content-Length: ").append(std::to_string(getBodySize())).append("\r\n\r\n");
+}
+
+std::string HttpResponse::serializeHead() const
+{
+	std::string ss;
+	serializeHead(ss);
+	return ss;
+}
+
+std::string HttpResponse::serialize() const
+{
+	std::string ss = serializeHead();
+	if (prepared)
+		return ss.append(variant().tail);
+
+	ss.reserve(ss.size() + getBodySize());
+	ss.append(this->body);
+	for (std::string_view part : parts)
+		ss.append(part);
 
-	ss.append("\r\n").append(this->body).append("\r\r\n\n");
+	if (file.fd >= 0) {
+		size_t start = ss.size();
+		ss.resize(start + file.size);
+		size_t got = 0;
+		while (got < file.size) {
+			ssize_t n = pread(file.fd, ss.data() + start + got, file.size - got, got);
+			if (n <= 0)
+				break;
+			got += n;
+		}
+		ss.resize(start + got);
+	}
 
 	return ss;
 }
 
-std::string HttpResponse::getStatusText(int code) const
+void HttpResponse::toIovecs(const std::string &head, std::vector<struct iovec> &iov) const
+{
+	iov.clear();
+	iov.push_back({ const_cast<char *>(head.data()), head.size() });
+	if (prepared) {
+		const std::string &tail = variant().tail;
+		iov.push_back({ const_cast<char *>(tail.data()), tail.size() });
+		return;
+	}
+	if (!body.empty())
+		iov.push_back({ const_cast<char *>(body.data()), body.size() });
+	for (std::string_view part : parts)
+		iov.push_back({ const_cast<char *>(part.data()), part.size() });
+}
+
+static const char *reason_phrase(int code)
 {
-	std::string text;
 	switch (code) {
-	case 200:
-		text = "OK";
-		break;
-	case 404:
-		text = "Not Found";
-		break;
-	case 500:
-		text = "Internal Server Error";
-		break;
-	default:
-		text = "Unknown";
-		break;
-	}
-	return "HTTP/1.1 " + std::to_string(code) + " " + text;
+	case 100: return "Continue";
+	case 101: return "Switching Protocols";
+	case 102: return "Processing";
+	case 103: return "Early Hints";
+	case 200: return "OK";
+	case 201: return "Created";
+	case 202: return "Accepted";
+	case 203: return "Non-Authoritative Information";
+	case 204: return "No Content";
+	case 205: return "Reset Content";
+	case 206: return "Partial Content";
+	case 207: return "Multi-Status";
+	case 208: return "Already Reported";
+	case 226: return "IM Used";
+	case 300: return "Multiple Choices";
+	case 301: return "Moved Permanently";
+	case 302: return "Found";
+	case 303: return "See Other";
+	case 304: return "Not Modified";
+	case 305: return "Use Proxy";
+	case 307: return "Temporary Redirect";
+	case 308: return "Permanent Redirect";
+	case 400: return "Bad Request";
+	case 401: return "Unauthorized";
+	case 402: return "Payment Required";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 406: return "Not Acceptable";
+	case 407: return "Proxy Authentication Required";
+	case 408: return "Request Timeout";
+	case 409: return "Conflict";
+	case 410: return "Gone";
+	case 411: return "Length Required";
+	case 412: return "Precondition Failed";
+	case 413: return "Content Too Large";
+	case 414: return "URI Too Long";
+	case 415: return "Unsupported Media Type";
+	case 416: return "Range Not Satisfiable";
+	case 417: return "Expectation Failed";
+	case 421: return "Misdirected Request";
+	case 422: return "Unprocessable Content";
+	case 423: return "Locked";
+	case 424: return "Failed Dependency";
+	case 425: return "Too Early";
+	case 426: return "Upgrade Required";
+	case 428: return "Precondition Required";
+	case 429: return "Too Many Requests";
+	case 431: return "Request Header Fields Too Large";
+	case 451: return "Unavailable For Legal Reasons";
+	case 500: return "Internal Server Error";
+	case 501: return "Not Implemented";
+	case 502: return "Bad Gateway";
+	case 503: return "Service Unavailable";
+	case 504: return "Gateway Timeout";
+	case 505: return "HTTP Version Not Supported";
+	case 506: return "Variant Also Negotiates";
+	case 507: return "Insufficient Storage";
+	case 508: return "Loop Detected";
+	case 510: return "Not Extended";
+	case 511: return "Network Authentication Required";
+	default: return "";	 // The reason phrase is optional, the code is what counts
+	}
+}
+
+std::string_view HttpResponse::statusLine(int code)
+{
+	static const std::array<std::string, 600> lines = [] {
+		std::array<std::string, 600> all;
+		for (int c = 100; c < 600; c++)
+			all[c] = "HTTP/1.1 " + std::to_string(c) + " " + reason_phrase(c) + "\r\n";
+		return all;
+	}();
+	return lines[code >= 100 && code < 600 ? code : 500];
+}
+
+namespace {
+
+// Formats the Date line once a second and publishes it under a seqlock: the words are atomics
+// so readers racing the update are well defined, and they retry if the sequence moved (or is
+// odd, mid-update) while they copied. Each thread keeps its last copy, and only copies again
+// once the sequence changes
+class DateClock {
+   public:
+	static constexpr size_t length = 37;
+
+   private:
+	static constexpr size_t n_words = (length + 7) / 8;
+	std::atomic<uint64_t> sequence = 0;
+	std::atomic<uint64_t> words[n_words] = {};
+
+	void publish()
+	{
+		std::time_t now = std::time(nullptr);
+		std::tm tm;
+		gmtime_r(&now, &tm);
+		char line[n_words * 8 + 1] = {};
+		std::strftime(line, sizeof(line), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &tm);
+
+		uint64_t seq = sequence.load(std::memory_order_relaxed);
+		sequence.store(seq + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		for (size_t i = 0; i < n_words; i++) {
+			uint64_t word;
+			std::memcpy(&word, line + i * 8, 8);
+			words[i].store(word, std::memory_order_relaxed);
+		}
+		sequence.store(seq + 2, std::memory_order_release);
+	}
+
+   public:
+	DateClock()
+	{
+		publish();
+		std::thread([this] {
+			for (;;) {
+				// Wake right after the second changes
+				auto now = std::chrono::system_clock::now();
+				std::this_thread::sleep_until(std::chrono::ceil<std::chrono::seconds>(now));
+				publish();
+			}
+		}).detach();
+	}
+
+	std::string_view line() const
+	{
+		thread_local uint64_t copied_seq = 1;  // Odd, never a published one
+		thread_local char copy[n_words * 8];
+		for (;;) {
+			uint64_t seq = sequence.load(std::memory_order_acquire);
+			if (seq == copied_seq)
+				break;
+			if (seq & 1)
+				continue;
+			for (size_t i = 0; i < n_words; i++) {
+				uint64_t word = words[i].load(std::memory_order_relaxed);
+				std::memcpy(copy + i * 8, &word, 8);
+			}
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (sequence.load(std::memory_order_relaxed) == seq)
+				copied_seq = seq;
+		}
+		return { copy, length };
+	}
+};
+
+}  // namespace
+
+std::string_view HttpResponse::dateLine()
+{
+	static DateClock *clock = new DateClock();  // Never freed, its thread runs until exit
+	return clock->line();
 }
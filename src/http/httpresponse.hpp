@@ -1,27 +1,130 @@
 #ifndef HTTP_RESPONSE
 #define HTTP_RESPONSE
 
-#include <map>
+#include <list>
+#include <memory>
+#include <memory_resource>
 #include <netinet/in.h>
+#include <optional>
 #include <string>
+#include <string_view>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <vector>
 
+// Like HttpRequest, a response can live in the connection's arena: handlers build it with
+// HttpResponse(req.getAllocator()). Without an allocator it uses the global one
 class HttpResponse {
    public:
-	HttpResponse() = default;
+	using allocator_type = std::pmr::polymorphic_allocator<char>;
+	using Headers = std::pmr::vector<std::pair<std::pmr::string, std::pmr::string>>;
+
+	// A response serialized once, at startup, that any number of requests can send: handlers
+	// return HttpResponse(prepared), which only copies the pointer. Sending it writes the status
+	// line and Date, everything else goes out straight from here. Bodies worth compressing get
+	// a gzip variant too. Changing a response built from one makes it a normal response again
+	struct Prepared {
+		struct Variant {
+			Headers headers;
+			std::string body;
+			std::string tail;  // Serialized headers after Date, blank line and body
+		};
+		int code;
+		Variant plain, gzip;
+		bool has_gzip = false;
+	};
+	// File bodies can't be prepared
+	static std::shared_ptr<const Prepared> prepare(HttpResponse response);
+
+	explicit HttpResponse(allocator_type alloc = {});
+	explicit HttpResponse(std::shared_ptr<const Prepared> prepared, allocator_type alloc = {});
+	// Parts may point into owned_parts, a copy would point into the original's. So would a move
+	// assignment between different allocators
+	HttpResponse(const HttpResponse &) = delete;
+	HttpResponse(HttpResponse &&) = default;
+	HttpResponse &operator=(const HttpResponse &) = delete;
+	HttpResponse &operator=(HttpResponse &&) = delete;
+
+	allocator_type getAllocator() const;
+
 	void setStatusCode(int code);
-	void setContentType(std::string type);
-	void setBody(std::string body);
-	void addHeader(const std::string &, const std::string &);
+	void setContentType(std::string_view type);
+	void setBody(std::string_view body);
+	void addHeader(std::string_view key, std::string_view value);
+
+	// The body can also be built from parts that are sent with a single writev, without ever
+	// being concatenated. Static parts are not copied, so they must outlive the response
+	void appendBody(std::pmr::string part);	 // Not copied if it's from the same allocator
+	void appendBody(std::shared_ptr<const std::string> part);
+	void appendStaticBody(std::string_view part);
+
+	// Sends size bytes of fd with sendfile after everything else, without them ever entering
+	// user space. Takes ownership of fd
+	void setFileBody(int fd, size_t size);
+	int getFileFd() const;	// -1 without a file body
+	size_t getFileSize() const;
+
+	// Makes the response the start of a feed (see Feeds): over HTTP/1.1 it goes out chunked,
+	// and the connection then gets everything published to topic. The body must be a file body,
+	// the topic's bytes up to its size. Elsewhere it's sent as it is
+	void setFeed(std::string_view topic);
+	std::string_view getFeed() const;
 
+	// Opts the body into HttpServer's compressed variant cache. The key must change whenever
+	// the body does
+	void setCacheKey(std::string_view key);
+	std::string_view getCacheKey() const;
+
+	int getStatusCode() const;
+	std::optional<std::string_view> getHeader(std::string_view) const;
+	// Without Date and Content-Length, which are only added when it's serialized
+	const Headers &getHeaders() const;
+	size_t getBodySize() const;
+	std::vector<std::string_view> getBodyParts() const;
+
+	bool isPrepared() const;
+	// Prepared responses only: sends the gzip variant from now on. False if there's none
+	bool usePreparedGzip();
+
+	// Into out, reusing its buffer
+	void serializeHead(std::string &out) const;
+	std::string serializeHead() const;
 	std::string serialize() const;
+	// Fills iov with head followed by the body parts. head must be serializeHead()'s result
+	void toIovecs(const std::string &head, std::vector<struct iovec> &iov) const;
 
    private:
 	int code = 200;
-	std::string body;
-	std::map<std::string, std::string> headers;
+	std::pmr::string body;
+	std::pmr::vector<std::string_view> parts;  // Come after body
+	std::pmr::list<std::pmr::string> owned_parts;  // Backing storage, stable and free to construct empty
+	std::pmr::vector<std::shared_ptr<const std::string>> shared_parts;
+	std::pmr::string cache_key;
+	std::pmr::string feed;
+
+	struct FileBody {  // Owns fd, -1 for none
+		int fd = -1;
+		size_t size = 0;
+		FileBody() = default;
+		FileBody(FileBody &&) noexcept;
+		FileBody &operator=(FileBody &&) = delete;
+		~FileBody();
+	};
+	FileBody file;
+	Headers headers;  // Few enough that a linear search beats any map
 
-	std::string getStatusText(int code) const;
+	std::shared_ptr<const Prepared> prepared;
+	bool prepared_gzip = false;
+
+	const Prepared::Variant &variant() const;
+	void materialize();	 // Turns a prepared response into a normal one, before changing it
+
+   public:
+	// "HTTP/1.1 404 Not Found\r\n", from a table built once
+	static std::string_view statusLine(int code);
+	// "Date: Sun, 06 Nov 1994 08:49:37 GMT\r\n", kept current by a clock thread. The calling
+	// thread's copy, good until its next call
+	static std::string_view dateLine();
 };
 
 #endif	// !HTTP_RESPONSE
@@ -1,41 +1,87 @@
 #include "httpserver.hpp"
+#include <algorithm>
+#include <charconv>
+#include <climits>
+#include <csignal>
 #include <cstdio>
 #include <fcntl.h>
 #include <memory>
 #include <mutex>
 #include <optional>
+#include <poll.h>
+#include <string_view>
+#include <strings.h>
 #include <sys/epoll.h>
+#include <sys/sendfile.h>
 #include <unistd.h>
+#include <utility>
 
 std::optional<HttpRequest> HttpServer::get_request(ConnectionContext &ctx, bool &is_closed)
 {
-	const int fd = ctx.fd;
-	HttpRequest req = ctx.req;
-	std::string &body = ctx.body;
+	std::pmr::string &body = ctx.body;
+
+	auto finish = [&ctx] {
+		ctx.req->setBody(std::move(ctx.body));
+		HttpRequest final_req = std::move(*ctx.req);
+		ctx.reset();
+		return final_req;
+	};
 
 	for (;;) {
-		ssize_t bytes_received = recv(fd, ctx.buffer, sizeof(ctx.buffer), 0);
-
-		if (bytes_received <= 0) {
-			// If we get 0 or the error doesn't say to try again we retry
-			if (bytes_received == 0 || (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK))
-				is_closed = true;
-			if (ctx.state >= BODY) {
-				req.setBody(std::move(ctx.body));
-				HttpRequest final_req = std::move(ctx.req);
-				ctx.reset();
-				return req;
+		// Bytes left over from the previous read belong to the next (pipelined) request
+		if (ctx.buf_pos == ctx.buf_len) {
+			size_t wanted = ctx.readSize();
+			if (ctx.buffer.size() < BufferPool::classSize(wanted))
+				ctx.buffer = BufferPool::acquire(wanted);
+			ssize_t bytes_received = ctx.tls ? ctx.tls->read(ctx.buffer.data(), ctx.buffer.size())
+											 : recv(ctx.fd, ctx.buffer.data(), ctx.buffer.size(), 0);
+
+			if (bytes_received <= 0) {
+				if (bytes_received < 0 && errno == EINTR)
+					continue;
+				if (bytes_received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+					is_closed = true;
+				// Nothing in it is unparsed, someone busy can have it until more comes
+				ctx.buffer.release();
+				ctx.buf_pos = ctx.buf_len = 0;
+				// We haven't finished a request, so we return nullopt and wait for more
+				return std::nullopt;
 			}
-			return std::nullopt;
+			ctx.buf_pos = 0;
+			ctx.buf_len = bytes_received;
+			ctx.bytes_received += bytes_received;
+			Metrics::add(Metrics::BYTES_IN, bytes_received);
+			if (ctx.capture)
+				ctx.capture->data(ctx.conn_id, ctx.buffer.data(), bytes_received);
 		}
 
 		// TODO: Further checks (slowloris, long headers...)
-		for (int i = 0; i < bytes_received; i++) {
-			char c = ctx.buffer[i];
+		while (ctx.buf_pos < ctx.buf_len) {
+			if (ctx.state == BODY) {
+				// The body is copied in bulk, only the head needs the byte by byte state machine
+				size_t n = std::min(ctx.content_length - body.size(), ctx.buf_len - ctx.buf_pos);
+				body.append(ctx.buffer.data() + ctx.buf_pos, n);
+				ctx.buf_pos += n;
+				if (body.size() >= ctx.content_length)
+					return finish();
+				continue;
+			}
+			if (ctx.state == CHUNK_DATA) {
+				size_t n = std::min(ctx.chunk_remaining, ctx.buf_len - ctx.buf_pos);
+				body.append(ctx.buffer.data() + ctx.buf_pos, n);
+				ctx.buf_pos += n;
+				ctx.chunk_remaining -= n;
+				if (ctx.chunk_remaining == 0)
+					ctx.state = CHUNK_END;
+				continue;
+			}
+
+			HttpRequest &req = *ctx.req;
+			char c = ctx.buffer.data()[ctx.buf_pos++];
 			switch (ctx.state) {
 			case METHOD:
 				if (c == ' ') {
-					req.setMethod(std::move(ctx.temp_method));
+					req.setMethod(ctx.temp_method);
 					ctx.state = PATH;
 				} else {
 					ctx.temp_method += c;
@@ -43,7 +89,13 @@ std::optional<HttpRequest> HttpServer::get_request(ConnectionContext &ctx, bool
 				break;
 			case PATH:
 				if (c == ' ') {	 // TODO: Clean path?
-					req.setPath(std::move(ctx.temp_path));
+					std::string_view target = ctx.temp_path;
+					size_t query_start = target.find('?');
+					if (query_start != std::string_view::npos) {
+						req.setQuery(target.substr(query_start + 1));
+						target = target.substr(0, query_start);
+					}
+					req.setPath(target);
 					ctx.state = VERSION;
 				} else {
 					ctx.temp_path += c;
@@ -53,8 +105,13 @@ std::optional<HttpRequest> HttpServer::get_request(ConnectionContext &ctx, bool
 				if (c == '\r')
 					continue;
 				if (c == '\n') {
-					req.setVersion(std::move(ctx.temp_version));
+					req.setVersion(ctx.temp_version);
 					ctx.state = HEADERS_KEY;
+					// Decided now so a limited client costs us no routing or storage work. The
+					// headers still get parsed to know how much body is coming
+					if (ctx.limiter)
+						ctx.retry_after = ctx.limiter->acquire(
+						  ctx.peer, RateLimiter::kindFor(req.getMethod()));
 				} else {
 					ctx.temp_version += c;
 				}
@@ -65,16 +122,30 @@ std::optional<HttpRequest> HttpServer::get_request(ConnectionContext &ctx, bool
 					continue;
 				if (c == '\n') {
 					if (ctx.current_header_key.empty()) {
+						if (ctx.content_length > max_body) {
+							ctx.too_large = ctx.close_after_response = true;
+							return finish();
+						}
+						// Not worth reading a big (or unsized) body just to throw it away
+						if (ctx.retry_after
+							&& (ctx.chunked || ctx.expect_continue
+								|| ctx.content_length > rejected_body_max)) {
+							ctx.close_after_response = true;
+							return finish();
+						}
 						// If we're done with headers (2 straight empty lines), we see if we need a
 						// body
-						if (ctx.content_length > 0) {
-							ctx.state = BODY;
-							body.reserve(ctx.content_length);
+						if (ctx.chunked) {
+							ctx.state = CHUNK_SIZE;
+						} else if (ctx.content_length == 0) {
+							return finish();
 						} else {
-							HttpRequest final_req = std::move(ctx.req);
-							ctx.reset();
-							return req;
+							ctx.state = BODY;
+							body.reserve(std::min(ctx.content_length, body_reserve_max));
 						}
+						// curl holds big uploads back for a second unless we tell it to go on
+						if (ctx.expect_continue)
+							send_response(ctx, "HTTP/1.1 100 Continue\r\n\r\n");
 					}
 					ctx.current_header_key.clear();
 				} else if (c == ':') {
@@ -91,8 +162,19 @@ std::optional<HttpRequest> HttpServer::get_request(ConnectionContext &ctx, bool
 					// If we're done with this value, we can add the header. And start again
 					req.addHeader(ctx.current_header_key, ctx.current_header_value);
 
-					if (ctx.current_header_key == "Content-Length") {
-						ctx.content_length = std::stoi(ctx.current_header_value);
+					const std::string &key = ctx.current_header_key, &value = ctx.current_header_value;
+					if (strcasecmp(key.c_str(), "Content-Length") == 0) {
+						auto [ptr, ec] = std::from_chars(value.data(), value.data() + value.size(),
+														 ctx.content_length);
+						if (ec != std::errc()) {
+							is_closed = true;
+							return std::nullopt;
+						}
+					} else if (strcasecmp(key.c_str(), "Transfer-Encoding") == 0) {
+						// curl -T - streams stdin like this
+						ctx.chunked = strcasestr(value.c_str(), "chunked") != nullptr;
+					} else if (strcasecmp(key.c_str(), "Expect") == 0) {
+						ctx.expect_continue = strcasecmp(value.c_str(), "100-continue") == 0;
 					}
 
 					ctx.current_header_value.clear();
@@ -106,37 +188,104 @@ std::optional<HttpRequest> HttpServer::get_request(ConnectionContext &ctx, bool
 				}
 				break;
 
-			case BODY:
-				body.push_back(c);
-				if (body.size() >= ctx.content_length) {
-					ctx.state = DONE;
+			case CHUNK_SIZE:
+				if (c == '\r')
+					continue;
+				if (c == '\n') {
+					if (ctx.chunk_remaining > max_body - body.size()) {
+						ctx.too_large = ctx.close_after_response = true;
+						return finish();
+					}
+					ctx.state = ctx.chunk_remaining ? CHUNK_DATA : CHUNK_TRAILER;
+					ctx.chunk_extension = false;
+				} else if (c == ';' || ctx.chunk_extension) {
+					ctx.chunk_extension = true;
+				} else {
+					int digit = isxdigit(c) ? (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10) : -1;
+					if (digit < 0 || ctx.chunk_remaining >> 56) {
+						is_closed = true;
+						return std::nullopt;
+					}
+					ctx.chunk_remaining = ctx.chunk_remaining << 4 | digit;
 				}
 				break;
 
-			case DONE:
-				// TODO: Save extra bytes for next request (Weird but possible)
-				req.setBody(std::move(body));
-				HttpRequest final_req = std::move(ctx.req);
-				ctx.reset();
-				return req;
+			case CHUNK_END:	 // CRLF after the chunk data
+				if (c == '\n')
+					ctx.state = CHUNK_SIZE;
+				break;
+
+			case CHUNK_TRAILER:	 // Trailer headers are ignored, an empty line ends the body
+				if (c == '\r')
+					continue;
+				if (c == '\n') {
+					if (ctx.chunk_remaining == 0)
+						return finish();
+					ctx.chunk_remaining = 0;
+				} else {
+					ctx.chunk_remaining++;
+				}
+				break;
+
+			case BODY:	// Handled above
+			case CHUNK_DATA:
+				break;
 			}
 		}
 	}
+}
 
-	// We haven't finished a request, so we return nullopt and wait for more
-	return std::nullopt;
+// What an overloaded server answers, ready to go so shedding costs next to nothing
+static constexpr std::string_view unavailable_response = "HTTP/1.1 503 Service Unavailable\r\n"
+														 "Retry-After: 1\r\n"
+														 "Connection: close\r\n"
+														 "Content-Length: 32\r\n\r\n"
+														 "<h1>503 Service Unavailable</h1>";
+
+// Waits until fd is writable again. False if it never becomes so
+static bool wait_writable(int fd, int timeout_ms)
+{
+	struct pollfd pfd = { fd, POLLOUT, 0 };
+	int r;
+	do {
+		r = poll(&pfd, 1, timeout_ms);
+	} while (r < 0 && errno == EINTR);
+	return r > 0 && !(pfd.revents & (POLLERR | POLLHUP | POLLNVAL));
 }
 
-void HttpServer::send_response(int fd, const std::string &response)
+bool HttpServer::send_tls(ConnectionContext &c, const char *data, size_t size)
 {
-	const char *str = response.c_str();
-	int total_sent = 0, to_send = response.size();
+	while (size > 0) {
+		ssize_t bytes_sent = c.tls->write(data, size);
+		if (bytes_sent < 0 && errno == EAGAIN && wait_writable(c.fd, send_timeout_ms))
+			continue;
+		if (bytes_sent <= 0)
+			return false;
+		data += bytes_sent;
+		size -= bytes_sent;
+		Metrics::add(Metrics::BYTES_OUT, bytes_sent);
+	}
+	return true;
+}
 
-	for (;;) {
+void HttpServer::send_response(ConnectionContext &c, std::string_view response)
+{
+	if (c.tls && !c.tls->kernelSend()) {
+		send_tls(c, response.data(), response.size());
+		return;
+	}
+
+	int fd = c.fd;
+	const char *str = response.data();
+	size_t total_sent = 0, to_send = response.size();
+
+	while (to_send > 0) {
 		ssize_t bytes_sent = send(fd, str + total_sent, to_send, MSG_NOSIGNAL);
 
 		if (bytes_sent < 0) {
-			if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(fd, send_timeout_ms))
 				continue;
 			return;
 		}
@@ -145,10 +294,214 @@ void HttpServer::send_response(int fd, const std::string &response)
 
 		total_sent += bytes_sent;
 		to_send -= bytes_sent;
+		Metrics::add(Metrics::BYTES_OUT, bytes_sent);
+	}
+}
+
+void HttpServer::send_unavailable(int fd)
+{
+	// Closing with unread input resets the connection, and the 503 could go with it. Never
+	// waits, this runs on the epoll thread too
+	char scratch[4096];
+	for (int i = 0; i < 16 && recv(fd, scratch, sizeof(scratch), MSG_DONTWAIT) > 0; i++)
+		;
+	ssize_t sent = send(fd, unavailable_response.data(), unavailable_response.size(),
+						MSG_NOSIGNAL | MSG_DONTWAIT);
+	if (sent > 0)
+		Metrics::add(Metrics::BYTES_OUT, sent);
+}
+
+void HttpServer::send_response_tls(ConnectionContext &c, const HttpResponse &response,
+								   const std::vector<struct iovec> &iov)
+{
+	// Small parts are gathered first, so the head and a short body make one record rather than
+	// one each
+	thread_local std::string pending;
+	pending.clear();
+	for (const struct iovec &part : iov) {
+		const char *data = static_cast<const char *>(part.iov_base);
+		if (pending.size() + part.iov_len <= tls_record_size) {
+			pending.append(data, part.iov_len);
+			continue;
+		}
+		if (!send_tls(c, pending.data(), pending.size()))
+			return;
+		pending.clear();
+		if (part.iov_len < tls_record_size)
+			pending.append(data, part.iov_len);
+		else if (!send_tls(c, data, part.iov_len))
+			return;
+	}
+	if (!pending.empty() && !send_tls(c, pending.data(), pending.size()))
+		return;
+
+	// No sendfile without kTLS, the file is read and encrypted here
+	thread_local char chunk[64 << 10];
+	off_t offset = 0;
+	size_t remaining = response.getFileFd() >= 0 ? response.getFileSize() : 0;
+	while (remaining > 0) {
+		ssize_t n = pread(response.getFileFd(), chunk, std::min(sizeof(chunk), remaining), offset);
+		if (n <= 0 || !send_tls(c, chunk, n))
+			return;
+		offset += n;
+		remaining -= n;
 	}
 }
 
-void HttpServer::handle_connection(int fd)
+void HttpServer::send_response(ConnectionContext &c, const HttpResponse &response,
+							   const std::string &head)
+{
+	// Head and body parts go out in one sendmsg (writev with MSG_NOSIGNAL), so parts are never
+	// joined into a single buffer
+	thread_local std::vector<struct iovec> iov;
+	response.toIovecs(head, iov);
+	// With kTLS the kernel encrypts what we send, so TLS takes the same path as plain HTTP
+	if (c.tls && !c.tls->kernelSend()) {
+		send_response_tls(c, response, iov);
+		return;
+	}
+	int fd = c.fd;
+
+	size_t first = 0;
+	while (first < iov.size()) {
+		struct msghdr msg = {};
+		msg.msg_iov = &iov[first];
+		msg.msg_iovlen = std::min<size_t>(iov.size() - first, IOV_MAX);
+
+		ssize_t bytes_sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (bytes_sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(fd, send_timeout_ms))
+				continue;
+			return;
+		}
+
+		Metrics::add(Metrics::BYTES_OUT, bytes_sent);
+
+		// Skip what was fully sent and trim the partially sent one
+		size_t n = bytes_sent;
+		while (first < iov.size() && n >= iov[first].iov_len)
+			n -= iov[first++].iov_len;
+		if (first < iov.size()) {
+			iov[first].iov_base = static_cast<char *>(iov[first].iov_base) + n;
+			iov[first].iov_len -= n;
+		}
+	}
+
+	if (response.getFileFd() < 0)
+		return;
+	off_t offset = 0;
+	size_t remaining = response.getFileSize();
+	while (remaining > 0) {
+		ssize_t bytes_sent = sendfile(fd, response.getFileFd(), &offset, remaining);
+		if (bytes_sent < 0) {
+			if (errno == EINTR)
+				continue;
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) && wait_writable(fd, send_timeout_ms))
+				continue;
+			return;
+		}
+		if (bytes_sent == 0)  // File shrank under us, the client will see a short body
+			return;
+		remaining -= bytes_sent;
+		Metrics::add(Metrics::BYTES_OUT, bytes_sent);
+	}
+}
+
+void HttpServer::compress_response(const HttpRequest &req, HttpResponse &response)
+{
+	if (response.isPrepared()) {  // Compressed when it was prepared, if at all
+		if (negotiate_encoding(req.getHeader("Accept-Encoding")) == Encoding::GZIP)
+			response.usePreparedGzip();
+		return;
+	}
+
+	// The handler took care of it, or the body is a file that goes out as-is
+	if (response.getHeader("Content-Encoding") || response.getFileFd() >= 0)
+		return;
+
+	size_t size = response.getBodySize();
+	std::optional<std::string_view> content_type = response.getHeader("Content-Type");
+	if (size < compress_min_size || !content_type || !is_compressible(*content_type))
+		return;
+
+	// Anything caching the response must tell encodings apart
+	response.addHeader("Vary", "Accept-Encoding");
+	Encoding encoding = negotiate_encoding(req.getHeader("Accept-Encoding"));
+	if (encoding == Encoding::IDENTITY)
+		return;
+
+	std::string_view cache_key = response.getCacheKey();
+	thread_local std::string variant_key;  // Reused, most keys are too long for SSO
+	variant_key.clear();
+	if (!cache_key.empty())
+		variant_key.append(cache_key).append(":").append(encoding_name(encoding));
+
+	std::shared_ptr<const std::string> compressed;
+	if (!variant_key.empty())
+		compressed = compressed_cache.get(variant_key);
+
+	if (!compressed) {
+		// Cached variants are paid for once, so they get the better ratio
+		int level = size > compress_fast_size ? 1 : variant_key.empty() ? 6 : 9;
+		compressed = std::make_shared<const std::string>(
+		  gzip_compress(response.getBodyParts(), level));
+		if (!variant_key.empty())
+			compressed_cache.put(variant_key, compressed);
+	}
+
+	response.setBody("");
+	response.appendBody(std::move(compressed));
+	response.addHeader("Content-Encoding", encoding_name(encoding));
+}
+
+const HttpServer::Route *HttpServer::find_route(std::string_view path) const
+{
+	auto it = endpoints.find(path);
+	if (it != endpoints.end())
+		return &it->second;
+
+	for (const auto &[base_path, route] : wildcard_endpoints) {
+		if (path.starts_with(base_path))
+			return &route;
+	}
+	return nullptr;
+}
+
+HttpResponse HttpServer::dispatch(const HttpRequest &request, const Route *route,
+								  uint32_t retry_after)
+{
+	if (retry_after) {
+		Metrics::add(Metrics::RATE_LIMITED);
+		HttpResponse limited(request.getAllocator());
+		limited.setStatusCode(429);
+		limited.addHeader("Retry-After", std::to_string(retry_after));
+		limited.setBody("<h1>429 Too Many Requests</h1>");
+		return limited;
+	}
+	if (!route) {
+		static const auto not_found = [] {
+			HttpResponse response;
+			response.setStatusCode(404);
+			response.setBody("<h1>404 Not found</h1>");
+			return HttpResponse::prepare(std::move(response));
+		}();
+		return HttpResponse(not_found);
+	}
+
+	// A throwing handler would take the whole worker (and process) down with it
+	try {
+		return route->handler(request);
+	} catch (std::exception &ex) {
+		HttpResponse error(request.getAllocator());
+		error.setStatusCode(500);
+		error.setBody("<h1>500 Internal Server Error</h1>");
+		return error;
+	}
+}
+
+void HttpServer::handle_connection(int fd, uint64_t queued_at)
 {
 	// First we get the context in a thread-safe way
 	std::shared_ptr<ConnectionContext> ctx_ptr = nullptr;
@@ -161,67 +514,422 @@ void HttpServer::handle_connection(int fd)
 	if (!ctx_ptr)
 		return;
 	ConnectionContext &c = *ctx_ptr;
+	if (c.waiting.exchange(ConnectionContext::BUSY) == ConnectionContext::BUSY)
+		return;	 // Queued by the drain too, and the other task got it
+
+	// Trace timestamps are only taken for sampled connections
+	uint32_t trace_id = c.trace_id;
+	auto trace_now = [trace_id] { return trace_id ? Tracer::now() : 0; };
+	if (trace_id)
+		Tracer::span("dequeue", queued_at, Tracer::now(), trace_id, fd);
+	if (c.tls_context && !tls_handshake(c, trace_now()))
+		return;
+	if (c.h2) {
+		serve_h2(c);
+		return;
+	}
 
 	for (;;) {
 		bool is_closed = false;
+		Metrics::Clock::time_point start = Metrics::Clock::now();
+		uint64_t trace_start = trace_now();
+		// Destroyed after the request and its response, then drops all they allocated
+		Arena::Scope request_memory(*c.arena);
 		std::optional<HttpRequest> request = get_request(c, is_closed);
 
+		if (is_closed || !request)	// A partial request stays in the arena
+			request_memory.dismiss();
+
 		if (is_closed) {
-			close(fd);
-			{
-				std::lock_guard lock(contexts_mutex);
-				contexts.erase(fd);
-			}
+			close_connection(c);
+			return;
+		}
+
+		if (!request)
+			break;
+
+		// HTTP/2 with prior knowledge: its preface starts like an HTTP/1.1 request
+		if (request->getMethod() == "PRI" && request->getPath() == "*"
+			&& request->getVersion() == "HTTP/2.0") {
+			c.retry_after = 0;
+			c.h2 = std::make_unique<Http2Connection>(Http2Connection::preface_request_size);
+			serve_h2(c);
 			return;
 		}
+		// Or an upgrade to it (h2c), the request is then answered as stream 1. Over TLS only ALPN
+		// can pick HTTP/2
+		std::string_view h2_settings = request->getHeader("HTTP2-Settings");
+		if (!c.tls && !c.too_large && !h2_settings.empty()
+			&& request->getHeader("Upgrade").find("h2c") != std::string_view::npos) {
+			auto h2 = std::make_unique<Http2Connection>();
+			if (h2->upgrade(h2_settings)) {	 // Else it's answered as if it never asked
+				send_response(c, "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\n"
+								 "Upgrade: h2c\r\n\r\n");
+				c.h2 = std::move(h2);
+				respond_h2(c, 1, *request, std::exchange(c.retry_after, 0), start);
+				serve_h2(c);
+				return;
+			}
+		}
 
-		if (request) {
-			const HttpResponse response = [&request, this] {
-				const std::string &path = request->getPath();
+		Metrics::Clock::time_point parsed = Metrics::Clock::now();
+		uint64_t trace_parsed = trace_now();
+		uint32_t retry_after = std::exchange(c.retry_after, 0);
+		bool too_large = std::exchange(c.too_large, false);
+		const Route *route =
+		  retry_after || too_large ? nullptr : find_route(request->getPath());
+		uint64_t trace_routed = trace_now();
 
-				auto it = this->endpoints.find(path);
-				if (it != this->endpoints.end()) {
-					return it->second(*request);
-				}
+		static const auto payload_too_large = [] {
+			HttpResponse response;
+			response.setStatusCode(413);
+			response.setBody("<h1>413 Content Too Large</h1>");
+			return HttpResponse::prepare(std::move(response));
+		}();
+		HttpResponse response = too_large ? HttpResponse(payload_too_large)
+										  : dispatch(*request, route, retry_after);
+		Metrics::Clock::time_point handled = Metrics::Clock::now();
+		uint64_t trace_handled = trace_now();
 
-				for (const auto &[base_path, handler] : this->wildcard_endpoints) {
-					if (path.rfind(base_path, 0) == 0) {
-						return handler(*request);
-					}
-				}
+		// Followers are written from other threads, so feeds only go out where the kernel writes
+		// the socket. Everywhere else, and to HTTP/1.0 clients, they're sent as they are now
+		bool feed = !response.getFeed().empty();
+		if (feed
+			&& (request->getMethod() != "GET" || request->getVersion() != "HTTP/1.1"
+				|| response.getFileFd() < 0 || (c.tls && !c.tls->kernelSend())
+				|| draining.load(std::memory_order_relaxed))) {
+			response.setFeed("");
+			feed = false;
+		}
+
+		// Draining, or the rest of a rate limited or too large body is still unread. A feed never
+		// ends here
+		bool closing = feed || c.close_after_response || draining.load(std::memory_order_relaxed);
+		if (closing)
+			response.addHeader("Connection", "close");
+
+		compress_response(*request, response);
+		thread_local std::string head;
+		response.serializeHead(head);
+		Metrics::Clock::time_point serialized = Metrics::Clock::now();
+		uint64_t trace_serialized = trace_now();
+
+		// What there is of a feed is its first chunk
+		size_t first_chunk = feed ? response.getBodySize() : 0;
+		if (first_chunk) {
+			char size[16];
+			auto [end, ec] = std::to_chars(size, size + sizeof(size), first_chunk, 16);
+			head.append(size, end).append("\r\n");
+		}
+		send_response(c, response, head);
+		if (first_chunk)
+			send_response(c, "\r\n");
+		if (c.capture)	// The request ended where the unparsed bytes begin
+			c.capture->response(c.conn_id, c.bytes_received - (c.buf_len - c.buf_pos), response);
+
+		if (trace_id) {
+			uint64_t trace_sent = Tracer::now();
+			Tracer::span("parse", trace_start, trace_parsed, trace_id, fd);
+			Tracer::span("route", trace_parsed, trace_routed, trace_id, fd);
+			Tracer::span("handler", trace_routed, trace_handled, trace_id, fd);
+			Tracer::span("serialize", trace_handled, trace_serialized, trace_id, fd);
+			Tracer::span("send", trace_serialized, trace_sent, trace_id, fd);
+		}
+
+		size_t route_id = route ? route->metrics_id : Metrics::unmatched_route;
+		Metrics::recordPhase(Metrics::PARSE, std::chrono::nanoseconds(parsed - start).count());
+		Metrics::recordPhase(Metrics::HANDLER, std::chrono::nanoseconds(handled - parsed).count());
+		Metrics::recordPhase(Metrics::SERIALIZE,
+							 std::chrono::nanoseconds(serialized - handled).count());
+		uint64_t total_ns = Metrics::since(start);
+		Metrics::recordPhase(Metrics::SEND, Metrics::since(serialized));
+		Metrics::recordRequest(route_id, response.getStatusCode(), total_ns);
+		if (access_log)
+			access_log->log(c.peer, request->getMethod(), request->getPath(),
+							response.getStatusCode(), response.getBodySize(), total_ns);
 
-				HttpResponse notFound;
-				notFound.setStatusCode(404);
-				notFound.setBody("<h1>404 Not found</h1>");
-				return notFound;
-			}();
+		if (feed) {
+			park(c, response);
+			return;
+		}
+		if (closing) {
+			close_connection(c);
+			return;
+		}
+	}
+
+	bool idle = c.state == METHOD && c.temp_method.empty() && c.buf_pos == c.buf_len;
+	if (!wait_for_more(c, idle))
+		close_connection(c);
+}
+
+void HttpServer::serve_h2(ConnectionContext &c)
+{
+	Http2Connection &h2 = *c.h2;
+	// Replay only knows HTTP/1.1, what was recorded of the connection so far ends here
+	if (c.capture) {
+		c.capture->close(c.conn_id);
+		c.capture = nullptr;
+	}
 
-			std::string s_response = response.serialize();
-			send_response(c.fd, s_response);
+	// Streams are answered one after another, in the order they complete
+	std::vector<Http2Connection::Request> ready;
+	bool ok = true;
+	for (;;) {
+		if (draining.load(std::memory_order_relaxed))
+			h2.goAway();
+		if (!h2.output().empty()) {
+			send_response(c, h2.output());
+			h2.output().clear();
+		}
+		if (!ok || h2.isDone()) {
+			close_connection(c);
+			return;
+		}
+
+		std::string_view data;
+		if (c.buf_pos < c.buf_len) {  // Read along with the preface or the upgrade request
+			data = std::string_view(c.buffer.data() + c.buf_pos, c.buf_len - c.buf_pos);
+			c.buf_pos = c.buf_len = 0;
 		} else {
-			break;
+			if (c.buffer.size() < h2_read_size)
+				c.buffer = BufferPool::acquire(h2_read_size);
+			ssize_t n = c.tls ? c.tls->read(c.buffer.data(), c.buffer.size())
+							  : recv(c.fd, c.buffer.data(), c.buffer.size(), 0);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				c.buffer.release();
+				if (wait_for_more(c, h2.isIdle()))
+					return;
+				continue;  // Draining, around once more for the GOAWAY
+			}
+			if (n <= 0) {
+				close_connection(c);
+				return;
+			}
+			c.bytes_received += n;
+			Metrics::add(Metrics::BYTES_IN, n);
+			data = std::string_view(c.buffer.data(), n);
+		}
+
+		Metrics::Clock::time_point start = Metrics::Clock::now();
+		ok = h2.receive(data, ready);
+		for (auto &[stream, request] : ready) {
+			uint32_t retry_after =
+			  c.limiter ? c.limiter->acquire(c.peer, RateLimiter::kindFor(request.getMethod())) : 0;
+			respond_h2(c, stream, request, retry_after, start);
 		}
+		ready.clear();
 	}
+}
 
+void HttpServer::respond_h2(ConnectionContext &c, uint32_t stream, const HttpRequest &request,
+							uint32_t retry_after, Metrics::Clock::time_point start)
+{
+	const Route *route = retry_after ? nullptr : find_route(request.getPath());
+	HttpResponse response = dispatch(request, route, retry_after);
+	compress_response(request, response);
+	int status = response.getStatusCode();
+	size_t size = response.getBodySize();
+	c.h2->respond(stream, std::move(response));
+
+	uint64_t total_ns = Metrics::since(start);
+	Metrics::recordRequest(route ? route->metrics_id : Metrics::unmatched_route, status, total_ns);
+	if (access_log)
+		access_log->log(c.peer, request.getMethod(), request.getPath(), status, size, total_ns);
+}
+
+void HttpServer::watch(int fd)
+{
 	// We used EPOLLONESHOT, so the socket is now ignored by epoll.
 	// We must add it back so we get notified of the next packet.
-	struct epoll_event ev;
-	ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-	ev.data.fd = fd;
+	struct epoll_event ev = { EPOLLIN | EPOLLET | EPOLLONESHOT, { .u64 = uint32_t(fd) } };
 	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
 }
 
+bool HttpServer::wait_for_more(ConnectionContext &c, bool idle)
+{
+	c.waiting.store(idle ? ConnectionContext::IDLE : ConnectionContext::PARTIAL);
+	// Stored first: either this sees the drain, or the drain sees it's idle
+	if (idle && draining.load())
+		return c.waiting.exchange(ConnectionContext::BUSY) == ConnectionContext::BUSY;
+	watch(c.fd);
+	return true;
+}
+
+void HttpServer::park(ConnectionContext &c, const HttpResponse &response)
+{
+	// The socket is the feed's now, whatever else the client sent is dropped
+	c.buffer.release();
+	c.buf_pos = c.buf_len = 0;
+	int file_fd = fcntl(response.getFileFd(), F_DUPFD_CLOEXEC, 0);
+	c.follower = Feeds::follow(response.getFeed(), c.fd, file_fd, response.getFileSize());
+
+	// Not oneshot, nothing is queued for it and only the epoll thread handles its events. Edge
+	// triggered EPOLLOUT only comes once a socket that filled up drains
+	struct epoll_event ev = { EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET,
+							  { .u64 = follower_tag | uint32_t(c.fd) } };
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c.fd, &ev);
+}
+
+void HttpServer::serve_follower(int fd)
+{
+	std::shared_ptr<ConnectionContext> ctx;
+	{
+		std::lock_guard lock(contexts_mutex);
+		auto it = contexts.find(fd);
+		if (it == contexts.end())
+			return;
+		ctx = it->second;
+	}
+	if (ctx->follower && !Feeds::service(*ctx->follower))
+		close_connection(*ctx);
+}
+
+bool HttpServer::tls_handshake(ConnectionContext &c, uint64_t trace_start)
+{
+	if (c.tls && c.tls->isEstablished())
+		return true;
+	if (!c.tls)
+		c.tls = c.tls_context->accept(c.fd);
+
+	// The server's flight is small, it rarely fills the socket buffer
+	TlsConnection::Handshake status;
+	while ((status = c.tls->handshake()) == TlsConnection::WANT_WRITE
+		   && wait_writable(c.fd, send_timeout_ms))
+		;
+	if (status == TlsConnection::WANT_READ) {
+		if (!wait_for_more(c, true))
+			close_connection(c);
+		return false;
+	}
+	if (status != TlsConnection::DONE) {
+		Metrics::add(Metrics::TLS_FAILED);
+		close_connection(c);
+		return false;
+	}
+
+	Metrics::add(c.tls->isResumed() ? Metrics::TLS_RESUMED : Metrics::TLS_FULL);
+	if (c.tls->kernelSend())
+		Metrics::add(Metrics::TLS_KERNEL);
+	if (c.trace_id)
+		Tracer::span("handshake", trace_start, Tracer::now(), c.trace_id, c.fd);
+	if (c.tls->protocol() == "h2")
+		c.h2 = std::make_unique<Http2Connection>();
+	return true;
+}
+
+std::shared_ptr<HttpServer::ConnectionContext> HttpServer::new_context(
+  size_t queue, int fd, const struct sockaddr_storage &peer, uint32_t trace_id)
+{
+	ContextPool &pool = *context_pools[queue];
+	std::unique_ptr<ConnectionContext> ctx;
+	{
+		std::lock_guard lock(pool.mutex);
+		if (!pool.free.empty()) {
+			ctx = std::move(pool.free.back());
+			pool.free.pop_back();
+		}
+	}
+	// Rebuilt in place around the same arena. The old one may still hold a request cut short in
+	// the arena, so it goes first and only then is the arena reset
+	auto rebuild = [](ConnectionContext *c, int fd, const struct sockaddr_storage &peer,
+					  uint32_t trace_id) {
+		std::unique_ptr<Arena> arena = std::move(c->arena);
+		std::destroy_at(c);
+		arena->reset();
+		std::construct_at(c, fd, peer, trace_id, std::move(arena));
+	};
+	if (ctx)
+		rebuild(ctx.get(), fd, peer, trace_id);
+	else
+		ctx = std::make_unique<ConnectionContext>(fd, peer, trace_id);
+
+	return std::shared_ptr<ConnectionContext>(ctx.release(), [&pool, rebuild](ConnectionContext *c) {
+		// Pooled without its read buffer or arena block, those go back to the BufferPool now
+		rebuild(c, -1, {}, 0);
+		std::unique_ptr<ConnectionContext> owned(c);
+		std::lock_guard lock(pool.mutex);
+		if (pool.free.size() < context_pool_max)
+			pool.free.push_back(std::move(owned));
+	});
+}
+
+void HttpServer::close_connection(ConnectionContext &c)
+{
+	// Out of the map before the fd is closed, or a new connection reusing the fd could be
+	// registered in between and then erased here
+	{
+		std::lock_guard lock(contexts_mutex);
+		contexts.erase(c.fd);
+	}
+	if (c.capture)
+		c.capture->close(c.conn_id);
+	if (c.tls)
+		c.tls->shutdown();
+	close(c.fd);
+	open_connections.fetch_sub(1, std::memory_order_relaxed);
+	Metrics::add(Metrics::CONNECTIONS_CLOSED);
+}
+
+void HttpServer::reject_connection(int fd)
+{
+	std::shared_ptr<ConnectionContext> ctx;
+	{
+		std::lock_guard lock(contexts_mutex);
+		auto it = contexts.find(fd);
+		if (it == contexts.end())
+			return;
+		ctx = it->second;
+	}
+	if (ctx->waiting.exchange(ConnectionContext::BUSY) == ConnectionContext::BUSY)
+		return;
+	// A TLS client can only be told through its session, if it got that far. An HTTP/2 client
+	// wouldn't understand an HTTP/1.1 503 at all, it just sees the connection close
+	if (!ctx->tls_context && !ctx->h2)
+		send_unavailable(fd);
+	else if (ctx->tls && ctx->tls->isEstablished() && !ctx->h2)
+		ctx->tls->write(unavailable_response.data(), unavailable_response.size());
+	close_connection(*ctx);
+}
+
 HttpServer::~HttpServer()
 {
 	if (epoll_fd >= 0)
 		close(epoll_fd);
 }
 
-HttpServer::HttpServer(int port, std::optional<size_t> n_threads) : tp(n_threads)
+HttpServer::HttpServer(int port, std::optional<size_t> n_threads, const std::string &handoff_path,
+					   const Placement &p)
+	: placement(p), tp(n_threads, p.worker_cpus)
 {
+	for (size_t queue = 0; queue < tp.queueCount(); queue++) {
+		ContextPool *pool = context_pools.emplace_back(std::make_unique<ContextPool>()).get();
+		tp.addTask([pool] {	 // On one of the queue's workers, so the memory is theirs
+			std::lock_guard lock(pool->mutex);
+			struct sockaddr_storage none = {};
+			for (size_t i = 0; i < context_pool_prefill; i++)
+				pool->free.push_back(std::make_unique<ConnectionContext>(-1, none, 0));
+		}, nullptr, queue);
+	}
+
 	epoll_fd = epoll_create1(0);
-	tcpServer.emplace("", port);
-	tcpServer->startServer();
+
+	int listener = -1;
+	if (!handoff_path.empty()) {
+		handoff = std::make_unique<Handoff>(handoff_path);
+		listener = handoff->takeListener(&inherited_tls_listener);
+	}
+	if (listener >= 0) {
+		fprintf(stderr, "Took over the listening socket from the running server\n");
+		tcpServer.emplace(listener);
+	} else {
+		tcpServer.emplace("", port);
+		tcpServer->startServer();
+	}
+
+	addEndpoint("/metrics", Metrics::endpoint);
 }
 
 auto &HttpServer::operator=(HttpServer &&s) noexcept
@@ -247,65 +955,245 @@ HttpServer::HttpServer(HttpServer &&s) noexcept
 	s.tcpServer.reset();
 }
 
+void HttpServer::enableAccessLog(const std::string &path)
+{
+	access_log = std::make_unique<AccessLog>(path);
+}
+
+void HttpServer::enableCapture(const std::string &path)
+{
+	capture = std::make_unique<TrafficCapture>(path);
+}
+
+void HttpServer::enableTracing(unsigned sample_every)
+{
+	Tracer::enable(sample_every);
+	Tracer::installSignalHandler(SIGUSR2);
+	addEndpoint("/debug/trace", Tracer::endpoint);
+}
+
+void HttpServer::enableRateLimit(RateLimiter::Limit read, RateLimiter::Limit write)
+{
+	limiter = std::make_unique<RateLimiter>(read, write);
+}
+
+void HttpServer::setAdmissionLimits(size_t max_conns, ThreadPool::Limits queue)
+{
+	max_connections = max_conns;
+	tp.setLimits(queue);
+}
+
+void HttpServer::enableTls(int port, const std::string &cert_path, const std::string &key_path)
+{
+	tls_context = std::make_unique<TlsContext>(cert_path, key_path);
+	if (inherited_tls_listener >= 0) {
+		tlsServer.emplace(std::exchange(inherited_tls_listener, -1));
+	} else {
+		tlsServer.emplace("", port);
+		tlsServer->startServer();
+	}
+}
+
 void HttpServer::addEndpoint(const std::string &path,
 							 std::function<HttpResponse(const HttpRequest &)> f)
 {
+	Route route { std::move(f), Metrics::registerRoute(path) };
 	if (!path.empty() && path.back() == '*') {
 		std::string base_path = path.substr(0, path.size() - 1);
-		wildcard_endpoints.push_back({ base_path, f });
+		wildcard_endpoints.push_back({ base_path, std::move(route) });
 	} else {
-		endpoints[path] = f;
+		endpoints[path] = std::move(route);
 	}
 }
 
 void HttpServer::serve(std::optional<std::reference_wrapper<std::atomic<bool>>> stop)
 {
+	if (!Topology::pinCurrentThread(placement.epoll_cpus))
+		fprintf(stderr, "Could not pin the epoll thread\n");
+
 	int socketfd = tcpServer->getSocket();
 	// We add the listen socket monitor, which will accept connections.
-	struct epoll_event ev;
-	ev.events = EPOLLIN | EPOLLET;
-	ev.data.fd = socketfd;
-
+	struct epoll_event ev = { EPOLLIN | EPOLLET, { .u64 = uint32_t(socketfd) } };
 	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, socketfd, &ev);
 
-	while (stop == std::nullopt || !stop->get().load()) {
-		int n_fds = epoll_wait(epoll_fd, wait_events, max_events, -1);
+	int tls_socketfd = tlsServer ? tlsServer->getSocket() : -1;
+	if (tls_socketfd >= 0) {
+		struct epoll_event tls_ev = { EPOLLIN | EPOLLET, { .u64 = uint32_t(tls_socketfd) } };
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, tls_socketfd, &tls_ev);
+	}
+	// The server we took over had TLS on and we don't, nobody would accept on it
+	if (inherited_tls_listener >= 0)
+		close(std::exchange(inherited_tls_listener, -1));
+
+	// Only now, a server we took over stops accepting once we answer
+	if (handoff && handoff->listen()) {
+		struct epoll_event handoff_ev = { EPOLLIN, { .u64 = uint32_t(handoff->getSocket()) } };
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handoff->getSocket(), &handoff_ev);
+	}
 
-		if (n_fds < 0) {
-			if (errno == EINTR && stop->get().load())
-				break;
-			continue;
+	std::optional<Metrics::Clock::time_point> drain_deadline;
+	auto start_draining = [&] {
+		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, socketfd, nullptr);
+		tcpServer.reset();	// A new server has its own reference to the listener
+		socketfd = -1;
+		if (tls_socketfd >= 0) {
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, tls_socketfd, nullptr);
+			tlsServer.reset();
+			tls_socketfd = -1;
 		}
+		if (handoff)
+			handoff->close();
+		draining = true;
+		Feeds::endAll();  // Followers close once they have the last chunk
 
-		for (int i = 0; i < n_fds; i++) {
-			int fd = wait_events[i].data.fd;
-			if (fd == socketfd) {
-				for (;;) {	// Loop accept due to Edge Triggered mode
-					// Activity on socket => We can accept a new connection
-					int new_fd = tcpServer->acceptConnection();
+		// Idle keep-alive connections would hold the drain open until they time out. Queued,
+		// they find nothing to read and close (HTTP/2 ones after a GOAWAY)
+		std::vector<int> idle;
+		{
+			std::lock_guard lock(contexts_mutex);
+			for (const auto &[fd, ctx] : contexts) {
+				if (ctx->waiting.load() == ConnectionContext::IDLE)
+					idle.push_back(fd);
+			}
+		}
+		for (int fd : idle) {
+			uint64_t queued_at = Tracer::now();
+			if (!tp.addTask([this, fd, queued_at] { handle_connection(fd, queued_at); },
+							[this, fd] { reject_connection(fd); }, fd_queues[fd]))
+				reject_connection(fd);
+		}
+		drain_deadline = Metrics::Clock::now() + std::chrono::seconds(drain_timeout_s);
+	};
 
-					if (new_fd < 0)
-						break;
+	// SIGUSR2 may land on any thread, so with tracing on we wake up now and then to look for it
+	bool tracing = Tracer::enabled();
+	int timeout_ms = tracing ? trace_poll_ms : -1;
+	Tracer::nameThread("epoll");
 
-					// Non-blocking
-					int flags = fcntl(new_fd, F_GETFL, 0);
-					fcntl(new_fd, F_SETFL, flags | O_NONBLOCK);
+	auto accept_all = [&](TCPServer &listener, const TlsContext *tls) {
+		for (;;) {	// Loop accept due to Edge Triggered mode
+			// Activity on socket => We can accept a new connection
+			uint64_t accept_start = tracing ? Tracer::now() : 0;
+			struct sockaddr_storage peer;
+			int new_fd = listener.acceptConnection(&peer);
 
-					struct epoll_event new_ev;
-					new_ev.events = EPOLLIN | EPOLLET | EPOLLONESHOT;
-					new_ev.data.fd = new_fd;
+			if (new_fd < 0)
+				break;
 
-					epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_fd, &new_ev);
+			if (max_connections && open_connections.load() >= max_connections) {
+				if (!tls)  // A TLS client wouldn't understand it
+					send_unavailable(new_fd);
+				close(new_fd);
+				Metrics::add(Metrics::SHED_CONNECTIONS);
+				continue;
+			}
+			open_connections.fetch_add(1, std::memory_order_relaxed);
 
-					{
-						std::lock_guard lock(contexts_mutex);
-						contexts[new_fd] = std::make_shared<ConnectionContext>(new_fd);
-					}
+			// Non-blocking
+			int flags = fcntl(new_fd, F_GETFL, 0);
+			fcntl(new_fd, F_SETFL, flags | O_NONBLOCK);
+
+			struct epoll_event new_ev = { EPOLLIN | EPOLLET | EPOLLONESHOT,
+										  { .u64 = uint32_t(new_fd) } };
+			epoll_ctl(epoll_fd, EPOLL_CTL_ADD, new_fd, &new_ev);
+			Metrics::add(Metrics::CONNECTIONS_OPENED);
+
+			// With workers on several nodes a connection sticks to one node's queue
+			size_t queue = 0;
+			if (tp.queueCount() > 1) {
+				std::optional<size_t> rx_queue;
+				int cpu;
+				socklen_t len = sizeof(cpu);
+				if (placement.follow_rx
+					&& getsockopt(new_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) == 0)
+					rx_queue = tp.queueForCpu(cpu);
+				queue = rx_queue ? *rx_queue : next_queue++ % tp.queueCount();
+			}
+			if (fd_queues.size() <= size_t(new_fd))
+				fd_queues.resize(new_fd + 1);
+			fd_queues[new_fd] = queue;
+
+			uint32_t trace_id = Tracer::sampleConnection();
+			auto ctx = new_context(queue, new_fd, peer, trace_id);
+			ctx->conn_id = next_conn_id++;
+			ctx->capture = capture.get();
+			ctx->limiter = limiter.get();
+			ctx->tls_context = tls;
+			if (capture)
+				capture->open(ctx->conn_id);
+			{
+				std::lock_guard lock(contexts_mutex);
+				contexts[new_fd] = std::move(ctx);
+			}
+			if (tracing) {
+				if (trace_ids.size() <= size_t(new_fd))
+					trace_ids.resize(new_fd + 1);
+				trace_ids[new_fd] = trace_id;
+				if (trace_id)
+					Tracer::span("accept", accept_start, Tracer::now(), trace_id, new_fd);
+			}
+		}
+	};
+
+	for (;;) {
+		if (!drain_deadline && stop && stop->get().load())
+			start_draining();
+		if (drain_deadline
+			&& (open_connections.load() == 0 || Metrics::Clock::now() >= *drain_deadline))
+			break;
+
+		int n_fds = epoll_wait(epoll_fd, wait_events, max_events,
+							   drain_deadline ? drain_poll_ms : timeout_ms);
+		if (tracing)
+			Tracer::dumpIfRequested();
+
+		if (n_fds < 0)	// EINTR, most likely the stop signal
+			continue;
+
+		for (int i = 0; i < n_fds; i++) {
+			uint64_t data = wait_events[i].data.u64;
+			int fd = int(uint32_t(data));
+			if (data & follower_tag) {
+				serve_follower(fd);
+				continue;
+			}
+			if (handoff && fd == handoff->getSocket()) {
+				handoff->giveListener(socketfd, tls_socketfd);
+				if (handoff->getPeer() >= 0) {
+					struct epoll_event peer_ev = { EPOLLIN | EPOLLRDHUP,
+												   { .u64 = uint32_t(handoff->getPeer()) } };
+					epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handoff->getPeer(), &peer_ev);
+				}
+				continue;
+			}
+			if (handoff && fd == handoff->getPeer()) {
+				std::optional<bool> upgraded = handoff->upgradeResult();
+				if (upgraded == true) {
+					fprintf(stderr, "A new server took over, draining connections\n");
+					start_draining();
+				} else if (upgraded == false) {
+					fprintf(stderr, "The new server went away before taking over\n");
 				}
 				continue;
 			}
+			if (fd == socketfd || fd == tls_socketfd) {
+				accept_all(fd == socketfd ? *tcpServer : *tlsServer,
+						   fd == socketfd ? nullptr : tls_context.get());
+				continue;
+			}
 
-			tp.addTask([this, fd] { this->handle_connection(fd); });
+			uint64_t queued_at = 0;
+			if (tracing && size_t(fd) < trace_ids.size() && trace_ids[fd]) {
+				queued_at = Tracer::now();
+				Tracer::instant("enqueue", queued_at, trace_ids[fd], fd);
+			}
+			size_t queue = size_t(fd) < fd_queues.size() ? fd_queues[fd] : 0;
+			bool queued = tp.addTask([this, fd, queued_at] { handle_connection(fd, queued_at); },
+									 [this, fd] { reject_connection(fd); }, queue);
+			if (!queued) {
+				Metrics::add(Metrics::SHED_QUEUE_FULL);
+				reject_connection(fd);
+			}
 		}
 	}
 }
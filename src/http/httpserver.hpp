@@ -13,72 +13,255 @@
 #include <unordered_map>
 
 #include "httprequest.hpp"
+#include "accesslog.hpp"
+#include "arena.hpp"
+#include "bufferpool.hpp"
+#include "capture.hpp"
+#include "compression.hpp"
+#include "feeds.hpp"
+#include "handoff.hpp"
+#include "http2.hpp"
 #include "httpresponse.hpp"
+#include "metrics.hpp"
+#include "ratelimiter.hpp"
 #include "tcpserver.hpp"
 #include "threadpool.hpp"
+#include "tls.hpp"
+#include "topology.hpp"
+#include "tracer.hpp"
 
 class HttpServer {
    private:
-	enum State { METHOD, PATH, VERSION, HEADERS_KEY, HEADERS_VALUE, BODY, DONE };
+	friend struct ParserBench;	// bench/http.cpp drives get_request directly
+
+	enum State {
+		METHOD,
+		PATH,
+		VERSION,
+		HEADERS_KEY,
+		HEADERS_VALUE,
+		BODY,
+		CHUNK_SIZE,
+		CHUNK_DATA,
+		CHUNK_END,
+		CHUNK_TRAILER
+	};
 
 	struct ConnectionContext {	// Manages parsing in active connections
 		int fd;
+		struct sockaddr_storage peer;
 
+		// The request being parsed, its body and later its response live here. Reset once the
+		// response is sent, and kept with the context when it goes back to the pool
+		std::unique_ptr<Arena> arena;
 		State state = METHOD;
-		HttpRequest req;
+		std::optional<HttpRequest> req;
+		// Scratch for the parser. Global allocator, but cleared rather than freed, so after the
+		// first few requests they never need to grow
 		std::string temp_method, temp_path, temp_version;
 		std::string current_header_key, current_header_value;
-		static constexpr int buf_max = 512;
-		char buffer[buf_max];
-		std::string body;
+		// Taken from the BufferPool for a read and given back once the socket runs dry, so an
+		// idle connection holds none. Sized by readSize()
+		BufferPool::Buffer buffer;
+		size_t buf_pos = 0, buf_len = 0;  // Unparsed bytes are buffer.data()[buf_pos, buf_len)
+		std::pmr::string body;
 		size_t content_length = 0;
+		size_t chunk_remaining = 0;	 // Also counts trailer line length in CHUNK_TRAILER
+		bool chunked = false, chunk_extension = false;
+		bool expect_continue = false;
+		// Set for connections to the TLS port. The session is set up by the first worker to
+		// get the connection, the epoll thread never does TLS work
+		const TlsContext *tls_context = nullptr;
+		std::unique_ptr<TlsConnection> tls;
+		// Once the connection switched to HTTP/2, which then does all the parsing
+		std::unique_ptr<Http2Connection> h2;
+		// Once the connection is parked on a feed. The epoll thread serves it from then on
+		std::shared_ptr<Feeds::Follower> follower;
+		uint32_t trace_id = 0;	// Non zero if this connection was sampled for tracing
+		uint32_t conn_id = 0;
+		TrafficCapture *capture = nullptr;
+		uint64_t bytes_received = 0;
+		RateLimiter *limiter = nullptr;
+		// Set when the request line went over the client's limit, survive reset() so
+		// handle_connection can answer 429 instead of routing
+		uint32_t retry_after = 0;
+		bool close_after_response = false;
+		bool too_large = false;	 // Body over max_body, answered with a 413 and closed
+		// What it's waiting for in epoll. A drain queues the idle ones once more so they get
+		// closed, then there may be two tasks for it: the first to flip this to BUSY has it
+		enum Waiting : uint8_t { BUSY, IDLE, PARTIAL };	 // IDLE: between requests
+		std::atomic<uint8_t> waiting = IDLE;
 
-		ConnectionContext(int f) : fd(f)
+		ConnectionContext(int f, const struct sockaddr_storage &p, uint32_t t,
+						  std::unique_ptr<Arena> a = std::make_unique<Arena>())
+			: fd(f), peer(p), arena(std::move(a)), req(std::in_place, arena->get()),
+			  body(arena->get()), trace_id(t)
 		{
 		}
 
+		// How much the next read should take. The rest of a sized body, or twice as much as
+		// last time if that filled the buffer, a big upload or a pipelined batch is coming
+		size_t readSize() const
+		{
+			if (state == BODY)
+				return content_length - body.size();
+			if (buf_len == buffer.size())
+				return buffer.size() * 2;
+			return buffer.size();
+		}
+
 		void reset()  // To be called after each request is parsed
 		{
 			state = METHOD;
-			req = HttpRequest();
+			// New ones rather than cleared, which would keep buffers in the arena past its reset
+			req.emplace(arena->get());
+			std::pmr::string(arena->get()).swap(body);
 			temp_method.clear();
 			temp_path.clear();
 			temp_version.clear();
 			current_header_key.clear();
 			current_header_value.clear();
-			body.clear();
 			content_length = 0;
+			chunk_remaining = 0;
+			chunked = chunk_extension = false;
+			expect_continue = false;
 		}
 	};
 
 	std::optional<TCPServer> tcpServer;
-	std::unordered_map<std::string, std::function<HttpResponse(const HttpRequest &)>> endpoints;
-	std::vector<std::pair<std::string, std::function<HttpResponse(const HttpRequest &)>>>
-	  wildcard_endpoints;
+	std::optional<TCPServer> tlsServer;
+	std::unique_ptr<TlsContext> tls_context;
+	int inherited_tls_listener = -1;  // From the server we took over, for enableTls
+	struct Route {
+		std::function<HttpResponse(const HttpRequest &)> handler;
+		size_t metrics_id;
+	};
+	// Looked up by string_view, the request path is in the arena
+	struct RouteHash {
+		using is_transparent = void;
+		size_t operator()(std::string_view path) const { return std::hash<std::string_view>()(path); }
+	};
+	std::unordered_map<std::string, Route, RouteHash, std::equal_to<>> endpoints;
+	std::vector<std::pair<std::string, Route>> wildcard_endpoints;
+
+	// Free contexts, one pool per ThreadPool queue. They're first allocated by that queue's
+	// workers, so on NUMA hosts a connection's state sits on the node of the workers serving it
+	struct ContextPool {
+		std::mutex mutex;
+		std::vector<std::unique_ptr<ConnectionContext>> free;
+	};
+	std::vector<std::unique_ptr<ContextPool>> context_pools;
+	static constexpr size_t context_pool_prefill = 256, context_pool_max = 4096;
+	std::shared_ptr<ConnectionContext> new_context(size_t queue, int fd,
+												   const struct sockaddr_storage &peer,
+												   uint32_t trace_id);
 
 	// Map with the context for each fd, that way a thread can resume the parsing of a request that
 	// another thread started
 	std::unordered_map<int, std::shared_ptr<ConnectionContext>> contexts;
 	std::mutex contexts_mutex;	// unordered_map is not thread-safe
 
+	std::unique_ptr<AccessLog> access_log;
+	std::unique_ptr<TrafficCapture> capture;
+	std::unique_ptr<RateLimiter> limiter;
+	uint32_t next_conn_id = 0;	// Only touched by the epoll thread
+	std::vector<uint32_t> trace_ids;  // By fd, only touched by the epoll thread
+	std::vector<uint16_t> fd_queues;  // ThreadPool queue of each fd, same
+	size_t next_queue = 0;
+	Placement placement;
+
+	std::unique_ptr<Handoff> handoff;
+	// Once set the listener is gone, and connections are closed after their next response
+	std::atomic<bool> draining = false;
+	static constexpr int drain_timeout_s = 30;	// Then whatever is still open is dropped
+	static constexpr int drain_poll_ms = 100;
+
 	ThreadPool tp;
+	size_t max_connections = 0;	 // 0 for no limit
+	std::atomic<size_t> open_connections = 0;
 	int epoll_fd;
 	static constexpr int max_events = 10;
 	struct epoll_event wait_events[max_events];
 
-	void handle_connection(int fd);
-	static void send_response(int fd, const std::string &response);
+	static constexpr size_t compressed_cache_size = 64 << 20;
+	CompressionCache compressed_cache { compressed_cache_size };
+
+	void handle_connection(int fd, uint64_t queued_at);
+	// The response a request gets: the route's, or a 429, 404 or 500
+	static HttpResponse dispatch(const HttpRequest &request, const Route *route,
+								 uint32_t retry_after);
+	// Reads, answers and writes frames until the socket runs dry or the connection is done
+	void serve_h2(ConnectionContext &c);
+	void respond_h2(ConnectionContext &c, uint32_t stream, const HttpRequest &request,
+					uint32_t retry_after, Metrics::Clock::time_point start);
+	static constexpr size_t h2_read_size = 16 << 10;  // A whole frame, most of the time
+	// As far as the socket allows. False if the connection can't take requests yet, it was
+	// closed or is waiting for the client
+	bool tls_handshake(ConnectionContext &c, uint64_t trace_start);
+	void watch(int fd);	 // Back into epoll for the next read
+	// watch, marking the connection idle or not. False if it's idle and draining, the caller
+	// closes it then. True if it's watched, or the drain's task has it
+	bool wait_for_more(ConnectionContext &c, bool idle);
+	// Epoll data of parked followers, next to the fd. Their events are handled right away by the
+	// epoll thread instead of being queued
+	static constexpr uint64_t follower_tag = 1ULL << 32;
+	void park(ConnectionContext &c, const HttpResponse &response);
+	void serve_follower(int fd);
+	void close_connection(ConnectionContext &c);
+	void reject_connection(int fd);
+	const Route *find_route(std::string_view path) const;
+	void compress_response(const HttpRequest &req, HttpResponse &response);
+	static constexpr int send_timeout_ms = 30000;  // Max wait for a stalled client to read
+	static constexpr int trace_poll_ms = 500;	   // How late a SIGUSR2 trace dump can be
+	// Bodies of rate limited requests up to this size are read and dropped to keep the
+	// connection, bigger ones get the connection closed after the 429
+	static constexpr size_t rejected_body_max = 64 << 10;
+	// Bigger bodies get a 413 and the connection closed, without reading them
+	static constexpr size_t max_body = 64 << 20;
+	// Most of a declared Content-Length reserved up front, past that the body grows as it comes
+	static constexpr size_t body_reserve_max = 1 << 20;
+
+	static constexpr size_t tls_record_size = 16 << 10;	// The most plaintext a record can take
+	// Through OpenSSL, when the kernel isn't doing the encryption. False if the connection broke
+	static bool send_tls(ConnectionContext &c, const char *data, size_t size);
+	static void send_response_tls(ConnectionContext &c, const HttpResponse &response,
+								  const std::vector<struct iovec> &iov);
+	static void send_response(ConnectionContext &c, std::string_view response);
+	static void send_unavailable(int fd);
+	static void send_response(ConnectionContext &c, const HttpResponse &response,
+							  const std::string &head);
 	static std::optional<HttpRequest> get_request(ConnectionContext &c, bool &is_closed);
 
    public:
-	HttpServer(int port, std::optional<size_t> n_threads = std::nullopt);
+	// With a handoff_path, the listening socket is taken from the server running there if there
+	// is one (port is then ignored), and given to the next server that asks once serving
+	HttpServer(int port, std::optional<size_t> n_threads = std::nullopt,
+			   const std::string &handoff_path = "", const Placement &placement = {});
 	HttpServer(const HttpServer &) = delete;
 	HttpServer(HttpServer &&) noexcept;
 	auto &operator=(const HttpServer &) = delete;
 	auto &operator=(HttpServer &&) noexcept;
 	~HttpServer();
 
+	// Starts logging every request to path, as JSON lines. Throws if it can't be opened
+	void enableAccessLog(const std::string &path);
+	// Records all traffic to path for tools/replay. Throws if it can't be opened
+	void enableCapture(const std::string &path);
+	// Traces one in every sample_every connections, served at /debug/trace and dumped to a file
+	// on SIGUSR2
+	void enableTracing(unsigned sample_every);
+	// Limits how often each client (IPv4 address or IPv6 /64) can make read and write requests.
+	// Requests over the limit get a 429 before any routing or storage work
+	void enableRateLimit(RateLimiter::Limit read, RateLimiter::Limit write);
+	// Over max_connections new connections get a 503 and are closed, same for requests that
+	// find the queue full or wait in it too long (see ThreadPool::Limits). 0 means no limit
+	void setAdmissionLimits(size_t max_connections, ThreadPool::Limits queue);
+	// Also serves HTTPS on port, with the certificate (and chain) and key in PEM files. Throws
+	// if they can't be loaded. The port is ignored if the server we took over had TLS on
+	void enableTls(int port, const std::string &cert_path, const std::string &key_path);
 	void addEndpoint(const std::string &path, std::function<HttpResponse(const HttpRequest &)>);
-	void serve(std::optional<std::reference_wrapper<std::atomic<bool>>> = std::nullopt);
+	// Returns after stop is set, or another server took over, and the open connections were
+	// drained (for up to drain_timeout_s)
+	void serve(std::optional<std::reference_wrapper<std::atomic<bool>>> stop = std::nullopt);
 };
 #endif
@@ -0,0 +1,302 @@
+#include "metrics.hpp"
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+struct RouteMetrics {
+	std::array<std::atomic<uint64_t>, 5> by_class {};  // 1xx to 5xx
+	Metrics::Histogram latency;
+};
+
+// One per thread. Aligned so neighbouring blocks never share a cache line
+struct alignas(64) ThreadMetrics {
+	std::array<RouteMetrics, Metrics::max_routes> routes;
+	std::array<Metrics::Histogram, Metrics::N_PHASES> phases;
+	Metrics::Histogram queue_wait;
+	std::array<std::atomic<uint64_t>, Metrics::N_COUNTERS> counters {};
+};
+
+struct Registry {
+	std::mutex mutex;
+	std::deque<ThreadMetrics> threads;	// deque never moves its elements
+	std::vector<std::string> routes { "unmatched" };
+};
+
+Registry &registry()
+{
+	static Registry r;
+	return r;
+}
+
+ThreadMetrics &local()
+{
+	// Only the first record of each thread takes the lock
+	thread_local ThreadMetrics *mine = [] {
+		Registry &r = registry();
+		std::lock_guard lock(r.mutex);
+		return &r.threads.emplace_back();
+	}();
+	return *mine;
+}
+
+// Single writer, so a plain load and store is enough and keeps the bus lock off the hot path
+inline void bump(std::atomic<uint64_t> &counter, uint64_t n)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+struct HistogramTotals {
+	std::array<uint64_t, Metrics::Histogram::n_buckets> buckets {};
+	uint64_t sum_ns = 0;
+
+	void add(const Metrics::Histogram &h)
+	{
+		for (size_t i = 0; i < buckets.size(); i++)
+			buckets[i] += h.buckets[i].load(std::memory_order_relaxed);
+		sum_ns += h.sum_ns.load(std::memory_order_relaxed);
+	}
+
+	uint64_t count() const
+	{
+		uint64_t n = 0;
+		for (uint64_t b : buckets)
+			n += b;
+		return n;
+	}
+};
+
+std::string escape_label(const std::string &value)
+{
+	std::string out;
+	for (char c : value) {
+		if (c == '"' || c == '\\')
+			out += '\\';
+		out += c;
+	}
+	return out;
+}
+
+void write_histogram(std::string &out, const std::string &name, const std::string &labels,
+					 const HistogramTotals &h)
+{
+	std::string sep = labels.empty() ? "" : ",";
+	uint64_t cumulative = 0;
+	char bound[32];
+	// The last bucket catches everything above the others, it's the +Inf one
+	for (size_t i = 0; i + 1 < h.buckets.size(); i++) {
+		cumulative += h.buckets[i];
+		snprintf(bound, sizeof(bound), "%g", Metrics::Histogram::upperBoundSeconds(i));
+		out.append(name).append("_bucket{").append(labels).append(sep).append("le=\"");
+		out.append(bound).append("\"} ").append(std::to_string(cumulative)).append("\n");
+	}
+	out.append(name).append("_bucket{").append(labels).append(sep).append("le=\"+Inf\"} ");
+	out.append(std::to_string(h.count())).append("\n");
+
+	std::string braces = labels.empty() ? "" : "{" + labels + "}";
+	snprintf(bound, sizeof(bound), "%.9f", h.sum_ns / 1e9);
+	out.append(name).append("_sum").append(braces).append(" ").append(bound).append("\n");
+	out.append(name).append("_count").append(braces).append(" ");
+	out.append(std::to_string(h.count())).append("\n");
+}
+
+}  // namespace
+
+void Metrics::Histogram::record(uint64_t ns)
+{
+	bump(buckets[bucketFor(ns)], 1);
+	bump(sum_ns, ns);
+}
+
+size_t Metrics::Histogram::bucketFor(uint64_t ns)
+{
+	uint64_t v = ns >> 10;
+	if (v == 0)
+		return 0;
+	int msb = 63 - __builtin_clzll(v);
+	// Bucket 2 * msb is the lower half of [2^msb, 2^(msb + 1)), the next one the upper half
+	size_t bucket = msb == 0 ? 1 : 2 * msb + ((v >> (msb - 1)) & 1);
+	return bucket < n_buckets ? bucket : n_buckets - 1;
+}
+
+double Metrics::Histogram::upperBoundSeconds(size_t bucket)
+{
+	uint64_t units;
+	if (bucket < 2) {
+		units = bucket + 1;
+	} else {
+		uint64_t half = uint64_t(1) << (bucket / 2 - 1);
+		units = 2 * half + (bucket % 2 + 1) * half;
+	}
+	return units * 1024 / 1e9;
+}
+
+size_t Metrics::registerRoute(const std::string &name)
+{
+	Registry &r = registry();
+	std::lock_guard lock(r.mutex);
+	for (size_t i = 0; i < r.routes.size(); i++) {
+		if (r.routes[i] == name)
+			return i;
+	}
+	if (r.routes.size() == max_routes)
+		return unmatched_route;
+	r.routes.push_back(name);
+	return r.routes.size() - 1;
+}
+
+void Metrics::recordRequest(size_t route, int status, uint64_t ns)
+{
+	RouteMetrics &m = local().routes[route < max_routes ? route : unmatched_route];
+	int status_class = status / 100;
+	if (status_class >= 1 && status_class <= 5)
+		bump(m.by_class[status_class - 1], 1);
+	m.latency.record(ns);
+}
+
+void Metrics::recordPhase(Phase phase, uint64_t ns)
+{
+	local().phases[phase].record(ns);
+}
+
+void Metrics::recordQueueWait(uint64_t ns)
+{
+	local().queue_wait.record(ns);
+}
+
+void Metrics::add(Counter counter, uint64_t n)
+{
+	bump(local().counters[counter], n);
+}
+
+std::string Metrics::render()
+{
+	Registry &r = registry();
+	std::vector<std::string> routes;
+	std::vector<const ThreadMetrics *> threads;
+	{
+		std::lock_guard lock(r.mutex);
+		routes = r.routes;
+		for (const ThreadMetrics &t : r.threads)
+			threads.push_back(&t);
+	}
+
+	std::array<uint64_t, N_COUNTERS> counters {};
+	std::vector<std::array<uint64_t, 5>> by_class(routes.size());
+	std::vector<HistogramTotals> latency(routes.size());
+	std::array<HistogramTotals, N_PHASES> phases;
+	HistogramTotals queue_wait;
+
+	for (const ThreadMetrics *t : threads) {
+		for (size_t i = 0; i < N_COUNTERS; i++)
+			counters[i] += t->counters[i].load(std::memory_order_relaxed);
+		for (size_t route = 0; route < routes.size(); route++) {
+			for (size_t c = 0; c < 5; c++)
+				by_class[route][c] += t->routes[route].by_class[c].load(std::memory_order_relaxed);
+			latency[route].add(t->routes[route].latency);
+		}
+		for (size_t p = 0; p < N_PHASES; p++)
+			phases[p].add(t->phases[p]);
+		queue_wait.add(t->queue_wait);
+	}
+
+	std::string out;
+	out.reserve(32 << 10);
+
+	out.append("# TYPE posthaste_http_requests_total counter\n");
+	for (size_t route = 0; route < routes.size(); route++) {
+		for (size_t c = 0; c < 5; c++) {
+			if (!by_class[route][c])
+				continue;
+			out.append("posthaste_http_requests_total{route=\"").append(escape_label(routes[route]));
+			out.append("\",code=\"").append(std::to_string(c + 1)).append("xx\"} ");
+			out.append(std::to_string(by_class[route][c])).append("\n");
+		}
+	}
+
+	out.append("# TYPE posthaste_http_request_duration_seconds histogram\n");
+	for (size_t route = 0; route < routes.size(); route++) {
+		if (latency[route].count())
+			write_histogram(out, "posthaste_http_request_duration_seconds",
+							"route=\"" + escape_label(routes[route]) + "\"", latency[route]);
+	}
+
+	static constexpr const char *phase_names[N_PHASES] = { "parse", "handler", "serialize", "send" };
+	out.append("# TYPE posthaste_http_phase_duration_seconds histogram\n");
+	for (size_t p = 0; p < N_PHASES; p++)
+		write_histogram(out, "posthaste_http_phase_duration_seconds",
+						std::string("phase=\"") + phase_names[p] + "\"", phases[p]);
+
+	auto gauge = [&out](const char *name, const char *type, uint64_t value) {
+		out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+		out.append(name).append(" ").append(std::to_string(value)).append("\n");
+	};
+
+	// Opened and closed are counted by different threads, so a scrape can catch a close before
+	// the matching open. Clamp rather than wrap around
+	auto difference = [](uint64_t a, uint64_t b) { return a > b ? a - b : 0; };
+	gauge("posthaste_connections_active", "gauge",
+		  difference(counters[CONNECTIONS_OPENED], counters[CONNECTIONS_CLOSED]));
+	gauge("posthaste_connections_total", "counter", counters[CONNECTIONS_OPENED]);
+	gauge("posthaste_threadpool_queue_depth", "gauge",
+		  difference(counters[TASKS_QUEUED], counters[TASKS_STARTED]));
+	out.append("# TYPE posthaste_threadpool_wait_seconds histogram\n");
+	write_histogram(out, "posthaste_threadpool_wait_seconds", "", queue_wait);
+	gauge("posthaste_bytes_received_total", "counter", counters[BYTES_IN]);
+	gauge("posthaste_bytes_sent_total", "counter", counters[BYTES_OUT]);
+	gauge("posthaste_access_log_dropped_total", "counter", counters[ACCESS_LOG_DROPPED]);
+	gauge("posthaste_rate_limited_total", "counter", counters[RATE_LIMITED]);
+
+	out.append("# TYPE posthaste_shed_total counter\n");
+	out.append("posthaste_shed_total{reason=\"max_connections\"} ");
+	out.append(std::to_string(counters[SHED_CONNECTIONS])).append("\n");
+	out.append("posthaste_shed_total{reason=\"queue_full\"} ");
+	out.append(std::to_string(counters[SHED_QUEUE_FULL])).append("\n");
+	out.append("posthaste_shed_total{reason=\"queue_wait\"} ");
+	out.append(std::to_string(counters[SHED_QUEUE_WAIT])).append("\n");
+
+	out.append("# TYPE posthaste_tls_handshakes_total counter\n");
+	out.append("posthaste_tls_handshakes_total{result=\"full\"} ");
+	out.append(std::to_string(counters[TLS_FULL])).append("\n");
+	out.append("posthaste_tls_handshakes_total{result=\"resumed\"} ");
+	out.append(std::to_string(counters[TLS_RESUMED])).append("\n");
+	out.append("posthaste_tls_handshakes_total{result=\"failed\"} ");
+	out.append(std::to_string(counters[TLS_FAILED])).append("\n");
+	gauge("posthaste_tls_kernel_offload_total", "counter", counters[TLS_KERNEL]);
+
+	out.append("# TYPE posthaste_cluster_requests_total counter\n");
+	out.append("posthaste_cluster_requests_total{result=\"answered\"} ");
+	out.append(std::to_string(counters[CLUSTER_REQUESTS])).append("\n");
+	out.append("posthaste_cluster_requests_total{result=\"unreachable\"} ");
+	out.append(std::to_string(counters[CLUSTER_UNREACHABLE])).append("\n");
+	gauge("posthaste_cluster_replica_failures_total", "counter", counters[CLUSTER_REPLICA_FAILED]);
+
+	gauge("posthaste_followers_active", "gauge",
+		  difference(counters[FOLLOWERS_PARKED], counters[FOLLOWERS_LEFT]));
+	gauge("posthaste_followers_dropped_total", "counter", counters[FOLLOWERS_DROPPED]);
+
+	gauge("posthaste_searches_total", "counter", counters[SEARCHES]);
+	out.append("# TYPE posthaste_search_candidates_total counter\n");
+	out.append("posthaste_search_candidates_total{result=\"match\"} ");
+	out.append(std::to_string(counters[SEARCH_MATCHES])).append("\n");
+	out.append("posthaste_search_candidates_total{result=\"miss\"} ");
+	out.append(std::to_string(counters[SEARCH_MISSES])).append("\n");
+
+	out.append("# TYPE posthaste_storage_lookups_total counter\n");
+	out.append("posthaste_storage_lookups_total{result=\"hit\"} ");
+	out.append(std::to_string(counters[STORAGE_HITS])).append("\n");
+	out.append("posthaste_storage_lookups_total{result=\"miss\"} ");
+	out.append(std::to_string(counters[STORAGE_MISSES])).append("\n");
+
+	return out;
+}
+
+HttpResponse Metrics::endpoint(const HttpRequest &)
+{
+	HttpResponse response;
+	response.setBody(render());
+	response.setContentType("text/plain; version=0.0.4");
+	return response;
+}
@@ -0,0 +1,86 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include "httprequest.hpp"
+#include "httpresponse.hpp"
+
+// Process wide metrics, served in Prometheus text format by the built-in /metrics endpoint.
+//
+// Every thread records into its own block, so the hot path never touches a cache line another
+// thread writes to. The owner updates its counters with a relaxed load and store (no locked
+// read-modify-write), and a scrape sums the blocks of all threads that ever recorded anything
+class Metrics {
+   public:
+	enum Phase { PARSE, HANDLER, SERIALIZE, SEND, N_PHASES };
+	enum Counter {
+		BYTES_IN,
+		BYTES_OUT,
+		CONNECTIONS_OPENED,
+		CONNECTIONS_CLOSED,
+		TASKS_QUEUED,
+		TASKS_STARTED,
+		STORAGE_HITS,
+		STORAGE_MISSES,
+		ACCESS_LOG_DROPPED,
+		RATE_LIMITED,
+		SHED_CONNECTIONS,
+		SHED_QUEUE_FULL,
+		SHED_QUEUE_WAIT,
+		TLS_FULL,
+		TLS_RESUMED,
+		TLS_FAILED,
+		TLS_KERNEL,	 // Handshakes after which kTLS took over sending
+		CLUSTER_REQUESTS,  // Sent to other nodes and answered
+		CLUSTER_UNREACHABLE,
+		CLUSTER_REPLICA_FAILED,	 // Copies of new pastes that didn't make it to a replica
+		FOLLOWERS_PARKED,  // Connections that started following a feed
+		FOLLOWERS_LEFT,
+		FOLLOWERS_DROPPED,	// Fell too far behind, or their socket broke
+		SEARCHES,
+		SEARCH_MATCHES,	 // Candidates from the index that had the query
+		SEARCH_MISSES,	// And those that didn't
+		N_COUNTERS
+	};
+
+	static constexpr size_t max_routes = 32;
+	static constexpr size_t unmatched_route = 0;  // Requests no endpoint took (404s)
+
+	using Clock = std::chrono::steady_clock;
+
+	// Log-linear buckets, two per power of two starting at 1024 ns (~1 us) and going up to
+	// ~70 s. Bounded relative error like HdrHistogram, at a fraction of the size
+	struct Histogram {
+		static constexpr size_t n_buckets = 56;
+		std::array<std::atomic<uint64_t>, n_buckets> buckets {};
+		std::atomic<uint64_t> sum_ns = 0;
+
+		void record(uint64_t ns);  // Owner thread only
+		static size_t bucketFor(uint64_t ns);
+		static double upperBoundSeconds(size_t bucket);
+	};
+
+	// Returns the id to pass to recordRequest. Called from addEndpoint, before serving
+	static size_t registerRoute(const std::string &name);
+
+	static void recordRequest(size_t route, int status, uint64_t ns);
+	static void recordPhase(Phase phase, uint64_t ns);
+	static void recordQueueWait(uint64_t ns);
+	static void add(Counter counter, uint64_t n = 1);
+
+	static uint64_t since(Clock::time_point start)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count();
+	}
+
+	static std::string render();
+	static HttpResponse endpoint(const HttpRequest &);
+};
+
+#endif	// !METRICS_HPP
@@ -0,0 +1,94 @@
+#include "ratelimiter.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <endian.h>
+#include <netinet/in.h>
+
+static int64_t monotonic_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+			 std::chrono::steady_clock::now().time_since_epoch())
+	  .count();
+}
+
+// splitmix64's finalizer, addresses are anything but uniformly spread
+static uint64_t mix(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
+	return x ^ (x >> 31);
+}
+
+RateLimiter::RateLimiter(Limit read, Limit write)
+	: limits { read, write }, shards(std::make_unique<Shard[]>(n_shards))
+{
+	for (Limit &limit : limits)
+		limit.burst = std::max(limit.burst, 1.0);
+}
+
+RateLimiter::Kind RateLimiter::kindFor(std::string_view method)
+{
+	return method == "GET" || method == "HEAD" || method == "OPTIONS" ? READ : WRITE;
+}
+
+RateLimiter::Key RateLimiter::keyFor(const struct sockaddr_storage &peer)
+{
+	uint32_t v4;
+	if (peer.ss_family == AF_INET6) {
+		const auto *in6 = reinterpret_cast<const struct sockaddr_in6 *>(&peer);
+		if (!IN6_IS_ADDR_V4MAPPED(&in6->sin6_addr)) {
+			uint64_t prefix;
+			memcpy(&prefix, in6->sin6_addr.s6_addr, sizeof(prefix));
+			return { be64toh(prefix), true };
+		}
+		memcpy(&v4, in6->sin6_addr.s6_addr + 12, sizeof(v4));
+	} else {
+		v4 = reinterpret_cast<const struct sockaddr_in *>(&peer)->sin_addr.s_addr;
+	}
+	return { ntohl(v4), false };  // A mapped address is the same client as the plain one
+}
+
+uint32_t RateLimiter::acquire(const struct sockaddr_storage &peer, Kind kind)
+{
+	const Limit &limit = limits[kind];
+	if (limit.rate <= 0)
+		return 0;
+
+	Key key = keyFor(peer);
+	uint64_t h = mix(key.address) ^ key.v6;
+	Shard &shard = shards[h % n_shards];
+	Entry *set = &shard.entries[(h / n_shards) % sets_per_shard * ways];
+	int64_t now = monotonic_ns();
+
+	std::lock_guard lock(shard.mutex);
+	Entry *entry = nullptr, *oldest = set;
+	for (Entry *e = set; e != set + ways; e++) {
+		if (e->last_ns && e->key == key) {
+			entry = e;
+			break;
+		}
+		if (e->last_ns < oldest->last_ns)
+			oldest = e;
+	}
+
+	if (!entry) {  // New (or evicted and back), starts with full buckets
+		entry = oldest;
+		entry->key = key;
+		for (size_t i = 0; i < N_KINDS; i++)
+			entry->tokens[i] = limits[i].burst;
+	} else {
+		double elapsed = (now - entry->last_ns) / 1e9;
+		for (size_t i = 0; i < N_KINDS; i++)
+			entry->tokens[i] = std::min(limits[i].burst, entry->tokens[i] + elapsed * limits[i].rate);
+	}
+	entry->last_ns = now;
+
+	float &tokens = entry->tokens[kind];
+	if (tokens >= 1) {
+		tokens -= 1;
+		return 0;
+	}
+	return std::max<uint32_t>(1, std::ceil((1 - tokens) / limit.rate));
+}
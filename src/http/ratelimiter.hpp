@@ -0,0 +1,62 @@
+#ifndef RATELIMITER_HPP
+#define RATELIMITER_HPP
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/socket.h>
+
+// Per-client token buckets, one for reads and one for writes. IPv4 clients are keyed by their
+// address and IPv6 ones by their /64, since a single host usually has a whole /64 to pick
+// addresses from.
+//
+// The table never grows, so a flood of distinct addresses can't eat memory: it's split in shards
+// with a lock each, a key hashes to one set of `ways` slots in a shard, and when the set is full
+// the entry seen longest ago gets evicted (approximate LRU). An evicted client comes back with
+// full buckets, which only matters when more than `ways` busy clients share a set
+class RateLimiter {
+   public:
+	enum Kind { READ, WRITE, N_KINDS };
+	struct Limit {
+		double rate = 0;   // Tokens per second, 0 for no limit
+		double burst = 1;  // Bucket size
+	};
+
+	RateLimiter(Limit read, Limit write);
+	RateLimiter(const RateLimiter &) = delete;
+	RateLimiter &operator=(const RateLimiter &) = delete;
+
+	// 0 if the request can go on, otherwise the seconds until it would be allowed
+	uint32_t acquire(const struct sockaddr_storage &peer, Kind kind);
+
+	static Kind kindFor(std::string_view method);
+
+   private:
+	static constexpr size_t n_shards = 64, sets_per_shard = 256, ways = 8;	// 128K clients
+
+	// The family is kept apart, a /64 can be any 64 bits, IPv4 addresses included
+	struct Key {
+		uint64_t address;  // IPv4 address, or IPv6 /64 prefix
+		bool v6;
+		bool operator==(const Key &) const = default;
+	};
+	struct Entry {
+		Key key;
+		int64_t last_ns = 0;  // 0 for an empty slot
+		float tokens[N_KINDS];
+	};
+	struct alignas(64) Shard {
+		std::mutex mutex;
+		std::array<Entry, sets_per_shard * ways> entries;
+	};
+
+	std::array<Limit, N_KINDS> limits;
+	std::unique_ptr<Shard[]> shards;
+
+	static Key keyFor(const struct sockaddr_storage &peer);
+};
+
+#endif	// !RATELIMITER_HPP
@@ -1,6 +1,7 @@
 #include "tcpserver.hpp"
 #include <arpa/inet.h>
 #include <cstdio>
+#include <fcntl.h>
 #include <iostream>
 #include <sys/socket.h>
 #include <unistd.h>
@@ -28,6 +29,19 @@ TCPServer::TCPServer(const std::string &ipAddress, int port) : port(port), serve
 	}
 }
 
+TCPServer::TCPServer(int listeningSocket) : serverSocket(listeningSocket)
+{
+	socklen_t len = sizeof(socketAddress);
+	if (getsockname(serverSocket, (struct sockaddr *)&socketAddress, &len) < 0
+		|| socketAddress.sin_family != AF_INET) {
+		exitWithError("Inherited socket is not an IPv4 listener");
+	}
+	port = ntohs(socketAddress.sin_port);
+
+	int flags = fcntl(serverSocket, F_GETFL, 0);
+	fcntl(serverSocket, F_SETFL, flags | O_NONBLOCK);
+}
+
 TCPServer::TCPServer(TCPServer &&s)
 {
 	socketAddress = std::exchange(s.socketAddress, { 0, 0, 0, 0 });
@@ -67,17 +81,20 @@ void TCPServer::startServer()
 		perror("bind");
 		exitWithError("Failed to bind.");
 	}
-	if (listen(serverSocket, 5) < 0) {
+	if (listen(serverSocket, SOMAXCONN) < 0) {
 		perror("listen");
 		exitWithError("Failed to listen");
 	}
 }
 
-int TCPServer::acceptConnection()
+int TCPServer::acceptConnection(struct sockaddr_storage *peer)
 {
-	struct sockaddr_in clientAddr;
+	struct sockaddr_storage clientAddr;
 	socklen_t clientAddrLen = sizeof(clientAddr);
-	return accept(this->serverSocket, (struct sockaddr *)&clientAddr, &clientAddrLen);
+	int fd = accept(this->serverSocket, (struct sockaddr *)&clientAddr, &clientAddrLen);
+	if (fd >= 0 && peer)
+		*peer = clientAddr;
+	return fd;
 }
 
 int TCPServer::getSocket()
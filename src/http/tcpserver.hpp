@@ -15,6 +15,8 @@ class TCPServer {
 
    public:
 	TCPServer(const std::string &ipAddress, int port);
+	// Adopts a socket that is already listening, e.g. one handed over by a previous server
+	explicit TCPServer(int listeningSocket);
 	TCPServer(const TCPServer &) = delete;
 	TCPServer(TCPServer &&s);
 	auto &operator=(const TCPServer &) = delete;
@@ -22,7 +24,8 @@ class TCPServer {
 	~TCPServer();
 
 	void startServer();
-	int acceptConnection();
+	// peer, if given, receives the client address
+	int acceptConnection(struct sockaddr_storage *peer = nullptr);
 	int getSocket();
 	void closeClient(int clientSocket);
 };
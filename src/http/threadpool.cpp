@@ -1,36 +1,76 @@
 #include "threadpool.hpp"
+#include "bufferpool.hpp"
+#include "metrics.hpp"
+#include "topology.hpp"
+#include "tracer.hpp"
+#include <cstdio>
 #include <functional>
 #include <mutex>
 #include <optional>
 #include <thread>
 #include <utility>
 
-ThreadPool::ThreadPool(std::optional<size_t> n_threads)
+ThreadPool::ThreadPool(std::optional<size_t> n_threads, const std::vector<int> &cpus)
 {
 	if (!n_threads) {
 		n_threads = std::thread::hardware_concurrency();
 	}
+
+	// Which queue each worker takes tasks from
+	std::vector<size_t> worker_queue(*n_threads, 0);
+	queues.push_back(std::make_unique<Queue>());
+	if (!cpus.empty()) {
+		queues[0]->node = Topology::nodeOf(cpus[0]);
+		for (size_t i = 0; i < n_threads; i++) {
+			int node = Topology::nodeOf(cpus[i % cpus.size()]);
+			std::optional<size_t> queue = queueForCpu(cpus[i % cpus.size()]);
+			if (!queue) {
+				queue = queues.size();
+				queues.push_back(std::make_unique<Queue>());
+				queues.back()->node = node;
+			}
+			worker_queue[i] = *queue;
+		}
+	}
+
 	for (size_t i = 0; i < n_threads; i++) {
-		threads.emplace_back([this] {
+		Queue &queue = *queues[worker_queue[i]];
+		threads.emplace_back([this, i, &queue, cpus] {
+			// First thing, so everything this thread allocates is on its node
+			if (!cpus.empty() && !Topology::pinCurrentThread({ cpus[i % cpus.size()] }))
+				fprintf(stderr, "Could not pin worker %zu to CPU %d\n", i, cpus[i % cpus.size()]);
+			BufferPool::setNode(queue.node);
+			Tracer::nameThread("worker " + std::to_string(i));
 			for (;;) {
-				std::function<void()> task;
+				Task task;
+				bool drained;
 
 				{
 					// This waits until the mutex is up (RAII). Which is why we have this context
-					std::unique_lock lock(queue_mutex);
+					std::unique_lock lock(queue.mutex);
 
 					// This releases the mutex again, and waits until notification and predicate,
 					// then waits for the mutex again
-					cv.wait(lock, [this] { return !tasks.empty() || stop; });
+					queue.cv.wait(lock, [this, &queue] { return !queue.tasks.empty() || stop; });
 
-					if (stop && tasks.empty())
+					if (stop && queue.tasks.empty())
 						return;
 
-					task = std::move(tasks.front());
-					tasks.pop();
+					task = std::move(queue.tasks.front());
+					queue.tasks.pop();
+					drained = queue.tasks.empty();
+				}
+				// Here we have released the queue mutex
+				Clock::time_point now = Clock::now();
+				Clock::duration waited = now - task.queued_at;
+				Metrics::add(Metrics::TASKS_STARTED);
+				Metrics::recordQueueWait(std::chrono::nanoseconds(waited).count());
+				if (shouldShed(queue, now, waited, drained) && task.shed) {
+					Metrics::add(Metrics::SHED_QUEUE_WAIT);
+					task.shed();
+				} else {
+					task.run();
 				}
-				// Here we have released the queue_mutex
-				task();
 			}
 		});
 	}
@@ -38,22 +78,58 @@ ThreadPool::ThreadPool(std::optional<size_t> n_threads)
 
 ThreadPool::~ThreadPool()
 {
-	{
-		std::unique_lock lock(queue_mutex);
+	for (auto &queue : queues) {
+		std::unique_lock lock(queue->mutex);
 		stop = true;
 	}
-	cv.notify_all();
+	for (auto &queue : queues)
+		queue->cv.notify_all();
 
 	for (std::thread &thread : threads) {
 		thread.join();
 	}
 }
 
-void ThreadPool::addTask(std::function<void()> task)
+std::optional<size_t> ThreadPool::queueForCpu(int cpu) const
+{
+	int node = Topology::nodeOf(cpu);
+	for (size_t i = 0; i < queues.size(); i++) {
+		if (queues[i]->node == node)
+			return i;
+	}
+	return std::nullopt;
+}
+
+void ThreadPool::setLimits(Limits l)
+{
+	limits = l;
+}
+
+bool ThreadPool::shouldShed(Queue &queue, Clock::time_point now, Clock::duration waited,
+							bool drained)
+{
+	if (limits.max_wait.count() == 0)
+		return false;
+	if (waited < codel_target || drained) {
+		queue.last_below_target.store(now.time_since_epoch().count(), std::memory_order_relaxed);
+		return false;
+	}
+	Clock::time_point below(
+	  Clock::duration(queue.last_below_target.load(std::memory_order_relaxed)));
+	bool standing = now - below > codel_interval;
+	return waited > (standing ? Clock::duration(codel_target) : Clock::duration(limits.max_wait));
+}
+
+bool ThreadPool::addTask(std::function<void()> task, std::function<void()> shed, size_t queue)
 {
+	Queue &q = *queues[queue < queues.size() ? queue : 0];
 	{
-		std::unique_lock lock(queue_mutex);
-		tasks.push(task);
+		std::unique_lock lock(q.mutex);
+		if (limits.max_queued && q.tasks.size() >= limits.max_queued)
+			return false;
+		q.tasks.push({ std::move(task), std::move(shed), Clock::now() });
 	}
-	cv.notify_one();
+	Metrics::add(Metrics::TASKS_QUEUED);
+	q.cv.notify_one();
+	return true;
 }
@@ -1,7 +1,10 @@
 #ifndef THREADPOOL_HPP
 #define THREADPOOL_HPP
 
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <queue>
@@ -11,23 +14,61 @@
 #include <condition_variable>
 
 class ThreadPool {
+   public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Limits {
+		size_t max_queued = 0;				  // Per queue, 0 for no limit
+		std::chrono::milliseconds max_wait {};	// 0 for no limit (and no CoDel)
+	};
+
    private:
-	std::queue<std::function<void()>> tasks;
+	struct Task {
+		std::function<void()> run, shed;
+		Clock::time_point queued_at;  // For the queue wait metric and shedding
+	};
+	// One per NUMA node the workers are pinned to (just one if they aren't), so a connection
+	// always lands on workers of the same node and its memory stays local to them
+	struct alignas(64) Queue {
+		std::queue<Task> tasks;
+		std::mutex mutex;
+		std::condition_variable cv;
+		int node = 0;
+		// CoDel's, below. Each queue stands or drains on its own
+		std::atomic<Clock::rep> last_below_target { Clock::now().time_since_epoch().count() };
+	};
+	std::vector<std::unique_ptr<Queue>> queues;
 	std::vector<std::thread> threads;
 
-	std::mutex queue_mutex;
-	std::condition_variable cv;
+	bool stop = false;	// Read under each queue's mutex
 
-	bool stop = false;
+	// CoDel, the way it's done for server queues: a queue that drains now and then is fine and
+	// tasks may wait up to max_wait. Once the wait hasn't dropped below codel_target for a whole
+	// codel_interval the queue is standing, and anything that waited over codel_target is shed
+	// until it drains again. Old tasks are the ones whose clients gave up or soon will
+	static constexpr std::chrono::milliseconds codel_target { 5 }, codel_interval { 100 };
+	Limits limits;
+
+	bool shouldShed(Queue &queue, Clock::time_point now, Clock::duration waited, bool drained);
 
    public:
-	ThreadPool(std::optional<size_t> n_threads = std::nullopt);
+	// With cpus, worker i is pinned to cpus[i % cpus.size()]
+	ThreadPool(std::optional<size_t> n_threads = std::nullopt, const std::vector<int> &cpus = {});
 	~ThreadPool();
 	ThreadPool(const ThreadPool &) = delete;
 	ThreadPool(ThreadPool &&) = delete;
 	ThreadPool &operator=(const ThreadPool &) = delete;
 	ThreadPool &operator=(ThreadPool &&) = delete;
 
-	void addTask(std::function<void()>);
+	// Before adding any task
+	void setLimits(Limits l);
+	// False (and task dropped) if the queue is full. If the task waits too long in the queue,
+	// shed runs instead of it, or it runs anyway if there's no shed
+	bool addTask(std::function<void()> task, std::function<void()> shed = nullptr,
+				 size_t queue = 0);
+
+	size_t queueCount() const { return queues.size(); }
+	// The queue whose workers are on cpu's node, nullopt if there's none
+	std::optional<size_t> queueForCpu(int cpu) const;
 };
 #endif	// !THREADPOOL_HPP
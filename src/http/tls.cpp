@@ -0,0 +1,175 @@
+#include "tls.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <new>
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <stdexcept>
+
+// With OpenSSL's error queue, which is then cleared
+static std::runtime_error ssl_error(const std::string &what)
+{
+	char reason[256] = "unknown error";
+	if (unsigned long e = ERR_get_error())
+		ERR_error_string_n(e, reason, sizeof(reason));
+	ERR_clear_error();
+	return std::runtime_error(what + ": " + reason);
+}
+
+// ALPN, in our order of preference. No protocol in common is no ALPN at all rather than a
+// failed handshake, the client can still try HTTP/1.1
+static int select_protocol(SSL *, const unsigned char **out, unsigned char *out_len,
+						   const unsigned char *offered, unsigned int offered_len, void *)
+{
+	static const unsigned char supported[] = "\x02h2\x08http/1.1";
+	unsigned char *selected;
+	if (SSL_select_next_proto(&selected, out_len, supported, sizeof(supported) - 1, offered,
+							  offered_len)
+		!= OPENSSL_NPN_NEGOTIATED)
+		return SSL_TLSEXT_ERR_NOACK;
+	*out = selected;
+	return SSL_TLSEXT_ERR_OK;
+}
+
+TlsContext::TlsContext(const std::string &cert_path, const std::string &key_path)
+{
+	ctx = SSL_CTX_new(TLS_server_method());
+	if (!ctx)
+		throw ssl_error("SSL_CTX_new");
+	auto fail = [this](const std::string &what) {
+		std::runtime_error error = ssl_error(what);
+		SSL_CTX_free(ctx);
+		return error;
+	};
+
+	if (SSL_CTX_use_certificate_chain_file(ctx, cert_path.c_str()) != 1)
+		throw fail("Loading certificate " + cert_path);
+	if (SSL_CTX_use_PrivateKey_file(ctx, key_path.c_str(), SSL_FILETYPE_PEM) != 1)
+		throw fail("Loading key " + key_path);
+	if (SSL_CTX_check_private_key(ctx) != 1)
+		throw fail("Key " + key_path + " doesn't match " + cert_path);
+
+	SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+	// An EOF without close_notify is just a closed connection, most clients don't bother
+	uint64_t options = SSL_OP_NO_RENEGOTIATION | SSL_OP_IGNORE_UNEXPECTED_EOF;
+#ifdef SSL_OP_ENABLE_KTLS
+	options |= SSL_OP_ENABLE_KTLS;
+#endif
+	SSL_CTX_set_options(ctx, options);
+	// Partial writes like send(), and no read and write buffers kept for idle connections
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER
+							| SSL_MODE_RELEASE_BUFFERS);
+
+	// Resumption both ways: session IDs from a server side cache (TLS 1.2), and tickets, which
+	// are on by default and need nothing stored here
+	static const unsigned char session_context[] = "posthaste";
+	SSL_CTX_set_session_id_context(ctx, session_context, sizeof(session_context) - 1);
+	SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+	SSL_CTX_sess_set_cache_size(ctx, session_cache_size);
+	SSL_CTX_set_timeout(ctx, session_timeout_s);
+
+	SSL_CTX_set_alpn_select_cb(ctx, select_protocol, nullptr);
+}
+
+TlsContext::~TlsContext()
+{
+	SSL_CTX_free(ctx);
+}
+
+std::unique_ptr<TlsConnection> TlsContext::accept(int fd) const
+{
+	return std::make_unique<TlsConnection>(ctx, fd);
+}
+
+bool TlsContext::kernelTlsBuilt()
+{
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS)
+	return true;
+#else
+	return false;
+#endif
+}
+
+TlsConnection::TlsConnection(ssl_ctx_st *ctx, int fd) : ssl(SSL_new(ctx))
+{
+	if (!ssl)
+		throw std::bad_alloc();
+	// A socket BIO, the only kind kTLS works with
+	SSL_set_fd(ssl, fd);
+	SSL_set_accept_state(ssl);
+}
+
+TlsConnection::~TlsConnection()
+{
+	SSL_free(ssl);
+}
+
+TlsConnection::Handshake TlsConnection::handshake()
+{
+	ERR_clear_error();
+	int r = SSL_do_handshake(ssl);
+	if (r == 1) {
+		established = true;
+		kernel_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+		return DONE;
+	}
+	switch (SSL_get_error(ssl, r)) {
+	case SSL_ERROR_WANT_READ: return WANT_READ;
+	case SSL_ERROR_WANT_WRITE: return WANT_WRITE;
+	default: ERR_clear_error(); return FAILED;
+	}
+}
+
+bool TlsConnection::isResumed() const
+{
+	return SSL_session_reused(ssl) == 1;
+}
+
+std::string_view TlsConnection::protocol() const
+{
+	const unsigned char *name = nullptr;
+	unsigned int size = 0;
+	SSL_get0_alpn_selected(ssl, &name, &size);
+	return std::string_view(reinterpret_cast<const char *>(name), size);
+}
+
+// The errno a recv or send would have left for what SSL_read or SSL_write returned
+static ssize_t io_result(SSL *ssl, int r)
+{
+	if (r > 0)
+		return r;
+	int error = SSL_get_error(ssl, r);
+	ERR_clear_error();
+	switch (error) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE: errno = EAGAIN; return -1;
+	case SSL_ERROR_ZERO_RETURN: return 0;
+	case SSL_ERROR_SYSCALL:
+		if (errno == 0 || errno == EAGAIN)
+			errno = ECONNRESET;
+		return -1;
+	default: errno = EPROTO; return -1;
+	}
+}
+
+ssize_t TlsConnection::read(char *buf, size_t len)
+{
+	ERR_clear_error();
+	errno = 0;
+	return io_result(ssl, SSL_read(ssl, buf, std::min<size_t>(len, INT_MAX)));
+}
+
+ssize_t TlsConnection::write(const char *buf, size_t len)
+{
+	ERR_clear_error();
+	errno = 0;
+	return io_result(ssl, SSL_write(ssl, buf, std::min<size_t>(len, INT_MAX)));
+}
+
+void TlsConnection::shutdown()
+{
+	if (established)
+		SSL_shutdown(ssl);
+	ERR_clear_error();
+}
@@ -0,0 +1,69 @@
+#ifndef TLS_HPP
+#define TLS_HPP
+
+#include <memory>
+#include <string>
+#include <string_view>
+#include <sys/types.h>
+
+// OpenSSL's, declared here so the rest of the server doesn't pull in its headers
+struct ssl_st;
+struct ssl_ctx_st;
+
+// One TLS connection over a non-blocking socket. read and write work like recv and send: -1
+// with errno EAGAIN when the socket isn't ready, 0 once the peer closed.
+//
+// Once the handshake is done OpenSSL hands the keys to the kernel (kTLS) if it can. Then what
+// we send is encrypted by the kernel, and plain send, sendmsg and sendfile on the socket work
+// as they do for a plain connection. Reads always go through OpenSSL, which reads through kTLS
+// as well when the kernel took the receiving side too
+class TlsConnection {
+   public:
+	enum Handshake { DONE, WANT_READ, WANT_WRITE, FAILED };
+
+   private:
+	ssl_st *ssl;
+	bool established = false;
+	bool kernel_send = false;
+
+   public:
+	TlsConnection(ssl_ctx_st *ctx, int fd);
+	TlsConnection(const TlsConnection &) = delete;
+	TlsConnection &operator=(const TlsConnection &) = delete;
+	~TlsConnection();
+
+	// Call again after WANT_READ or WANT_WRITE once the socket is ready
+	Handshake handshake();
+	bool isEstablished() const { return established; }
+	bool isResumed() const;
+	// What we send can skip OpenSSL and go straight to the socket
+	bool kernelSend() const { return kernel_send; }
+	// What ALPN settled on, "h2" or "http/1.1". Empty if the client didn't ask
+	std::string_view protocol() const;
+
+	ssize_t read(char *buf, size_t len);
+	ssize_t write(const char *buf, size_t len);
+	void shutdown();  // Sends close_notify if the socket takes it right away, never waits
+};
+
+class TlsContext {
+   private:
+	ssl_ctx_st *ctx;
+
+   public:
+	static constexpr long session_cache_size = 20000;
+	static constexpr long session_timeout_s = 2 * 60 * 60;
+
+	// PEM files, the certificate may be followed by its chain. Throws if they can't be used.
+	// Clients that offer HTTP/2 through ALPN get it
+	TlsContext(const std::string &cert_path, const std::string &key_path);
+	TlsContext(const TlsContext &) = delete;
+	TlsContext &operator=(const TlsContext &) = delete;
+	~TlsContext();
+
+	std::unique_ptr<TlsConnection> accept(int fd) const;
+	// Whether this OpenSSL can hand connections to kTLS at all, the kernel may still refuse
+	static bool kernelTlsBuilt();
+};
+
+#endif	// !TLS_HPP
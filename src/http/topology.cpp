@@ -0,0 +1,157 @@
+#include "topology.hpp"
+#include <algorithm>
+#include <charconv>
+#include <fstream>
+#include <map>
+#include <pthread.h>
+#include <sched.h>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+
+namespace {
+
+struct Nodes {
+	std::map<int, std::vector<int>> cpus;  // By node
+	std::map<int, int> node_of;			   // By CPU
+
+	Nodes()
+	{
+		std::ifstream online("/sys/devices/system/node/online");
+		std::string list;
+		if (online && std::getline(online, list)) {
+			for (int node : Topology::parseCpuList(list)) {	 // Same format as CPU lists
+				std::ifstream file("/sys/devices/system/node/node" + std::to_string(node)
+								   + "/cpulist");
+				std::string node_cpus;
+				if (!std::getline(file, node_cpus) || node_cpus.empty())  // Memory only node
+					continue;
+				cpus[node] = Topology::parseCpuList(node_cpus);
+				for (int cpu : cpus[node])
+					node_of[cpu] = node;
+			}
+		}
+		if (cpus.empty()) {
+			for (unsigned cpu = 0; cpu < std::thread::hardware_concurrency(); cpu++) {
+				cpus[0].push_back(cpu);
+				node_of[cpu] = 0;
+			}
+		}
+	}
+};
+
+const Nodes &nodes()
+{
+	static const Nodes n;
+	return n;
+}
+
+}  // namespace
+
+int Topology::nodeOf(int cpu)
+{
+	auto it = nodes().node_of.find(cpu);
+	return it == nodes().node_of.end() ? 0 : it->second;
+}
+
+size_t Topology::nodeCount()
+{
+	return nodes().cpus.size();
+}
+
+std::vector<int> Topology::cpusOf(int node)
+{
+	auto it = nodes().cpus.find(node);
+	return it == nodes().cpus.end() ? std::vector<int>() : it->second;
+}
+
+std::vector<int> Topology::parseCpuList(const std::string &list)
+{
+	auto number = [&list](std::string_view text) {
+		int n;
+		auto [ptr, ec] = std::from_chars(text.data(), text.data() + text.size(), n);
+		if (text.empty() || ec != std::errc() || ptr != text.data() + text.size() || n < 0
+			|| n >= CPU_SETSIZE)
+			throw std::invalid_argument("bad CPU list: " + list);
+		return n;
+	};
+
+	std::vector<int> cpus;
+	std::string_view rest(list);
+	while (!rest.empty()) {
+		size_t comma = rest.find(',');
+		std::string_view range = rest.substr(0, comma);
+		rest = comma == std::string_view::npos ? "" : rest.substr(comma + 1);
+
+		size_t dash = range.find('-');
+		int first = number(range.substr(0, dash));
+		int last = dash == std::string_view::npos ? first : number(range.substr(dash + 1));
+		if (last < first)
+			throw std::invalid_argument("bad CPU list: " + list);
+		for (int cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+std::string Topology::formatCpuList(std::vector<int> cpus)
+{
+	std::sort(cpus.begin(), cpus.end());
+	cpus.erase(std::unique(cpus.begin(), cpus.end()), cpus.end());
+	std::string out;
+	for (size_t i = 0; i < cpus.size();) {
+		size_t j = i;
+		while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1)
+			j++;
+		if (!out.empty())
+			out += ',';
+		out += std::to_string(cpus[i]);
+		if (j > i)
+			out += '-' + std::to_string(cpus[j]);
+		i = j + 1;
+	}
+	return out;
+}
+
+bool Topology::pinCurrentThread(const std::vector<int> &cpus)
+{
+	if (cpus.empty())
+		return true;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (int cpu : cpus)
+		CPU_SET(cpu, &set);
+	return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+}
+
+std::string Topology::describe(const Placement &placement, size_t n_workers)
+{
+	std::string out;
+	for (const auto &[node, cpus] : nodes().cpus) {
+		out.append("Node ").append(std::to_string(node));
+		out.append(": CPUs ").append(formatCpuList(cpus)).append("\n");
+	}
+
+	if (placement.worker_cpus.empty()) {
+		out.append(std::to_string(n_workers)).append(" workers, not pinned\n");
+	} else {
+		std::map<int, std::vector<int>> used;  // CPUs taken by workers, by node
+		for (size_t i = 0; i < n_workers; i++) {
+			int cpu = placement.worker_cpus[i % placement.worker_cpus.size()];
+			used[nodeOf(cpu)].push_back(cpu);
+		}
+		out.append(std::to_string(n_workers)).append(" workers pinned to");
+		for (const auto &[node, cpus] : used)
+			out.append(" ").append(formatCpuList(cpus)).append(" (node ").append(std::to_string(node))
+			  .append(")");
+		out += used.size() > 1 ? ", one queue per node\n" : "\n";
+	}
+	out += "Epoll thread: ";
+	if (placement.epoll_cpus.empty())
+		out += "not pinned";
+	else
+		out.append("CPUs ").append(formatCpuList(placement.epoll_cpus));
+	if (placement.follow_rx)
+		out += ", connections follow their RX CPU";
+	return out;
+}
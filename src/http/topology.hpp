@@ -0,0 +1,36 @@
+#ifndef TOPOLOGY_HPP
+#define TOPOLOGY_HPP
+
+#include <string>
+#include <vector>
+
+// Where threads run. Everything per thread (metrics blocks, log and trace rings, malloc arenas)
+// is allocated by its own thread the first time it's needed, so once a thread is pinned the
+// kernel's first-touch policy already puts that memory on its NUMA node. No libnuma needed
+struct Placement {
+	std::vector<int> worker_cpus;  // Worker i runs on worker_cpus[i % size], empty for anywhere
+	std::vector<int> epoll_cpus;   // The thread calling serve, empty for anywhere
+	// Hand connections to the workers on the node of the CPU their packets arrive on
+	// (SO_INCOMING_CPU), so they line up with the NIC's RX queues. Otherwise round robin
+	bool follow_rx = false;
+};
+
+// CPUs and NUMA nodes, read once from sysfs. A machine without NUMA info is one node
+class Topology {
+   public:
+	static int nodeOf(int cpu);
+	static size_t nodeCount();
+	static std::vector<int> cpusOf(int node);
+
+	// "0-3,8,10-11" and back. Throws std::invalid_argument on garbage
+	static std::vector<int> parseCpuList(const std::string &list);
+	static std::string formatCpuList(std::vector<int> cpus);
+
+	// False if the kernel refused (e.g. CPUs outside our cpuset)
+	static bool pinCurrentThread(const std::vector<int> &cpus);
+
+	// Nodes with their CPUs, then where workers and the epoll thread go, for the startup banner
+	static std::string describe(const Placement &placement, size_t n_workers);
+};
+
+#endif	// !TOPOLOGY_HPP
@@ -0,0 +1,217 @@
+#include "tracer.hpp"
+#include <array>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+struct Event {
+	const char *name;
+	uint64_t start, end;  // end == 0 for instant events
+	uint32_t conn;
+	int fd;
+};
+
+struct ThreadRing {
+	std::mutex mutex;
+	std::string name;
+	uint32_t tid;
+	uint64_t written = 0;  // The next event goes to events[written % ring_size]
+	std::array<Event, Tracer::ring_size> events;
+};
+
+struct Registry {
+	std::mutex mutex;
+	std::deque<ThreadRing> threads;	 // deque never moves its elements
+};
+
+Registry &registry()
+{
+	static Registry r;
+	return r;
+}
+
+std::atomic<unsigned> sample_every = 0;
+std::atomic<uint32_t> connections = 0;
+std::atomic<bool> dump_requested = false;
+uint64_t base_ticks = 0;
+double ticks_per_us = 1000;	 // Overwritten by the calibration in enable()
+
+thread_local std::string thread_name;
+
+// The ring is only allocated once the thread records something, threads that never see a traced
+// request cost nothing
+ThreadRing &local()
+{
+	thread_local ThreadRing *mine = [] {
+		Registry &r = registry();
+		std::lock_guard lock(r.mutex);
+		ThreadRing &ring = r.threads.emplace_back();
+		ring.tid = r.threads.size();
+		ring.name = thread_name.empty() ? "thread " + std::to_string(ring.tid) : thread_name;
+		return &ring;
+	}();
+	return *mine;
+}
+
+void record(const Event &event)
+{
+	ThreadRing &ring = local();
+	std::lock_guard lock(ring.mutex);
+	ring.events[ring.written++ % Tracer::ring_size] = event;
+}
+
+void signal_handler(int)
+{
+	dump_requested = true;
+}
+
+double to_us(uint64_t ticks)
+{
+	return ticks > base_ticks ? (ticks - base_ticks) / ticks_per_us : 0;
+}
+
+}  // namespace
+
+void Tracer::enable(unsigned every)
+{
+	if (every == 0)
+		return;
+
+	// The TSC is invariant on anything recent, so one measurement against steady_clock is enough
+	auto clock_start = std::chrono::steady_clock::now();
+	uint64_t ticks_start = now();
+	std::this_thread::sleep_for(std::chrono::milliseconds(20));
+	uint64_t ticks_end = now();
+	auto elapsed = std::chrono::steady_clock::now() - clock_start;
+
+	base_ticks = ticks_start;
+	ticks_per_us = (ticks_end - ticks_start)
+				   / std::chrono::duration<double, std::micro>(elapsed).count();
+	sample_every = every;
+}
+
+bool Tracer::enabled()
+{
+	return sample_every.load(std::memory_order_relaxed) != 0;
+}
+
+uint32_t Tracer::sampleConnection()
+{
+	unsigned every = sample_every.load(std::memory_order_relaxed);
+	if (every == 0)
+		return 0;
+	uint32_t n = connections.fetch_add(1, std::memory_order_relaxed) + 1;
+	return n % every == 0 ? n : 0;
+}
+
+void Tracer::span(const char *name, uint64_t start, uint64_t end, uint32_t conn, int fd)
+{
+	record({ name, start, end > start ? end : start + 1, conn, fd });
+}
+
+void Tracer::instant(const char *name, uint64_t at, uint32_t conn, int fd)
+{
+	record({ name, at, 0, conn, fd });
+}
+
+void Tracer::nameThread(const std::string &name)
+{
+	thread_name = name;
+}
+
+std::string Tracer::dumpJson()
+{
+	struct Snapshot {
+		uint32_t tid;
+		std::string name;
+		std::vector<Event> events;
+	};
+	std::vector<Snapshot> snapshots;
+	{
+		Registry &r = registry();
+		std::lock_guard lock(r.mutex);
+		for (ThreadRing &ring : r.threads) {
+			std::lock_guard ring_lock(ring.mutex);
+			Snapshot &s = snapshots.emplace_back(ring.tid, ring.name);
+			size_t n = std::min<uint64_t>(ring.written, ring_size);
+			for (uint64_t i = ring.written - n; i < ring.written; i++)
+				s.events.push_back(ring.events[i % ring_size]);
+		}
+	}
+
+	std::string out = "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n";
+	char buf[256];
+	bool first = true;
+	auto separator = [&out, &first] {
+		if (!first)
+			out += ",\n";
+		first = false;
+	};
+
+	for (const Snapshot &s : snapshots) {
+		separator();
+		snprintf(buf, sizeof(buf),
+				 "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"",
+				 s.tid);
+		out.append(buf).append(s.name).append("\"}}");
+
+		for (const Event &e : s.events) {
+			separator();
+			if (e.end) {
+				snprintf(buf, sizeof(buf),
+						 "{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,"
+						 "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"conn\":%u,\"fd\":%d}}",
+						 e.name, s.tid, to_us(e.start), (e.end - e.start) / ticks_per_us, e.conn,
+						 e.fd);
+			} else {
+				snprintf(buf, sizeof(buf),
+						 "{\"name\":\"%s\",\"cat\":\"http\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,"
+						 "\"tid\":%u,\"ts\":%.3f,\"args\":{\"conn\":%u,\"fd\":%d}}",
+						 e.name, s.tid, to_us(e.start), e.conn, e.fd);
+			}
+			out.append(buf);
+		}
+	}
+	out += "\n]}\n";
+	return out;
+}
+
+HttpResponse Tracer::endpoint(const HttpRequest &)
+{
+	HttpResponse response;
+	response.setBody(dumpJson());
+	response.setContentType("application/json");
+	return response;
+}
+
+void Tracer::installSignalHandler(int signal)
+{
+	::signal(signal, signal_handler);
+}
+
+void Tracer::dumpIfRequested()
+{
+	if (!dump_requested.load(std::memory_order_relaxed) || !dump_requested.exchange(false))
+		return;
+
+	char path[64];
+	snprintf(path, sizeof(path), "posthaste-trace-%d-%lld.json", getpid(),
+			 static_cast<long long>(time(nullptr)));
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		perror("trace dump");
+		return;
+	}
+	std::string json = dumpJson();
+	fwrite(json.data(), 1, json.size(), file);
+	fclose(file);
+	fprintf(stderr, "Wrote trace to %s\n", path);
+}
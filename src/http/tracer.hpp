@@ -0,0 +1,58 @@
+#ifndef TRACER_HPP
+#define TRACER_HPP
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "httprequest.hpp"
+#include "httpresponse.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <chrono>
+#endif
+
+// Sampled per-request span tracing, exported as Chrome trace-event JSON (loads in Perfetto and
+// chrome://tracing). One in every N connections is traced, and each of its requests records
+// accept, enqueue, dequeue (time spent in the ThreadPool queue), parse, route, handler,
+// serialize and send spans.
+//
+// Timestamps are raw TSC reads, calibrated against steady_clock once when tracing is enabled.
+// Spans go into a per-thread ring that keeps the most recent ones, behind a per-thread lock that
+// only a dump ever contends on
+class Tracer {
+   public:
+	static constexpr size_t ring_size = 16384;	// Spans kept per thread
+
+	// Traces one in every sample_every connections. 0 disables tracing
+	static void enable(unsigned sample_every);
+	static bool enabled();
+
+	// Returns the id to trace a new connection with, or 0 if it isn't sampled
+	static uint32_t sampleConnection();
+
+	static uint64_t now()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+	}
+
+	// name must be a string literal (it's kept as a pointer)
+	static void span(const char *name, uint64_t start, uint64_t end, uint32_t conn, int fd);
+	static void instant(const char *name, uint64_t at, uint32_t conn, int fd);
+	static void nameThread(const std::string &name);
+
+	static std::string dumpJson();
+	static HttpResponse endpoint(const HttpRequest &);
+
+	// For SIGUSR2: the handler only raises a flag, the serve loop does the actual dump
+	static void installSignalHandler(int signal);
+	static void dumpIfRequested();
+};
+
+#endif	// !TRACER_HPP
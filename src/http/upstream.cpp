@@ -0,0 +1,193 @@
+#include "upstream.hpp"
+#include <cerrno>
+#include <charconv>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <utility>
+
+std::string_view UpstreamPool::Response::header(std::string_view name) const
+{
+	size_t pos = head.find("\r\n");
+	while (pos != std::string::npos) {
+		size_t start = pos + 2, end = head.find("\r\n", start);
+		std::string_view line(head.data() + start,
+							  (end == std::string::npos ? head.size() : end) - start);
+		size_t colon = line.find(':');
+		if (colon == name.size() && strncasecmp(line.data(), name.data(), colon) == 0) {
+			std::string_view value = line.substr(colon + 1);
+			while (!value.empty() && value.front() == ' ')
+				value.remove_prefix(1);
+			return value;
+		}
+		pos = end;
+	}
+	return {};
+}
+
+UpstreamPool::UpstreamPool(std::string h, int p) : host(std::move(h)), port(p)
+{
+}
+
+UpstreamPool::~UpstreamPool()
+{
+	for (int fd : idle)
+		close(fd);
+}
+
+int UpstreamPool::connect() const
+{
+	struct addrinfo hints = {}, *res;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0)
+		return -1;
+
+	// Non-blocking only to bound the connect, a node that's down may never answer the SYN
+	int fd = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd >= 0 && ::connect(fd, res->ai_addr, res->ai_addrlen) < 0) {
+		struct pollfd pfd = { fd, POLLOUT, 0 };
+		int error = 0;
+		socklen_t len = sizeof(error);
+		if (errno != EINPROGRESS || poll(&pfd, 1, timeout_ms) != 1
+			|| getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	if (fd < 0)
+		return -1;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+	struct timeval timeout = { timeout_ms / 1000, (timeout_ms % 1000) * 1000 };
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return fd;
+}
+
+// Idle, so anything to read is the server closing it (or garbage), and it can't be used
+static bool still_open(int fd)
+{
+	char byte;
+	ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+	return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+// Safe to send twice, nothing else may run twice because a connection broke
+static bool idempotent(std::string_view request)
+{
+	return request.starts_with("GET ") || request.starts_with("HEAD ");
+}
+
+bool UpstreamPool::exchange(int fd, std::string_view request, size_t max_body, Response &response,
+							bool &sent_any, bool &got_any, bool &keep_alive) const
+{
+	while (!request.empty()) {
+		ssize_t n = ::send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		sent_any = true;
+		request.remove_prefix(n);
+	}
+
+	// The head, and whatever of the body came along with it
+	std::string buffer;
+	size_t head_end;
+	char chunk[16 << 10];
+	while ((head_end = buffer.find("\r\n\r\n")) == std::string::npos) {
+		if (buffer.size() > max_head)
+			return false;
+		ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		got_any = true;
+		buffer.append(chunk, n);
+	}
+
+	// "HTTP/1.1 200 OK"
+	response.head.assign(buffer, 0, head_end);
+	if (response.head.size() < 12 || !response.head.starts_with("HTTP/1."))
+		return false;
+	const char *code = response.head.data() + 9;
+	if (std::from_chars(code, code + 3, response.status).ec != std::errc())
+		return false;
+	std::string_view length = response.header("Content-Length");
+	size_t size;
+	if (std::from_chars(length.data(), length.data() + length.size(), size).ec != std::errc())
+		return false;
+	keep_alive = response.header("Connection").find("close") == std::string_view::npos;
+	if (size > max_body) {	// The rest of it would still come, so the connection can't stay
+		response.too_large = true;
+		keep_alive = false;
+		return true;
+	}
+
+	response.body.assign(buffer, head_end + 4);
+	if (response.body.size() > size)  // Nothing was asked for after this one
+		return false;
+	response.body.resize(size);
+	size_t got = buffer.size() - head_end - 4;
+	while (got < size) {
+		ssize_t n = recv(fd, response.body.data() + got, size - got, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		got += n;
+	}
+	return true;
+}
+
+std::optional<UpstreamPool::Response> UpstreamPool::send(std::string_view request, size_t max_body)
+{
+	for (int attempt = 0; attempt < 2; attempt++) {
+		int fd = -1;
+		if (attempt == 0) {
+			std::lock_guard lock(mutex);
+			while (fd < 0 && !idle.empty()) {
+				fd = idle.back();
+				idle.pop_back();
+				if (!still_open(fd)) {
+					close(fd);
+					fd = -1;
+				}
+			}
+		}
+		bool reused = fd >= 0;
+		if (!reused && (fd = connect()) < 0)
+			return std::nullopt;
+
+		Response response;
+		bool sent_any = false, got_any = false, keep_alive = false;
+		if (exchange(fd, request, max_body, response, sent_any, got_any, keep_alive)) {
+			std::unique_lock lock(mutex);
+			if (keep_alive && idle.size() < max_idle) {
+				idle.push_back(fd);
+				fd = -1;
+			}
+			lock.unlock();
+			if (fd >= 0)
+				close(fd);
+			return response;
+		}
+		close(fd);
+		// The server may close an idle connection just as it's taken, after the check above.
+		// Then nothing comes back, but a request that went out may have run all the same, so
+		// only one that never left or can run twice goes again on a new connection
+		if (!reused || got_any || (sent_any && !idempotent(request)))
+			return std::nullopt;
+	}
+	return std::nullopt;
+}
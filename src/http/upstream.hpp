@@ -0,0 +1,56 @@
+#ifndef UPSTREAM_HPP
+#define UPSTREAM_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Keep-alive HTTP/1.1 connections to another server, for requests we pass on to it. Blocking:
+// the worker sending a request waits for its response, up to timeout_ms for every step. Idle
+// connections are kept for the next request, so in the steady state nothing is connected.
+//
+// Responses must carry a Content-Length, as posthaste's always do
+class UpstreamPool {
+   public:
+	struct Response {
+		int status = 0;
+		std::string head;  // Status line and headers, without the empty line
+		std::string body;
+		bool too_large = false;	 // Its Content-Length was over max_body, body is left empty
+
+		// Case insensitive, empty if missing
+		std::string_view header(std::string_view name) const;
+	};
+
+	static constexpr int timeout_ms = 2000;
+	static constexpr size_t max_idle = 64;
+	static constexpr size_t max_head = 16 << 10;
+
+   private:
+	std::string host;
+	int port;
+	std::mutex mutex;
+	std::vector<int> idle;
+
+	int connect() const;  // -1 on failure
+	// False if the connection broke. sent_any and got_any tell whether any of the request went
+	// out, and any of the response came back, before that
+	bool exchange(int fd, std::string_view request, size_t max_body, Response &response,
+				  bool &sent_any, bool &got_any, bool &keep_alive) const;
+
+   public:
+	UpstreamPool(std::string host, int port);
+	UpstreamPool(const UpstreamPool &) = delete;
+	UpstreamPool &operator=(const UpstreamPool &) = delete;
+	~UpstreamPool();
+
+	// request is a whole HTTP/1.1 request. nullopt if the server can't be reached, or broke off
+	// or answered garbage. Bodies over max_body aren't read, the response says too_large
+	std::optional<Response> send(std::string_view request, size_t max_body = SIZE_MAX);
+};
+
+#endif	// !UPSTREAM_HPP
@@ -0,0 +1,123 @@
+#include "idallocator.hpp"
+#include <cmath>
+#include <filesystem>
+#include <system_error>
+
+#include "utils.hpp"
+
+static uint64_t fnv1a(std::string_view s)
+{
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (unsigned char c : s) {
+		h ^= c;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static uint64_t mix(uint64_t x)	 // splitmix64 finalizer
+{
+	x ^= x >> 30;
+	x *= 0xbf58476d1ce4e5b9ULL;
+	x ^= x >> 27;
+	x *= 0x94d049bb133111ebULL;
+	x ^= x >> 31;
+	return x;
+}
+
+IdAllocator::IdAllocator() : bloom(new std::atomic<uint64_t>[bloom_bits / 64])
+{
+	for (size_t i = 0; i < bloom_bits / 64; i++)
+		bloom[i].store(0, std::memory_order_relaxed);
+}
+
+IdAllocator &IdAllocator::instance()
+{
+	static IdAllocator allocator;
+	return allocator;
+}
+
+bool IdAllocator::maybeContains(std::string_view id) const
+{
+	// Double hashing: k probes derived from two independent 64 bit hashes
+	uint64_t h1 = fnv1a(id), h2 = mix(h1) | 1;
+	for (int i = 0; i < bloom_hashes; i++) {
+		uint64_t bit = (h1 + i * h2) % bloom_bits;
+		if (!(bloom[bit / 64].load(std::memory_order_relaxed) & (uint64_t(1) << (bit % 64))))
+			return false;
+	}
+	return true;
+}
+
+void IdAllocator::insert(std::string_view id)
+{
+	uint64_t h1 = fnv1a(id), h2 = mix(h1) | 1;
+	for (int i = 0; i < bloom_hashes; i++) {
+		uint64_t bit = (h1 + i * h2) % bloom_bits;
+		bloom[bit / 64].fetch_or(uint64_t(1) << (bit % 64), std::memory_order_relaxed);
+	}
+	n_ids.fetch_add(1, std::memory_order_relaxed);
+}
+
+size_t IdAllocator::load(const std::string &root)
+{
+	namespace fs = std::filesystem;
+	size_t found = 0;
+	std::error_code ec;
+
+	// Layout is p/<id[0]>/<id[1]>/<id[2:]> (+ .meta), see save_paste_to_disk
+	for (const auto &shard1 : fs::directory_iterator(root, ec)) {
+		if (!shard1.is_directory())
+			continue;
+		for (const auto &shard2 : fs::directory_iterator(shard1.path(), ec)) {
+			if (!shard2.is_directory())
+				continue;
+			std::string prefix = shard1.path().filename().string() + shard2.path().filename().string();
+			for (const auto &file : fs::directory_iterator(shard2.path(), ec)) {
+				if (file.path().has_extension())  // .meta, or a .meta.tmp a crash left behind
+					continue;
+				insert(prefix + file.path().filename().string());
+				found++;
+			}
+		}
+	}
+	return found;
+}
+
+int IdAllocator::idLength() const
+{
+	double n = static_cast<double>(n_ids.load(std::memory_order_relaxed));
+	int length = min_length;
+	while (length < max_length && n >= std::pow(62.0, length) / 65536.0)
+		length++;
+	return length;
+}
+
+size_t IdAllocator::size() const
+{
+	return n_ids.load(std::memory_order_relaxed);
+}
+
+std::string IdAllocator::allocate(const std::function<bool(std::string_view)> &accept)
+{
+	int length = idLength();
+	int rejected = 0;
+	for (int attempt = 0; attempt < max_attempts;) {
+		std::string id = generate_id(length);
+		if (accept && rejected < max_rejected && !accept(id)) {
+			rejected++;
+			continue;
+		}
+		attempt++;
+		if (maybeContains(id))
+			continue;  // Possibly taken, a new candidate is cheaper than asking the disk
+		insert(id);
+		return id;
+	}
+
+	// Only reachable with a saturated filter. A longer ID is almost surely free, and
+	// save_paste_to_disk refuses to overwrite in the unlikely case it isn't
+	std::string id = generate_id(std::min(length + 2, max_length));
+	insert(id);
+	return id;
+}
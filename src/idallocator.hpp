@@ -0,0 +1,49 @@
+#ifndef IDALLOCATOR_HPP
+#define IDALLOCATOR_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+
+// Hands out paste IDs that are not in use. Every ID ever seen (loaded from disk at startup or
+// allocated since) goes into a Bloom filter, and candidates that hit the filter are simply
+// discarded and regenerated, so allocation never has to probe the disk. The filter can't forget
+// expired pastes, which only makes it a bit more conservative. save_paste_to_disk creates files
+// with O_EXCL, so whatever the filter can't know about (other processes) is still caught there.
+class IdAllocator {
+   private:
+	static constexpr size_t bloom_bits = size_t(1) << 24;  // 2 MiB, ~1% FPR at 1.7M IDs
+	static constexpr int bloom_hashes = 7;
+	static constexpr int min_length = 6, max_length = 16;
+	static constexpr int max_attempts = 64;
+	static constexpr int max_rejected = 4096;
+
+	std::unique_ptr<std::atomic<uint64_t>[]> bloom;
+	std::atomic<size_t> n_ids = 0;
+
+	bool maybeContains(std::string_view id) const;
+
+   public:
+	IdAllocator();
+	IdAllocator(const IdAllocator &) = delete;
+	IdAllocator &operator=(const IdAllocator &) = delete;
+
+	static IdAllocator &instance();
+
+	// Walks the storage directory and registers every paste found. Returns how many there were
+	size_t load(const std::string &root = "p/");
+	void insert(std::string_view id);
+	// Only candidates accept takes count (cluster mode wants IDs this node owns). After
+	// max_rejected of them it's ignored, the caller must check the ID it got
+	std::string allocate(const std::function<bool(std::string_view)> &accept = nullptr);
+
+	// Grows as the store fills up so a random pick stays unlikely to collide (< 1 in 65536)
+	int idLength() const;
+	size_t size() const;
+};
+
+#endif	// !IDALLOCATOR_HPP
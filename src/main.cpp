@@ -1,11 +1,18 @@
 #include <csignal>
+#include <fstream>
 #include <iostream>
 #include <string>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include "cluster.hpp"
 #include "endpoints.hpp"
+#include "idallocator.hpp"
+#include "http/feeds.hpp"
 #include "http/httpserver.hpp"
+#include "searchindex.hpp"
+#include "storage.hpp"
 
 using namespace std;
 
@@ -13,49 +20,217 @@ std::atomic<bool> stop_signal(false);
 
 void signal_handler(int)
 {
+	if (stop_signal)  // Second ^C, don't wait for the drain
+		_exit(1);
 	stop_signal = true;
 }
 
-HttpResponse status(const HttpRequest &)
-{
+static const auto status_ok = [] {
 	HttpResponse response;
 	response.setStatusCode(200);
 	response.setBody("{\"status\":\"ok\"}");
 	response.setContentType("application/json");
+	return HttpResponse::prepare(std::move(response));
+}();
+
+HttpResponse status(const HttpRequest &)
+{
+	return HttpResponse(status_ok);
+}
 
-	return response;
+// "<rate>[:<burst>]", the burst defaults to ten seconds worth
+static RateLimiter::Limit parse_limit(const string &spec)
+{
+	RateLimiter::Limit limit;
+	size_t colon = spec.find(':');
+	limit.rate = stod(spec.substr(0, colon));
+	limit.burst = colon == string::npos ? limit.rate * 10 : stod(spec.substr(colon + 1));
+	return limit;
 }
 
 int main(int argc, char *argv[])
 {
-	int port = 80, n_threads = thread::hardware_concurrency();
+	int port = 80, tls_port = 0, n_threads = thread::hardware_concurrency();
+	string access_log, capture, rate_limit, handoff, worker_cpus, epoll_cpus, tls_cert, tls_key;
+	string cluster_nodes, cluster_self, cluster_key_file, search_index;
+	size_t replicas = 1;
+	Placement placement;
+	unsigned trace_every = 0;
+	size_t max_connections = 0;
+	ThreadPool::Limits queue_limits;
 
 	if (argc == 1) {
 		cout << "Using default values:\nPort 80, Number of workers: " << n_threads << endl;
 	}
 
-	for (int i = 1; i < argc - 1; i++) {
+	for (int i = 1; i < argc; i++) {
 		string_view arg(argv[i]);
+		if (arg == "-R") {	// The only flag without a value
+			placement.follow_rx = true;
+			continue;
+		}
+		if (i + 1 == argc)
+			break;
 		if (arg == "-p") {
 			port = stoi(argv[i + 1]);
 			i++;
 		} else if (arg == "-w") {
 			n_threads = stoi(argv[i + 1]);
 			i++;
+		} else if (arg == "-l") {
+			access_log = argv[i + 1];
+			i++;
+		} else if (arg == "-c") {
+			capture = argv[i + 1];
+			i++;
+		} else if (arg == "-t") {
+			trace_every = stoi(argv[i + 1]);
+			i++;
+		} else if (arg == "-L") {
+			rate_limit = argv[i + 1];
+			i++;
+		} else if (arg == "-a") {
+			worker_cpus = argv[i + 1];
+			i++;
+		} else if (arg == "-e") {
+			epoll_cpus = argv[i + 1];
+			i++;
+		} else if (arg == "-u") {
+			handoff = argv[i + 1];
+			i++;
+		} else if (arg == "-m") {
+			max_connections = stoul(argv[i + 1]);
+			i++;
+		} else if (arg == "-q") {
+			queue_limits.max_queued = stoul(argv[i + 1]);
+			i++;
+		} else if (arg == "-d") {
+			queue_limits.max_wait = chrono::milliseconds(stoul(argv[i + 1]));
+			i++;
+		} else if (arg == "-s") {
+			tls_port = stoi(argv[i + 1]);
+			i++;
+		} else if (arg == "-C") {
+			tls_cert = argv[i + 1];
+			i++;
+		} else if (arg == "-K") {
+			tls_key = argv[i + 1];
+			i++;
+		} else if (arg == "-n") {
+			cluster_nodes = argv[i + 1];
+			i++;
+		} else if (arg == "-N") {
+			cluster_self = argv[i + 1];
+			i++;
+		} else if (arg == "-r") {
+			replicas = stoul(argv[i + 1]);
+			i++;
+		} else if (arg == "-k") {
+			cluster_key_file = argv[i + 1];
+			i++;
+		} else if (arg == "-i") {
+			search_index = argv[i + 1];
+			i++;
 		}
 	}
 
-	HttpServer server(port, n_threads);
+	// Stop signals must reach the main thread, epoll_wait wouldn't notice them anywhere else.
+	// Threads inherit the mask, so they stay blocked until all of them are started
+	sigset_t stop_signals;
+	sigemptyset(&stop_signals);
+	sigaddset(&stop_signals, SIGINT);
+	sigaddset(&stop_signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stop_signals, nullptr);
+
+	size_t n_pastes = IdAllocator::instance().load();
+	cout << "Found " << n_pastes << " pastes, using IDs of length "
+		 << IdAllocator::instance().idLength() << endl;
+
+	try {
+		placement.worker_cpus = Topology::parseCpuList(worker_cpus);
+		placement.epoll_cpus = Topology::parseCpuList(epoll_cpus);
+		if (!cluster_nodes.empty()) {
+			if (cluster_self.empty())
+				throw invalid_argument("Cluster mode needs -N <host:port>, this node in the -n list");
+			// From a file, so it doesn't show up in ps
+			string key;
+			ifstream key_file(cluster_key_file);
+			if (cluster_key_file.empty() || !getline(key_file, key) || key.empty())
+				throw invalid_argument("Cluster mode needs -k <file>, with the key every node shares");
+			Cluster &cluster = Cluster::instance();
+			cluster.configure(cluster_nodes, cluster_self, replicas, key);
+			cout << "Cluster of " << cluster.size() << " nodes, "
+				 << (cluster.isMember() ? "this one is " + cluster_self : "this one forwards only")
+				 << ", " << cluster.copies() << " copies of each paste" << endl;
+		}
+		if (!search_index.empty()) {
+			SearchIndex &index = SearchIndex::instance();
+			size_t indexed = index.open(search_index);
+			cout << "Search index in " << search_index << ": " << indexed << " pastes in "
+				 << index.segmentCount() << " segments" << endl;
+		}
+	} catch (exception &ex) {
+		cerr << "Error: " << ex.what() << endl;
+		return 1;
+	}
+	cout << Topology::describe(placement, n_threads) << endl;
+
+	HttpServer server(port, n_threads, handoff, placement);
+
+	try {
+		if (!access_log.empty())
+			server.enableAccessLog(access_log);
+		if (!capture.empty())
+			server.enableCapture(capture);
+		if (!rate_limit.empty()) {	// "<reads>,<writes>"
+			size_t comma = rate_limit.find(',');
+			if (comma == string::npos)
+				throw invalid_argument("-L takes <reads>[:<burst>],<writes>[:<burst>]");
+			server.enableRateLimit(parse_limit(rate_limit.substr(0, comma)),
+								   parse_limit(rate_limit.substr(comma + 1)));
+		}
+		if (tls_port || !tls_cert.empty()) {
+			if (tls_cert.empty() || tls_key.empty())
+				throw invalid_argument("TLS needs both -C <cert.pem> and -K <key.pem>");
+			server.enableTls(tls_port ? tls_port : 443, tls_cert, tls_key);
+		}
+	} catch (exception &ex) {
+		cerr << "Error: " << ex.what() << endl;
+		return 1;
+	}
+
+	if (trace_every)
+		server.enableTracing(trace_every);
+	server.setAdmissionLimits(max_connections, queue_limits);
 
 	signal(SIGINT, signal_handler);
+	signal(SIGTERM, signal_handler);
+	// OpenSSL writes to sockets with write(), not send() with MSG_NOSIGNAL, so a TLS client that
+	// hangs up mid-response would kill the process
+	signal(SIGPIPE, SIG_IGN);
+	pthread_sigmask(SIG_UNBLOCK, &stop_signals, nullptr);
 
 	server.addEndpoint("/health", status);
 	server.addEndpoint("/", root_endpoint);
 	server.addEndpoint("/paste", handle_paste);
 	server.addEndpoint("/p/*", show_paste);
+	server.addEndpoint("/pastes", handle_batch);
+	if (Cluster::instance().enabled())
+		server.addEndpoint("/replica/*", store_replica);
+	// A node without an index can still ask the others
+	if (SearchIndex::instance().enabled() || Cluster::instance().enabled())
+		server.addEndpoint("/search", handle_search);
+	// Followers are fed paste IDs, a sealed paste ends them
+	Feeds::setEndedCheck(paste_finished);
 
 	server.serve(stop_signal);
 
+	try {
+		SearchIndex::instance().flush();
+	} catch (exception &ex) {
+		cerr << "Error: " << ex.what() << endl;
+	}
+
 	cout << "\nExiting!\n";
 
 	return 0;
@@ -0,0 +1,589 @@
+#include "searchindex.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <optional>
+#include <stdexcept>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <unordered_set>
+
+#include "storage.hpp"
+
+namespace {
+
+// The last two are the version. 01 had no flags after each doc's expiration
+constexpr char segment_magic[8] = { 'P', 'H', 'T', 'R', 'I', 'G', '0', '2' };
+constexpr uint8_t doc_part = 1;
+
+unsigned char fold(unsigned char c)
+{
+	return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+// The distinct trigrams of text, in the order they first appear. Deduplicated through a small
+// open addressing set, sorting all of them costs several times more
+void trigrams(std::string_view text, std::vector<uint32_t> &out)
+{
+	out.clear();
+	if (text.size() < 3)
+		return;
+	constexpr uint32_t empty = UINT32_MAX;	// Trigrams are 24 bits
+	thread_local std::vector<uint32_t> seen;
+	int bits = 12;
+	seen.assign(size_t(1) << bits, empty);
+	auto slot_of = [&bits](uint32_t gram) { return (gram * 0x9e3779b1u) >> (32 - bits); };
+
+	uint32_t gram = fold(text[0]) << 8 | fold(text[1]);
+	for (size_t i = 2; i < text.size(); i++) {
+		gram = (gram << 8 | fold(text[i])) & 0xffffff;
+		size_t slot = slot_of(gram), mask = seen.size() - 1;
+		while (seen[slot] != gram && seen[slot] != empty)
+			slot = (slot + 1) & mask;
+		if (seen[slot] == gram)
+			continue;
+		seen[slot] = gram;
+		out.push_back(gram);
+
+		if (out.size() * 2 > seen.size()) {  // Kept at most half full
+			seen.assign(size_t(1) << ++bits, empty);
+			for (uint32_t g : out) {
+				size_t s = slot_of(g);
+				while (seen[s] != empty)
+					s = (s + 1) & (seen.size() - 1);
+				seen[s] = g;
+			}
+		}
+	}
+	if (seen.size() > (size_t(1) << 20)) {	// A huge paste, don't keep its set around
+		seen.clear();
+		seen.shrink_to_fit();
+	}
+}
+
+void put_varint(std::string &out, uint32_t value)
+{
+	while (value >= 0x80) {
+		out.push_back(char(value | 0x80));
+		value >>= 7;
+	}
+	out.push_back(char(value));
+}
+
+bool get_varint(std::string_view &in, uint32_t &value)
+{
+	value = 0;
+	for (int shift = 0; shift < 35 && !in.empty(); shift += 7) {
+		unsigned char byte = in.front();
+		in.remove_prefix(1);
+		value |= uint32_t(byte & 0x7f) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+// Postings are the gaps between doc numbers, the first one counting from 0
+void decode(std::string_view postings, std::vector<uint32_t> &docs)
+{
+	docs.clear();
+	uint32_t doc = 0, delta;
+	while (get_varint(postings, delta))
+		docs.push_back(doc += delta);
+}
+
+// Keeps the docs that are also in postings
+void intersect(std::vector<uint32_t> &docs, std::string_view postings)
+{
+	size_t kept = 0, i = 0;
+	uint32_t doc = 0, delta;
+	while (i < docs.size() && get_varint(postings, delta)) {
+		doc += delta;
+		while (i < docs.size() && docs[i] < doc)
+			i++;
+		if (i < docs.size() && docs[i] == doc)
+			docs[kept++] = docs[i++];
+	}
+	docs.resize(kept);
+}
+
+bool expired(long long expires, std::time_t now)
+{
+	return expires != -1 && now > expires;
+}
+
+// Native byte order, segments don't move between machines
+template <typename T>
+void put_raw(std::string &out, T value)
+{
+	out.append(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T>
+bool get_raw(std::string_view &in, T &value)
+{
+	if (in.size() < sizeof(value))
+		return false;
+	std::memcpy(&value, in.data(), sizeof(value));
+	in.remove_prefix(sizeof(value));
+	return true;
+}
+
+}  // namespace
+
+SearchIndex &SearchIndex::instance()
+{
+	static SearchIndex index;
+	return index;
+}
+
+size_t SearchIndex::open(const std::string &path)
+{
+	namespace fs = std::filesystem;
+	dir = path;
+	while (dir.size() > 1 && dir.back() == '/')
+		dir.pop_back();
+	if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+		throw std::system_error(errno, std::generic_category(), "mkdir " + dir);
+
+	// "<sequence>.seg", loaded in sequence order. A .tmp is a write a crash cut short
+	std::vector<std::pair<uint64_t, std::string>> files;
+	for (const auto &entry : fs::directory_iterator(dir)) {
+		std::string name = entry.path().filename().string();
+		if (name.ends_with(".tmp")) {
+			std::error_code ec;
+			fs::remove(entry.path(), ec);
+		} else if (name.ends_with(".seg")) {
+			files.emplace_back(std::strtoull(name.c_str(), nullptr, 10), entry.path().string());
+		}
+	}
+	std::sort(files.begin(), files.end());
+
+	size_t docs = 0;
+	for (const auto &[sequence, file] : files) {
+		segments.push_back(load(file));
+		docs += segments.back()->docs.size();
+		next_segment = std::max(next_segment, sequence + 1);
+	}
+	return segments.empty() ? rebuild() : docs;
+}
+
+std::shared_ptr<SearchIndex::Segment> SearchIndex::load(const std::string &path) const
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat st;
+	if (fd < 0 || fstat(fd, &st) < 0)
+		throw std::system_error(errno, std::generic_category(), "open " + path);
+	std::string data(st.st_size, '\0');
+	size_t got = 0;
+	while (got < data.size()) {
+		ssize_t n = pread(fd, data.data() + got, data.size() - got, got);
+		if (n <= 0)
+			break;
+		got += n;
+	}
+	close(fd);
+
+	// Magic, doc count, term count, postings size. Then the docs (ID length, ID, expiration,
+	// flags), the terms (trigram, doc count, postings size) and the postings
+	auto segment = std::make_shared<Segment>();
+	segment->path = path;
+	std::string_view in(data.data(), got);
+	uint32_t n_docs, n_terms;
+	uint64_t postings_size;
+	bool has_flags = in.starts_with(std::string_view(segment_magic, sizeof(segment_magic)));
+	bool ok = has_flags || in.starts_with("PHTRIG01");
+	if (ok)
+		in.remove_prefix(sizeof(segment_magic));
+	ok = ok && get_raw(in, n_docs) && get_raw(in, n_terms) && get_raw(in, postings_size);
+	for (uint32_t i = 0; ok && i < n_docs; i++) {
+		uint8_t length, flags = 0;
+		Doc &doc = segment->docs.emplace_back();
+		ok = get_raw(in, length) && in.size() >= length;
+		if (ok) {
+			doc.id.assign(in.substr(0, length));
+			in.remove_prefix(length);
+			ok = get_raw(in, doc.expires) && (!has_flags || get_raw(in, flags));
+		}
+		doc.part = flags & doc_part;
+		segment->parts |= doc.part;
+	}
+	size_t offset = 0;
+	for (uint32_t i = 0; ok && i < n_terms; i++) {
+		Term &term = segment->terms.emplace_back();
+		ok = get_raw(in, term.trigram) && get_raw(in, term.count) && get_raw(in, term.size);
+		term.offset = offset;
+		offset += term.size;
+	}
+	if (!ok || offset != postings_size || in.size() != postings_size)
+		throw std::runtime_error("Corrupt search index segment " + path);
+	segment->postings.assign(in);
+	return segment;
+}
+
+void SearchIndex::write(const Segment &segment) const
+{
+	std::string out;
+	out.reserve(32 + segment.docs.size() * 25 + segment.terms.size() * 12
+				+ segment.postings.size());
+	out.append(segment_magic, sizeof(segment_magic));
+	put_raw(out, uint32_t(segment.docs.size()));
+	put_raw(out, uint32_t(segment.terms.size()));
+	put_raw(out, uint64_t(segment.postings.size()));
+	for (const Doc &doc : segment.docs) {
+		put_raw(out, uint8_t(doc.id.size()));
+		out.append(doc.id);
+		put_raw(out, doc.expires);
+		put_raw(out, uint8_t(doc.part ? doc_part : 0));
+	}
+	for (const Term &term : segment.terms) {
+		put_raw(out, term.trigram);
+		put_raw(out, term.count);
+		put_raw(out, term.size);
+	}
+	out.append(segment.postings);
+
+	// Renamed into place, a segment file is either all there or not at all
+	std::string tmp = segment.path + ".tmp";
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "open " + tmp);
+	for (std::string_view rest = out; !rest.empty();) {
+		ssize_t n = ::write(fd, rest.data(), rest.size());
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			int err = errno;
+			close(fd);
+			throw std::system_error(err, std::generic_category(), "write " + tmp);
+		}
+		rest.remove_prefix(n);
+	}
+	fdatasync(fd);
+	close(fd);
+	if (rename(tmp.c_str(), segment.path.c_str()) < 0)
+		throw std::system_error(errno, std::generic_category(), "rename " + tmp);
+}
+
+// Stored pastes, oldest first so the newest end up in the newest segments
+size_t SearchIndex::rebuild()
+{
+	namespace fs = std::filesystem;
+	std::vector<std::pair<fs::file_time_type, std::string>> found;
+	std::error_code ec;
+	for (const auto &shard1 : fs::directory_iterator("p", ec)) {
+		for (const auto &shard2 : fs::directory_iterator(shard1.path(), ec)) {
+			std::string prefix = shard1.path().filename().string() + shard2.path().filename().string();
+			for (const auto &file : fs::directory_iterator(shard2.path(), ec)) {
+				if (!file.path().has_extension())
+					found.emplace_back(file.last_write_time(ec),
+									   prefix + file.path().filename().string());
+			}
+		}
+	}
+	std::sort(found.begin(), found.end());
+
+	size_t indexed = 0;
+	for (const auto &[time, id] : found) {
+		std::optional<StoredPaste> paste = open_paste(id);
+		if (!paste)
+			continue;
+		add(id, read_paste(*paste), paste->expiration, paste->appendable);
+		indexed++;
+	}
+	flush();
+	return indexed;
+}
+
+void SearchIndex::add(std::string_view id, std::string_view content, long long expires_at,
+					  bool part)
+{
+	if (!enabled() || std::memchr(content.data(), '\0', std::min<size_t>(content.size(), 4096)))
+		return;
+	thread_local std::vector<uint32_t> grams;
+	trigrams(content.substr(0, max_indexed), grams);
+	if (grams.empty())
+		return;
+
+	bool full;
+	{
+		std::lock_guard lock(mutex);
+		auto now = std::chrono::steady_clock::now();
+		if (live_docs.empty())
+			live_since = now;
+		uint32_t doc = live_docs.size();
+		live_docs.push_back({ std::string(id), expires_at, part });
+		live_parts += part;
+		for (uint32_t gram : grams) {
+			LivePostings &postings = live_terms[gram];
+			size_t before = postings.bytes.size();
+			put_varint(postings.bytes, doc - postings.last);
+			postings.last = doc;
+			postings.count++;
+			live_bytes += postings.bytes.size() - before;
+		}
+		full = live_docs.size() >= flush_docs || live_bytes >= flush_bytes
+			   || now - live_since >= flush_after;
+	}
+
+	// Whoever fills it up writes it out. If a flush is running already, the next add retries
+	if (full && flush_mutex.try_lock()) {
+		std::lock_guard flushing(flush_mutex, std::adopt_lock);
+		try {
+			persist();
+		} catch (std::exception &ex) {
+			// Still searchable until the next restart
+			std::cerr << "Search index: " << ex.what() << std::endl;
+		}
+	}
+}
+
+std::shared_ptr<SearchIndex::Segment> SearchIndex::seal()
+{
+	auto segment = std::make_shared<Segment>();
+	char name[32];
+	snprintf(name, sizeof(name), "/%016llu.seg", (unsigned long long)next_segment++);
+	segment->path = dir + name;
+	segment->docs = std::move(live_docs);
+	segment->parts = live_parts > 0;
+
+	std::vector<std::pair<uint32_t, LivePostings *>> sorted;
+	sorted.reserve(live_terms.size());
+	size_t total = 0;
+	for (auto &[gram, postings] : live_terms) {
+		sorted.emplace_back(gram, &postings);
+		total += postings.bytes.size();
+	}
+	std::sort(sorted.begin(), sorted.end());
+	segment->terms.reserve(sorted.size());
+	segment->postings.reserve(total);
+	for (const auto &[gram, postings] : sorted) {
+		segment->terms.push_back(
+		  { gram, postings->count, segment->postings.size(), uint32_t(postings->bytes.size()) });
+		segment->postings.append(postings->bytes);
+	}
+
+	live_docs.clear();
+	live_terms.clear();
+	live_bytes = 0;
+	live_parts = 0;
+	return segment;
+}
+
+void SearchIndex::persist()
+{
+	std::shared_ptr<Segment> sealed;
+	{
+		std::lock_guard lock(mutex);
+		if (!live_docs.empty()) {
+			sealed = seal();
+			segments.push_back(sealed);
+		}
+	}
+	if (sealed)
+		write(*sealed);
+	prune();
+}
+
+void SearchIndex::flush()
+{
+	if (!enabled())
+		return;
+	std::lock_guard flushing(flush_mutex);
+	persist();
+}
+
+// Segments that are at least half expired pastes are rewritten without them
+void SearchIndex::prune()
+{
+	std::vector<std::shared_ptr<const Segment>> current;
+	{
+		std::lock_guard lock(mutex);
+		current = segments;
+	}
+
+	std::time_t now = std::time(nullptr);
+	std::vector<uint32_t> docs;
+	for (const std::shared_ptr<const Segment> &segment : current) {
+		size_t dead = std::count_if(segment->docs.begin(), segment->docs.end(),
+									[now](const Doc &doc) { return expired(doc.expires, now); });
+		if (dead == 0 || dead * 2 < segment->docs.size())
+			continue;
+
+		std::shared_ptr<Segment> pruned;
+		if (dead < segment->docs.size()) {
+			pruned = std::make_shared<Segment>();
+			pruned->path = segment->path;
+			std::vector<uint32_t> renumbered(segment->docs.size(), UINT32_MAX);
+			for (size_t i = 0; i < segment->docs.size(); i++) {
+				if (!expired(segment->docs[i].expires, now)) {
+					renumbered[i] = pruned->docs.size();
+					pruned->docs.push_back(segment->docs[i]);
+					pruned->parts |= segment->docs[i].part;
+				}
+			}
+			for (const Term &term : segment->terms) {
+				decode(std::string_view(segment->postings).substr(term.offset, term.size), docs);
+				size_t offset = pruned->postings.size();
+				uint32_t count = 0, last = 0;
+				for (uint32_t doc : docs) {
+					if (renumbered[doc] == UINT32_MAX)
+						continue;
+					put_varint(pruned->postings, renumbered[doc] - last);
+					last = renumbered[doc];
+					count++;
+				}
+				if (count)
+					pruned->terms.push_back(
+					  { term.trigram, count, offset, uint32_t(pruned->postings.size() - offset) });
+			}
+			write(*pruned);
+		} else if (unlink(segment->path.c_str()) < 0 && errno != ENOENT) {
+			throw std::system_error(errno, std::generic_category(), "unlink " + segment->path);
+		}
+
+		std::lock_guard lock(mutex);
+		auto it = std::find(segments.begin(), segments.end(), segment);
+		if (pruned)
+			*it = pruned;
+		else
+			segments.erase(it);
+	}
+}
+
+void SearchIndex::candidates(std::string_view query,
+							 const std::function<bool(std::string_view id)> &visit) const
+{
+	std::vector<uint32_t> grams, docs;
+	trigrams(query, grams);
+	if (query.size() < min_query || grams.empty())
+		return;
+	std::time_t now = std::time(nullptr);
+
+	// The parts' postings are read whole, by trigram, and counted by ID. One that got them all
+	// is a candidate even when no single part has them. Doc positions order them newest first
+	struct Parts {
+		size_t trigrams = 0;  // The first ones of grams, in order
+		uint64_t newest = 0;
+	};
+	std::unordered_map<std::string, Parts> parts;
+	auto count_part = [&](const Doc &doc, size_t gram, uint64_t position) {
+		if (!doc.part || expired(doc.expires, now))
+			return;
+		auto it = gram == 0 ? parts.try_emplace(doc.id).first : parts.find(doc.id);
+		if (it == parts.end() || it->second.trigrams != gram)
+			return;
+		it->second.trigrams++;
+		it->second.newest = std::max(it->second.newest, position);
+	};
+	auto find_term = [](const std::vector<Term> &terms, uint32_t gram) -> const Term * {
+		auto it = std::lower_bound(terms.begin(), terms.end(), gram,
+								   [](const Term &t, uint32_t g) { return t.trigram < g; });
+		return it == terms.end() || it->trigram != gram ? nullptr : &*it;
+	};
+
+	// The live segment's matches are copied out, the sealed segments can be read without the
+	// lock once there's a reference to them
+	std::vector<std::string> live_matches;
+	std::vector<std::vector<std::pair<uint32_t, Doc>>> live_parts_of(grams.size());
+	std::vector<std::shared_ptr<const Segment>> current;
+	{
+		std::lock_guard lock(mutex);
+		current = segments;
+		std::vector<const LivePostings *> found;
+		for (size_t i = 0; i < grams.size(); i++) {
+			auto it = live_terms.find(grams[i]);
+			if (it == live_terms.end())
+				continue;
+			found.push_back(&it->second);
+			if (live_parts == 0)
+				continue;
+			decode(it->second.bytes, docs);
+			for (uint32_t doc : docs) {
+				if (live_docs[doc].part)
+					live_parts_of[i].emplace_back(doc, live_docs[doc]);
+			}
+		}
+		if (found.size() == grams.size()) {
+			std::sort(found.begin(), found.end(),
+					  [](const LivePostings *a, const LivePostings *b) { return a->count < b->count; });
+			decode(found[0]->bytes, docs);
+			for (size_t i = 1; i < found.size() && !docs.empty(); i++)
+				intersect(docs, found[i]->bytes);
+			for (auto doc = docs.rbegin(); doc != docs.rend(); doc++) {
+				if (!expired(live_docs[*doc].expires, now))
+					live_matches.push_back(live_docs[*doc].id);
+			}
+		}
+	}
+
+	for (size_t i = 0; i < grams.size(); i++) {
+		for (size_t s = 0; s < current.size(); s++) {
+			const Segment &segment = *current[s];
+			const Term *term = segment.parts ? find_term(segment.terms, grams[i]) : nullptr;
+			if (!term)
+				continue;
+			decode(std::string_view(segment.postings).substr(term->offset, term->size), docs);
+			for (uint32_t doc : docs)
+				count_part(segment.docs[doc], i, uint64_t(s + 1) << 32 | doc);
+		}
+		for (const auto &[doc, d] : live_parts_of[i])
+			count_part(d, i, uint64_t(current.size() + 1) << 32 | doc);
+	}
+	std::vector<std::pair<uint64_t, std::string_view>> part_matches;
+	for (const auto &[id, counted] : parts) {
+		if (counted.trigrams == grams.size())
+			part_matches.emplace_back(counted.newest, id);
+	}
+	std::sort(part_matches.rbegin(), part_matches.rend());
+
+	// Appendable pastes first, they're the ones still growing. Then the rest newest first, an
+	// ID is visited once however many of its docs matched
+	std::unordered_set<std::string_view> seen;
+	for (const auto &[position, id] : part_matches) {
+		if (seen.insert(id).second && !visit(id))
+			return;
+	}
+	for (const std::string &id : live_matches) {
+		if (seen.insert(id).second && !visit(id))
+			return;
+	}
+
+	std::vector<const Term *> found;
+	for (auto segment = current.rbegin(); segment != current.rend(); segment++) {
+		found.clear();
+		for (uint32_t gram : grams) {
+			const Term *term = find_term((*segment)->terms, gram);
+			if (!term)
+				break;
+			found.push_back(term);
+		}
+		if (found.size() != grams.size())
+			continue;
+
+		// Smallest postings first, the intersection can only shrink from there
+		std::sort(found.begin(), found.end(),
+				  [](const Term *a, const Term *b) { return a->count < b->count; });
+		std::string_view postings = (*segment)->postings;
+		decode(postings.substr(found[0]->offset, found[0]->size), docs);
+		for (size_t i = 1; i < found.size() && !docs.empty(); i++)
+			intersect(docs, postings.substr(found[i]->offset, found[i]->size));
+		for (auto doc = docs.rbegin(); doc != docs.rend(); doc++) {
+			const Doc &d = (*segment)->docs[*doc];
+			if (!expired(d.expires, now) && seen.insert(d.id).second && !visit(d.id))
+				return;
+		}
+	}
+}
+
+size_t SearchIndex::segmentCount() const
+{
+	std::lock_guard lock(mutex);
+	return segments.size();
+}
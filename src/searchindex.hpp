@@ -0,0 +1,107 @@
+#ifndef SEARCHINDEX_HPP
+#define SEARCHINDEX_HPP
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Trigram inverted index over paste contents, for substring search without reading every
+// paste. Each run of three bytes (ASCII lowercased) maps to the pastes containing it, so the
+// pastes that may contain a query are the intersection of its trigrams' postings. They can only
+// be candidates: matching trigrams don't mean the query is there in one piece, the caller reads
+// them to check.
+//
+// Pastes are indexed as they're stored (appends too, as more documents for the same ID) into a
+// live segment in memory. The documents of an appendable paste are its parts: a query may only
+// match across them, so their trigrams count together by ID. Once that's big or old enough it's sealed and written out as an
+// immutable segment file in the index directory, so the index survives restarts. Postings are
+// doc numbers local to their segment, delta + varint encoded in memory and on disk. Expired
+// pastes are skipped at lookup, and segments mostly made of them are rewritten without them
+// (or deleted) whenever the live segment is flushed.
+//
+// What's in the live segment is lost on a crash. Deleting the directory rebuilds the index
+// from p/ on the next start
+class SearchIndex {
+   public:
+	static constexpr size_t min_query = 3;
+	static constexpr size_t flush_docs = 1024;
+	static constexpr size_t flush_bytes = 8 << 20;  // Of live postings
+	static constexpr std::chrono::seconds flush_after { 300 };
+	static constexpr size_t max_indexed = 8 << 20;  // Of each paste, the rest isn't searchable
+
+   private:
+	struct Doc {
+		std::string id;
+		long long expires;	// -1 for never
+		bool part;			// Of an appendable paste, one of several docs maybe
+	};
+	struct Term {
+		uint32_t trigram;
+		uint32_t count;	 // Docs in its postings
+		size_t offset;
+		uint32_t size;
+	};
+	// Sealed, never changed again. Pruning makes a new one
+	struct Segment {
+		std::string path;
+		std::vector<Doc> docs;
+		std::vector<Term> terms;  // Sorted by trigram
+		std::string postings;
+		bool parts = false;	 // Any of its docs is a part
+	};
+	struct LivePostings {
+		std::string bytes;
+		uint32_t last = 0, count = 0;
+	};
+
+	std::string dir;
+	mutable std::mutex mutex;  // Everything below
+	std::vector<Doc> live_docs;
+	std::unordered_map<uint32_t, LivePostings> live_terms;
+	size_t live_bytes = 0;
+	size_t live_parts = 0;
+	std::chrono::steady_clock::time_point live_since;
+	std::vector<std::shared_ptr<const Segment>> segments;  // Oldest first
+	uint64_t next_segment = 1;
+	std::mutex flush_mutex;	 // One flush at a time, the files are written outside mutex
+
+	SearchIndex() = default;
+
+	std::shared_ptr<Segment> seal();  // The live segment, under mutex
+	void write(const Segment &segment) const;
+	std::shared_ptr<Segment> load(const std::string &path) const;
+	void persist();	 // flush, with flush_mutex held
+	void prune();
+	size_t rebuild();
+
+   public:
+	static SearchIndex &instance();
+
+	// Loads the segments in dir, or builds the index from the stored pastes if there are none.
+	// Returns how many pastes it has. Throws if dir can't be used
+	size_t open(const std::string &dir);
+	bool enabled() const { return !dir.empty(); }
+
+	// More content of id, appended to what was indexed of it before (if anything). Binary
+	// content isn't indexed. part is for appendable pastes, a query then matches across what
+	// was added for id rather than within each add
+	void add(std::string_view id, std::string_view content, long long expires_at,
+			 bool part = false);
+	// Calls visit with each paste that may contain query, ignoring ASCII case, newest first
+	// and once each, until it returns false. Queries shorter than min_query match nothing
+	void candidates(std::string_view query,
+					const std::function<bool(std::string_view id)> &visit) const;
+	// Writes out the live segment and prunes expired pastes
+	void flush();
+
+	size_t segmentCount() const;
+};
+
+#endif	// !SEARCHINDEX_HPP
@@ -0,0 +1,45 @@
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Returns a pointer to the first byte in [p, end) equal to any of Needles, or end. Compares 32
+// (AVX2) or 16 (SSE2) bytes per step and finishes the tail one byte at a time
+template <char... Needles>
+inline const char *find_any(const char *p, const char *end)
+{
+#if defined(__AVX2__)
+	for (; end - p >= 32; p += 32) {
+		__m256i chunk = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+		__m256i hits = _mm256_setzero_si256();
+		((hits = _mm256_or_si256(hits, _mm256_cmpeq_epi8(chunk, _mm256_set1_epi8(Needles)))),
+		 ...);
+		if (unsigned mask = _mm256_movemask_epi8(hits))
+			return p + __builtin_ctz(mask);
+	}
+#endif
+#if defined(__SSE2__)
+	for (; end - p >= 16; p += 16) {
+		__m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+		__m128i hits = _mm_setzero_si128();
+		((hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(Needles)))), ...);
+		if (unsigned mask = _mm_movemask_epi8(hits))
+			return p + __builtin_ctz(mask);
+	}
+#endif
+	for (; p < end; p++) {
+		if (((*p == Needles) || ...))
+			return p;
+	}
+	return end;
+}
+
+template <char... Needles>
+inline char *find_any(char *p, char *end)
+{
+	return const_cast<char *>(find_any<Needles...>(static_cast<const char *>(p), end));
+}
+
+#endif	// !SIMD_HPP
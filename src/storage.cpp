@@ -0,0 +1,366 @@
+#include "storage.hpp"
+#include "http/metrics.hpp"
+#include "searchindex.hpp"
+#include <algorithm>
+#include <charconv>
+#include <ctime>
+#include <fcntl.h>
+#include <mutex>
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <sys/stat.h>
+#include <system_error>
+#include <unistd.h>
+#include <utility>
+
+static bool valid_id(std::string_view id)
+{
+	return id.length() >= 4 &&
+		   id.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789") ==
+			 std::string_view::npos;
+}
+
+// "p/a/b/cdef" into out, reusing its buffer
+static void paste_path(std::string &out, std::string_view id)
+{
+	out.assign("p/").append(1, id[0]).append("/").append(1, id[1]).append("/").append(id.substr(2));
+}
+
+StoredPaste::StoredPaste(StoredPaste &&p) noexcept
+	: fd(std::exchange(p.fd, -1)), size(p.size), expiration(p.expiration), encoding(p.encoding),
+	  appendable(p.appendable)
+{
+}
+
+StoredPaste &StoredPaste::operator=(StoredPaste &&p) noexcept
+{
+	if (fd >= 0)
+		close(fd);
+	fd = std::exchange(p.fd, -1);
+	size = p.size;
+	expiration = p.expiration;
+	encoding = p.encoding;
+	appendable = p.appendable;
+	return *this;
+}
+
+StoredPaste::~StoredPaste()
+{
+	if (fd >= 0)
+		close(fd);
+}
+
+int StoredPaste::release()
+{
+	return std::exchange(fd, -1);
+}
+
+static void write_all(int fd, std::string_view data, const std::string &path)
+{
+	size_t written = 0;
+	while (written < data.size()) {
+		ssize_t n = write(fd, data.data() + written, data.size() - written);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			int err = errno;
+			close(fd);
+			throw std::system_error(err, std::generic_category(), "write " + path);
+		}
+		written += n;
+	}
+}
+
+long long expiration_time(std::string_view expiry)
+{
+	std::time_t now = std::time(nullptr);
+	if (expiry == "1h")
+		return now + 3600;
+	if (expiry == "1d")
+		return now + 86400;
+	if (expiry == "1w")
+		return now + 604800;
+	return -1;
+}
+
+bool save_paste_to_disk(const std::string &id, std::string_view content, std::string_view expiry)
+{
+	return save_paste_to_disk(id, content, expiration_time(expiry));
+}
+
+// Shard directories are made when the first paste of a shard needs them: the open is tried
+// first, and only fails with ENOENT then. Every other save skips the stat and the mkdirs
+static int create_paste_file(std::string &path, std::string_view id)
+{
+	paste_path(path, id);
+	// O_EXCL makes the existence check and the creation a single step, so two uploads can never
+	// end up sharing (and overwriting) the same ID
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd >= 0 || errno != ENOENT)
+		return fd;
+
+	// "p", "p/a" and "p/a/b"
+	for (size_t length : { 1, 3, 5 }) {
+		std::string dir = path.substr(0, length);
+		if (mkdir(dir.c_str(), 0755) < 0 && errno != EEXIST)
+			return -1;
+	}
+	return open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+}
+
+std::string write_token_hash(std::string_view token)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int length = 0;
+	EVP_Digest(token.data(), token.size(), digest, &length, EVP_sha256(), nullptr);
+	static constexpr char hex[] = "0123456789abcdef";
+	std::string out;
+	for (unsigned int i = 0; i < length; i++)
+		out.append(1, hex[digest[i] >> 4]).append(1, hex[digest[i] & 15]);
+	return out;
+}
+
+// "<expiration> gzip", "<expiration> append <token hash>" or just "<expiration>". Garbage, e.g.
+// a file cut short by a crash, counts as expired
+static void parse_meta(std::string_view meta, long long &expiration, Encoding &encoding,
+					   std::string_view &token_hash)
+{
+	const char *end = meta.data() + meta.size();
+	auto [rest, parsed] = std::from_chars(meta.data(), end, expiration);
+	if (parsed != std::errc())
+		expiration = 0;
+	meta = std::string_view(rest, end - rest);
+	while (meta.starts_with(' '))
+		meta.remove_prefix(1);
+	if (meta.starts_with("gzip")) {
+		encoding = Encoding::GZIP;
+	} else if (meta.starts_with("append ")) {
+		token_hash = meta.substr(7);
+		while (!token_hash.empty() && (token_hash.back() == '\n' || token_hash.back() == ' '))
+			token_hash.remove_suffix(1);
+	}
+}
+
+// Written whole every time, it only changes when a paste is sealed. Through a temporary file
+// renamed over it, a reader that caught it truncated would take the paste for expired and
+// delete it
+static void write_meta(const std::string &metapath, long long expiration, Encoding encoding,
+					   std::string_view token_hash)
+{
+	char meta[128];
+	char *end = std::to_chars(meta, meta + 24, expiration).ptr;
+	if (encoding != Encoding::IDENTITY) {
+		std::string_view codec = encoding_name(encoding);
+		*end++ = ' ';
+		end = std::copy(codec.begin(), codec.end(), end);
+	} else if (!token_hash.empty() && token_hash.size() <= 96) {
+		end = std::copy_n(" append ", 8, end);
+		end = std::copy(token_hash.begin(), token_hash.end(), end);
+	}
+	thread_local std::string tmppath;
+	tmppath.assign(metapath).append(".tmp");
+	int fd = open(tmppath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw std::system_error(errno, std::generic_category(), "open " + tmppath);
+	write_all(fd, std::string_view(meta, end - meta), tmppath);
+	close(fd);
+	if (rename(tmppath.c_str(), metapath.c_str()) < 0)
+		throw std::system_error(errno, std::generic_category(), "rename " + tmppath);
+}
+
+bool save_paste_to_disk(const std::string &id, std::string_view content, long long expiry_timestamp,
+						std::string_view token_hash)
+{
+	if (!valid_id(id))
+		throw std::invalid_argument("Invalid paste ID");
+
+	thread_local std::string filepath, metapath;
+	int fd = create_paste_file(filepath, id);
+	if (fd < 0) {
+		if (errno == EEXIST)
+			return false;
+		throw std::system_error(errno, std::generic_category(), "open " + filepath);
+	}
+
+	// Logs and source compress 5-10x, which saves disk, page cache and read I/O on every fetch.
+	// Pastes stay plain gzip files, so zcat still works on them
+	Encoding encoding = Encoding::IDENTITY;
+	std::string_view original = content;
+	std::string compressed;
+	if (content.size() >= store_compressed_min_size && token_hash.empty()) {
+		compressed = gzip_compress({ content }, 6);
+		if (compressed.size() < content.size() - content.size() / 8) {
+			content = compressed;
+			encoding = Encoding::GZIP;
+		}
+	}
+
+	write_all(fd, content, filepath);
+	close(fd);
+
+	metapath.assign(filepath).append(".meta");
+	write_meta(metapath, expiry_timestamp, encoding, token_hash);
+
+	SearchIndex::instance().add(id, original, expiry_timestamp, !token_hash.empty());
+	return true;
+}
+
+static std::optional<StoredPaste> open_paste_file(std::string_view id)
+{
+	if (!valid_id(id))
+		return std::nullopt;
+
+	// Paths are rebuilt in the same buffers every time, a lookup costs no allocations
+	thread_local std::string filepath, metapath;
+	paste_path(filepath, id);
+	metapath.assign(filepath).append(".meta");
+
+	StoredPaste paste;
+	paste.fd = open(filepath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (paste.fd < 0)
+		return std::nullopt;
+
+	// Small enough for one read
+	char meta[128];
+	int meta_fd = open(metapath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (meta_fd < 0)
+		return std::nullopt;
+	ssize_t meta_len = pread(meta_fd, meta, sizeof(meta), 0);
+	close(meta_fd);
+	if (meta_len < 0)
+		return std::nullopt;
+
+	std::string_view token_hash;
+	parse_meta(std::string_view(meta, meta_len), paste.expiration, paste.encoding, token_hash);
+	paste.appendable = !token_hash.empty();
+
+	if (paste.expiration != -1 && std::time(nullptr) > paste.expiration) {
+		std::error_code ec;
+		std::filesystem::remove(filepath, ec);
+		std::filesystem::remove(metapath, ec);
+
+		std::filesystem::path dirpath = std::filesystem::path(filepath).parent_path();
+		if (std::filesystem::is_empty(dirpath, ec))
+			std::filesystem::remove(dirpath, ec);
+		return std::nullopt;
+	}
+
+	struct stat st;
+	if (fstat(paste.fd, &st) < 0)
+		return std::nullopt;
+	paste.size = st.st_size;
+
+	return paste;
+}
+
+AppendResult append_paste(std::string_view id, std::string_view token, std::string_view data,
+						  bool seal, size_t &offset)
+{
+	if (!valid_id(id))
+		return AppendResult::MISSING;
+
+	thread_local std::string filepath, metapath;
+	paste_path(filepath, id);
+	metapath.assign(filepath).append(".meta");
+
+	// Appends to a paste go one at a time, so none can slip in between another's token check
+	// and its write, or after the seal
+	static std::mutex locks[64];
+	std::lock_guard lock(locks[std::hash<std::string_view>()(id) % std::size(locks)]);
+
+	char meta[128];
+	int meta_fd = open(metapath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (meta_fd < 0)
+		return AppendResult::MISSING;
+	ssize_t meta_len = pread(meta_fd, meta, sizeof(meta), 0);
+	close(meta_fd);
+	if (meta_len < 0)
+		return AppendResult::MISSING;
+	long long expiration;
+	Encoding encoding = Encoding::IDENTITY;
+	std::string_view token_hash;
+	parse_meta(std::string_view(meta, meta_len), expiration, encoding, token_hash);
+	if (expiration != -1 && std::time(nullptr) > expiration)
+		return AppendResult::MISSING;
+	if (token_hash.empty())
+		return AppendResult::SEALED;
+	std::string given = write_token_hash(token);
+	if (given.size() != token_hash.size()
+		|| CRYPTO_memcmp(given.data(), token_hash.data(), given.size()) != 0)
+		return AppendResult::WRONG_TOKEN;
+
+	int fd = open(filepath.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+	if (fd < 0)
+		return AppendResult::MISSING;
+	write_all(fd, data, filepath);
+	offset = lseek(fd, 0, SEEK_CUR) - data.size();
+
+	// With the two bytes before it, so trigrams across the boundary are indexed too
+	SearchIndex &index = SearchIndex::instance();
+	if (index.enabled()) {
+		thread_local std::string indexed;
+		char before[2];
+		size_t n_before = std::min<size_t>(offset, sizeof(before));
+		ssize_t got = pread(fd, before, n_before, offset - n_before);
+		indexed.assign(before, std::max<ssize_t>(got, 0)).append(data);
+		index.add(id, indexed, expiration, true);
+	}
+	close(fd);
+
+	if (seal)
+		write_meta(metapath, expiration, encoding, {});
+	return AppendResult::APPENDED;
+}
+
+std::optional<StoredPaste> open_paste(std::string_view id)
+{
+	std::optional<StoredPaste> paste = open_paste_file(id);
+	Metrics::add(paste ? Metrics::STORAGE_HITS : Metrics::STORAGE_MISSES);
+	return paste;
+}
+
+bool paste_finished(std::string_view id)
+{
+	std::optional<StoredPaste> paste = open_paste_file(id);
+	return !paste || !paste->appendable;
+}
+
+void read_paste(const StoredPaste &paste, const std::function<void(std::string_view)> &sink,
+				size_t max_size)
+{
+	thread_local char chunk[1 << 16];
+
+	if (paste.encoding == Encoding::IDENTITY) {
+		off_t offset = 0;
+		ssize_t n;
+		while (max_size
+			   && (n = pread(paste.fd, chunk, std::min(sizeof(chunk), max_size), offset)) > 0) {
+			sink(std::string_view(chunk, n));
+			offset += n;
+			max_size -= n;
+		}
+		return;
+	}
+
+	// Compressed pastes are small on disk, so they're read whole and inflated in chunks
+	std::string compressed(paste.size, '\0');
+	size_t got = 0;
+	while (got < compressed.size()) {
+		ssize_t n = pread(paste.fd, compressed.data() + got, compressed.size() - got, got);
+		if (n <= 0)
+			throw std::runtime_error("Short read on paste");
+		got += n;
+	}
+	gzip_decompress(compressed, sink, max_size);
+}
+
+std::string read_paste(const StoredPaste &paste)
+{
+	std::string content;
+	content.reserve(paste.encoding == Encoding::IDENTITY ? paste.size : paste.size * 4);
+	read_paste(paste, [&content](std::string_view chunk) { content.append(chunk); });
+	return content;
+}
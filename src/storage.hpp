@@ -0,0 +1,65 @@
+#ifndef STORAGE_HPP
+#define STORAGE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <optional>
+#include <string>
+#include <string_view>
+
+#include "http/compression.hpp"
+
+// Pastes live in p/<id[0]>/<id[1]>/<id[2:]>, with a .meta file next to them holding the
+// expiration timestamp and, for pastes stored compressed, the codec ("1792426069 gzip").
+// Appendable pastes are never compressed, their .meta has the SHA-256 of their write token
+// instead ("1792426069 append <hex>"), until they're sealed
+
+// Content at least this big is stored gzipped, if that saves at least an eighth of it
+static constexpr size_t store_compressed_min_size = 4096;
+
+// An open paste. Owns the content's fd, which stays valid even if the paste is deleted
+struct StoredPaste {
+	int fd = -1;
+	size_t size = 0;  // Bytes on disk, compressed if encoding says so
+	long long expiration = -1;
+	Encoding encoding = Encoding::IDENTITY;
+	bool appendable = false;
+
+	StoredPaste() = default;
+	StoredPaste(const StoredPaste &) = delete;
+	StoredPaste(StoredPaste &&) noexcept;
+	StoredPaste &operator=(const StoredPaste &) = delete;
+	StoredPaste &operator=(StoredPaste &&) noexcept;
+	~StoredPaste();
+
+	int release();	// Hands the fd over to the caller
+};
+
+// Unix time a paste uploaded now with this expiration ("1h", "1d", "1w") expires at, -1 for never
+long long expiration_time(std::string_view expiration);
+// Returns false if the ID is already taken, nothing is overwritten in that case
+bool save_paste_to_disk(const std::string &id, std::string_view content,
+						std::string_view expiration);
+// Same with the Unix time it expires at, as replicas get it. With a token_hash the paste can
+// be appended to by whoever has the token
+bool save_paste_to_disk(const std::string &id, std::string_view content, long long expires_at,
+						std::string_view token_hash = {});
+std::string write_token_hash(std::string_view token);
+
+enum class AppendResult { APPENDED, MISSING, WRONG_TOKEN, SEALED };
+// Appends data to the end of an appendable paste, offset is where it went. A sealed paste
+// takes no more appends, seal seals it after this one
+AppendResult append_paste(std::string_view id, std::string_view token, std::string_view data,
+						  bool seal, size_t &offset);
+// nullopt if missing or expired. Expired pastes are deleted on the way (lazy expiration)
+std::optional<StoredPaste> open_paste(std::string_view id);
+// Whether no more appends can come: the paste was sealed, never appendable, or is gone
+bool paste_finished(std::string_view id);
+// Decoded content, handed to sink in chunks so it never has to be held as a whole. Only its
+// first max_size bytes are read
+void read_paste(const StoredPaste &paste, const std::function<void(std::string_view)> &sink,
+				size_t max_size = SIZE_MAX);
+std::string read_paste(const StoredPaste &paste);
+
+#endif	// !STORAGE_HPP
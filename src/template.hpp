@@ -0,0 +1,38 @@
+#ifndef TEMPLATE_HPP
+#define TEMPLATE_HPP
+
+#include <array>
+#include <cstddef>
+#include <string_view>
+
+// Page templates with "{{name}}" slots, split into their static fragments at compile time.
+// Rendering is emitting fragment, value, fragment... in order, so the static parts can go out
+// as their own iovecs (see HttpResponse::appendStaticBody) without ever being copied. Slot names
+// are only there for readability, values are given by position
+
+consteval size_t count_slots(std::string_view tpl)
+{
+	size_t n = 0;
+	for (size_t pos = tpl.find("{{"); pos != std::string_view::npos; pos = tpl.find("{{", pos + 2))
+		n++;
+	return n;
+}
+
+template <size_t Slots>
+consteval std::array<std::string_view, Slots + 1> split_template(std::string_view tpl)
+{
+	std::array<std::string_view, Slots + 1> fragments {};
+	size_t start = 0;
+	for (size_t i = 0; i < Slots; i++) {
+		size_t open = tpl.find("{{", start);
+		size_t close = tpl.find("}}", open);
+		if (close == std::string_view::npos)
+			throw "Unterminated template slot";	 // Fails the build
+		fragments[i] = tpl.substr(start, open - start);
+		start = close + 2;
+	}
+	fragments[Slots] = tpl.substr(start);
+	return fragments;
+}
+
+#endif	// !TEMPLATE_HPP
@@ -1,141 +1,349 @@
 #include "utils.hpp"
+#include <algorithm>
+#include <array>
 #include <cstddef>
-#include <ctime>
-#include <filesystem>
-#include <fstream>
-#include <random>
-#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <strings.h>
+#include <sys/random.h>
+#include <system_error>
 
-std::string url_decode(const std::string &src)
+#include "simd.hpp"
+
+// -1 for anything that isn't a hex digit
+static constexpr std::array<int8_t, 256> hex_values = [] {
+	std::array<int8_t, 256> t {};
+	t.fill(-1);
+	for (int i = 0; i < 10; i++)
+		t['0' + i] = i;
+	for (int i = 0; i < 6; i++)
+		t['a' + i] = t['A' + i] = 10 + i;
+	return t;
+}();
+
+// Decodes the %XX escape at r into w. False if it is truncated or not hex
+static inline bool decode_escape(const char *r, const char *end, char *w)
+{
+	if (end - r < 3)
+		return false;
+	int hi = hex_values[static_cast<unsigned char>(r[1])];
+	int lo = hex_values[static_cast<unsigned char>(r[2])];
+	if ((hi | lo) < 0)
+		return false;
+	*w = static_cast<char>(hi << 4 | lo);
+	return true;
+}
+
+bool url_decode(std::string &s)
 {
-	std::string ret;
-	char ch;
-	size_t i;
-	int ii;
-	for (i = 0; i < src.length(); i++) {
-		if (src[i] == '%') {
-			sscanf(src.substr(i + 1, 2).c_str(), "%x", &ii);
-			ch = static_cast<char>(ii);
-			ret += ch;
-			i = i + 2;
-		} else if (src[i] == '+') {
-			ret += ' ';
+	char *r = s.data(), *w = r, *end = r + s.size();
+
+	for (;;) {
+		char *hit = find_any<'%', '+'>(r, end);
+		if (w != r)
+			std::memmove(w, r, hit - r);
+		w += hit - r;
+		r = hit;
+
+		if (r == end)
+			break;
+		if (*r == '+') {
+			*w++ = ' ';
+			r++;
 		} else {
-			ret += src[i];
+			if (!decode_escape(r, end, w++))
+				return false;
+			r += 3;
 		}
 	}
-	return ret;
+
+	s.resize(w - s.data());
+	return true;
 }
 
-std::unordered_map<std::string, std::string> parse_form_data(const std::string &body)
+namespace {
+
+// Where parse_form() writes: over the body it reads, or appended to a string reserved to the
+// body's size. Either way nothing moves once written, decoding never grows the data
+struct InPlace {
+	char *w;
+	char *pos() const { return w; }
+	void put(const char *r, size_t n)
+	{
+		if (w != r)
+			std::memmove(w, r, n);
+		w += n;
+	}
+	void put(char c) { *w++ = c; }
+};
+
+struct AppendTo {
+	std::pmr::string &out;
+	char *pos() { return out.data() + out.size(); }
+	void put(const char *r, size_t n) { out.append(r, n); }
+	void put(char c) { out.push_back(c); }
+};
+
+template <typename Out>
+std::optional<FormFields> parse_form(const char *r, const char *end, Out out)
 {
-	std::unordered_map<std::string, std::string> data;
-	std::stringstream ss(body);
-	std::string pair;
-
-	while (std::getline(ss, pair, '&')) {
-		size_t pos = pair.find('=');
-		if (pos != std::string::npos) {
-			std::string key = pair.substr(0, pos);
-			std::string val = url_decode(pair.substr(pos + 1));
-			data[key] = val;
+	FormFields fields;
+
+	// Single pass: the reader jumps between delimiters and escapes, and the decoded bytes are
+	// written behind it
+	char *key_start = out.pos(), *key_end = nullptr;  // key_end is null until the pair's '='
+
+	for (;;) {
+		const char *hit = find_any<'&', '=', '%', '+'>(r, end);
+		out.put(r, hit - r);
+		r = hit;
+
+		if (r == end || *r == '&') {
+			// Pairs without '=' are ignored
+			if (key_end)
+				fields.emplace_back(std::string_view(key_start, key_end - key_start),
+									std::string_view(key_end, out.pos() - key_end));
+			if (r == end)
+				break;
+			r++;
+			key_start = out.pos();
+			key_end = nullptr;
+			continue;
+		}
+
+		switch (*r) {
+		case '=':
+			if (key_end)
+				out.put('=');  // Only the first '=' splits
+			else
+				key_end = out.pos();
+			r++;
+			break;
+		case '+':
+			out.put(' ');
+			r++;
+			break;
+		case '%': {
+			char c;
+			if (!decode_escape(r, end, &c))
+				return std::nullopt;
+			out.put(c);
+			r += 3;
+			break;
+		}
 		}
 	}
-	return data;
+
+	return fields;
 }
 
-void save_paste_to_disk(const std::string &id, const std::string &content,
-						const std::string &expiry)
+}  // namespace
+
+std::optional<FormFields> parse_form_data(std::span<char> body)
 {
-	if (id.length() < 4)
-		return;
+	return parse_form(body.data(), body.data() + body.size(), InPlace { body.data() });
+}
+
+std::optional<FormFields> parse_form_data(std::string_view body, std::pmr::string &out)
+{
+	out.clear();
+	out.reserve(body.size());
+	return parse_form(body.data(), body.data() + body.size(), AppendTo { out });
+}
 
-	if (id.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789")
-		!= std::string::npos) {
-		return;
+std::optional<std::string_view> form_value(const FormFields &fields, std::string_view key)
+{
+	// Last one wins on repeated keys
+	for (auto it = fields.rbegin(); it != fields.rend(); it++) {
+		if (it->first == key)
+			return it->second;
 	}
+	return std::nullopt;
+}
+
+// Case-insensitive, for header names and media types
+static bool iequals(std::string_view a, std::string_view b)
+{
+	return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+static std::string_view trim(std::string_view s)
+{
+	size_t start = s.find_first_not_of(" \t");
+	if (start == std::string_view::npos)
+		return {};
+	return s.substr(start, s.find_last_not_of(" \t") - start + 1);
+}
+
+// Looks up a parameter in a header value like `form-data; name="content"; filename="a.txt"`
+static std::optional<std::string_view> header_param(std::string_view value, std::string_view param)
+{
+	size_t pos = value.find(';');
+	while (pos != std::string_view::npos) {
+		size_t next = value.find(';', pos + 1);
+		std::string_view item = trim(value.substr(pos + 1, next == std::string_view::npos ? next : next - pos - 1));
+		pos = next;
 
-	if (!std::filesystem::is_directory("p/"))
-		std::filesystem::create_directory("p/");
-
-	std::string shard1 = "p/" + id.substr(0, 1) + "/";
-	std::string shard2 = shard1 + id.substr(1, 1) + "/";
-	std::filesystem::create_directory(shard1);
-	std::filesystem::create_directory(shard2);
-	std::ofstream output(shard2 + id.substr(2));
-	std::ofstream metadata(shard2 + id.substr(2) + ".meta");
-
-	long long expiry_timestamp = -1;
-	std::time_t now = std::time(nullptr);
-
-	if (expiry == "1h") {
-		expiry_timestamp = now + 3600;	// +1 hour
-	} else if (expiry == "1d") {
-		expiry_timestamp = now + 86400;	 // +24 hours
-	} else if (expiry == "1w") {
-		expiry_timestamp = now + 604800;  // +7 days
+		size_t eq = item.find('=');
+		if (eq == std::string_view::npos || !iequals(trim(item.substr(0, eq)), param))
+			continue;
+		std::string_view v = trim(item.substr(eq + 1));
+		if (v.size() >= 2 && v.front() == '"' && v.back() == '"')
+			v = v.substr(1, v.size() - 2);
+		return v;
 	}
-	metadata << expiry_timestamp;
-	output << content;
+	return std::nullopt;
+}
 
-	output.close();
-	metadata.close();
+std::string_view media_type(std::string_view content_type)
+{
+	return trim(content_type.substr(0, content_type.find(';')));
 }
 
-std::string html_escape(const std::string_view &data)
+std::optional<std::string_view> multipart_boundary(std::string_view content_type)
 {
-	std::string buffer;
+	if (!iequals(media_type(content_type), "multipart/form-data"))
+		return std::nullopt;
+	auto boundary = header_param(content_type, "boundary");
+	if (!boundary || boundary->empty() || boundary->size() > 70)  // RFC 2046 limit
+		return std::nullopt;
+	return boundary;
+}
 
-	// Spare space to minimize reallocations
-	buffer.reserve(data.size() + (data.size() >> 3));
+std::optional<std::vector<MultipartPart>> parse_multipart(std::string_view body,
+														   std::string_view boundary)
+{
+	// Every delimiter but the first is "\r\n--boundary". The searcher is built once and skips
+	// through the data in strides of up to the delimiter length, so large files cost little
+	// more than a memchr and nothing is copied
+	std::string delimiter = "\r\n--" + std::string(boundary);
+	std::boyer_moore_horspool_searcher searcher(delimiter.begin(), delimiter.end());
+	auto find_delimiter = [&](size_t from) {
+		return static_cast<size_t>(std::search(body.begin() + from, body.end(), searcher) - body.begin());
+	};
 
-	size_t pos = 0;
-	while (pos < data.size()) {
-		size_t next = data.find_first_of("&\"'<>", pos);
-		if (next == std::string_view::npos) {
-			buffer.append(data.substr(pos));
-			break;
+	size_t pos;
+	if (body.substr(0, delimiter.size() - 2) == std::string_view(delimiter).substr(2)) {
+		pos = delimiter.size() - 2;
+	} else {
+		pos = find_delimiter(0);  // Skip the preamble
+		if (pos == body.size())
+			return std::nullopt;
+		pos += delimiter.size();
+	}
+
+	std::vector<MultipartPart> parts;
+	for (;;) {
+		// A delimiter is followed by "--" if it's the last one, by CRLF otherwise
+		if (body.substr(pos, 2) == "--")
+			return parts;
+		if (body.substr(pos, 2) != "\r\n")
+			return std::nullopt;
+		pos += 2;
+
+		MultipartPart part;
+		while (body.substr(pos, 2) != "\r\n") {
+			size_t line_end = body.find("\r\n", pos);
+			if (line_end == std::string_view::npos)
+				return std::nullopt;
+			std::string_view line = body.substr(pos, line_end - pos);
+			pos = line_end + 2;
+
+			size_t colon = line.find(':');
+			if (colon == std::string_view::npos)
+				continue;
+			std::string_view key = trim(line.substr(0, colon)), value = trim(line.substr(colon + 1));
+			if (iequals(key, "Content-Disposition")) {
+				part.name = header_param(value, "name").value_or("");
+				part.filename = header_param(value, "filename").value_or("");
+			} else if (iequals(key, "Content-Type")) {
+				part.content_type = value;
+			}
 		}
+		pos += 2;
+
+		size_t data_end = find_delimiter(pos);
+		if (data_end == body.size())
+			return std::nullopt;
+		part.data = body.substr(pos, data_end - pos);
+		parts.push_back(part);
+		pos = data_end + delimiter.size();
+	}
+}
 
-		buffer.append(data.substr(pos, next - pos));
+template <typename String>
+void html_escape(String &out, std::string_view data)
+{
+	// Spare space to minimize reallocations
+	out.reserve(out.size() + data.size() + (data.size() >> 3));
 
-		switch (data[next]) {
+	// Runs without special characters are found with SIMD and copied in one go. 16 bytes a step,
+	// 32 with make avx2, which only pays off on long runs: code, with a special character every
+	// few bytes, escapes no faster
+	const char *pos = data.data(), *end = pos + data.size();
+	for (;;) {
+		const char *next = find_any<'&', '"', '\'', '<', '>'>(pos, end);
+		out.append(pos, next - pos);
+		if (next == end)
+			break;
+
+		switch (*next) {
 		case '&':
-			buffer.append("&amp;");
+			out.append("&amp;");
 			break;
 		case '\"':
-			buffer.append("&quot;");
+			out.append("&quot;");
 			break;
 		case '\'':
-			buffer.append("&apos;");
+			out.append("&apos;");
 			break;
 		case '<':
-			buffer.append("&lt;");
+			out.append("&lt;");
 			break;
 		case '>':
-			buffer.append("&gt;");
+			out.append("&gt;");
 			break;
 		}
 
 		pos = next + 1;
 	}
+}
 
+template void html_escape(std::string &out, std::string_view data);
+template void html_escape(std::pmr::string &out, std::string_view data);
+
+std::string html_escape(std::string_view data)
+{
+	std::string buffer;
+	html_escape(buffer, data);
 	return buffer;
 }
 
 std::string generate_id(int length)
 {
-	const std::string charset = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	static constexpr std::string_view charset =
+	  "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+	// Bytes come from the kernel CSPRNG, fetched in batches so most IDs cost no syscall
+	thread_local unsigned char pool[256];
+	thread_local size_t pool_pos = sizeof(pool);
 
-	// Generador de números aleatorios moderno
-	std::random_device rd;
-	std::mt19937 generator(rd());
-	std::uniform_int_distribution<> distribution(0, charset.size() - 1);
+	char id[64];
+	length = std::clamp(length, 1, static_cast<int>(sizeof(id)));
 
-	std::string id;
-	for (int i = 0; i < length; ++i) {
-		id += charset[distribution(generator)];
+	for (int i = 0; i < length;) {
+		if (pool_pos == sizeof(pool)) {
+			ssize_t n = getrandom(pool, sizeof(pool), 0);
+			if (n != sizeof(pool))
+				throw std::system_error(errno, std::generic_category(), "getrandom");
+			pool_pos = 0;
+		}
+		unsigned char b = pool[pool_pos++];
+		// 248 = 4 * 62, rejecting the rest keeps every character equally likely
+		if (b < 248)
+			id[i++] = charset[b % 62];
 	}
 
-	return id;
+	return std::string(id, length);
 }
@@ -1,15 +1,37 @@
 #ifndef UTILS_HPP
 #define UTILS_HPP
+#include <memory_resource>
+#include <optional>
+#include <span>
 #include <string>
-
 #include <string_view>
-#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using FormFields = std::vector<std::pair<std::string_view, std::string_view>>;
+
+// Both decode in place. The views returned by parse_form_data point into body, and either fails
+// on a malformed %XX escape
+std::optional<FormFields> parse_form_data(std::span<char> body);
+// The same, decoding into out instead, which the views then point into. body is left as it is
+std::optional<FormFields> parse_form_data(std::string_view body, std::pmr::string &out);
+std::optional<std::string_view> form_value(const FormFields &fields, std::string_view key);
+bool url_decode(std::string &s);
+
+struct MultipartPart {
+	std::string_view name, filename, content_type, data;
+};
 
-std::unordered_map<std::string, std::string> parse_form_data(const std::string &body);
-std::string url_decode(const std::string &src);
+// "text/plain; charset=utf-8" -> "text/plain"
+std::string_view media_type(std::string_view content_type);
+std::optional<std::string_view> multipart_boundary(std::string_view content_type);
+// Parts point into body. nullopt if the body is not valid multipart/form-data
+std::optional<std::vector<MultipartPart>> parse_multipart(std::string_view body,
+														   std::string_view boundary);
 std::string generate_id(int length = 6);
-void save_paste_to_disk(const std::string &id, const std::string &content,
-						const std::string &expiration);
-std::string html_escape(const std::string_view &data);
+std::string html_escape(std::string_view data);
+// Appends the escaped data to out, a std::string or a std::pmr::string
+template <typename String>
+void html_escape(String &out, std::string_view data);
 
 #endif
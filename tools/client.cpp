@@ -0,0 +1,146 @@
+#include "client.hpp"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+void ResponseParser::reset()
+{
+	state = HEAD;
+	remaining = 0;
+	line.clear();
+	status = 0;
+	head.clear();
+	body.clear();
+}
+
+std::string_view ResponseParser::header(std::string_view name) const
+{
+	size_t pos = head.find("\r\n");
+	while (pos != std::string::npos) {
+		size_t start = pos + 2, end = head.find("\r\n", start);
+		std::string_view line(head.data() + start,
+							  (end == std::string::npos ? head.size() : end) - start);
+		size_t colon = line.find(':');
+		if (colon == name.size() && strncasecmp(line.data(), name.data(), colon) == 0) {
+			std::string_view value = line.substr(colon + 1);
+			while (!value.empty() && value.front() == ' ')
+				value.remove_prefix(1);
+			return value;
+		}
+		pos = end;
+	}
+	return {};
+}
+
+bool ResponseParser::parseHead()
+{
+	// "HTTP/1.1 200 OK"
+	if (head.size() < 12 || head.compare(0, 5, "HTTP/") != 0)
+		return false;
+	auto [ptr, ec] = std::from_chars(head.data() + 9, head.data() + 12, status);
+	if (ec != std::errc())
+		return false;
+
+	std::string_view encoding = header("Transfer-Encoding");
+	if (encoding.find("chunked") != std::string_view::npos) {
+		state = CHUNK_SIZE;
+		return true;
+	}
+	std::string_view length = header("Content-Length");
+	remaining = 0;
+	if (!length.empty()) {
+		auto [p, e] = std::from_chars(length.data(), length.data() + length.size(), remaining);
+		if (e != std::errc())
+			return false;
+	}
+	state = remaining ? BODY : DONE;
+	return true;
+}
+
+long ResponseParser::feed(const char *data, size_t len)
+{
+	size_t i = 0;
+	while (i < len && state != DONE) {
+		if (state == BODY || state == CHUNK_DATA) {
+			size_t n = std::min(remaining, len - i);
+			if (keep_body)
+				body.append(data + i, n);
+			i += n;
+			remaining -= n;
+			if (remaining == 0)
+				state = state == BODY ? DONE : CHUNK_END;
+			continue;
+		}
+
+		// Everything else is line based
+		const char *nl = static_cast<const char *>(memchr(data + i, '\n', len - i));
+		size_t n = (nl ? nl - data + 1 : len) - i;
+		line.append(data + i, n);
+		i += n;
+		if (!nl)
+			break;
+		line.pop_back();
+		if (!line.empty() && line.back() == '\r')
+			line.pop_back();
+
+		switch (state) {
+		case HEAD:
+			if (line.empty()) {
+				if (!parseHead())
+					return -1;
+			} else {
+				if (!head.empty())
+					head += "\r\n";
+				head += line;
+			}
+			break;
+		case CHUNK_SIZE: {
+			auto [ptr, ec] = std::from_chars(line.data(), line.data() + line.size(), remaining, 16);
+			if (ec != std::errc())
+				return -1;
+			state = remaining ? CHUNK_DATA : TRAILER;
+			break;
+		}
+		case CHUNK_END:
+			state = CHUNK_SIZE;
+			break;
+		case TRAILER:
+			if (line.empty())
+				state = DONE;
+			break;
+		default:
+			break;
+		}
+		line.clear();
+	}
+	return i;
+}
+
+int connect_to(const std::string &host, int port, bool nonblocking)
+{
+	struct addrinfo hints = {}, *res;
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0)
+		return -1;
+
+	int fd = socket(res->ai_family, SOCK_STREAM | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+	if (fd >= 0) {
+		int one = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+		if (connect(fd, res->ai_addr, res->ai_addrlen) < 0 && errno != EINPROGRESS) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	return fd;
+}
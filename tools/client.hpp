@@ -0,0 +1,43 @@
+#ifndef CLIENT_HPP
+#define CLIENT_HPP
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+// Bits shared by the load generator and the replay tool
+
+// Incremental HTTP/1.1 response parser. Handles Content-Length and chunked bodies, which is all
+// posthaste ever sends
+class ResponseParser {
+   private:
+	enum State { HEAD, BODY, CHUNK_SIZE, CHUNK_DATA, CHUNK_END, TRAILER, DONE };
+	State state = HEAD;
+	size_t remaining = 0;
+	std::string line;
+
+	bool parseHead();
+
+   public:
+	int status = 0;
+	std::string head;  // Status line and headers, without the final empty line
+	std::string body;
+	bool keep_body = true;	// The load generator only needs the body of POSTs
+
+	// Consumes up to len bytes and returns how many were used. The rest belong to the next
+	// response. Returns -1 if the response is malformed
+	long feed(const char *data, size_t len);
+	bool done() const
+	{
+		return state == DONE;
+	}
+	void reset();
+
+	std::string_view header(std::string_view name) const;
+};
+
+// TCP connect to host:port with Nagle off. Non-blocking ones are still connecting when this
+// returns. -1 on failure
+int connect_to(const std::string &host, int port, bool nonblocking = true);
+
+#endif	// !CLIENT_HPP
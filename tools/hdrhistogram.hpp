@@ -0,0 +1,97 @@
+#ifndef HDRHISTOGRAM_HPP
+#define HDRHISTOGRAM_HPP
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+// HdrHistogram with 3 significant digits, for nanosecond values from 1 ns up to ~137 s. Same
+// layout as the reference implementation: buckets of 2048 sub-buckets, each bucket twice as wide
+// as the previous one, so any value is stored with a relative error under 0.1%
+class HdrHistogram {
+   private:
+	static constexpr int sub_bucket_half_magnitude = 10;
+	static constexpr int64_t sub_bucket_count = int64_t(1) << (sub_bucket_half_magnitude + 1);
+	static constexpr int64_t sub_bucket_half_count = sub_bucket_count / 2;
+	static constexpr int64_t sub_bucket_mask = sub_bucket_count - 1;
+	static constexpr int bucket_count = 28;	 // 2048 << 27 ns ~ 137 s
+
+	std::vector<uint64_t> counts;
+	uint64_t total = 0;
+	int64_t max_value = 0;
+
+	static int bucketIndex(int64_t value)
+	{
+		return 64 - __builtin_clzll(value | sub_bucket_mask) - (sub_bucket_half_magnitude + 1);
+	}
+
+	static size_t countsIndex(int64_t value)
+	{
+		int bucket = bucketIndex(value);
+		int64_t sub_bucket = value >> bucket;
+		return ((bucket + 1) << sub_bucket_half_magnitude) + (sub_bucket - sub_bucket_half_count);
+	}
+
+	// Highest value that lands in the same slot as index
+	static int64_t highestEquivalent(size_t index)
+	{
+		int bucket = int(index >> sub_bucket_half_magnitude) - 1;
+		int64_t sub_bucket = (index & (sub_bucket_half_count - 1)) + sub_bucket_half_count;
+		if (bucket < 0) {
+			sub_bucket -= sub_bucket_half_count;
+			bucket = 0;
+		}
+		return (sub_bucket << bucket) + (int64_t(1) << bucket) - 1;
+	}
+
+   public:
+	static constexpr int64_t highest_trackable = (sub_bucket_count << (bucket_count - 1)) - 1;
+
+	HdrHistogram() : counts((bucket_count + 1) * sub_bucket_half_count)
+	{
+	}
+
+	void record(int64_t value, uint64_t n = 1)
+	{
+		value = std::clamp<int64_t>(value, 0, highest_trackable);
+		counts[countsIndex(value)] += n;
+		total += n;
+		max_value = std::max(max_value, value);
+	}
+
+	void add(const HdrHistogram &other)
+	{
+		for (size_t i = 0; i < counts.size(); i++)
+			counts[i] += other.counts[i];
+		total += other.total;
+		max_value = std::max(max_value, other.max_value);
+	}
+
+	uint64_t count() const
+	{
+		return total;
+	}
+
+	int64_t max() const
+	{
+		return max_value;
+	}
+
+	// percentile in [0, 100]
+	int64_t valueAt(double percentile) const
+	{
+		if (total == 0)
+			return 0;
+		uint64_t wanted = std::max<uint64_t>(1, uint64_t(std::ceil(percentile / 100 * total)));
+		uint64_t seen = 0;
+		for (size_t i = 0; i < counts.size(); i++) {
+			seen += counts[i];
+			if (seen >= wanted)
+				return std::min(highestEquivalent(i), max_value);
+		}
+		return max_value;
+	}
+};
+
+#endif	// !HDRHISTOGRAM_HPP
@@ -0,0 +1,461 @@
+// HTTP load generator for posthaste. Drives a mix of realistic requests over keep-alive
+// connections and reports latency percentiles per request type.
+//
+// In open loop mode (-r) requests are scheduled at a constant rate whether or not the server
+// keeps up, and latency is measured from the time a request was *meant* to be sent. A stalled
+// server therefore shows up in the percentiles instead of silently slowing the generator down
+// (coordinated omission). Closed loop mode sends the next request as soon as the previous one
+// is answered, which measures service time and maximum throughput
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <thread>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "client.hpp"
+#include "hdrhistogram.hpp"
+
+using namespace std;
+
+enum Kind { LANDING, HELP, POST, GET, NOT_FOUND, N_KINDS };
+static const char *kind_names[N_KINDS] = { "landing", "help", "post", "get", "404" };
+
+struct Options {
+	string host = "127.0.0.1";
+	int port = 80;
+	int connections = 64;
+	int threads = 1;
+	double duration_s = 10;
+	double rate = 0;  // Requests per second over all connections, 0 for closed loop
+	double weights[N_KINDS] = { 5, 5, 10, 70, 10 };
+	size_t post_min = 64, post_max = 64 << 10;
+	double zipf = 1.0;
+	int seed_pastes = 200;
+};
+
+struct Stats {
+	HdrHistogram latency;
+	uint64_t requests = 0, errors = 0, bytes = 0;
+};
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1'000'000'000LL + ts.tv_nsec;
+}
+
+// Paste bodies are cut out of this, letters only so they need no urlencoding
+static string filler;
+
+static string build_request(Kind kind, const Options &opt, const vector<string> &ids,
+							mt19937_64 &rng)
+{
+	static const char *scans[]
+	  = { "/wp-login.php", "/.env", "/admin", "/.git/config", "/phpmyadmin/", "/p" };
+	string host = "Host: " + opt.host + "\r\n";
+
+	switch (kind) {
+	case LANDING:
+		return "GET / HTTP/1.1\r\n" + host
+			 + "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+			   "Accept: text/html,application/xhtml+xml,*/*;q=0.8\r\n"
+			   "Accept-Encoding: gzip, deflate, br\r\n\r\n";
+	case HELP:
+		return "GET / HTTP/1.1\r\n" + host + "User-Agent: curl/8.5.0\r\nAccept: */*\r\n\r\n";
+	case POST: {
+		// Log-uniform sizes, most pastes are small but the big ones matter
+		uniform_real_distribution<double> u(log(opt.post_min), log(opt.post_max));
+		size_t size = min(size_t(exp(u(rng))), filler.size());
+		string body = "expiration=1h&content=" + filler.substr(rng() % (filler.size() - size + 1), size);
+		return "POST /paste HTTP/1.1\r\n" + host
+			 + "User-Agent: curl/8.5.0\r\n"
+			   "Content-Type: application/x-www-form-urlencoded\r\n"
+			   "Content-Length: "
+			 + to_string(body.size()) + "\r\n\r\n" + body;
+	}
+	case GET: {
+		// Zipf over the pastes seen so far, newest first. Inverse CDF of the continuous power law,
+		// close enough to the discrete one and cheap for a population that keeps growing
+		double n = ids.size(), u = uniform_real_distribution<double>(0, 1)(rng);
+		double x = opt.zipf == 1 ? pow(n, u)
+								 : pow((pow(n, 1 - opt.zipf) - 1) * u + 1, 1 / (1 - opt.zipf));
+		size_t rank = min<size_t>(max<size_t>(size_t(x), 1), ids.size());
+		return "GET /p/" + ids[ids.size() - rank] + " HTTP/1.1\r\n" + host
+			 + "User-Agent: Mozilla/5.0\r\nAccept-Encoding: gzip\r\n\r\n";
+	}
+	default:
+		return string("GET ") + scans[rng() % size(scans)] + " HTTP/1.1\r\n" + host
+			 + "User-Agent: Mozilla/5.0 zgrab/0.x\r\n\r\n";
+	}
+}
+
+static bool expected_status(Kind kind, int status)
+{
+	return kind == NOT_FOUND ? status == 404 : status == 200;
+}
+
+// "/p/<id>\n", what posthaste answers curl
+static string posted_id(const string &body)
+{
+	size_t slash = body.rfind('/');
+	if (slash == string::npos)
+		return "";
+	string id = body.substr(slash + 1);
+	while (!id.empty() && (id.back() == '\n' || id.back() == '\r'))
+		id.pop_back();
+	return id;
+}
+
+// Blocking POSTs before the run, so GETs have something to ask for from the start
+static vector<string> seed(const Options &opt, int count)
+{
+	vector<string> ids;
+	mt19937_64 rng(42);
+	for (int i = 0; i < count; i++) {
+		int fd = connect_to(opt.host, opt.port, false);
+		if (fd < 0)
+			break;
+		string req = build_request(POST, opt, ids, rng);
+		if (send(fd, req.data(), req.size(), MSG_NOSIGNAL) != ssize_t(req.size())) {
+			close(fd);
+			break;
+		}
+		ResponseParser parser;
+		char buf[4096];
+		while (!parser.done()) {
+			ssize_t n = recv(fd, buf, sizeof(buf), 0);
+			if (n <= 0 || parser.feed(buf, n) < 0)
+				break;
+		}
+		close(fd);
+		if (parser.done() && parser.status == 200)
+			ids.push_back(posted_id(parser.body));
+	}
+	return ids;
+}
+
+struct Conn {
+	int fd = -1;
+	bool busy = false;
+	Kind kind = LANDING;
+	string out;
+	size_t out_pos = 0;
+	size_t received = 0;
+	ResponseParser parser;
+	int64_t intended = 0;  // When the request should have gone out
+};
+
+// One per thread: its own epoll, its share of connections and of the rate
+class Worker {
+   private:
+	const Options &opt;
+	int epoll_fd;
+	vector<Conn> conns;
+	vector<string> ids;	 // Pastes known to this worker: the seeds plus its own POSTs
+	mt19937_64 rng;
+	discrete_distribution<int> mix;
+	deque<int64_t> pending;	 // Open loop: scheduled sends waiting for a free connection
+
+   public:
+	Stats stats[N_KINDS];
+	uint64_t unfinished = 0, connect_errors = 0;
+
+	Worker(const Options &o, int n_conns, const vector<string> &seeds, uint64_t seed)
+		: opt(o), conns(n_conns), ids(seeds), rng(seed), mix(begin(o.weights), end(o.weights))
+	{
+		epoll_fd = epoll_create1(0);
+		for (size_t i = 0; i < conns.size(); i++)
+			reconnect(i);
+	}
+
+	~Worker()
+	{
+		for (Conn &c : conns) {
+			if (c.fd >= 0)
+				close(c.fd);
+		}
+		close(epoll_fd);
+	}
+
+	void reconnect(size_t i)
+	{
+		Conn &c = conns[i];
+		if (c.fd >= 0)
+			close(c.fd);
+		c.busy = false;
+		c.parser.reset();
+		c.fd = connect_to(opt.host, opt.port);
+		if (c.fd < 0) {
+			connect_errors++;
+			return;
+		}
+		struct epoll_event ev;
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+		ev.data.u64 = i;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &ev);
+	}
+
+	void fail(size_t i)
+	{
+		Conn &c = conns[i];
+		if (c.busy) {
+			stats[c.kind].requests++;
+			stats[c.kind].errors++;
+		}
+		reconnect(i);
+	}
+
+	void start(size_t i, int64_t intended)
+	{
+		Conn &c = conns[i];
+		Kind kind = Kind(mix(rng));
+		if (kind == GET && ids.empty())
+			kind = POST;
+		c.kind = kind;
+		c.out = build_request(kind, opt, ids, rng);
+		c.out_pos = 0;
+		c.received = 0;
+		c.parser.reset();
+		c.parser.keep_body = kind == POST;
+		c.intended = intended;
+		c.busy = true;
+		flush(i);
+	}
+
+	void flush(size_t i)
+	{
+		Conn &c = conns[i];
+		while (c.out_pos < c.out.size()) {
+			ssize_t n = send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOTCONN)
+					return;	 // EPOLLOUT brings us back
+				fail(i);
+				return;
+			}
+			c.out_pos += n;
+		}
+	}
+
+	// Returns false once the connection is gone
+	bool receive(size_t i)
+	{
+		Conn &c = conns[i];
+		char buf[64 << 10];
+		for (;;) {
+			ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return true;
+			if (n <= 0 || !c.busy) {  // Closed, or bytes nobody asked for
+				fail(i);
+				return false;
+			}
+			if (c.parser.feed(buf, n) != n) {  // Malformed, or more than one response
+				fail(i);
+				return false;
+			}
+			c.received += n;
+			if (!c.parser.done())
+				continue;
+
+			Stats &s = stats[c.kind];
+			s.requests++;
+			s.bytes += c.received;
+			s.latency.record(now_ns() - c.intended);
+			if (!expected_status(c.kind, c.parser.status))
+				s.errors++;
+			if (c.kind == POST && c.parser.status == 200)
+				ids.push_back(posted_id(c.parser.body));
+			c.busy = false;
+			if (c.parser.header("Connection") == "close") {	 // E.g. a server draining
+				reconnect(i);
+				return false;
+			}
+			return true;
+		}
+	}
+
+	void run(int64_t start_ns, int64_t end_ns, double rate)
+	{
+		uint64_t scheduled = 0;
+		double interval = rate > 0 ? 1e9 / rate : 0;
+		struct epoll_event events[256];
+
+		for (;;) {
+			int64_t now = now_ns();
+			if (now >= end_ns)
+				break;
+
+			if (interval > 0) {
+				for (int64_t due; (due = start_ns + int64_t(scheduled * interval)) <= now; scheduled++)
+					pending.push_back(due);
+			}
+			for (size_t i = 0; i < conns.size(); i++) {
+				if (conns[i].busy || conns[i].fd < 0)
+					continue;
+				if (interval == 0) {
+					start(i, now);
+				} else if (!pending.empty()) {
+					start(i, pending.front());
+					pending.pop_front();
+				}
+			}
+
+			int timeout = interval > 0 ? 1 : 10;
+			int n = epoll_wait(epoll_fd, events, size(events), timeout);
+			for (int e = 0; e < n; e++) {
+				size_t i = events[e].data.u64;
+				if (conns[i].fd < 0)
+					continue;
+				if (events[e].events & EPOLLOUT)
+					flush(i);
+				if (events[e].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP))
+					receive(i);
+			}
+			// Connections that failed to reconnect get another chance
+			for (size_t i = 0; i < conns.size(); i++) {
+				if (conns[i].fd < 0)
+					reconnect(i);
+			}
+		}
+
+		for (const Conn &c : conns)
+			unfinished += c.busy;
+		unfinished += pending.size();
+	}
+};
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+			"Usage: %s [-h <host>] [-p <port>] [-c <connections>] [-T <threads>] [-d <seconds>]\n"
+			"          [-r <requests/s>] [-m <landing,help,post,get,404 weights>]\n"
+			"          [-s <min post bytes>,<max post bytes>] [-z <zipf exponent>] [-n <seed pastes>]\n"
+			"Without -r the load is closed loop: every connection sends as soon as it's answered\n",
+			argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	Options opt;
+
+	for (int i = 1; i < argc; i++) {
+		string_view arg(argv[i]);
+		if (i + 1 == argc)
+			usage(argv[0]);
+		const char *value = argv[++i];
+		if (arg == "-h") {
+			opt.host = value;
+		} else if (arg == "-p") {
+			opt.port = stoi(value);
+		} else if (arg == "-c") {
+			opt.connections = stoi(value);
+		} else if (arg == "-T") {
+			opt.threads = stoi(value);
+		} else if (arg == "-d") {
+			opt.duration_s = stod(value);
+		} else if (arg == "-r") {
+			opt.rate = stod(value);
+		} else if (arg == "-m") {
+			if (sscanf(value, "%lf,%lf,%lf,%lf,%lf", &opt.weights[0], &opt.weights[1],
+					   &opt.weights[2], &opt.weights[3], &opt.weights[4])
+				!= N_KINDS)
+				usage(argv[0]);
+		} else if (arg == "-s") {
+			if (sscanf(value, "%zu,%zu", &opt.post_min, &opt.post_max) != 2 || !opt.post_min
+				|| opt.post_min > opt.post_max)
+				usage(argv[0]);
+		} else if (arg == "-z") {
+			opt.zipf = stod(value);
+		} else if (arg == "-n") {
+			opt.seed_pastes = stoi(value);
+		} else {
+			usage(argv[0]);
+		}
+	}
+	opt.threads = max(1, min(opt.threads, opt.connections));
+
+	filler.resize(max<size_t>(opt.post_max, 1 << 20));
+	mt19937_64 fill_rng(1);
+	for (char &c : filler)
+		c = 'a' + fill_rng() % 26;
+
+	vector<string> seeds = seed(opt, opt.weights[GET] > 0 ? opt.seed_pastes : 0);
+	printf("Seeded %zu pastes. %d connections, %d threads, %.0f s, ", seeds.size(),
+		   opt.connections, opt.threads, opt.duration_s);
+	if (opt.rate > 0)
+		printf("open loop at %.0f req/s\n", opt.rate);
+	else
+		printf("closed loop\n");
+	fflush(stdout);
+
+	vector<unique_ptr<Worker>> workers;
+	for (int t = 0; t < opt.threads; t++) {
+		int share = opt.connections / opt.threads + (t < opt.connections % opt.threads);
+		workers.push_back(make_unique<Worker>(opt, share, seeds, 1000 + t));
+	}
+
+	int64_t start_ns = now_ns() + 10'000'000;  // Let every thread get going first
+	int64_t end_ns = start_ns + int64_t(opt.duration_s * 1e9);
+	vector<thread> threads;
+	for (auto &w : workers)
+		threads.emplace_back([&w, start_ns, end_ns, &opt] {
+			w->run(start_ns, end_ns, opt.rate / opt.threads);
+		});
+	for (thread &t : threads)
+		t.join();
+
+	Stats total[N_KINDS + 1];
+	uint64_t unfinished = 0, connect_errors = 0;
+	for (auto &w : workers) {
+		for (int k = 0; k < N_KINDS; k++) {
+			total[k].latency.add(w->stats[k].latency);
+			total[k].requests += w->stats[k].requests;
+			total[k].errors += w->stats[k].errors;
+			total[k].bytes += w->stats[k].bytes;
+		}
+		unfinished += w->unfinished;
+		connect_errors += w->connect_errors;
+	}
+	for (int k = 0; k < N_KINDS; k++) {
+		total[N_KINDS].latency.add(total[k].latency);
+		total[N_KINDS].requests += total[k].requests;
+		total[N_KINDS].errors += total[k].errors;
+		total[N_KINDS].bytes += total[k].bytes;
+	}
+
+	printf("\n%-8s %10s %10s %8s %10s %10s %10s %10s %10s\n", "type", "requests", "req/s",
+		   "errors", "MB/s", "p50 ms", "p99 ms", "p999 ms", "max ms");
+	for (int k = 0; k <= N_KINDS; k++) {
+		const Stats &s = total[k];
+		if (!s.requests)
+			continue;
+		const HdrHistogram &h = s.latency;
+		printf("%-8s %10lu %10.0f %8lu %10.2f %10.3f %10.3f %10.3f %10.3f\n",
+			   k == N_KINDS ? "total" : kind_names[k], s.requests, s.requests / opt.duration_s,
+			   s.errors, s.bytes / opt.duration_s / 1e6, h.valueAt(50) / 1e6, h.valueAt(99) / 1e6,
+			   h.valueAt(99.9) / 1e6, h.max() / 1e6);
+	}
+	if (opt.rate > 0 && unfinished)
+		printf("\n%lu requests were still waiting or in flight at the end\n", unfinished);
+	if (connect_errors)
+		printf("%lu connection attempts failed\n", connect_errors);
+	if (opt.rate > 0 && total[N_KINDS].requests < 0.95 * opt.rate * opt.duration_s)
+		printf("Only reached %.0f of %.0f req/s, the latencies above include the backlog\n",
+			   total[N_KINDS].requests / opt.duration_s, opt.rate);
+	return 0;
+}
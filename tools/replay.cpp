@@ -0,0 +1,349 @@
+// Replays a traffic capture (server -c <file>) against a running server. Every connection is
+// reopened and fed the same bytes, chunked the same way, at the captured times divided by the
+// speed factor. Responses are compared with the captured ones by status, size and body hash,
+// and timed from when the last byte of their request went out.
+//
+// POSTs get fresh paste IDs and pastes that don't exist on the target 404, so replay against a
+// copy of the p/ directory taken when the capture started for a clean diff
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+#include "client.hpp"
+#include "hdrhistogram.hpp"
+#include "http/capture.hpp"
+
+using namespace std;
+using Capture = TrafficCapture;
+
+struct Event {
+	uint64_t ts;
+	uint32_t conn;
+	uint8_t type;
+	string payload;
+};
+
+struct Expected {
+	Capture::ResponseInfo info;
+	int64_t sent_at = 0;  // When the whole request had gone out, 0 until then
+};
+
+struct Conn {
+	int fd = -1;
+	bool closing = false, done = false;
+	string input;  // Everything the capture says the client sent, for request lines in reports
+	string out;
+	size_t out_pos = 0;
+	uint64_t sent = 0;	// Bytes of input written so far
+	deque<Expected> expected;
+	ResponseParser parser;
+	size_t responses = 0;
+	uint64_t request_start = 0;	 // Offset of the request being answered
+};
+
+static int64_t now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1'000'000'000LL + ts.tv_nsec;
+}
+
+static vector<Event> load(const char *path, uint32_t &n_conns)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file) {
+		perror(path);
+		exit(1);
+	}
+	Capture::FileHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1
+		|| memcmp(header.magic, Capture::magic, sizeof(Capture::magic)) != 0) {
+		fprintf(stderr, "%s: not a posthaste capture\n", path);
+		exit(1);
+	}
+
+	vector<Event> events;
+	n_conns = 0;
+	Capture::RecordHeader record;
+	while (fread(&record, sizeof(record), 1, file) == 1) {
+		Event &e = events.emplace_back(uint64_t(record.ts_ns), uint32_t(record.conn),
+									   uint8_t(record.type));
+		e.payload.resize(record.len);
+		if (record.len && fread(e.payload.data(), record.len, 1, file) != 1) {
+			events.pop_back();	// Cut short, the server was probably killed mid flush
+			break;
+		}
+		n_conns = max(n_conns, record.conn + 1);
+	}
+	fclose(file);
+
+	stable_sort(events.begin(), events.end(),
+				[](const Event &a, const Event &b) { return a.ts < b.ts; });
+	return events;
+}
+
+static string request_line(const Conn &c, uint64_t start)
+{
+	if (start >= c.input.size())
+		return "?";
+	size_t end = c.input.find("\r\n", start);
+	return c.input.substr(start, min<size_t>(end == string::npos ? c.input.size() : end, start + 100)
+									 - start);
+}
+
+static void usage(const char *argv0)
+{
+	fprintf(stderr,
+			"Usage: %s <capture> [-h <host>] [-p <port>] [-x <speed>] [-v <mismatches to show>]\n"
+			"-x 2 replays twice as fast, -x 0 as fast as possible\n",
+			argv0);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+		usage(argv[0]);
+	string host = "127.0.0.1";
+	int port = 80;
+	double speed = 1;
+	int verbose = 10;
+
+	for (int i = 2; i < argc; i++) {
+		string_view arg(argv[i]);
+		if (i + 1 == argc)
+			usage(argv[0]);
+		const char *value = argv[++i];
+		if (arg == "-h")
+			host = value;
+		else if (arg == "-p")
+			port = stoi(value);
+		else if (arg == "-x")
+			speed = stod(value);
+		else if (arg == "-v")
+			verbose = stoi(value);
+		else
+			usage(argv[0]);
+	}
+
+	uint32_t n_conns;
+	vector<Event> events = load(argv[1], n_conns);
+	vector<Conn> conns(n_conns);
+	for (const Event &e : events) {
+		if (e.type == Capture::DATA)
+			conns[e.conn].input += e.payload;
+		else if (e.type == Capture::RESPONSE && e.payload.size() == sizeof(Capture::ResponseInfo))
+			conns[e.conn].expected.push_back({ *reinterpret_cast<const Capture::ResponseInfo *>(
+			  e.payload.data()) });
+	}
+	// Connections whose OPEN was before the capture file got them (none, normally) are skipped
+	for (Conn &c : conns)
+		c.done = true;
+	for (const Event &e : events) {
+		if (e.type == Capture::OPEN)
+			conns[e.conn].done = false;
+	}
+
+	uint64_t n_requests = 0, matched = 0, status_diff = 0, body_diff = 0, unexpected = 0;
+	uint64_t connect_errors = 0;
+	int shown = 0;
+	HdrHistogram latency;
+	for (const Conn &c : conns)
+		n_requests += c.expected.size();
+
+	int epoll_fd = epoll_create1(0);
+
+	auto finish = [&](uint32_t id) {
+		Conn &c = conns[id];
+		if (c.fd >= 0)
+			close(c.fd);
+		c.fd = -1;
+		c.done = true;
+	};
+
+	auto flush = [&](uint32_t id) {
+		Conn &c = conns[id];
+		while (c.out_pos < c.out.size()) {
+			ssize_t n = send(c.fd, c.out.data() + c.out_pos, c.out.size() - c.out_pos, MSG_NOSIGNAL);
+			if (n < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOTCONN)
+					finish(id);
+				return;
+			}
+			c.out_pos += n;
+			c.sent += n;
+		}
+		c.out.clear();
+		c.out_pos = 0;
+		int64_t now = now_ns();
+		for (Expected &e : c.expected) {
+			if (e.info.request_end > c.sent)
+				break;
+			if (!e.sent_at)
+				e.sent_at = now;
+		}
+		if (c.closing)
+			shutdown(c.fd, SHUT_WR);
+	};
+
+	auto receive = [&](uint32_t id) {
+		Conn &c = conns[id];
+		char buf[64 << 10];
+		for (;;) {
+			ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return;
+			if (n <= 0) {
+				finish(id);
+				return;
+			}
+			for (size_t used = 0; used < size_t(n);) {
+				long consumed = c.parser.feed(buf + used, n - used);
+				if (consumed < 0) {
+					fprintf(stderr, "conn %u: malformed response\n", id);
+					finish(id);
+					return;
+				}
+				used += consumed;
+				if (!c.parser.done())
+					break;
+
+				int status = c.parser.status;
+				uint64_t size = c.parser.body.size();
+				uint64_t hash = Capture::hash(Capture::hash_seed, c.parser.body.data(), size);
+				c.parser.reset();
+				if (status >= 100 && status < 200)	// 100 Continue, the real answer follows
+					continue;
+
+				c.responses++;
+				if (c.expected.empty()) {
+					unexpected++;
+					continue;
+				}
+				Expected e = c.expected.front();
+				c.expected.pop_front();
+				if (e.sent_at)
+					latency.record(now_ns() - e.sent_at);
+
+				const char *what = nullptr;
+				if (status != e.info.status) {
+					status_diff++;
+					what = "status";
+				} else if (size != e.info.body_size || hash != e.info.body_hash) {
+					body_diff++;
+					what = "body";
+				} else {
+					matched++;
+				}
+				if (what && shown < verbose) {
+					shown++;
+					printf("conn %u response %zu (%s): %s differs, captured %u with %lu bytes, got "
+						   "%d with %lu bytes\n",
+						   id, c.responses, request_line(c, c.request_start).c_str(), what,
+						   e.info.status, e.info.body_size, status, size);
+				}
+				c.request_start = e.info.request_end;
+			}
+			if (c.closing && c.expected.empty()) {
+				finish(id);
+				return;
+			}
+		}
+	};
+
+	int64_t start = now_ns();
+	uint64_t last_ts = events.empty() ? 0 : events.back().ts;
+	size_t next = 0;
+	struct epoll_event ready[256];
+	int64_t deadline = 0;  // Once everything is sent, how long we wait for the stragglers
+
+	for (;;) {
+		int64_t now = now_ns();
+		for (; next < events.size(); next++) {
+			const Event &e = events[next];
+			if (speed > 0 && start + int64_t(e.ts / speed) > now)
+				break;
+			Conn &c = conns[e.conn];
+			if (c.done && e.type != Capture::OPEN)
+				continue;
+
+			switch (e.type) {
+			case Capture::OPEN: {
+				c.fd = connect_to(host, port);
+				if (c.fd < 0) {
+					connect_errors++;
+					c.done = true;
+					break;
+				}
+				struct epoll_event ev;
+				ev.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLRDHUP;
+				ev.data.u32 = e.conn;
+				epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c.fd, &ev);
+				break;
+			}
+			case Capture::DATA:
+				c.out += e.payload;
+				flush(e.conn);
+				break;
+			case Capture::CLOSE:
+				c.closing = true;
+				if (c.out.empty())
+					shutdown(c.fd, SHUT_WR);
+				if (c.expected.empty())
+					finish(e.conn);
+				break;
+			}
+		}
+
+		if (next == events.size()) {
+			bool all_done = all_of(conns.begin(), conns.end(), [](const Conn &c) {
+				return c.done || c.expected.empty();
+			});
+			if (all_done)
+				break;
+			if (!deadline)
+				deadline = now + 10'000'000'000LL;
+			else if (now > deadline)
+				break;
+		}
+
+		int timeout = next < events.size() ? 1 : 100;
+		int n = epoll_wait(epoll_fd, ready, size(ready), timeout);
+		for (int i = 0; i < n; i++) {
+			uint32_t id = ready[i].data.u32;
+			if (conns[id].fd < 0)
+				continue;
+			if (ready[i].events & EPOLLOUT)
+				flush(id);
+			if (conns[id].fd >= 0 && (ready[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)))
+				receive(id);
+		}
+	}
+	double elapsed = (now_ns() - start) / 1e9;
+
+	uint64_t missing = 0;
+	for (Conn &c : conns) {
+		missing += c.expected.size();
+		if (c.fd >= 0)
+			close(c.fd);
+	}
+
+	printf("\n%u connections, %lu requests, captured over %.2f s, replayed in %.2f s\n", n_conns,
+		   n_requests, last_ts / 1e9, elapsed);
+	printf("matched %lu, status differs %lu, body differs %lu, missing %lu, unexpected %lu\n",
+		   matched, status_diff, body_diff, missing, unexpected);
+	if (connect_errors)
+		printf("%lu connections could not be opened\n", connect_errors);
+	printf("latency ms: p50 %.3f  p99 %.3f  p999 %.3f  max %.3f\n", latency.valueAt(50) / 1e6,
+		   latency.valueAt(99) / 1e6, latency.valueAt(99.9) / 1e6, latency.max() / 1e6);
+
+	return status_diff || body_diff || missing ? 2 : 0;
+}